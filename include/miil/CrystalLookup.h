@@ -0,0 +1,41 @@
+#ifndef CRYSTAL_LOOKUP_H
+#define CRYSTAL_LOOKUP_H
+
+#include <vector>
+
+struct CrystalCalibration;
+
+/*!
+ * \brief A uniform grid over the anger logic space of an APD for crystal id
+ *
+ * The anger logic space, [-1, 1] in x and y, is split into a grid of cells.
+ * For each cell, the crystals that could be the nearest crystal for some point
+ * in the cell are listed, so that a lookup only has to check the few crystals
+ * listed for the cell the event lands in instead of every crystal on the APD.
+ * The candidates are checked in crystal order with the same distance
+ * calculation as GetCrystalID, so the same crystal is returned, including for
+ * events that are equidistant from two crystals.
+ */
+class CrystalLookup {
+public:
+    CrystalLookup();
+    int build(const std::vector<CrystalCalibration> & apd_cals);
+    int find(float x, float y) const;
+
+private:
+    //! The number of cells along each axis of the grid
+    int cells_per_side;
+    //! The x location of each crystal, indexed by crystal
+    std::vector<float> x_locs;
+    //! The y location of each crystal, indexed by crystal
+    std::vector<float> y_locs;
+    /*!
+     * The first index in candidates for each cell, with one extra entry at the
+     * end so that cell_start[cell + 1] is the end of the cell's candidates.
+     */
+    std::vector<int> cell_start;
+    //! The candidate crystal ids for each cell, in increasing order per cell
+    std::vector<int> candidates;
+};
+
+#endif // CRYSTAL_LOOKUP_H
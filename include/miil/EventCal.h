@@ -46,7 +46,8 @@ struct EventCal {
      * byte alignment requirement for the int64_t (long) so flags were added as
      * space for storing information in the future that may be useful for
      * calibration or processing purposes.  Their current uses are:
-     *     - 0: none
+     *     - 0: the configuration version used to calibrate, modulo 128, if
+     *          ProcessParams::setConfigurationVersions was used
      *     - 1: none
      *     - 2: none
      *     - 3: none
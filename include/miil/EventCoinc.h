@@ -69,7 +69,8 @@ struct EventCoinc {
      * byte alignment requirement for the int64_t (long) so flags were added as
      * space for storing information in the future that may be useful for
      * calibration or processing purposes.  Their current uses are:
-     *     - 0: none
+     *     - 0: 0 for a prompt coincidence, or the delayed window plus one for
+     *          a delayed coincidence from CoincidenceSorter
      *     - 1: none
      */
     int8_t flags[2];
@@ -0,0 +1,155 @@
+#ifndef GEOMETRY_TRAITS_H
+#define GEOMETRY_TRAITS_H
+
+#include <miil/SystemConfiguration.h>
+
+/*!
+ * \brief Geometry that is read from the system configuration at runtime
+ *
+ * The fallback used by the templated decode and indexing functions when the
+ * loaded configuration does not match one of the fixed geometries.
+ */
+struct RuntimeGeometry {
+    static bool matches(const SystemConfiguration &) {
+        return(true);
+    }
+    static int daqsPerCartridge(const SystemConfiguration & config) {
+        return(config.daqs_per_cartridge);
+    }
+    static int renasPerDaq(const SystemConfiguration & config) {
+        return(config.renas_per_daq);
+    }
+    static int modulesPerRena(const SystemConfiguration & config) {
+        return(config.modules_per_rena);
+    }
+    static int finsPerCartridge(const SystemConfiguration & config) {
+        return(config.fins_per_cartridge);
+    }
+    static int modulesPerFin(const SystemConfiguration & config) {
+        return(config.modules_per_fin);
+    }
+    static int apdsPerModule(const SystemConfiguration & config) {
+        return(config.apds_per_module);
+    }
+    static int crystalsPerApd(const SystemConfiguration & config) {
+        return(config.crystals_per_apd);
+    }
+};
+
+/*!
+ * \brief Geometry of a cartridge known at compile time
+ *
+ * Returns the geometry of a cartridge as constants, so that the index math in
+ * the functions templated on the geometry can be folded and the loops over
+ * modules unrolled by the compiler.  The number of panels and cartridges are
+ * still taken from the system configuration, as they vary between setups that
+ * share the same cartridge design.
+ */
+template <int DAQS, int RENAS, int MODULES_PER_RENA, int FINS,
+          int MODULES_PER_FIN, int APDS, int CRYSTALS>
+struct FixedGeometry {
+    static bool matches(const SystemConfiguration & config) {
+        return((config.daqs_per_cartridge == DAQS) &&
+               (config.renas_per_daq == RENAS) &&
+               (config.modules_per_rena == MODULES_PER_RENA) &&
+               (config.fins_per_cartridge == FINS) &&
+               (config.modules_per_fin == MODULES_PER_FIN) &&
+               (config.apds_per_module == APDS) &&
+               (config.crystals_per_apd == CRYSTALS));
+    }
+    static int daqsPerCartridge(const SystemConfiguration &) {
+        return(DAQS);
+    }
+    static int renasPerDaq(const SystemConfiguration &) {
+        return(RENAS);
+    }
+    static int modulesPerRena(const SystemConfiguration &) {
+        return(MODULES_PER_RENA);
+    }
+    static int finsPerCartridge(const SystemConfiguration &) {
+        return(FINS);
+    }
+    static int modulesPerFin(const SystemConfiguration &) {
+        return(MODULES_PER_FIN);
+    }
+    static int apdsPerModule(const SystemConfiguration &) {
+        return(APDS);
+    }
+    static int crystalsPerApd(const SystemConfiguration &) {
+        return(CRYSTALS);
+    }
+};
+
+/*!
+ * The cartridge used in the full system: 4 daq boards with 8 renas each, 4
+ * modules per rena, and 8 fins of 16 modules, each with 2 PSAPDs of 64
+ * crystals.
+ */
+typedef FixedGeometry<4, 8, 4, 8, 16, 2, 64> ProductionGeometry;
+
+/*!
+ * \brief Convert PCDRM indexing to PCFM indexing for a given geometry
+ *
+ * The implementation of SystemConfiguration::convertPCDRMtoPCFM, templated on
+ * the geometry so that it can be specialized for ProductionGeometry.  See
+ * SystemConfiguration::convertPCDRMtoPCFM for the parameters and return codes.
+ */
+template <class Geometry>
+inline int ConvertPCDRMtoPCFM(
+        const SystemConfiguration & config,
+        int panel,
+        int cartridge,
+        int daq,
+        int rena,
+        int rena_local_module,
+        int & fin,
+        int & module)
+{
+    const int renas_per_daq = Geometry::renasPerDaq(config);
+    const int modules_per_rena = Geometry::modulesPerRena(config);
+    const int modules_per_fin = Geometry::modulesPerFin(config);
+
+    // Validate input
+    if (panel < 0 || panel >= config.panels_per_system) {
+        return(-1);
+    }
+    if (cartridge < 0 || cartridge >= config.cartridges_per_panel) {
+        return(-2);
+    }
+    if (daq < 0 || daq >= Geometry::daqsPerCartridge(config)) {
+        return(-3);
+    }
+    if (rena < 0 || rena >= renas_per_daq) {
+        return(-4);
+    }
+    if (rena_local_module < 0 || rena_local_module >= modules_per_rena) {
+        return(-5);
+    }
+    // Convert.  rena is not negative, so dividing by 2 is the same as flooring.
+    fin = Geometry::finsPerCartridge(config) - 1 - 2 * (rena / 2);
+    module = rena_local_module;
+    if (rena % 2) {
+        module += modules_per_rena;
+    }
+    if (daq % 2) {
+        module += (modules_per_fin / 2);
+    }
+
+    if (panel == 0) {
+        if (daq < 2) {
+            if (renas_per_daq > 2) {
+                fin--;
+            }
+        }
+    } else if (panel == 1) {
+        if (daq >= 2) {
+            if (renas_per_daq > 2) {
+                fin--;
+            }
+        }
+        module = modules_per_fin - 1 - module;
+    }
+    return(0);
+}
+
+#endif // GEOMETRY_TRAITS_H
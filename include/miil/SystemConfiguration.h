@@ -2,6 +2,8 @@
 #define SYSTEM_CONFIGURATION_H
 #include <vector>
 #include <string>
+#include <stdint.h>
+#include <miil/CrystalLookup.h>
 
 /*!
  * A rena has 36 channels (32 which are used) that can have up to 3 values read
@@ -37,6 +39,34 @@ struct ModulePedestals {
     int events;
 };
 
+/*!
+ * The number of fractional bits used for the pedestal values, and the channel
+ * values after pedestal subtraction, in the fixed point calibration.
+ */
+#define FIXED_POINT_PEDESTAL_BITS 8
+
+/*!
+ * The number of fractional bits used for the energy scale factors in the fixed
+ * point calibration.
+ */
+#define FIXED_POINT_ENERGY_SCALE_BITS 24
+
+/*!
+ * The pedestal values of a module used by the fixed point calibration.  Each is
+ * the value from ModulePedestals multiplied by 2^FIXED_POINT_PEDESTAL_BITS and
+ * rounded to the nearest integer.
+ */
+struct ModulePedestalsFixed {
+    int32_t a;
+    int32_t b;
+    int32_t c;
+    int32_t d;
+    int32_t com0;
+    int32_t com1;
+    int32_t com0h;
+    int32_t com1h;
+};
+
 /*!
  * A structure containing all of the information required to identify an event
  * to a particular crystal, convert the signal into an energy, and then
@@ -407,18 +437,47 @@ public:
             bool apply_individual);
     int loadPedestals(const std::string & filename);
     int writePedestals(const std::string & filename);
+    int writePedestals(
+            const std::string & filename,
+            const std::vector<std::vector<std::vector<std::vector<
+                    std::vector<ModulePedestals> > > > > & module_pedestals)
+            const;
     int loadUVCenters(const std::string & filename);
     int writeUVCenters(const std::string &filename);
+    int writeUVCenters(
+            const std::string & filename,
+            const std::vector<std::vector<std::vector<std::vector<
+                    std::vector<ModulePedestals> > > > > & module_pedestals)
+            const;
     int loadPhotopeakPositions(const std::string & filename);
     int writePhotopeakPositions(const std::string & filename);
+    int writePhotopeakPositions(
+            const std::string & filename,
+            const std::vector<float> & gain_spat,
+            const std::vector<float> & gain_comm) const;
     int loadCrystalLocations(const std::string &filename);
     int writeCrystalLocations(const std::string &filename);
+    int writeCrystalLocations(
+            const std::string & filename,
+            const std::vector<std::vector<std::vector<
+                    std::vector<std::vector<std::vector<
+                    CrystalCalibration> > > > > > & crystal_calibration) const;
     int loadCalibration(const std::string & filename);
     int writeCalibration(const std::string & filename);
+    int writeCalibration(
+            const std::string & filename,
+            const std::vector<std::vector<std::vector<
+                    std::vector<std::vector<std::vector<
+                    CrystalCalibration> > > > > > & crystal_calibration) const;
     int loadTimeCalibration(const std::string & filename);
     int writeTimeCalibration(const std::string &filename);
     int loadTimeCalWithEdep(const std::string &filename);
     int writeTimeCalWithEdep(const std::string &filename);
+    int writeTimeCalWithEdep(
+            const std::string & filename,
+            const std::vector<std::vector<std::vector<
+                    std::vector<std::vector<std::vector<
+                    CrystalCalibration> > > > > > & crystal_calibration) const;
 
     int lookupPanelCartridge(
             int backend_address,
@@ -444,6 +503,9 @@ public:
             int & rena_local_module) const;
 
     int createChannelMap();
+    int createFixedPointTables();
+    int createCrystalLookup();
+    void selectGeometry();
 
     /*!
      * \brief Check if pedestals have been loaded
@@ -481,8 +543,85 @@ public:
         return(time_calibration_loaded_flag);
     }
 
+    /*!
+     * \brief Check if the geometry matches ProductionGeometry
+     *
+     * \return bool indicating if the decoding and indexing functions can use
+     *         the version specialized for ProductionGeometry
+     */
+    bool productionGeometry() const {
+        return(production_geometry_flag);
+    }
+
     bool inBoundsPCFMA(int p, int c, int f, int m, int a);
 
+    /*!
+     * \brief The flattened index of a module in an array indexed Panel,
+     *        Cartridge, Fin, Module
+     *
+     * Defined here, as it is used for every event by the process monitors.
+     *
+     * \return The index, or -1 if any part of it is out of range
+     */
+    int indexPCFM(int p, int c, int f, int m) const {
+        if (p < 0 || p >= panels_per_system ||
+                c < 0 || c >= cartridges_per_panel ||
+                f < 0 || f >= fins_per_cartridge ||
+                m < 0 || m >= modules_per_fin)
+        {
+            return(-1);
+        }
+        return(((p * cartridges_per_panel + c) * fins_per_cartridge + f) *
+               modules_per_fin + m);
+    }
+
+    /*!
+     * \brief The flattened index of an apd in an array indexed Panel,
+     *        Cartridge, Fin, Module, APD
+     *
+     * \return The index, or -1 if any part of it is out of range
+     */
+    int indexPCFMA(int p, int c, int f, int m, int a) const {
+        const int module = indexPCFM(p, c, f, m);
+        if (module < 0 || a < 0 || a >= apds_per_module) {
+            return(-1);
+        }
+        return(module * apds_per_module + a);
+    }
+
+    /*!
+     * \brief The flattened index of a crystal in an array indexed Panel,
+     *        Cartridge, Fin, Module, APD, Crystal
+     *
+     * \return The index, or -1 if any part of it is out of range
+     */
+    int indexPCFMAX(int p, int c, int f, int m, int a, int x) const {
+        const int apd = indexPCFMA(p, c, f, m, a);
+        if (apd < 0 || x < 0 || x >= crystals_per_apd) {
+            return(-1);
+        }
+        return(apd * crystals_per_apd + x);
+    }
+
+    /*!
+     * \brief The flattened index of a module in an array indexed Panel,
+     *        Cartridge, DAQ Board, Rena, Module
+     *
+     * \return The index, or -1 if any part of it is out of range
+     */
+    int indexPCDRM(int p, int c, int d, int r, int m) const {
+        if (p < 0 || p >= panels_per_system ||
+                c < 0 || c >= cartridges_per_panel ||
+                d < 0 || d >= daqs_per_cartridge ||
+                r < 0 || r >= renas_per_daq ||
+                m < 0 || m >= modules_per_rena)
+        {
+            return(-1);
+        }
+        return((((p * cartridges_per_panel + c) * daqs_per_cartridge + d) *
+                renas_per_daq + r) * modules_per_rena + m);
+    }
+
     //! The number of panels in the system (should always be 2)
     int panels_per_system;
     //! The number of cartridges in each panel of the system
@@ -590,6 +729,30 @@ public:
             std::vector<std::vector<std::vector<
             CrystalCalibration> > > > > > calibration;
 
+    /*!
+     * Array indexed Panel, Cartridge, Fin, Module, APD holding the grid used
+     * to look up the crystal for an event.  Created by createCrystalLookup.
+     */
+    std::vector<std::vector<std::vector<std::vector<std::vector<
+            CrystalLookup> > > > > crystal_lookup;
+
+    /*!
+     * Array indexed Panel, Cartridge, DAQ_Board, Rena, Module holding the
+     * pedestals in the fixed point format.  Created by createFixedPointTables.
+     */
+    std::vector<std::vector<std::vector<std::vector<std::vector<
+            ModulePedestalsFixed> > > > > pedestals_fixed;
+
+    /*!
+     * Array indexed Panel, Cartridge, Fin, Module, APD, Crystal holding
+     * 511 / gain_spat for each crystal multiplied by
+     * 2^FIXED_POINT_ENERGY_SCALE_BITS and rounded, or 0 if the gain is not
+     * positive.  Created by createFixedPointTables.
+     */
+    std::vector<std::vector<std::vector<
+            std::vector<std::vector<std::vector<
+            int64_t> > > > > > energy_scale_fixed;
+
     /*!
      * Array index  Panel, Cartridge, DAQ_Board, Rena, Channel holding pointers
      * to the appropriate channel settings structure
@@ -707,6 +870,7 @@ private:
     bool calibration_loaded_flag;
     bool uv_centers_loaded_flag;
     bool time_calibration_loaded_flag;
+    bool production_geometry_flag;
 };
 
 #endif // SYSTEM_CONFIGURATION_H
@@ -0,0 +1,66 @@
+#ifndef CALIBRATION_POOL_H
+#define CALIBRATION_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <miil/EventRaw.h>
+#include <miil/EventCal.h>
+#include <miil/process/ProcessInfo.h>
+
+class SystemConfiguration;
+
+/*!
+ * \brief A pool of threads that calibrate decoded events in batches
+ *
+ * The decoded events handed to calibrate() are split into fixed size batches
+ * that are calibrated by the worker threads, as well as the calling thread.
+ * Each batch is calibrated into its own buffer with its own ProcessInfo, and
+ * the results are appended to the output in batch order once every batch has
+ * finished, so the output and the counters are identical to calibrating the
+ * events serially.
+ */
+class CalibrationPool {
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable cv_job_posted;
+    std::condition_variable cv_job_done;
+    //! Incremented for every job so workers know when new work is posted
+    long job_id;
+    bool shutdown_flag;
+    size_t workers_active;
+    std::atomic<size_t> next_batch;
+
+    const std::vector<EventRaw> * job_decoded_data;
+    SystemConfiguration const * job_config;
+    bool job_energy_gate;
+    float job_energy_gate_low;
+    float job_energy_gate_high;
+    bool job_fixed_point;
+    size_t job_no_batches;
+
+    size_t batch_size;
+    std::vector<std::vector<EventCal> > batch_calibrated;
+    std::vector<ProcessInfo> batch_info;
+
+    void workerLoop();
+    void calibrateBatches();
+
+public:
+    CalibrationPool(size_t no_workers, size_t events_per_batch = 4096);
+    ~CalibrationPool();
+    size_t size() const;
+    int calibrate(
+            const std::vector<EventRaw> & decoded_data,
+            std::vector<EventCal> & calibrated_data,
+            ProcessInfo & info,
+            SystemConfiguration const * const config,
+            bool energy_gate,
+            float energy_gate_low,
+            float energy_gate_high,
+            bool fixed_point = false);
+};
+
+#endif // CALIBRATION_POOL_H
@@ -0,0 +1,275 @@
+#ifndef COINCIDENCE_SORTER_H
+#define COINCIDENCE_SORTER_H
+
+#include <cstddef>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <miil/BoundedBuffer.h>
+#include <miil/EventCal.h>
+#include <miil/EventCoinc.h>
+#include <miil/process/LorIndexer.h>
+#include <miil/process/RenaMergeSorter.h>
+
+class SystemConfiguration;
+class LorHistogram;
+class TimingResolution;
+
+/*!
+ * The number of bins in CoincidenceInfo::multiplicity.  Bin n counts the
+ * prompt windows that closed with n singles, and the last bin also counts any
+ * windows with more singles than that.
+ */
+#define COINC_MULTIPLICITY_BINS 8
+
+/*!
+ * \brief Counters for the singles and coincidences of a CoincidenceSorter
+ */
+class CoincidenceInfo {
+public:
+    CoincidenceInfo();
+    void reset();
+    void addCoincidenceInfo(const CoincidenceInfo & other);
+
+    long singles_processed;
+    long dropped_energy_window;
+    //! Singles from a panel other than 0 or 1
+    long dropped_invalid_panel;
+    //! Singles that arrived before the start of the open coincidence window
+    long dropped_late;
+    //! Windows that closed with only the single that opened them
+    long windows_single;
+    //! Windows that closed with two singles from the same panel
+    long dropped_same_panel;
+    //! Windows with more than two singles that no coincidence was taken from
+    long dropped_multiples;
+    //! Coincidences taken from windows with more than two singles
+    long accepted_from_multiples;
+    //! The number of prompt windows by the number of singles they closed with
+    long multiplicity[COINC_MULTIPLICITY_BINS];
+    long accepted_coinc;
+    long written_coinc;
+    //! Coincidences found in all of the delayed windows
+    long accepted_delayed;
+    long written_delayed;
+};
+
+std::ostream& operator<<(std::ostream& os, const CoincidenceInfo& info);
+
+/*!
+ * \brief How a CoincidenceSorter handles windows with more than two singles
+ */
+enum MultiplesPolicy {
+    //! Take no coincidences from the window
+    KILL_ALL_MULTIPLES,
+    //! Take every pair of singles from opposite panels in the window
+    TAKE_ALL_GOOD_PAIRS,
+    //! Take the pair from opposite panels with the highest total energy
+    TAKE_WINNER_OF_GOOD_PAIRS
+};
+
+/*!
+ * \brief The pairs of singles in a multiple window chosen by a policy
+ *
+ * Each policy has a static select function that adds the indices, in the
+ * window, of the singles of each coincidence to be taken, so that the policy
+ * can be inlined into the windowing loop of CoincidenceSorter.
+ */
+typedef std::vector<std::pair<int, int> > CoincPairs;
+
+struct KillAllMultiples {
+    static void select(const std::vector<KeyedEventCal> &, CoincPairs &) {
+    }
+};
+
+struct TakeAllGoodPairs {
+    static void select(
+            const std::vector<KeyedEventCal> & window,
+            CoincPairs & pairs)
+    {
+        for (size_t ii = 0; ii < window.size(); ii++) {
+            for (size_t jj = ii + 1; jj < window.size(); jj++) {
+                if (window[ii].event.panel != window[jj].event.panel) {
+                    pairs.push_back(std::make_pair(ii, jj));
+                }
+            }
+        }
+    }
+};
+
+struct TakeWinnerOfGoodPairs {
+    static void select(
+            const std::vector<KeyedEventCal> & window,
+            CoincPairs & pairs)
+    {
+        int best_ii = -1;
+        int best_jj = -1;
+        float best_energy = 0;
+        for (size_t ii = 0; ii < window.size(); ii++) {
+            for (size_t jj = ii + 1; jj < window.size(); jj++) {
+                if (window[ii].event.panel == window[jj].event.panel) {
+                    continue;
+                }
+                float energy = window[ii].event.E + window[jj].event.E;
+                if ((best_ii < 0) || (energy > best_energy)) {
+                    best_ii = ii;
+                    best_jj = jj;
+                    best_energy = energy;
+                }
+            }
+        }
+        if (best_ii >= 0) {
+            pairs.push_back(std::make_pair(best_ii, best_jj));
+        }
+    }
+};
+
+/*!
+ * \brief Finds coincidences in a time sorted stream of calibrated singles
+ *
+ * Singles from both panels, in time order, such as the output of a
+ * GlobalMergeSorter, are passed through an energy window, and then grouped by
+ * time.  A coincidence window is opened by the first single after the previous
+ * window closed, and holds every single within the time window of it.  A
+ * window holding exactly one single from each panel is a coincidence, which is
+ * built with MakeCoinc, with the panel 0 single as the left event.  The time
+ * offsets of the crystals were already removed from the fine timestamps of
+ * the singles by RawEventToEventCal, so TimeCalCoincEvent is not applied
+ * again.  Each single is looked at once and only the open window is held, so
+ * the cost per single is constant.
+ *
+ * Windows with more than two singles are handled by the MultiplesPolicy given
+ * to the constructor.  The windowing is templated on the policy, which is
+ * picked once per batch of singles, so the decision for each window is inlined.
+ *
+ * Delayed windows, for estimating randoms, can be added with
+ * addDelayedWindow.  Each pairs the panel 0 singles with the panel 1 singles
+ * delayed by a whole number of coarse timestamp ticks, using the same windowing
+ * as the prompt coincidences.  The panel 1 singles are held once, in a single
+ * buffer spanning the longest delay that every delayed window reads from.
+ * The energy window and undelayed time key of each single are only
+ * calculated once, and the delayed key of each panel 1 single once for each
+ * delayed window.  Delayed coincidences are built from the delayed panel 1
+ * single, so they look like prompts in time, and are marked in flags[0] with
+ * the number of the delayed window plus one.  They are written to their own
+ * stream, and counted per line of response for each delayed window in a
+ * LorCounter, so counting does not allocate for each coincidence.
+ *
+ * The prompt coincidences written out by HandleData can also be counted in a
+ * LorHistogram, set with setLorHistogram, for scans where the coincidences
+ * themselves do not need to be kept, and histogrammed by time difference in
+ * a TimingResolution, set with setTimingResolution.
+ */
+class CoincidenceSorter {
+public:
+    CoincidenceSorter(
+            SystemConfiguration const * const config,
+            float time_window_ns,
+            float energy_low,
+            float energy_high,
+            size_t coinc_storage_size,
+            MultiplesPolicy multiples_policy = KILL_ALL_MULTIPLES);
+    int insert(
+            std::vector<EventCal>::const_iterator begin,
+            std::vector<EventCal>::const_iterator end);
+    int insert(const EventCal * begin, const EventCal * end);
+    int flush();
+    int popCoinc(std::vector<EventCoinc> & output);
+    int HandleData(
+            std::vector<EventCal>::const_iterator begin,
+            std::vector<EventCal>::const_iterator end,
+            bool write_out_remaining);
+    int setCoincFilename(const std::string & filename);
+    int addDelayedWindow(long delay_ticks);
+    int popDelayed(std::vector<EventCoinc> & output);
+    int setDelayedFilename(const std::string & filename);
+    void setLorHistogram(LorHistogram * histogram, int shard);
+    void setTimingResolution(TimingResolution * resolution, int shard);
+    void setOutputRange(int64_t first_key, int64_t last_key);
+    int64_t lorIndex(const EventCoinc & coinc) const;
+    const std::vector<LorCount> & delayedLorCounts(size_t delayed_window);
+    CoincidenceInfo getCoincidenceInfo();
+    void resetCoincidenceInfo();
+    BoundedBuffer<EventCoinc> coinc_storage;
+
+private:
+    /*!
+     * \brief A delayed coincidence window reading from the panel 1 singles
+     */
+    struct DelayedWindow {
+        //! The delay, in coarse timestamp ticks, applied to panel 1
+        long delay_ticks;
+        //! The index of the next single in delayed_singles to be added
+        size_t next;
+        //! The single at next, delayed and keyed, if next_keyed is set
+        KeyedEventCal next_single;
+        bool next_keyed;
+        std::vector<KeyedEventCal> window;
+        //! The number of delayed coincidences for each lorIndex
+        LorCounter lor_counts;
+    };
+
+    template <class Policy, class Iterator>
+    int insertPolicy(Iterator begin, Iterator end);
+    template <class Policy>
+    int flushPolicy();
+    template <class Policy>
+    void addToWindow(
+            std::vector<KeyedEventCal> & window,
+            const KeyedEventCal & single,
+            int delayed_window);
+    template <class Policy>
+    void closeWindow(std::vector<KeyedEventCal> & window, int delayed_window);
+    template <class Policy>
+    void feedDelayedWindow(
+            DelayedWindow & delayed,
+            int delayed_window,
+            int64_t up_to_key,
+            bool all);
+    void addCoinc(
+            const EventCal & single0,
+            const EventCal & single1,
+            int delayed_window);
+    void trimDelayedSingles();
+    void updateCoincidenceInfo();
+
+    SystemConfiguration const * const system_config;
+    //! The time window in picoseconds, the unit of the keys
+    int64_t time_window_ps;
+    float energy_low;
+    float energy_high;
+    MultiplesPolicy multiples_policy;
+    //! Only windows opened by a single in [first, last) are output
+    int64_t output_first_key;
+    int64_t output_last_key;
+    //! Scratch space for the pairs selected from a multiple window
+    CoincPairs selected_pairs;
+    //! The singles in the open coincidence window, in time order
+    std::vector<KeyedEventCal> window;
+    //! The coincidences found that have not been written out
+    std::vector<EventCoinc> coinc_data;
+    std::ofstream coinc_output_file;
+    //! Panel 1 singles still to be added to one of the delayed windows
+    std::deque<KeyedEventCal> delayed_singles;
+    std::vector<DelayedWindow> delayed_windows;
+    //! The delayed coincidences found that have not been written out
+    std::vector<EventCoinc> delayed_data;
+    std::ofstream delayed_output_file;
+    //! Counts the prompt coincidences by line of response, if set
+    LorHistogram * lor_histogram;
+    int lor_histogram_shard;
+    //! Histograms the prompt coincidences by time difference, if set
+    TimingResolution * timing_resolution;
+    int timing_resolution_shard;
+
+    CoincidenceInfo info;
+    //! A mutex locked copy that is updated outside of the main loop
+    CoincidenceInfo locked_info;
+    std::mutex lock_locked_info;
+};
+
+#endif // COINCIDENCE_SORTER_H
@@ -0,0 +1,45 @@
+#ifndef CONFIGURATION_VERSIONS_H
+#define CONFIGURATION_VERSIONS_H
+
+#include <memory>
+#include <mutex>
+
+class SystemConfiguration;
+
+/*!
+ * \brief A system configuration paired with the version it was published as
+ */
+struct ConfigurationSnapshot {
+    std::shared_ptr<const SystemConfiguration> config;
+    int version;
+    ConfigurationSnapshot() : version(0) {}
+};
+
+/*!
+ * \brief Versioned system configurations that can be swapped during a run
+ *
+ * Holds the current version of the system configuration so that calibration
+ * updates (pedestals, crystal locations, time offsets, etc.) can be published
+ * while the processing threads are running.  Each processing thread acquires
+ * a snapshot at the start of a batch and holds onto it until the batch is
+ * done, so a configuration is never modified or deleted while it is in use.
+ * A version that has been replaced is deleted when the last thread using it
+ * acquires a newer snapshot.
+ *
+ * Published configurations are treated as immutable.  To make an update, take
+ * a copy of the current configuration with copyCurrent(), load the new
+ * calibration files into it, and then publish() it.
+ */
+class ConfigurationVersions {
+    std::shared_ptr<const ConfigurationSnapshot> current;
+    //! Serializes publishers so that each version number is used once
+    std::mutex publish_lock;
+public:
+    ConfigurationVersions(std::shared_ptr<const SystemConfiguration> config);
+    ConfigurationSnapshot acquire() const;
+    int currentVersion() const;
+    std::shared_ptr<SystemConfiguration> copyCurrent() const;
+    int publish(std::shared_ptr<const SystemConfiguration> config);
+};
+
+#endif // CONFIGURATION_VERSIONS_H
@@ -0,0 +1,60 @@
+#ifndef CRYSTAL_LOCATIONS_H
+#define CRYSTAL_LOCATIONS_H
+
+#include <string>
+#include <vector>
+#include <miil/SystemConfiguration.h>
+
+class FloodHistogram;
+
+/*!
+ * \brief Finds the location of each crystal in the flood histogram of its APD
+ *
+ * Each flood is smoothed, and every crystal is moved from a starting position
+ * to the nearby peak of the flood with a mean shift, using the counts above
+ * the lowest count within a window around the crystal, so the background
+ * between the peaks does not pull the crystals in.  The window of each
+ * crystal is half the distance to its nearest neighbor, so two crystals can
+ * not settle on the same peak.  If any crystal of an APD is in use in the
+ * configuration, such as after loadCrystalLocations, the crystals in use start
+ * from their locations, shifted and scaled to the spread of the flood.
+ * Otherwise they start from a square grid, at the quantiles of the x and y
+ * counts of the flood, with the crystal index running along x and then along
+ * y, which needs a square number of crystals per APD.
+ *
+ * Crystals with fewer than min_crystal_counts events in their window are
+ * marked as not used, as are the crystals of an APD that has fewer than
+ * min_crystal_counts events for each of its crystals, which are left at
+ * their starting positions.  The APDs are processed on no_threads threads.
+ */
+int FindCrystalLocations(
+        const std::vector<double> & floods,
+        int bins_per_axis,
+        float range,
+        SystemConfiguration const * const config,
+        std::vector<std::vector<std::vector<
+                std::vector<std::vector<std::vector<
+                CrystalCalibration> > > > > > & crystal_calibration,
+        int no_threads,
+        double min_crystal_counts = 20);
+
+int FindCrystalLocations(
+        FloodHistogram & floods,
+        SystemConfiguration const * const config,
+        std::vector<std::vector<std::vector<
+                std::vector<std::vector<std::vector<
+                CrystalCalibration> > > > > > & crystal_calibration,
+        int no_threads,
+        double min_crystal_counts = 20);
+
+int FindCrystalLocationsFile(
+        const std::string & events_filename,
+        bool calibrated_events,
+        const std::string & locations_filename,
+        SystemConfiguration const * const config,
+        int no_threads,
+        int bins_per_axis = 128,
+        float range = 1.0,
+        double min_crystal_counts = 20);
+
+#endif // CRYSTAL_LOCATIONS_H
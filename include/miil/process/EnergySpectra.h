@@ -0,0 +1,104 @@
+#ifndef ENERGY_SPECTRA_H
+#define ENERGY_SPECTRA_H
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <miil/EventCal.h>
+#include <miil/process/ProcessMonitor.h>
+#include <miil/process/ShardedHistogram.h>
+
+class SystemConfiguration;
+
+/*!
+ * \brief Live per crystal energy spectra that track the photopeak of each
+ *
+ * Histograms the spatial total, spat_total, and the calibrated energy, E, of
+ * every calibrated event by crystal, so that the drift of the photopeaks can
+ * be watched while acquiring.  Adding an event is two increments of a
+ * ShardedHistogram, with no allocation or locking, and the shard of each
+ * thread is only summed when the spectra are read.
+ *
+ * updatePeaks estimates the photopeak of each spectrum with WindowedCentroid,
+ * a mean over the bins within a fraction of the estimate on either side,
+ * which is repeated until it settles.  Each update starts from the
+ * previous estimate of the crystal, so following a drifting peak usually takes
+ * a single pass.  The energy peaks start from 511keV, and the spatial peaks
+ * from the gain_spat of the crystal in the calibration, if there is one, or
+ * otherwise from the largest bin of the spectrum.  The spatial peak of each
+ * APD, from the sum of its crystal spectra, can be written out in the format
+ * of SystemConfiguration::writePhotopeakPositions.
+ */
+class EnergySpectra : public ProcessMonitor {
+public:
+    EnergySpectra(
+            SystemConfiguration const * const config,
+            int no_shards,
+            int spat_bins = 256,
+            float spat_max = 4096,
+            int energy_bins = 128,
+            float energy_max = 1024,
+            float peak_window = 0.15);
+    void add(int shard, const EventCal & event);
+    void add(int shard,
+             std::vector<EventCal>::const_iterator begin,
+             std::vector<EventCal>::const_iterator end);
+    void addCalibrated(
+            int shard,
+            std::vector<EventCal>::const_iterator begin,
+            std::vector<EventCal>::const_iterator end,
+            SystemConfiguration const * const config);
+    int crystalIndex(
+            int panel,
+            int cartridge,
+            int fin,
+            int module,
+            int apd,
+            int crystal) const;
+    int snapshot(
+            int crystal_index,
+            std::vector<double> & spat_spectrum,
+            std::vector<double> & energy_spectrum);
+    int updatePeaks();
+    float spatPeak(int crystal_index);
+    float energyPeak(int crystal_index);
+    int apdSpatPeaks(std::vector<float> & peaks);
+    int writePhotopeakPositions(
+            const std::string & filename,
+            SystemConfiguration const * const config);
+    void decay(double factor);
+    void reset();
+    int noCrystals() const;
+    int noShards() const;
+
+    //! The fewest counts within the window for a peak to be estimated
+    double min_peak_counts;
+
+private:
+    float largestBin(
+            const double * spectrum,
+            int no_bins,
+            float bin_width) const;
+
+    SystemConfiguration const * const config;
+    int spat_bins;
+    float spat_bin_width;
+    int energy_bins;
+    float energy_bin_width;
+    float peak_window;
+    ShardedHistogram spat_histogram;
+    ShardedHistogram energy_histogram;
+
+    //! Protects the peak estimates and the spectra read by updatePeaks
+    std::mutex lock_peaks;
+    //! The gain_spat of each crystal from the calibration, or zero
+    std::vector<float> calibrated_spat_peaks;
+    //! The latest estimates of each crystal, or -1 if there is none yet
+    std::vector<float> spat_peaks;
+    std::vector<float> energy_peaks;
+    std::vector<double> spat_spectra;
+    std::vector<double> energy_spectra;
+};
+
+#endif // ENERGY_SPECTRA_H
@@ -0,0 +1,75 @@
+#ifndef FLOOD_HISTOGRAM_H
+#define FLOOD_HISTOGRAM_H
+
+#include <cstddef>
+#include <vector>
+#include <miil/EventCal.h>
+#include <miil/EventRaw.h>
+#include <miil/process/ProcessMonitor.h>
+#include <miil/process/ShardedHistogram.h>
+
+class SystemConfiguration;
+
+/*!
+ * \brief Live flood histograms of the (x, y) position of events for each APD
+ *
+ * Accumulates a 2D histogram of the anger logic position of the events on
+ * each APD, as CalculateXYandEnergy calculates it, while the data is being
+ * processed, so that the crystal segmentation can be checked during a run.
+ * Events can be added as decoded EventRaw, which are positioned with
+ * CalculateXYandEnergy, so that floods can be taken before the crystal
+ * locations are known, or as EventCal, which already hold their position.
+ *
+ * The counts are held in a ShardedHistogram, with a shard for each thread
+ * adding events.  As a ProcessMonitor, added with ProcessThreads::addMonitor,
+ * it is filled from the decoded events of each ProcessParams.  Reading the
+ * flood of an APD only sums the shards of that APD, and never stalls the
+ * threads adding events.  Each flood is bins_per_axis by bins_per_axis,
+ * covering -range to range in x and y, stored with x varying fastest.
+ */
+class FloodHistogram : public ProcessMonitor {
+public:
+    FloodHistogram(
+            SystemConfiguration const * const config,
+            int no_shards,
+            int bins_per_axis = 128,
+            float range = 1.0);
+    void add(int shard, const EventCal & event);
+    void add(int shard,
+             std::vector<EventCal>::const_iterator begin,
+             std::vector<EventCal>::const_iterator end);
+    void add(int shard,
+             std::vector<EventRaw>::const_iterator begin,
+             std::vector<EventRaw>::const_iterator end,
+             SystemConfiguration const * const config);
+    void addDecoded(
+            int shard,
+            std::vector<EventRaw>::const_iterator begin,
+            std::vector<EventRaw>::const_iterator end,
+            SystemConfiguration const * const config);
+    int apdIndex(int panel, int cartridge, int fin, int module, int apd) const;
+    int snapshot(
+            int panel,
+            int cartridge,
+            int fin,
+            int module,
+            int apd,
+            std::vector<double> & flood);
+    int snapshot(std::vector<double> & floods);
+    void decay(double factor);
+    void reset();
+    int noApds() const;
+    int noShards() const;
+    int binsPerAxis() const;
+    float range() const;
+
+private:
+    SystemConfiguration const * const config;
+    int bins_per_axis;
+    float flood_range;
+    //! The number of bins per unit of x or y
+    float bin_scale;
+    ShardedHistogram histogram;
+};
+
+#endif // FLOOD_HISTOGRAM_H
@@ -0,0 +1,133 @@
+#ifndef GAIN_DRIFT_CORRECTION_H
+#define GAIN_DRIFT_CORRECTION_H
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+#include <miil/EventCal.h>
+#include <miil/SystemConfiguration.h>
+#include <miil/process/ProcessMonitor.h>
+#include <miil/process/ShardedHistogram.h>
+
+class ConfigurationVersions;
+
+/*!
+ * \brief Corrects the drift of the module gains with temperature
+ *
+ * The gain of each module is measured, relative to the calibration, as the
+ * photopeak of the spatial total of its events divided by the gain_spat of
+ * their crystals in the reference calibration, which is taken from the
+ * configuration the correction is created with.  The ratios are histogrammed
+ * with a ShardedHistogram, so adding an event needs no allocation or locking.
+ *
+ * The temperatures of the fins are added from the slow control as they are
+ * read, such as from CalculateThermistorTemp.  Each update takes the events
+ * and temperatures since the last update, finds the photopeak of each module
+ * with a windowed centroid, and pairs it with the average temperature of its
+ * fin.  Fins excluded by exclude_thermistor_value, or without a reading, use
+ * the average of the other fins of their cartridge.  A straight line of gain
+ * against temperature is fit to the pairs of each module, with older pairs
+ * weighted down by forgetting at each update, so the fit follows any slower
+ * drift.  Once the temperatures of a module span enough to fit the slope,
+ * the gain of the module is predicted from its latest temperature, so the
+ * correction follows the temperature without waiting for the photopeak to be
+ * measured again.  Otherwise the latest photopeak is used.
+ *
+ * publish applies the gains to a copy of the current configuration, scaling
+ * the gain_spat and gain_comm of every crystal of each module from the
+ * reference calibration, and publishes it, so RawEventToEventCal uses the
+ * corrected gains from the next batch of each processing thread on.
+ */
+class GainDriftCorrection : public ProcessMonitor {
+public:
+    GainDriftCorrection(
+            SystemConfiguration const * const config,
+            int no_shards,
+            int ratio_bins = 200,
+            float ratio_max = 2,
+            float peak_window = 0.15);
+    void add(int shard, const EventCal & event);
+    void add(int shard,
+             std::vector<EventCal>::const_iterator begin,
+             std::vector<EventCal>::const_iterator end);
+    void addCalibrated(
+            int shard,
+            std::vector<EventCal>::const_iterator begin,
+            std::vector<EventCal>::const_iterator end,
+            SystemConfiguration const * const config);
+    int addTemperature(int panel, int cartridge, int fin, float temperature);
+    int moduleIndex(int panel, int cartridge, int fin, int module) const;
+    int update();
+    float gain(int module_index);
+    float coefficient(int module_index);
+    int apply(std::vector<std::vector<std::vector<
+                      std::vector<std::vector<std::vector<
+                      CrystalCalibration> > > > > > & crystal_calibration);
+    int publish(ConfigurationVersions & versions);
+    void reset();
+    int noModules() const;
+    int noShards() const;
+
+    //! The fewest counts within the window for a photopeak to be measured
+    double min_peak_counts;
+    //! The weight kept by the earlier measurements of a module at each update
+    double forgetting;
+    /*!
+     * The smallest standard deviation of the temperatures, in degrees C,
+     * measured for a module for its gain to be fit against them
+     */
+    double min_temperature_spread;
+
+private:
+    /*!
+     * \brief The temperature readings of a fin since the last update
+     */
+    struct FinTemperature {
+        double sum;
+        int readings;
+        //! The latest average over an update, or NaN if there is none yet
+        float latest;
+    };
+
+    /*!
+     * \brief The weighted sums of the line of gain against temperature
+     */
+    struct GainFit {
+        double weight;
+        double temperature;
+        double temperature_sq;
+        double gain;
+        double temperature_gain;
+    };
+
+    float moduleTemperature(int panel, int cartridge, int fin) const;
+
+    SystemConfiguration const * const config;
+    int ratio_bins;
+    float ratio_bin_width;
+    float peak_window;
+    ShardedHistogram ratio_histogram;
+    //! The reference gain_spat and gain_comm of each crystal, or zero
+    std::vector<float> reference_spat;
+    std::vector<float> reference_comm;
+    //! If the thermistor of each fin is left out of the averages
+    std::vector<char> excluded_fins;
+
+    //! Protects everything below, which is only used by updates and readers
+    std::mutex lock_gains;
+    std::vector<FinTemperature> fin_temperatures;
+    //! The histograms at the last update
+    std::vector<double> last_spectra;
+    std::vector<double> spectra;
+    std::vector<GainFit> fits;
+    //! The latest measured photopeak of each module, or -1 if there is none
+    std::vector<float> measured_gains;
+    /*!
+     * The gain, and its fractional change per degree C, of each module, or -1
+     * and 0 if there is no estimate
+     */
+    std::vector<float> gains;
+    std::vector<float> coefficients;
+};
+
+#endif // GAIN_DRIFT_CORRECTION_H
@@ -0,0 +1,98 @@
+#ifndef GLOBAL_MERGE_SORTER_H
+#define GLOBAL_MERGE_SORTER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <miil/BoundedBuffer.h>
+#include <miil/EventCal.h>
+#include <miil/process/RenaMergeSorter.h>
+
+class SystemConfiguration;
+class ProcessControl;
+class CoincidenceSorter;
+
+/*!
+ * \brief Merges the sorted calibrated events of several ProcessParams in time
+ *
+ * Each ProcessParams, typically one per panel or ethernet link, sorts its own
+ * calibrated events.  They hand their sorted output to an input of the merge
+ * sorter with push(), along with their watermark, the key that their output is
+ * complete up to.  The merge thread, run by ProcessThreads, keeps a queue of
+ * events per input and writes out, in time order, every event at or before the
+ * lowest watermark of the inputs.  An input that is slow or has stopped would
+ * hold everything back, so no input's watermark is taken to be more than the
+ * delay bound behind the latest event from any input.  Events that arrive
+ * after a later event was written out are counted as late and written out as
+ * soon as possible.
+ *
+ * The merged events are written to the merged file, if set, copied into
+ * merged_storage, and handed to the coincidence sorter, if set.
+ */
+class GlobalMergeSorter {
+public:
+    GlobalMergeSorter(
+            SystemConfiguration const * const config,
+            ProcessControl * const control_ptr,
+            long max_delay,
+            size_t merged_storage_size);
+    int addInput();
+    int push(
+            int input,
+            std::vector<EventCal>::const_iterator begin,
+            std::vector<EventCal>::const_iterator end,
+            int64_t watermark);
+    int MergeData();
+    int setMergedFilename(const std::string & filename);
+    void setCoincidenceSorter(CoincidenceSorter * sorter);
+    long mergedEvents() const;
+    long lateEvents() const;
+    size_t size() const;
+    BoundedBuffer<EventCal> merged_storage;
+
+private:
+    void pullInputs();
+    int64_t cutoffKey() const;
+    int merge(bool all, int64_t cutoff_key);
+    int HandleData(bool write_out_remaining);
+
+    SystemConfiguration const * const system_config;
+    ProcessControl * const control;
+    //! The max delay given to the constructor in picoseconds, the unit of keys
+    int64_t max_delay_ps;
+
+    //! Protects the pending events and watermarks handed over by push()
+    std::mutex lock;
+    std::condition_variable cv_data_pushed;
+    std::vector<std::vector<EventCal> > pending_events;
+    std::vector<int64_t> pending_watermarks;
+
+    //! The events from each input waiting to be merged, owned by MergeData
+    std::vector<std::deque<KeyedEventCal> > queues;
+    //! Everything from each input at or before this key has been received
+    std::vector<int64_t> watermarks;
+    //! Scratch space for pulling events from pending_events
+    std::vector<EventCal> pulled_events;
+    //! Scratch space for the heap of queue indices used by merge
+    std::vector<int> heap;
+    //! The merged events waiting to be written out
+    std::vector<EventCal> merged_data;
+    size_t no_events;
+    //! The largest key received from any input
+    int64_t max_key;
+    //! The key of the last event written out
+    int64_t last_written_key;
+
+    std::ofstream merged_output_file;
+    //! Finds the coincidences in the merged events, if set
+    CoincidenceSorter * coinc_sorter;
+    std::atomic<long> merged_events;
+    std::atomic<long> late_events;
+};
+
+#endif // GLOBAL_MERGE_SORTER_H
@@ -0,0 +1,76 @@
+#ifndef LOR_HISTOGRAM_H
+#define LOR_HISTOGRAM_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <miil/EventCoinc.h>
+#include <miil/process/LorIndexer.h>
+
+class SystemConfiguration;
+
+/*!
+ * \brief Counts the coincidences on each line of response
+ *
+ * An alternative to storing every EventCoinc for static scans, where only the
+ * number of coincidences on each line of response is needed.  The lines of
+ * response are numbered by a LorIndexer, which rejects crystals that are out
+ * of range or not used by the calibration.
+ *
+ * The histogram is split into shards, one for each thread adding to it, so
+ * that threads do not contend for it.  Each shard counts in a LorCounter, so
+ * the cost stays constant per coincidence and the memory used grows with
+ * the number of lines of response that were hit, rather than all of them.
+ * merge() collects the shards into the totals, and can be called
+ * periodically while coincidences are still being added.
+ */
+class LorHistogram {
+public:
+    LorHistogram(
+            SystemConfiguration const * const config,
+            int no_shards,
+            size_t shard_buffer_size = 1 << 20);
+    int add(int shard, const EventCoinc & coinc);
+    int add(int shard,
+            std::vector<EventCoinc>::const_iterator begin,
+            std::vector<EventCoinc>::const_iterator end);
+    void merge();
+    int64_t crystalIndex(
+            int panel,
+            int cartridge,
+            int fin,
+            int module,
+            int apd,
+            int crystal) const;
+    int64_t lorIndex(const EventCoinc & coinc) const;
+    int64_t noLors() const;
+    std::vector<LorCount> totals();
+    long totalCounts();
+    long invalidEvents();
+    int write(const std::string & filename);
+    void reset();
+
+private:
+    /*!
+     * \brief The part of the histogram filled by one thread
+     */
+    struct Shard {
+        std::mutex lock;
+        LorCounter counts;
+        long invalid;
+    };
+
+    void addLocked(Shard & shard, const EventCoinc & coinc);
+
+    LorIndexer indexer;
+    std::vector<Shard> shards;
+
+    //! Protects the totals collected by merge()
+    std::mutex lock_totals;
+    std::vector<LorCount> total_counts;
+    long total_invalid;
+};
+
+#endif // LOR_HISTOGRAM_H
@@ -0,0 +1,82 @@
+#ifndef LOR_INDEXER_H
+#define LOR_INDEXER_H
+
+#include <stdint.h>
+#include <vector>
+#include <miil/EventCoinc.h>
+#include <miil/process/SortedAccumulator.h>
+
+class SystemConfiguration;
+
+/*!
+ * \brief The number of coincidences on a line of response
+ *
+ * The record written out by LorHistogram::write.
+ */
+struct LorCount {
+    //! The index of the line of response from LorIndexer::lorIndex
+    int64_t lor;
+    int64_t count;
+};
+
+/*!
+ * \brief The Traits of a SortedAccumulator counting lines of response
+ */
+struct LorCountTraits {
+    static int64_t sampleKey(int64_t lor) {
+        return(lor);
+    }
+    static int64_t sumKey(const LorCount & count) {
+        return(count.lor);
+    }
+    static void start(LorCount & count, int64_t lor) {
+        count.lor = lor;
+        count.count = 0;
+    }
+    static void add(LorCount & count, int64_t) {
+        count.count++;
+    }
+    static void merge(LorCount & count, const LorCount & other) {
+        count.count += other.count;
+    }
+};
+
+//! Counts the lines of response added to it, sorted by line of response
+typedef SortedAccumulator<int64_t, LorCount, LorCountTraits> LorCounter;
+
+/*!
+ * \brief Numbers the crystals and lines of response of a system
+ *
+ * The crystals of each panel are numbered by (cartridge, fin, module, apd,
+ * crystal), and a line of response by the crystal of the left event, in
+ * panel 0, times the crystals in a panel plus the crystal of the right event,
+ * in panel 1.  The crystals that are not used by the calibration are looked
+ * up in a table built from the SystemConfiguration when the indexer is
+ * created, and rejected, but only if the calibration has been loaded.
+ */
+class LorIndexer {
+public:
+    LorIndexer(SystemConfiguration const * const config);
+    int64_t crystalIndex(
+            int panel,
+            int cartridge,
+            int fin,
+            int module,
+            int apd,
+            int crystal) const;
+    int64_t lorIndex(const EventCoinc & coinc) const;
+    int64_t noCrystals() const;
+    int64_t noLors() const;
+
+private:
+    SystemConfiguration const * const config;
+    //! The number of crystals in each panel, in the numbering of the table
+    int64_t crystals_per_panel;
+    /*!
+     * The crystal number within its panel, or -1 if the crystal is not used,
+     * at the SystemConfiguration::indexPCFMAX of each crystal
+     */
+    std::vector<int32_t> crystal_table;
+};
+
+#endif // LOR_INDEXER_H
@@ -0,0 +1,107 @@
+#ifndef PARALLEL_COINCIDENCE_H
+#define PARALLEL_COINCIDENCE_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <miil/EventCal.h>
+#include <miil/EventCoinc.h>
+#include <miil/process/CoincidenceSorter.h>
+
+class SystemConfiguration;
+
+/*!
+ * \brief Finds the coincidences in sorted singles with a thread per time slice
+ *
+ * The singles, sorted by EventCalTimeKey, such as by radix_sort_file with an
+ * EventCalTimeKeyFunction, are split into slices of about slice_size singles.
+ * Each slice is started at a single that is more than the time window after
+ * the single before it that passed the energy window, where the coincidence
+ * windowing always starts a new window, so the slices line up exactly with
+ * the windows of a single CoincidenceSorter over every single.  Each slice is
+ * run through its own CoincidenceSorter, limited with setOutputRange to the
+ * windows that open within the slice, and given the singles up to the time
+ * window past the end of the slice, so that the last window is complete.
+ * Delayed windows also read singles from before the slice, far enough back
+ * that the delayed stream has started a new window before the slice starts.
+ *
+ * The coincidences of each slice are appended in the order of the slices, so
+ * the prompt coincidences, and the delayed coincidences of each delayed
+ * window, are the same, in the same order, as those of one CoincidenceSorter.
+ * Coincidences from different delayed windows are grouped by slice, rather
+ * than by the order that the windows closed in.  The counters of the slices
+ * are added together into info.
+ */
+int FindCoincidencesParallel(
+        const EventCal * singles,
+        size_t count,
+        SystemConfiguration const * const config,
+        float time_window_ns,
+        float energy_low,
+        float energy_high,
+        MultiplesPolicy multiples_policy,
+        const std::vector<long> & delays,
+        std::vector<EventCoinc> & coinc,
+        std::vector<EventCoinc> & delayed,
+        CoincidenceInfo & info,
+        int no_threads,
+        size_t slice_size);
+
+int FindCoincidencesParallelFile(
+        const std::string & singles_filename,
+        const std::string & coinc_filename,
+        const std::string & delayed_filename,
+        SystemConfiguration const * const config,
+        float time_window_ns,
+        float energy_low,
+        float energy_high,
+        MultiplesPolicy multiples_policy,
+        const std::vector<long> & delays,
+        CoincidenceInfo & info,
+        int no_threads,
+        size_t slice_size);
+
+/*!
+ * \brief The differences found between FindCoincidencesParallel and a single
+ *        CoincidenceSorter by CompareCoincidencesParallel
+ */
+struct ParallelCoincidenceComparison {
+    size_t serial_coinc;
+    size_t parallel_coinc;
+    //! Prompt coincidences that differ, in order, plus the difference in count
+    size_t coinc_mismatches;
+    size_t serial_delayed;
+    size_t parallel_delayed;
+    /*!
+     * Delayed coincidences that differ, in order within each delayed window,
+     * plus the difference in count
+     */
+    size_t delayed_mismatches;
+    //! If the counters of the slices add up to those of the single sorter
+    bool info_matches;
+
+    ParallelCoincidenceComparison() :
+        serial_coinc(0),
+        parallel_coinc(0),
+        coinc_mismatches(0),
+        serial_delayed(0),
+        parallel_delayed(0),
+        delayed_mismatches(0),
+        info_matches(false)
+    {}
+};
+
+int CompareCoincidencesParallel(
+        const EventCal * singles,
+        size_t count,
+        SystemConfiguration const * const config,
+        float time_window_ns,
+        float energy_low,
+        float energy_high,
+        MultiplesPolicy multiples_policy,
+        const std::vector<long> & delays,
+        int no_threads,
+        size_t slice_size,
+        ParallelCoincidenceComparison & comparison);
+
+#endif // PARALLEL_COINCIDENCE_H
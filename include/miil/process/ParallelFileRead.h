@@ -0,0 +1,87 @@
+#ifndef PARALLEL_FILE_READ_H
+#define PARALLEL_FILE_READ_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*!
+ * The number of events read at once by each thread of ReadEventFileParallel
+ */
+#define PARALLEL_FILE_READ_EVENTS 65536
+
+/*!
+ * \brief Read a file of events in equal parts, one on each of no_threads
+ *        threads
+ *
+ * The file is taken to be a packed array of Event, as written by the
+ * processing.  Each thread opens the file itself, seeks to its part, and
+ * reads it in blocks of PARALLEL_FILE_READ_EVENTS, calling
+ * process(thread, begin, end) on each block, so process is called
+ * concurrently from every thread, but only ever with the thread's own number.
+ * A thread stops at the first failed read.
+ *
+ * \param filename The file of events to be read
+ * \param no_threads The number of threads, and parts of the file
+ * \param process The function called with each block of events read
+ *
+ * \return 0 on success, less than otherwise
+ *       - -1 if no_threads is less than one
+ *       - -4 if the file could not be opened or read
+ *       - -5 if the size of the file is not a whole number of events
+ */
+template <class Event, class Func>
+int ReadEventFileParallel(
+        const std::string & filename,
+        int no_threads,
+        Func process)
+{
+    if (no_threads < 1) {
+        return(-1);
+    }
+    std::ifstream input(filename.c_str(), std::ios::binary);
+    if (!input.good()) {
+        return(-4);
+    }
+    input.seekg(0, std::ios::end);
+    const size_t length_bytes = input.tellg();
+    input.close();
+    if (length_bytes % sizeof(Event)) {
+        return(-5);
+    }
+    const size_t no_events = length_bytes / sizeof(Event);
+    const size_t events_per_read = PARALLEL_FILE_READ_EVENTS;
+
+    std::atomic<int> status(0);
+    auto reader = [&](int thread) {
+        const size_t first = no_events * thread / no_threads;
+        const size_t last = no_events * (thread + 1) / no_threads;
+        std::ifstream file(filename.c_str(), std::ios::binary);
+        file.seekg(first * sizeof(Event));
+        std::vector<Event> events;
+        for (size_t start = first; start < last; start += events_per_read) {
+            const size_t count = std::min(events_per_read, last - start);
+            events.resize(count);
+            file.read((char*) events.data(), count * sizeof(Event));
+            if (!file.good()) {
+                status = -4;
+                return;
+            }
+            process(thread, events.cbegin(), events.cend());
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < no_threads; thread++) {
+        threads.push_back(std::thread(reader, thread));
+    }
+    for (size_t ii = 0; ii < threads.size(); ii++) {
+        threads[ii].join();
+    }
+    return(status);
+}
+
+#endif // PARALLEL_FILE_READ_H
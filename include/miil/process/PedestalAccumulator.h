@@ -0,0 +1,96 @@
+#ifndef PEDESTAL_ACCUMULATOR_H
+#define PEDESTAL_ACCUMULATOR_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <miil/EventRaw.h>
+#include <miil/SystemConfiguration.h>
+#include <miil/process/ProcessMonitor.h>
+
+/*!
+ * \brief Estimates the pedestals of each module from the decoded events
+ *
+ * Keeps the running mean and standard deviation of each of the channels in a
+ * pedestal file, a, b, c, d, com0, com0h, com1 and com1h, for each module,
+ * from the decoded events of a pedestal acquisition, so the pedestal file is
+ * ready when the acquisition finishes rather than after processing the data
+ * again.  The values are updated with Welford's method, so they stay accurate
+ * over any number of events, and each thread adding events has its own shard
+ * of estimates, which are combined only when the pedestals are read.  Each
+ * shard is locked once per batch of events, so readers only wait for the
+ * batch being added.
+ *
+ * With setOutput, the file is written, in the format read by
+ * SystemConfiguration::loadPedestals, as soon as every module has reached a
+ * number of events, by the thread adding the event that completes the last
+ * module.
+ */
+class PedestalAccumulator : public ProcessMonitor {
+public:
+    PedestalAccumulator(SystemConfiguration const * const config,
+                        int no_shards);
+    void add(int shard,
+             std::vector<EventRaw>::const_iterator begin,
+             std::vector<EventRaw>::const_iterator end);
+    void addDecoded(
+            int shard,
+            std::vector<EventRaw>::const_iterator begin,
+            std::vector<EventRaw>::const_iterator end,
+            SystemConfiguration const * const config);
+    int moduleIndex(
+            int panel,
+            int cartridge,
+            int daq,
+            int rena,
+            int module) const;
+    long events(int module_index) const;
+    int pedestals(std::vector<std::vector<std::vector<std::vector<
+            std::vector<ModulePedestals> > > > > & module_pedestals) const;
+    int write(const std::string & filename) const;
+    void setOutput(const std::string & filename, long events_per_module);
+    int outputStatus() const;
+    void reset();
+    int noModules() const;
+    int noShards() const;
+
+private:
+    /*!
+     * \brief The running estimates of every module from one thread
+     */
+    struct Shard {
+        std::mutex lock;
+        std::vector<long> counts;
+        //! The mean of each channel of each module
+        std::vector<double> means;
+        //! The sum of the squared differences from the mean of each channel
+        std::vector<double> m2s;
+        //! The modules added to in the current batch, for the output check
+        std::vector<int> batch_modules;
+        std::vector<long> batch_counts;
+    };
+
+    void checkOutput(Shard & shard);
+
+    int no_modules;
+    std::unique_ptr<Shard[]> shards;
+    int no_shards;
+    SystemConfiguration const * const config;
+    //! The pedestals of the configuration, used for the modules with no events
+    std::vector<std::vector<std::vector<std::vector<
+            std::vector<ModulePedestals> > > > > initial_pedestals;
+
+    //! Protects output_filename, and serializes setOutput and reset
+    std::mutex lock_output;
+    std::string output_filename;
+    std::atomic<long> output_events;
+    //! The number of events of each module over all of the shards
+    std::unique_ptr<std::atomic<long>[]> module_events;
+    std::atomic<int> modules_complete;
+    //! 1 while waiting to write the file, then the result of write
+    std::atomic<int> output_status;
+};
+
+#endif // PEDESTAL_ACCUMULATOR_H
@@ -0,0 +1,95 @@
+#ifndef PHOTOPEAK_FIT_H
+#define PHOTOPEAK_FIT_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <miil/EventCal.h>
+#include <miil/EventRaw.h>
+#include <miil/SystemConfiguration.h>
+#include <miil/process/ProcessMonitor.h>
+#include <miil/process/ShardedHistogram.h>
+
+/*!
+ * \brief Fits the photopeak and energy resolution of every crystal
+ *
+ * Histograms the spatial total, and the common signal, of the events of each
+ * crystal into spectra with a fixed number of bins, so the memory used does
+ * not depend on the number of events, with a shard for each thread adding
+ * events.  The photopeak of each spectrum is then fit with a gaussian, by a
+ * weighted least squares fit of a parabola to the log of the counts over a
+ * window around the peak, which is moved to the fit peak and refit until it
+ * settles.  The window runs from one sigma below the peak to two above, to
+ * keep the compton edge out of the fit.  The fits start from the calibration
+ * of the crystal, if there is one, or otherwise from the bin with the largest
+ * product of counts and position, which favors the photopeak over the low
+ * energy noise.  The fits only read the spectra, so the crystals are fit on
+ * a pool of threads, with no allocation per crystal.
+ *
+ * The common signal is the low gain common of the APD of the event, less its
+ * pedestal, as calculated by CalculateXYandEnergy, which is the signal that
+ * gain_comm and eres_comm describe.  Only decoded events, not calibrated ones,
+ * can give the common photopeaks.  Calibrated events only fill the spatial
+ * spectra, and the common values of the calibration are kept.
+ * The results can be written out in the format of
+ * SystemConfiguration::writeCalibration, with the energy resolutions as the
+ * full width at half maximum in percent of the photopeak.
+ */
+class PhotopeakFit : public ProcessMonitor {
+public:
+    PhotopeakFit(
+            SystemConfiguration const * const config,
+            int no_shards,
+            int spat_bins = 256,
+            float spat_max = 4096,
+            int comm_bins = 256,
+            float comm_max = 2048);
+    void add(int shard,
+             std::vector<EventCal>::const_iterator begin,
+             std::vector<EventCal>::const_iterator end);
+    void add(int shard,
+             std::vector<EventRaw>::const_iterator begin,
+             std::vector<EventRaw>::const_iterator end,
+             SystemConfiguration const * const config);
+    void addDecoded(
+            int shard,
+            std::vector<EventRaw>::const_iterator begin,
+            std::vector<EventRaw>::const_iterator end,
+            SystemConfiguration const * const config);
+    int crystalIndex(
+            int panel,
+            int cartridge,
+            int fin,
+            int module,
+            int apd,
+            int crystal) const;
+    int fit(std::vector<std::vector<std::vector<
+                    std::vector<std::vector<std::vector<
+                    CrystalCalibration> > > > > > & crystal_calibration,
+            int no_threads);
+    int write(const std::string & filename, int no_threads);
+    void reset();
+    int noCrystals() const;
+    int noShards() const;
+
+    //! The fewest counts within the fit window for a photopeak to be fit
+    double min_peak_counts;
+
+private:
+    SystemConfiguration const * const config;
+    int spat_bins;
+    float spat_bin_width;
+    int comm_bins;
+    float comm_bin_width;
+    ShardedHistogram spat_histogram;
+    ShardedHistogram comm_histogram;
+};
+
+int FitCalibrationFile(
+        const std::string & events_filename,
+        bool calibrated_events,
+        const std::string & calibration_filename,
+        SystemConfiguration const * const config,
+        int no_threads);
+
+#endif // PHOTOPEAK_FIT_H
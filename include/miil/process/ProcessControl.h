@@ -7,13 +7,16 @@ class ProcessControl {
     std::atomic_bool read_sockets_flag;
     std::atomic_bool process_data_flag;
     std::atomic_bool end_of_acquisiton_flag;
+    std::atomic_bool merge_data_flag;
     friend class ProcessThreads;
     friend class ProcessParams;
+    friend class GlobalMergeSorter;
 public:
     std::atomic_bool write_data_flag;
     std::atomic_bool decode_events_flag;
     std::atomic_bool calibrate_events_flag;
     std::atomic_bool energy_gate_calibrated_events_flag;
+    std::atomic_bool fixed_point_calibration_flag;
     std::atomic_bool sort_calibrated_events_flag;
     ProcessControl();
 };
@@ -3,6 +3,14 @@
 
 #include <iostream>
 
+/*!
+ * The number of bins in ProcessInfo::sort_delay_histogram.  Bin 0 counts
+ * events that arrived in order, and bin n counts events that arrived
+ * [2^(n-1), 2^n) coarse timestamp ticks behind the latest event.  The last bin
+ * also counts anything later than that.
+ */
+#define SORT_DELAY_HISTOGRAM_BINS 40
+
 class ProcessInfo {
     size_t current_index;
     size_t start_index;
@@ -11,6 +19,7 @@ class ProcessInfo {
 public:
     ProcessInfo();
     void reset();
+    void addCalibrateInfo(const ProcessInfo & other);
     std::string getDecodeInfo();
     std::string getCalibrateInfo();
 
@@ -38,6 +47,19 @@ public:
     long recv_calls_normal;
     long recv_calls_zero;
     long recv_calls_error;
+
+    //! The version of the system configuration used for the last batch
+    int calibration_version;
+
+    /*!
+     * Calibrated events that arrived after a later event had already been
+     * written out by the sorter, and are therefore written out of order.
+     */
+    long sort_late_events;
+    //! The delay bound, in coarse timestamp ticks, used for the last batch
+    long sort_delay_bound;
+    //! How far behind the latest event each event arrived at the sorter
+    long sort_delay_histogram[SORT_DELAY_HISTOGRAM_BINS];
 };
 
 std::ostream& operator<<(std::ostream& os, const ProcessInfo& info);
@@ -0,0 +1,64 @@
+#ifndef PROCESS_MONITOR_H
+#define PROCESS_MONITOR_H
+
+#include <vector>
+#include <miil/EventCal.h>
+#include <miil/EventRaw.h>
+
+class SystemConfiguration;
+
+/*!
+ * \brief Something that watches the events of the processing pipeline
+ *
+ * Monitors, such as FloodHistogram, are added to each ProcessParams with
+ * addMonitor, typically through ProcessThreads::addMonitor, and are handed
+ * every batch of events from the processing thread of each ProcessParams.
+ * Each ProcessParams is given its own shard number, so that a monitor can
+ * keep separate state for each thread and not need any locking while it is
+ * being filled.  A monitor must have at least as many shards as there are
+ * ProcessParams, which ProcessThreads checks with noShards, as the shard is
+ * not checked for each batch.  Both add functions do nothing by default.
+ */
+class ProcessMonitor {
+public:
+    virtual ~ProcessMonitor() {}
+
+    /*!
+     * \brief The number of shards the monitor can be filled by
+     */
+    virtual int noShards() const = 0;
+
+    /*!
+     * \brief Called with each batch of decoded events
+     *
+     * \param shard The shard of the calling ProcessParams
+     * \param begin The first decoded event of the batch
+     * \param end One past the last decoded event of the batch
+     * \param config The configuration the batch is being processed with
+     */
+    virtual void addDecoded(
+            int,
+            std::vector<EventRaw>::const_iterator,
+            std::vector<EventRaw>::const_iterator,
+            SystemConfiguration const * const)
+    {
+    }
+
+    /*!
+     * \brief Called with each batch of calibrated events, before sorting
+     *
+     * \param shard The shard of the calling ProcessParams
+     * \param begin The first calibrated event of the batch
+     * \param end One past the last calibrated event of the batch
+     * \param config The configuration the batch is being processed with
+     */
+    virtual void addCalibrated(
+            int,
+            std::vector<EventCal>::const_iterator,
+            std::vector<EventCal>::const_iterator,
+            SystemConfiguration const * const)
+    {
+    }
+};
+
+#endif // PROCESS_MONITOR_H
@@ -7,18 +7,28 @@
 #include <string>
 #include <thread>
 #include <mutex>
+#include <memory>
+#include <utility>
 #include <miil/BoundedBuffer.h>
 #include <miil/EventRaw.h>
 #include <miil/EventCal.h>
 #include <miil/process/ProcessInfo.h>
+#include <miil/process/CalibrationPool.h>
+#include <miil/process/ConfigurationVersions.h>
+#include <miil/process/RenaMergeSorter.h>
 
 class ProcessControl;
+class GlobalMergeSorter;
+class ProcessMonitor;
 class Ethernet;
 class SystemConfiguration;
 
 class ProcessParams {
     Ethernet * ethernet;
-    SystemConfiguration const * const system_config;
+    SystemConfiguration const * system_config;
+    ConfigurationVersions * config_versions;
+    //! Keeps the configuration from config_versions alive during a batch
+    ConfigurationSnapshot config_snapshot;
     ProcessControl * const control;
     ProcessInfo info;
     //! A mutex locked copy that is updated outside of the main thread loops
@@ -35,6 +45,10 @@ class ProcessParams {
     std::deque<char> buffer_process_side;
     std::vector<EventRaw> decoded_data;
     std::vector<EventCal> calibrated_data;
+    //! The EventCalTimeKey of each event in calibrated_data, used for sorting
+    std::vector<int64_t> calibrated_keys;
+    //! Holds calibrated events until they can be assumed to be sorted
+    RenaMergeSorter event_sorter;
     std::string filename_raw;
     std::string filename_decode;
     std::string filename_calibrate;
@@ -46,8 +60,15 @@ class ProcessParams {
     bool write_calibrated_events_flag;
     bool files_reset_flag;
     size_t current_file_size;
+    std::unique_ptr<CalibrationPool> calibration_pool;
+    //! Where the sorted calibrated events are handed for a global merge
+    GlobalMergeSorter * merge_sorter;
+    int merge_sorter_input;
+    //! The monitors handed each batch of events, with the shard of each
+    std::vector<std::pair<ProcessMonitor *, int> > monitors;
 
     void updateProcessInfo();
+    void updateConfiguration();
     int DecodeBuffer(size_t write_to_position);
     int ClearProcessedData();
     int HandleData(bool write_out_remaining_cal_data);
@@ -76,6 +97,16 @@ public:
     void setRawFilename(const std::string & filename);
     void setDecodeFilename(const std::string & filename);
     void setCalibratedFilename(const std::string & filename);
+    void setConfigurationVersions(ConfigurationVersions * versions);
+    void setCalibrationWorkers(
+            size_t no_workers,
+            size_t events_per_batch = 4096);
+    void setAdaptiveSortDelay(
+            bool enable,
+            double quantile = 0.9999,
+            long min_delay = 0);
+    void setMergeSorter(GlobalMergeSorter * merger);
+    void addMonitor(ProcessMonitor * monitor, int shard);
     ProcessInfo getProcessInfo();
     void resetProcessInfo();
     BoundedBuffer<char> raw_storage;
@@ -101,6 +132,16 @@ public:
             std::vector<EventCal> & calibrated_data,
             ProcessInfo & info,
             SystemConfiguration const * const config);
+    static int CalibrateBuffer(
+            std::vector<EventRaw>::const_iterator begin,
+            std::vector<EventRaw>::const_iterator end,
+            std::vector<EventCal> & calibrated_data,
+            ProcessInfo & info,
+            SystemConfiguration const * const config,
+            bool energy_gate,
+            float energy_gate_low,
+            float energy_gate_high,
+            bool fixed_point = false);
     static int IDBuffer(
             const std::vector<EventRaw> & decoded_data,
             std::vector<EventCal> & calibrated_data,
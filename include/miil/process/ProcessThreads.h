@@ -7,12 +7,17 @@
 
 class ProcessParams;
 class ProcessControl;
+class GlobalMergeSorter;
+class ProcessMonitor;
 
 class ProcessThreads {
     std::vector<ProcessParams *> process_params_vec;
     ProcessControl * const control;
     std::vector<std::thread> read_sockets_threads;
     std::vector<std::thread> process_data_threads;
+    GlobalMergeSorter * merge_sorter;
+    std::vector<ProcessMonitor *> monitors;
+    std::thread merge_data_thread;
     bool is_running;
     void stopProcessing(bool end_acquisition);
     void startProcessing();
@@ -21,7 +26,9 @@ class ProcessThreads {
 
 public:
     ProcessThreads(ProcessControl * const control_ptr);
-    void addParams(ProcessParams * const process_params_ptr);
+    int addParams(ProcessParams * const process_params_ptr);
+    void setMergeSorter(GlobalMergeSorter * const merge_sorter_ptr);
+    int addMonitor(ProcessMonitor * const monitor);
     void start(bool single_thread = false);
     void stop(bool end_acquisition);
     void setRawFilename(const std::string & filename, int index);
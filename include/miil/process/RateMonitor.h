@@ -0,0 +1,142 @@
+#ifndef RATE_MONITOR_H
+#define RATE_MONITOR_H
+
+#include <stdint.h>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <miil/EventCal.h>
+#include <miil/EventRaw.h>
+#include <miil/process/ProcessMonitor.h>
+
+class SystemConfiguration;
+
+/*!
+ * \brief The level that RateMonitor::rates sums the rates up to
+ */
+enum RateLevel {
+    //! Each module of a rena
+    RATE_MODULE,
+    //! Each rena of a daq board
+    RATE_RENA,
+    //! Each daq board, or backend
+    RATE_DAQ
+};
+
+/*!
+ * \brief Why RateMonitor::checkAlarms raised an alarm
+ */
+enum RateAlarmType {
+    //! The decoded rate is below the low threshold, such as a dead module
+    RATE_ALARM_LOW,
+    //! The decoded rate is above the high threshold, such as a hot channel
+    RATE_ALARM_HIGH,
+    //! Too large a fraction of the decoded events were rejected
+    RATE_ALARM_REJECTED
+};
+
+/*!
+ * \brief An alarm raised by RateMonitor::checkAlarms for one module
+ */
+struct RateAlarm {
+    RateAlarmType type;
+    int panel;
+    int cartridge;
+    int daq;
+    int rena;
+    int module;
+    //! The decoded rate, or the rejected fraction, that raised the alarm
+    double value;
+};
+
+/*!
+ * \brief Time binned rates of each module of the system while acquiring
+ *
+ * Counts the decoded events, and the ones that were calibrated without being
+ * rejected, for each (panel, cartridge, daq, rena, module) in buckets of a
+ * fixed number of coarse timestamp ticks, so rate spikes, dead modules and
+ * hot channels can be seen during the run.  The buckets are kept in a ring,
+ * so the memory used is fixed no matter how long the run is, and only the
+ * last no_buckets buckets are kept.
+ *
+ * Each thread adding events, such as each ProcessParams through
+ * ProcessThreads::addMonitor, has its own ring, which only it writes, with
+ * relaxed atomic counters and no locks.  When the ring wraps around to a
+ * bucket still holding older counts, the writer marks the bucket as being
+ * reused, clears it, and then tags it with its new time, so a reader, which
+ * checks the tag before and after reading a bucket, skips any bucket that was
+ * reused while it was being read, as with a seqlock.  Events from before the
+ * oldest bucket of the ring are counted as late and not binned.
+ */
+class RateMonitor : public ProcessMonitor {
+public:
+    RateMonitor(
+            SystemConfiguration const * const config,
+            int no_shards,
+            double bucket_seconds = 0.1,
+            int no_buckets = 600);
+    void addDecoded(
+            int shard,
+            std::vector<EventRaw>::const_iterator begin,
+            std::vector<EventRaw>::const_iterator end,
+            SystemConfiguration const * const config);
+    void addCalibrated(
+            int shard,
+            std::vector<EventCal>::const_iterator begin,
+            std::vector<EventCal>::const_iterator end,
+            SystemConfiguration const * const config);
+    int moduleIndex(
+            int panel,
+            int cartridge,
+            int daq,
+            int rena,
+            int module) const;
+    int rates(
+            double seconds,
+            RateLevel level,
+            std::vector<double> & decoded_rates,
+            std::vector<double> & accepted_rates) const;
+    int checkAlarms(
+            double seconds,
+            double low_rate,
+            double high_rate,
+            double max_rejected_fraction,
+            std::vector<RateAlarm> & alarms) const;
+    long lateEvents() const;
+    double bucketSeconds() const;
+    int noModules() const;
+    int noShards() const;
+
+private:
+    /*!
+     * \brief The ring of buckets filled by one thread
+     *
+     * The counts of each bucket are held as the decoded and accepted counts of
+     * every module, in a single array for the whole ring.
+     */
+    struct Ring {
+        //! The bucket number held by each slot, or -1 while it is being reused
+        std::unique_ptr<std::atomic<int64_t>[]> bucket_ids;
+        std::unique_ptr<std::atomic<uint32_t>[]> counts;
+        //! The latest bucket number that has been added to
+        std::atomic<int64_t> latest_bucket;
+        std::atomic<long> late_events;
+    };
+
+    void count(int shard, int64_t ct, int module_index, int counter);
+
+    SystemConfiguration const * const config;
+    int no_modules;
+    double bucket_seconds;
+    int64_t bucket_ticks;
+    int no_buckets;
+    /*!
+     * The moduleIndex at the SystemConfiguration::indexPCFM of each module,
+     * for EventCal
+     */
+    std::vector<int> pcfm_table;
+    std::vector<Ring> rings;
+};
+
+#endif // RATE_MONITOR_H
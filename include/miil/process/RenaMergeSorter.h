@@ -0,0 +1,96 @@
+#ifndef RENA_MERGE_SORTER_H
+#define RENA_MERGE_SORTER_H
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <miil/EventCal.h>
+
+class SystemConfiguration;
+class ProcessInfo;
+
+/*!
+ * \brief A calibrated event held with its integer timestamp from EventCalTimeKey
+ */
+struct KeyedEventCal {
+    int64_t key;
+    EventCal event;
+};
+
+/*!
+ * \brief Sorts calibrated events by merging the time ordered stream of each rena
+ *
+ * Each rena reads out its events in time order, so the stream of calibrated
+ * events is an interleaving of one sorted stream per rena.  Events are
+ * demultiplexed into a queue per (panel, cartridge, daq, rena), and the queues
+ * are merged with a heap of their first events, which costs O(n log k) for n
+ * events from k renas.  An event that arrives out of order within its own rena
+ * is inserted into place in that rena's queue, so the queues, and therefore
+ * the output, stay sorted.  Events are ordered by the key calculated for them
+ * by EventCalTimeKey, so every comparison is between integers.
+ *
+ * The latest key from each rena is its low watermark, as nothing earlier is
+ * expected from it.  Events are written out once every rena has advanced past
+ * them.  A rena that has gone quiet would hold everything back, so each
+ * watermark is never considered to be more than the delay bound behind the
+ * latest event in the system.  The delay bound can be fixed, or adapted to the
+ * measured delays of the events arriving at the sorter.  Events that arrive
+ * after a later event was written out are counted as late.
+ */
+class RenaMergeSorter {
+public:
+    RenaMergeSorter(SystemConfiguration const * const config);
+    int insert(
+            std::vector<EventCal>::const_iterator begin,
+            std::vector<EventCal>::const_iterator end,
+            std::vector<int64_t>::const_iterator keys_begin,
+            ProcessInfo & info);
+    int popSorted(std::vector<EventCal> & output, long max_delay);
+    int popAll(std::vector<EventCal> & output);
+    void setAdaptiveDelay(bool enable, double quantile, long min_delay);
+    long delayBound() const;
+    int64_t watermark() const;
+    size_t size() const;
+    bool empty() const;
+
+private:
+    int sourceIndex(const EventCal & event) const;
+    int merge(std::vector<EventCal> & output, bool all, int64_t cutoff_key);
+    long adaptedDelay(long max_delay) const;
+
+    int panels_per_system;
+    int cartridges_per_panel;
+    int daqs_per_cartridge;
+    int renas_per_daq;
+    //! The period of the coarse timestamp in picoseconds, the unit of the keys
+    double ct_period_ps;
+    //! The time ordered events for each rena waiting to be merged
+    std::vector<std::deque<KeyedEventCal> > queues;
+    //! The largest key inserted for each rena, its low watermark
+    std::vector<int64_t> latest_keys;
+    //! The number of events held across all of the queues
+    size_t no_events;
+    //! The largest key inserted so far
+    int64_t max_key;
+    //! The key of the last event written out
+    int64_t last_written_key;
+    //! Every held event at or before this key has been written out
+    int64_t watermark_key;
+    //! Scratch space for the heap of queue indices used by merge
+    std::vector<int> heap;
+
+    bool adaptive_delay_flag;
+    double adaptive_delay_quantile;
+    long adaptive_min_delay;
+    //! The delay bound used by the last call to popSorted
+    long delay_bound;
+    /*!
+     * Histogram of the arrival delays, binned like
+     * ProcessInfo::sort_delay_histogram, that the adaptive delay is estimated
+     * from.  Halved periodically so it follows changes in the delays.
+     */
+    std::vector<long> delay_histogram;
+    long delays_since_decay;
+};
+
+#endif // RENA_MERGE_SORTER_H
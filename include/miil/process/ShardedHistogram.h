@@ -0,0 +1,69 @@
+#ifndef SHARDED_HISTOGRAM_H
+#define SHARDED_HISTOGRAM_H
+
+#include <stdint.h>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*!
+ * \brief A histogram filled by several threads and read without stalling them
+ *
+ * Each thread filling the histogram is given its own shard of counts, which
+ * only it writes, so incrementing a bin is a relaxed load and store with no
+ * locking or contention.  The shards are only summed when the histogram is
+ * read, by snapshot, which takes the counts added to each bin since the last
+ * read and folds them into a copy kept by the readers.  Readers therefore
+ * never lock or write to the shards, and the filling threads never wait for
+ * a reader.  Reset and decay are applied to the readers' copy, so they can be
+ * called at any time, by any reader.
+ *
+ * The counts of a shard are 32 bit and allowed to wrap, as only the
+ * difference since the last read is used, so a bin can take up to 2^32 counts
+ * between reads.
+ */
+class ShardedHistogram {
+public:
+    ShardedHistogram(size_t no_bins, int no_shards);
+
+    /*!
+     * \brief Add one to a bin of a shard
+     *
+     * Must only be called by the thread that owns the shard.  The shard and
+     * bin are not checked, so the monitors using the histogram check the bin,
+     * and ProcessThreads checks that each monitor has a shard for every
+     * ProcessParams before it is added.
+     */
+    void increment(int shard, size_t bin) {
+        std::atomic<uint32_t> & count = shard_counts[shard][bin];
+        count.store(count.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+    }
+
+    int snapshot(std::vector<double> & counts);
+    int snapshot(
+            size_t first_bin,
+            size_t no_bins,
+            std::vector<double> & counts);
+    void decay(double factor);
+    void reset();
+    size_t size() const;
+    int shards() const;
+
+private:
+    void fold(size_t first_bin, size_t no_bins);
+
+    size_t no_bins;
+    std::vector<std::unique_ptr<std::atomic<uint32_t>[]> > shard_counts;
+
+    //! Protects the readers' copy of the histogram
+    std::mutex lock_view;
+    //! The sum of the shards for each bin at the last read
+    std::vector<uint32_t> last_counts;
+    //! The counts of each bin, after any reset or decay
+    std::vector<double> view;
+};
+
+#endif // SHARDED_HISTOGRAM_H
@@ -0,0 +1,144 @@
+#ifndef SORTED_ACCUMULATOR_H
+#define SORTED_ACCUMULATOR_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+#include <miil/radix_sort.h>
+
+/*!
+ * \brief Sums of samples with an integer key, held sorted by the key
+ *
+ * Samples are appended to a buffer, which is radix sorted and collapsed into
+ * the sorted sums once it is as large as them, or as min_buffer_size if that
+ * is larger, so the cost of merging is spread over the samples in the buffer
+ * and stays constant per sample.  The memory used grows with the number of
+ * keys that were hit, rather than with the samples or every possible key.
+ *
+ * Traits supplies the keys and the arithmetic:
+ *     - static int64_t sampleKey(const Sample &)
+ *     - static int64_t sumKey(const Sum &)
+ *     - static void start(Sum &, int64_t key), an empty sum for the key
+ *     - static void add(Sum &, const Sample &)
+ *     - static void merge(Sum &, const Sum &), for two sums of the same key
+ *
+ * The accumulator is not locked.  Each thread should have its own, and
+ * combine them with merge.
+ */
+template <class Sample, class Sum, class Traits>
+class SortedAccumulator {
+public:
+    SortedAccumulator(size_t min_buffer_size = 1 << 20) :
+        min_buffer_size(min_buffer_size)
+    {
+    }
+
+    /*!
+     * \brief Add a sample, collapsing the buffer if it has grown large enough
+     */
+    void add(const Sample & sample) {
+        buffer.push_back(sample);
+        if (buffer.size() >= std::max(min_buffer_size, collapsed.size())) {
+            collapse();
+        }
+    }
+
+    /*!
+     * \brief Sort the buffered samples and add them into the sums
+     */
+    void collapse() {
+        if (buffer.empty()) {
+            return;
+        }
+        radix_sort(buffer, SampleKey());
+        std::vector<Sum> buffer_sums;
+        for (size_t ii = 0; ii < buffer.size(); ii++) {
+            const int64_t key = Traits::sampleKey(buffer[ii]);
+            if (buffer_sums.empty() ||
+                (Traits::sumKey(buffer_sums.back()) != key))
+            {
+                buffer_sums.push_back(Sum());
+                Traits::start(buffer_sums.back(), key);
+            }
+            Traits::add(buffer_sums.back(), buffer[ii]);
+        }
+        buffer.clear();
+        std::vector<Sum> merged;
+        merge(collapsed, buffer_sums, merged);
+        collapsed.swap(merged);
+    }
+
+    /*!
+     * \brief The sums of every sample added, sorted by key
+     *
+     * Collapses the buffer first.
+     */
+    const std::vector<Sum> & sums() {
+        collapse();
+        return(collapsed);
+    }
+
+    /*!
+     * \brief Exchange the samples of two accumulators
+     *
+     * Allows the samples to be taken out of a shared accumulator while it is
+     * locked, and collapsed after the lock is released.
+     */
+    void swap(SortedAccumulator & other) {
+        buffer.swap(other.buffer);
+        collapsed.swap(other.collapsed);
+    }
+
+    void clear() {
+        buffer.clear();
+        collapsed.clear();
+    }
+
+    /*!
+     * \brief Add two sets of sums sorted by key
+     *
+     * \param sums1 One set of sums
+     * \param sums2 The other set of sums
+     * \param output Where the sums of both, sorted by key, are returned
+     */
+    static void merge(
+            const std::vector<Sum> & sums1,
+            const std::vector<Sum> & sums2,
+            std::vector<Sum> & output)
+    {
+        output.clear();
+        output.reserve(sums1.size() + sums2.size());
+        size_t ii = 0;
+        size_t jj = 0;
+        while ((ii < sums1.size()) && (jj < sums2.size())) {
+            const int64_t key1 = Traits::sumKey(sums1[ii]);
+            const int64_t key2 = Traits::sumKey(sums2[jj]);
+            if (key1 < key2) {
+                output.push_back(sums1[ii++]);
+            } else if (key2 < key1) {
+                output.push_back(sums2[jj++]);
+            } else {
+                output.push_back(sums1[ii++]);
+                Traits::merge(output.back(), sums2[jj++]);
+            }
+        }
+        output.insert(output.end(), sums1.begin() + ii, sums1.end());
+        output.insert(output.end(), sums2.begin() + jj, sums2.end());
+    }
+
+private:
+    struct SampleKey {
+        int64_t operator()(const Sample & sample) const {
+            return(Traits::sampleKey(sample));
+        }
+    };
+
+    size_t min_buffer_size;
+    //! The samples added since the buffer was last collapsed
+    std::vector<Sample> buffer;
+    //! The sums collapsed from the buffer, sorted by key
+    std::vector<Sum> collapsed;
+};
+
+#endif // SORTED_ACCUMULATOR_H
@@ -0,0 +1,157 @@
+#ifndef TIME_OFFSET_SOLVER_H
+#define TIME_OFFSET_SOLVER_H
+
+#include <stdint.h>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <miil/EventCoinc.h>
+#include <miil/SystemConfiguration.h>
+#include <miil/process/LorIndexer.h>
+#include <miil/process/SortedAccumulator.h>
+
+/*!
+ * \brief Solves for the time offset of every crystal from coincidences
+ *
+ * The time difference of a coincidence is modeled as the offset of the left
+ * crystal less that of the right, each with a linear dependence on the energy
+ * of its event about 511keV, as TimeCalCoincEvent removes them.  The offsets
+ * are the least squares fit of the model to the time differences.  Only sums
+ * of the time differences and energies on each pair of crystals, numbered
+ * as lines of response by a LorIndexer, are kept.  Each shard sums its
+ * coincidences in a SortedAccumulator, as LorHistogram counts them, so the
+ * memory used grows with the number of pairs that were hit, not the number
+ * of coincidences.
+ *
+ * The fit is solved iteratively.  A crystal only shares coincidences with
+ * crystals of the other panel, so the offset and energy dependence of every
+ * crystal in a panel can be solved for at once on a pool of threads, holding
+ * the other panel fixed, and the panels are alternated until the largest
+ * change in the time correction of any crystal, at its typical energy, is
+ * below the tolerance.  Only differences of offsets are measured, so the
+ * offsets are shifted to an average of zero.  Crystals with fewer than
+ * min_crystal_counts coincidences, with other crystals that have enough, are
+ * not solved for, and their coincidences are left out.
+ *
+ * The sums assume coincidences built from singles calibrated once with the
+ * offsets of the configuration, by RawEventToEventCal or
+ * RawEventToEventCalFixed, such as the output of CoincidenceSorter, and not
+ * passed through TimeCalCoincEvent again.  The time differences then only
+ * hold what is left over from the offsets of the configuration, so the
+ * offsets found are added to them.  Coincidences built from fine timestamps
+ * without any time calibration can only be used with a configuration that
+ * has no time offsets loaded.
+ * Delayed coincidences are rejected.  The results can be written out in the
+ * format of SystemConfiguration::writeTimeCalWithEdep.
+ */
+class TimeOffsetSolver {
+public:
+    TimeOffsetSolver(
+            SystemConfiguration const * const config,
+            int no_shards,
+            size_t shard_buffer_size = 1 << 20);
+    int add(int shard, const EventCoinc & coinc);
+    int add(int shard,
+            std::vector<EventCoinc>::const_iterator begin,
+            std::vector<EventCoinc>::const_iterator end);
+    int64_t crystalIndex(
+            int panel,
+            int cartridge,
+            int fin,
+            int module,
+            int apd,
+            int crystal) const;
+    int64_t noCrystals() const;
+    int solve(std::vector<std::vector<std::vector<
+                      std::vector<std::vector<std::vector<
+                      CrystalCalibration> > > > > > & crystal_calibration,
+              int no_threads);
+    int write(const std::string & filename, int no_threads);
+    int iterations() const;
+    void reset();
+
+    //! The fewest coincidences of a crystal for it to be solved for
+    double min_crystal_counts;
+    //! The most times each panel is solved for
+    int max_iterations;
+    //! The largest change in time correction, in ns, of a converged solution
+    double tolerance;
+    //! If the energy dependence of the offsets is solved for, or left at zero
+    bool fit_edep;
+
+    /*!
+     * \brief The sums of the coincidences on a pair of crystals
+     *
+     * The energies are relative to 511keV, with 0 being the left event, and 1
+     * the right event.
+     */
+    struct PairSums {
+        //! The left crystal number times the crystals in a panel plus the right
+        int64_t pair;
+        double counts;
+        double e0;
+        double e1;
+        double e0e0;
+        double e1e1;
+        double e0e1;
+        double dtf;
+        double dtf_e0;
+        double dtf_e1;
+    };
+
+private:
+    /*!
+     * \brief A coincidence waiting to be collapsed into the sums of a shard
+     */
+    struct PairSample {
+        int64_t pair;
+        float e0;
+        float e1;
+        float dtf;
+    };
+
+    /*!
+     * \brief The Traits of the SortedAccumulator of the PairSums
+     */
+    struct PairTraits {
+        static int64_t sampleKey(const PairSample & sample) {
+            return(sample.pair);
+        }
+        static int64_t sumKey(const PairSums & sums) {
+            return(sums.pair);
+        }
+        static void start(PairSums & sums, int64_t pair);
+        static void add(PairSums & sums, const PairSample & sample);
+        static void merge(PairSums & sums, const PairSums & other);
+    };
+    typedef SortedAccumulator<PairSample, PairSums, PairTraits> PairAccumulator;
+
+    /*!
+     * \brief The part of the sums filled by one thread
+     */
+    struct Shard {
+        std::mutex lock;
+        PairAccumulator sums;
+    };
+
+    void addLocked(Shard & shard, const EventCoinc & coinc);
+
+    LorIndexer indexer;
+    int64_t crystals_per_panel;
+    int fins_per_cartridge;
+    int modules_per_fin;
+    int apds_per_module;
+    int crystals_per_apd;
+    std::vector<Shard> shards;
+    int last_iterations;
+    SystemConfiguration const * const config;
+};
+
+int SolveTimeCalibrationFile(
+        const std::string & coinc_filename,
+        const std::string & time_calibration_filename,
+        SystemConfiguration const * const config,
+        int no_threads);
+
+#endif // TIME_OFFSET_SOLVER_H
@@ -0,0 +1,71 @@
+#ifndef TIMING_RESOLUTION_H
+#define TIMING_RESOLUTION_H
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+#include <miil/EventCoinc.h>
+#include <miil/process/ShardedHistogram.h>
+
+class SystemConfiguration;
+
+/*!
+ * \brief Live histograms of the time difference of the coincidences
+ *
+ * Histograms dtf of every prompt coincidence, once over the whole system and
+ * once for the pair of cartridges of its events, so the timing resolution
+ * can be watched converging while the time calibration is updated.  Adding a
+ * coincidence is two increments of a ShardedHistogram, with no allocation or
+ * locking, and the memory used is fixed by the number of bins and cartridges.
+ * Coincidences outside of the range of the histograms are not counted.  The
+ * histograms can be filled by CoincidenceSorter, set with
+ * setTimingResolution.
+ *
+ * updateResolution estimates the full width at half maximum of each
+ * histogram, by interpolating where the counts fall to half of the largest
+ * bin on either side of it, along with the center of the peak, which shows
+ * any offset left between the cartridges.  decay can be used to let older
+ * coincidences fade out, so the estimates follow the latest calibration.
+ */
+class TimingResolution {
+public:
+    TimingResolution(
+            SystemConfiguration const * const config,
+            int no_shards,
+            int dtf_bins = 200,
+            float dtf_max = 50);
+    void add(int shard, const EventCoinc & coinc);
+    void add(int shard,
+             std::vector<EventCoinc>::const_iterator begin,
+             std::vector<EventCoinc>::const_iterator end);
+    int pairHistogram(int cartridge0, int cartridge1) const;
+    int snapshot(int histogram, std::vector<double> & counts);
+    int updateResolution();
+    float fwhm(int histogram);
+    float center(int histogram);
+    float binCenter(int bin) const;
+    void decay(double factor);
+    void reset();
+    int noHistograms() const;
+    int noBins() const;
+
+    //! The fewest counts in a histogram for its resolution to be estimated
+    double min_counts;
+
+private:
+    int cartridges_per_panel;
+    int dtf_bins;
+    float dtf_max;
+    float dtf_bin_width;
+    //! The global histogram, followed by that of each pair of cartridges
+    ShardedHistogram histograms;
+
+    //! Protects the estimates and the counts read by updateResolution
+    std::mutex lock_resolution;
+    //! The latest estimates of each histogram, or -1 if there is none yet
+    std::vector<float> fwhms;
+    std::vector<float> centers;
+    std::vector<double> dtf_counts;
+};
+
+#endif // TIMING_RESOLUTION_H
@@ -0,0 +1,88 @@
+#ifndef UV_CIRCLE_FIT_H
+#define UV_CIRCLE_FIT_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <miil/EventRaw.h>
+#include <miil/SystemConfiguration.h>
+#include <miil/process/ProcessMonitor.h>
+
+/*!
+ * \brief Fits the uv circle center of each APD from the decoded events
+ *
+ * The fine timestamp, from FineCalc, is the angle of the (u, v) timing
+ * samples of an event around the center of the circle they trace out for the
+ * APD.  This fits each circle from the decoded events while acquiring, with an
+ * algebraic least squares (Kasa) fit, so the centers are ready without taking
+ * a pass over the data.  The fit only needs ten sums of the samples of each
+ * APD, so the memory used does not grow with the number of events, and each
+ * thread adding events keeps its own sums, which are added together only when
+ * the circles are fit.  Each shard is locked once per batch of events, so
+ * readers only wait for the batch being added.
+ *
+ * The APD of each event is chosen, and double triggers and events below the
+ * hit threshold are rejected, as in RawEventToEventCal, so the pedestals need
+ * to be loaded.  The centers can be written out in the format of
+ * SystemConfiguration::writeUVCenters.
+ */
+class UVCircleFit : public ProcessMonitor {
+public:
+    UVCircleFit(SystemConfiguration const * const config, int no_shards);
+    void add(int shard,
+             std::vector<EventRaw>::const_iterator begin,
+             std::vector<EventRaw>::const_iterator end,
+             SystemConfiguration const * const config);
+    void addDecoded(
+            int shard,
+            std::vector<EventRaw>::const_iterator begin,
+            std::vector<EventRaw>::const_iterator end,
+            SystemConfiguration const * const config);
+    int apdIndex(int panel, int cartridge, int fin, int module, int apd) const;
+    long samples(int apd_index) const;
+    int fit(int apd_index, float & u, float & v, float & radius) const;
+    int centers(std::vector<std::vector<std::vector<std::vector<
+            std::vector<ModulePedestals> > > > > & module_pedestals) const;
+    int write(const std::string & filename) const;
+    void reset();
+    int noApds() const;
+    int noShards() const;
+
+    //! The fewest samples of an APD for its circle to be fit
+    long min_samples;
+
+private:
+    /*!
+     * \brief The sums of the samples of every APD from one thread
+     */
+    struct Shard {
+        std::mutex lock;
+        std::vector<double> sums;
+    };
+
+    void sumApd(int apd_index, std::vector<double> & apd_sums) const;
+
+    int panels;
+    int cartridges_per_panel;
+    int daqs_per_cartridge;
+    int renas_per_daq;
+    int modules_per_rena;
+    int fins_per_cartridge;
+    int modules_per_fin;
+    int apds_per_module;
+    int no_apds;
+    /*!
+     * The apdIndex of APD 0 of each module, at its
+     * SystemConfiguration::indexPCDRM, or -1 if it is not mapped to a fin
+     */
+    std::vector<int> pcdrm_table;
+    //! Subtracted from the samples of each APD, to keep the sums small
+    std::vector<float> u_offsets;
+    std::vector<float> v_offsets;
+    std::unique_ptr<Shard[]> shards;
+    int no_shards;
+    SystemConfiguration const * const config;
+};
+
+#endif // UV_CIRCLE_FIT_H
@@ -2,6 +2,7 @@
 #define PROCESSING_H
 
 #include <deque>
+#include <string>
 #include <vector>
 #include <miil/EventRaw.h>
 #include <miil/EventCal.h>
@@ -20,6 +21,51 @@ int RawEventToEventCal(
         EventCal & event,
         SystemConfiguration const * const system_config);
 
+int RawEventToEventCalFixed(
+        const EventRaw & rawevent,
+        EventCal & event,
+        SystemConfiguration const * const system_config);
+
+/*!
+ * \brief The differences found between RawEventToEventCalFixed and
+ *        RawEventToEventCal by CompareFixedPointCalibration
+ */
+struct FixedPointComparison {
+    //! The number of events compared
+    long events;
+    //! Events that only one of the two paths rejected
+    long status_mismatches;
+    //! Events that both of the paths calibrated
+    long calibrated;
+    //! Calibrated events assigned to a different crystal by the two paths
+    long crystal_mismatches;
+    //! The largest differences over the events assigned to the same crystal
+    float max_x_difference;
+    float max_y_difference;
+    float max_energy_difference;
+
+    FixedPointComparison() :
+        events(0),
+        status_mismatches(0),
+        calibrated(0),
+        crystal_mismatches(0),
+        max_x_difference(0),
+        max_y_difference(0),
+        max_energy_difference(0)
+    {}
+};
+
+void CompareFixedPointCalibration(
+        std::vector<EventRaw>::const_iterator begin,
+        std::vector<EventRaw>::const_iterator end,
+        SystemConfiguration const * const system_config,
+        FixedPointComparison & comparison);
+
+int CompareFixedPointCalibrationFile(
+        const std::string & filename,
+        SystemConfiguration const * const system_config,
+        FixedPointComparison & comparison);
+
 int PedestalCorrectEventRaw(
         EventRaw & event,
         SystemConfiguration const * const system_config,
@@ -82,6 +128,46 @@ bool EventCalLessThan(
         float uv_period_ns,
         float ct_period_ns);
 
+int64_t EventCalTimeKey(
+        const EventCal & event,
+        double uv_period_ns,
+        double ct_period_ns);
+
+int64_t EventCoincTimeKey(
+        const EventCoinc & event,
+        double uv_period_ns,
+        double ct_period_ns);
+
+/*!
+ * \brief Function object returning EventCalTimeKey, for use with radix_sort
+ */
+struct EventCalTimeKeyFunction {
+    double uv_period_ns;
+    double ct_period_ns;
+    EventCalTimeKeyFunction(double uv_period_ns, double ct_period_ns) :
+        uv_period_ns(uv_period_ns),
+        ct_period_ns(ct_period_ns)
+    {}
+    int64_t operator()(const EventCal & event) const {
+        return(EventCalTimeKey(event, uv_period_ns, ct_period_ns));
+    }
+};
+
+/*!
+ * \brief Function object returning EventCoincTimeKey, for use with radix_sort
+ */
+struct EventCoincTimeKeyFunction {
+    double uv_period_ns;
+    double ct_period_ns;
+    EventCoincTimeKeyFunction(double uv_period_ns, double ct_period_ns) :
+        uv_period_ns(uv_period_ns),
+        ct_period_ns(ct_period_ns)
+    {}
+    int64_t operator()(const EventCoinc & event) const {
+        return(EventCoincTimeKey(event, uv_period_ns, ct_period_ns));
+    }
+};
+
 bool EventCalLessThanOnlyCt(const EventCal & arg1, const EventCal & arg2);
 
 EventCoinc MakeCoinc(
@@ -94,4 +180,12 @@ int TimeCalCoincEvent(
         EventCoinc &event,
         SystemConfiguration const * const config);
 
+float WindowedCentroid(
+        const double * spectrum,
+        int no_bins,
+        float bin_width,
+        float start,
+        float window,
+        double min_counts);
+
 #endif // PROCESSING_H
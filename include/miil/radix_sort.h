@@ -0,0 +1,385 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*!
+ * The number of bits of the key sorted on by each pass of radix_sort.  Time
+ * keys of a long acquisition span around 50 bits, which is five passes, while
+ * the per thread histogram of 2^11 counts stays in the L1 cache.
+ */
+#define RADIX_SORT_DIGIT_BITS 11
+
+namespace RadixSort {
+
+/*!
+ * \brief The key of a record and the position it came from
+ */
+struct KeyIndex {
+    uint64_t key;
+    uint64_t index;
+};
+
+/*!
+ * \brief Map a signed key onto an unsigned key with the same order
+ */
+inline uint64_t UnsignedKey(int64_t key) {
+    return(((uint64_t) key) ^ (((uint64_t) 1) << 63));
+}
+
+/*!
+ * \brief Split count items into no_threads contiguous chunks
+ *
+ * \return The start of chunk thread, where thread == no_threads is count
+ */
+inline size_t ChunkStart(size_t count, int thread, int no_threads) {
+    return((count / no_threads) * thread +
+           std::min(count % no_threads, (size_t) thread));
+}
+
+/*!
+ * \brief Run func(thread) for each thread, in the calling thread if only one
+ */
+template <class Func>
+void RunThreads(int no_threads, Func func) {
+    if (no_threads == 1) {
+        func(0);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < no_threads; thread++) {
+        threads.push_back(std::thread(func, thread));
+    }
+    for (size_t ii = 0; ii < threads.size(); ii++) {
+        threads[ii].join();
+    }
+}
+
+/*!
+ * \brief Stable LSD radix sort of keys, skipping digits that never vary
+ *
+ * Each pass histograms the digit over a chunk per thread, then scatters each
+ * chunk to the positions given by the counts of the lower digits and of the
+ * earlier chunks, which keeps the sort stable.
+ *
+ * \param keys The keys to sort.  Holds the sorted keys on return.
+ * \param no_threads The number of threads to use for each pass
+ */
+inline void SortKeys(std::vector<KeyIndex> & keys, int no_threads) {
+    const size_t count = keys.size();
+    const size_t no_buckets = ((size_t) 1) << RADIX_SORT_DIGIT_BITS;
+    const uint64_t digit_mask = no_buckets - 1;
+    if (count < 2) {
+        return;
+    }
+
+    // Only the bits that differ from the first key need to be sorted on.  For
+    // a time key this removes the high bits that are constant over a file.
+    uint64_t varying_bits = 0;
+    bool sorted = true;
+    for (size_t ii = 1; ii < count; ii++) {
+        varying_bits |= keys[ii].key ^ keys[0].key;
+        if (keys[ii].key < keys[ii - 1].key) {
+            sorted = false;
+        }
+    }
+    if (sorted) {
+        return;
+    }
+
+    if ((size_t) no_threads > count) {
+        no_threads = count;
+    }
+    std::vector<KeyIndex> buffer(count);
+    std::vector<size_t> counts(no_threads * no_buckets);
+    KeyIndex * source = keys.data();
+    KeyIndex * dest = buffer.data();
+    for (int shift = 0; shift < 64; shift += RADIX_SORT_DIGIT_BITS) {
+        if (((varying_bits >> shift) & digit_mask) == 0) {
+            continue;
+        }
+        std::fill(counts.begin(), counts.end(), 0);
+        RunThreads(no_threads, [&](int thread) {
+            size_t * thread_counts = &counts[thread * no_buckets];
+            size_t end = ChunkStart(count, thread + 1, no_threads);
+            for (size_t ii = ChunkStart(count, thread, no_threads);
+                 ii < end; ii++)
+            {
+                thread_counts[(source[ii].key >> shift) & digit_mask]++;
+            }
+        });
+        // Turn the counts into the first output position for each digit of
+        // each chunk, with digit as the major order and chunk as the minor.
+        size_t position = 0;
+        for (size_t digit = 0; digit < no_buckets; digit++) {
+            for (int thread = 0; thread < no_threads; thread++) {
+                size_t & thread_count = counts[thread * no_buckets + digit];
+                size_t no_in_digit = thread_count;
+                thread_count = position;
+                position += no_in_digit;
+            }
+        }
+        RunThreads(no_threads, [&](int thread) {
+            size_t * thread_positions = &counts[thread * no_buckets];
+            size_t end = ChunkStart(count, thread + 1, no_threads);
+            for (size_t ii = ChunkStart(count, thread, no_threads);
+                 ii < end; ii++)
+            {
+                dest[thread_positions[
+                        (source[ii].key >> shift) & digit_mask]++] = source[ii];
+            }
+        });
+        std::swap(source, dest);
+    }
+    if (source != keys.data()) {
+        std::copy(source, source + count, keys.data());
+    }
+}
+
+/*!
+ * \brief Move the records into the order given by the sorted keys
+ *
+ * Follows each cycle of the permutation, so only one record is held outside
+ * of the array at a time.  The index of each key is overwritten with its own
+ * position to mark that it has been placed.
+ */
+template <class T>
+void ApplyOrder(T * data, std::vector<KeyIndex> & keys) {
+    for (size_t start = 0; start < keys.size(); start++) {
+        if (keys[start].index == start) {
+            continue;
+        }
+        T temp = data[start];
+        size_t current = start;
+        while (keys[current].index != start) {
+            size_t next = keys[current].index;
+            data[current] = data[next];
+            keys[current].index = current;
+            current = next;
+        }
+        data[current] = temp;
+        keys[current].index = current;
+    }
+}
+
+/*!
+ * \brief A sorted run of records in a file being merged by radix_sort_file
+ */
+template <class T>
+struct Run {
+    //! The offset of the next record to be read from the file, in records
+    size_t next;
+    //! One past the last record of the run in the file, in records
+    size_t end;
+    std::vector<T> buffer;
+    size_t buffer_pos;
+};
+
+}
+
+/*!
+ * \brief Sort an array of records in place with an LSD radix sort
+ *
+ * Calculates the key of every record once and sorts the keys, along with the
+ * position of the record, using a radix sort that costs O(n) regardless of how
+ * out of order the records are.  Only the bits of the keys that vary are
+ * sorted on.  The records are then moved into place by following the cycles
+ * of the sorted order, so the array itself is never copied, which allows a
+ * file mapped into memory with mmap to be sorted directly.  Needs 32 bytes of
+ * memory per record for the keys.  The sort is stable.
+ *
+ * \param data The array of records to be sorted, such as EventCal or
+ *        EventCoinc
+ * \param count The number of records in data
+ * \param key A function object taking a record and returning its int64_t key,
+ *        such as EventCalTimeKeyFunction.  It is called concurrently when
+ *        no_threads is more than one.
+ * \param no_threads The number of threads used to calculate and sort the keys
+ *
+ * \return 0 on success, -1 if no_threads is less than one
+ */
+template <class T, class KeyFunc>
+int radix_sort(T * data, size_t count, KeyFunc key, int no_threads = 1) {
+    if (no_threads < 1) {
+        return(-1);
+    }
+    std::vector<RadixSort::KeyIndex> keys(count);
+    const int key_threads = (size_t) no_threads > count ? 1 : no_threads;
+    RadixSort::RunThreads(key_threads, [&](int thread) {
+        size_t end = RadixSort::ChunkStart(count, thread + 1, key_threads);
+        for (size_t ii = RadixSort::ChunkStart(count, thread, key_threads);
+             ii < end; ii++)
+        {
+            keys[ii].key = RadixSort::UnsignedKey(key(data[ii]));
+            keys[ii].index = ii;
+        }
+    });
+    RadixSort::SortKeys(keys, no_threads);
+    RadixSort::ApplyOrder(data, keys);
+    return(0);
+}
+
+/*!
+ * \brief Sort a vector of records in place with an LSD radix sort
+ *
+ * See radix_sort(T *, size_t, KeyFunc, int).
+ */
+template <class T, class KeyFunc>
+int radix_sort(std::vector<T> & data, KeyFunc key, int no_threads = 1) {
+    return(radix_sort(data.data(), data.size(), key, no_threads));
+}
+
+/*!
+ * \brief Sort a binary file of records that may be larger than memory
+ *
+ * The file is sorted with radix_sort in runs that fit within memory_limit,
+ * each written back in place.  If there is more than one run, the runs are
+ * merged into a temporary file next to the original, which then replaces it,
+ * so the disk needs free space for a second copy of the file.  Equal keys keep
+ * their order from the file.
+ *
+ * \param filename The file of records, such as EventCal or EventCoinc
+ * \param key A function object taking a record and returning its int64_t key
+ * \param memory_limit The approximate number of bytes of memory to use
+ * \param no_threads The number of threads used to sort each run
+ *
+ * \return 0 on success
+ *         - -1 if the file could not be opened
+ *         - -2 if the file is not a whole number of records
+ *         - -3 if reading or writing the file failed
+ *         - -4 if the temporary file could not be created or renamed
+ *         - -5 if memory_limit or no_threads is too small
+ */
+template <class T, class KeyFunc>
+int radix_sort_file(
+        const std::string & filename,
+        KeyFunc key,
+        size_t memory_limit,
+        int no_threads = 1)
+{
+    // Each record of a run in memory also needs two KeyIndex for the sort.
+    const size_t run_size = memory_limit /
+            (sizeof(T) + 2 * sizeof(RadixSort::KeyIndex));
+    if ((run_size == 0) || (no_threads < 1)) {
+        return(-5);
+    }
+    std::fstream file(filename.c_str(),
+                      std::ios::in | std::ios::out | std::ios::binary);
+    if (!file.good()) {
+        return(-1);
+    }
+    file.seekg(0, file.end);
+    const size_t length_bytes = file.tellg();
+    if (length_bytes % sizeof(T)) {
+        return(-2);
+    }
+    const size_t count = length_bytes / sizeof(T);
+
+    std::vector<RadixSort::Run<T> > runs;
+    {
+        std::vector<T> run_data;
+        for (size_t start = 0; start < count; start += run_size) {
+            const size_t no_records = std::min(run_size, count - start);
+            run_data.resize(no_records);
+            file.seekg(start * sizeof(T), file.beg);
+            file.read((char*) run_data.data(), no_records * sizeof(T));
+            if (!file.good()) {
+                return(-3);
+            }
+            radix_sort(run_data, key, no_threads);
+            file.seekp(start * sizeof(T), file.beg);
+            file.write((char*) run_data.data(), no_records * sizeof(T));
+            if (!file.good()) {
+                return(-3);
+            }
+            RadixSort::Run<T> run;
+            run.next = start;
+            run.end = start + no_records;
+            run.buffer_pos = 0;
+            runs.push_back(run);
+        }
+    }
+    if (runs.size() <= 1) {
+        return(0);
+    }
+
+    // Split the memory between the read buffer for each run and one write
+    // buffer.
+    const size_t buffer_size = std::max((size_t) 1,
+            memory_limit / ((runs.size() + 1) * sizeof(T)));
+    const std::string temp_filename = filename + ".radix_sort.tmp";
+    std::ofstream output(temp_filename.c_str(), std::ios::binary);
+    if (!output.good()) {
+        return(-4);
+    }
+
+    // Fills the buffer of a run from the file.  Returns false if the run has
+    // no more records.
+    auto fill_buffer = [&](RadixSort::Run<T> & run) -> bool {
+        const size_t no_records = std::min(buffer_size, run.end - run.next);
+        run.buffer.resize(no_records);
+        run.buffer_pos = 0;
+        if (no_records == 0) {
+            return(false);
+        }
+        file.seekg(run.next * sizeof(T), file.beg);
+        file.read((char*) run.buffer.data(), no_records * sizeof(T));
+        run.next += no_records;
+        return(true);
+    };
+
+    // The heap holds the key of the next record of each run, with ties going
+    // to the earlier run so that the merge is stable.
+    typedef std::pair<int64_t, size_t> HeapEntry;
+    std::priority_queue<HeapEntry, std::vector<HeapEntry>,
+                        std::greater<HeapEntry> > heap;
+    for (size_t ii = 0; ii < runs.size(); ii++) {
+        fill_buffer(runs[ii]);
+        heap.push(HeapEntry(key(runs[ii].buffer[0]), ii));
+    }
+    if (!file.good()) {
+        return(-3);
+    }
+
+    std::vector<T> output_buffer;
+    output_buffer.reserve(buffer_size);
+    while (!heap.empty()) {
+        RadixSort::Run<T> & run = runs[heap.top().second];
+        const size_t run_index = heap.top().second;
+        heap.pop();
+        output_buffer.push_back(run.buffer[run.buffer_pos++]);
+        if (output_buffer.size() == buffer_size) {
+            output.write((char*) output_buffer.data(),
+                         output_buffer.size() * sizeof(T));
+            output_buffer.clear();
+        }
+        if ((run.buffer_pos < run.buffer.size()) || fill_buffer(run)) {
+            heap.push(HeapEntry(key(run.buffer[run.buffer_pos]), run_index));
+        }
+    }
+    output.write((char*) output_buffer.data(),
+                 output_buffer.size() * sizeof(T));
+    if (!file.good() || !output.good()) {
+        output.close();
+        std::remove(temp_filename.c_str());
+        return(-3);
+    }
+    output.close();
+    file.close();
+    if (std::rename(temp_filename.c_str(), filename.c_str())) {
+        return(-4);
+    }
+    return(0);
+}
+
+#endif // RADIX_SORT_H
@@ -1,4 +1,9 @@
 
-HEADERS += ../include/miil/SystemConfiguration.h
+HEADERS += \
+    ../include/miil/SystemConfiguration.h \
+    ../include/miil/GeometryTraits.h \
+    ../include/miil/CrystalLookup.h
 
-SOURCES += ../src/SystemConfiguration.cpp
+SOURCES += \
+    ../src/SystemConfiguration.cpp \
+    ../src/CrystalLookup.cpp
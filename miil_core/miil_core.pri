@@ -12,6 +12,7 @@ HEADERS += \
     ../include/miil/instekpowersupply.h \
     ../include/miil/log.h \
     ../include/miil/pid.h \
+    ../include/miil/radix_sort.h \
     ../include/miil/raw_socket.h \
     ../include/miil/standard_socket.h \
     ../include/miil/sorting.h \
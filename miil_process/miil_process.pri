@@ -1,14 +1,55 @@
 
 HEADERS += \
     ../include/miil/process/processing.h \
+    ../include/miil/process/CalibrationPool.h \
+    ../include/miil/process/CoincidenceSorter.h \
+    ../include/miil/process/ConfigurationVersions.h \
+    ../include/miil/process/CrystalLocations.h \
+    ../include/miil/process/EnergySpectra.h \
+    ../include/miil/process/FloodHistogram.h \
+    ../include/miil/process/GainDriftCorrection.h \
+    ../include/miil/process/GlobalMergeSorter.h \
+    ../include/miil/process/LorHistogram.h \
+    ../include/miil/process/LorIndexer.h \
+    ../include/miil/process/ParallelCoincidence.h \
+    ../include/miil/process/ParallelFileRead.h \
+    ../include/miil/process/PedestalAccumulator.h \
+    ../include/miil/process/PhotopeakFit.h \
     ../include/miil/process/ProcessControl.h \
     ../include/miil/process/ProcessInfo.h \
+    ../include/miil/process/ProcessMonitor.h \
     ../include/miil/process/ProcessParams.h \
-    ../include/miil/process/ProcessThreads.h
+    ../include/miil/process/ProcessThreads.h \
+    ../include/miil/process/RateMonitor.h \
+    ../include/miil/process/RenaMergeSorter.h \
+    ../include/miil/process/ShardedHistogram.h \
+    ../include/miil/process/SortedAccumulator.h \
+    ../include/miil/process/TimeOffsetSolver.h \
+    ../include/miil/process/TimingResolution.h \
+    ../include/miil/process/UVCircleFit.h
 
 SOURCES += \
     ../src/processing.cpp \
+    ../src/CalibrationPool.cpp \
+    ../src/CoincidenceSorter.cpp \
+    ../src/ConfigurationVersions.cpp \
+    ../src/CrystalLocations.cpp \
+    ../src/EnergySpectra.cpp \
+    ../src/FloodHistogram.cpp \
+    ../src/GainDriftCorrection.cpp \
+    ../src/GlobalMergeSorter.cpp \
+    ../src/LorHistogram.cpp \
+    ../src/LorIndexer.cpp \
+    ../src/ParallelCoincidence.cpp \
+    ../src/PedestalAccumulator.cpp \
+    ../src/PhotopeakFit.cpp \
     ../src/ProcessControl.cpp \
     ../src/ProcessInfo.cpp \
     ../src/ProcessParams.cpp \
-    ../src/ProcessThreads.cpp
+    ../src/ProcessThreads.cpp \
+    ../src/RateMonitor.cpp \
+    ../src/RenaMergeSorter.cpp \
+    ../src/ShardedHistogram.cpp \
+    ../src/TimeOffsetSolver.cpp \
+    ../src/TimingResolution.cpp \
+    ../src/UVCircleFit.cpp
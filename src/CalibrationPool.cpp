@@ -0,0 +1,182 @@
+#include <miil/process/CalibrationPool.h>
+#include <miil/process/ProcessParams.h>
+#include <algorithm>
+
+using namespace std;
+
+/*!
+ * \brief Start the worker threads for the pool
+ *
+ * \param no_workers The number of threads to start.  The thread that calls
+ *        calibrate() also calibrates batches, so zero is a valid value.
+ * \param events_per_batch The number of decoded events in each batch
+ */
+CalibrationPool::CalibrationPool(size_t no_workers, size_t events_per_batch) :
+    job_id(0),
+    shutdown_flag(false),
+    workers_active(0),
+    next_batch(0),
+    job_decoded_data(0),
+    job_config(0),
+    job_energy_gate(false),
+    job_energy_gate_low(0),
+    job_energy_gate_high(0),
+    job_fixed_point(false),
+    job_no_batches(0),
+    batch_size(events_per_batch > 0 ? events_per_batch : 1)
+{
+    for (size_t ii = 0; ii < no_workers; ii++) {
+        workers.emplace_back(&CalibrationPool::workerLoop, this);
+    }
+}
+
+CalibrationPool::~CalibrationPool() {
+    {
+        std::lock_guard<std::mutex> lck(lock);
+        shutdown_flag = true;
+    }
+    cv_job_posted.notify_all();
+    for (size_t ii = 0; ii < workers.size(); ii++) {
+        if (workers[ii].joinable()) {
+            workers[ii].join();
+        }
+    }
+}
+
+/*!
+ * \brief Returns the number of worker threads in the pool
+ */
+size_t CalibrationPool::size() const {
+    return(workers.size());
+}
+
+void CalibrationPool::workerLoop() {
+    long last_job_id = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lck(lock);
+            while (!shutdown_flag && (job_id == last_job_id)) {
+                cv_job_posted.wait(lck);
+            }
+            if (shutdown_flag) {
+                return;
+            }
+            last_job_id = job_id;
+            workers_active++;
+        }
+        calibrateBatches();
+        {
+            std::lock_guard<std::mutex> lck(lock);
+            workers_active--;
+        }
+        cv_job_done.notify_all();
+    }
+}
+
+/*!
+ * \brief Calibrate batches from the current job until none are left
+ *
+ * Run by the workers and the calling thread.  Each batch is only written by
+ * the thread that claimed its index.
+ */
+void CalibrationPool::calibrateBatches() {
+    for (size_t batch = next_batch++;
+         batch < job_no_batches;
+         batch = next_batch++)
+    {
+        size_t start = batch * batch_size;
+        size_t stop = std::min(start + batch_size, job_decoded_data->size());
+        ProcessParams::CalibrateBuffer(
+                job_decoded_data->begin() + start,
+                job_decoded_data->begin() + stop,
+                batch_calibrated[batch],
+                batch_info[batch],
+                job_config,
+                job_energy_gate,
+                job_energy_gate_low,
+                job_energy_gate_high,
+                job_fixed_point);
+    }
+}
+
+/*!
+ * \brief Calibrate a buffer of decoded events using the pool
+ *
+ * Splits the decoded events into batches that are calibrated in parallel.  The
+ * calibrated events are appended to calibrated_data in the same order as
+ * ProcessParams::CalibrateBuffer would place them, and the calibration
+ * counters of info are incremented by the same amounts.
+ *
+ * \param decoded_data The events to be calibrated
+ * \param calibrated_data Where the calibrated events are appended
+ * \param info The process info where the calibration counters are incremented
+ * \param config The system configuration used for the calibration
+ * \param energy_gate Whether to reject events outside the energy window
+ * \param energy_gate_low The low edge of the energy window
+ * \param energy_gate_high The high edge of the energy window
+ * \param fixed_point Use the fixed point calibration
+ *
+ * \return 0 on success
+ */
+int CalibrationPool::calibrate(
+        const std::vector<EventRaw> & decoded_data,
+        std::vector<EventCal> & calibrated_data,
+        ProcessInfo & info,
+        SystemConfiguration const * const config,
+        bool energy_gate,
+        float energy_gate_low,
+        float energy_gate_high,
+        bool fixed_point)
+{
+    if (decoded_data.empty()) {
+        return(0);
+    }
+    size_t no_batches = (decoded_data.size() + batch_size - 1) / batch_size;
+    {
+        // A worker that woke up late for the previous job could still be
+        // looking at the job variables, so wait for it before changing them.
+        std::unique_lock<std::mutex> lck(lock);
+        while (workers_active > 0) {
+            cv_job_done.wait(lck);
+        }
+        // Reuse the batch buffers between calls so their capacity is kept.
+        if (batch_calibrated.size() < no_batches) {
+            batch_calibrated.resize(no_batches);
+            batch_info.resize(no_batches);
+        }
+        job_decoded_data = &decoded_data;
+        job_config = config;
+        job_energy_gate = energy_gate;
+        job_energy_gate_low = energy_gate_low;
+        job_energy_gate_high = energy_gate_high;
+        job_fixed_point = fixed_point;
+        job_no_batches = no_batches;
+        next_batch = 0;
+        job_id++;
+    }
+    cv_job_posted.notify_all();
+
+    calibrateBatches();
+
+    // Every batch has been claimed at this point, so wait for the workers that
+    // are still calibrating theirs.  A worker that has not woken up yet will
+    // find no batches left, so it is safe to post the next job.
+    {
+        std::unique_lock<std::mutex> lck(lock);
+        while (workers_active > 0) {
+            cv_job_done.wait(lck);
+        }
+    }
+
+    // Re-sequence the output by batch, and fold in the counters.
+    for (size_t batch = 0; batch < no_batches; batch++) {
+        calibrated_data.insert(
+                calibrated_data.end(),
+                batch_calibrated[batch].begin(),
+                batch_calibrated[batch].end());
+        batch_calibrated[batch].clear();
+        info.addCalibrateInfo(batch_info[batch]);
+        batch_info[batch] = ProcessInfo();
+    }
+    return(0);
+}
@@ -0,0 +1,651 @@
+#include <miil/process/CoincidenceSorter.h>
+#include <miil/process/LorHistogram.h>
+#include <miil/process/TimingResolution.h>
+#include <miil/process/processing.h>
+#include <miil/SystemConfiguration.h>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+using namespace std;
+
+CoincidenceInfo::CoincidenceInfo() {
+    reset();
+}
+
+/*!
+ * \brief Add the counters of another CoincidenceInfo into this one
+ */
+void CoincidenceInfo::addCoincidenceInfo(const CoincidenceInfo & other) {
+    singles_processed += other.singles_processed;
+    dropped_energy_window += other.dropped_energy_window;
+    dropped_invalid_panel += other.dropped_invalid_panel;
+    dropped_late += other.dropped_late;
+    windows_single += other.windows_single;
+    dropped_same_panel += other.dropped_same_panel;
+    dropped_multiples += other.dropped_multiples;
+    accepted_coinc += other.accepted_coinc;
+    written_coinc += other.written_coinc;
+    accepted_delayed += other.accepted_delayed;
+    written_delayed += other.written_delayed;
+    accepted_from_multiples += other.accepted_from_multiples;
+    for (int ii = 0; ii < COINC_MULTIPLICITY_BINS; ii++) {
+        multiplicity[ii] += other.multiplicity[ii];
+    }
+}
+
+void CoincidenceInfo::reset() {
+    singles_processed = 0;
+    dropped_energy_window = 0;
+    dropped_invalid_panel = 0;
+    dropped_late = 0;
+    windows_single = 0;
+    dropped_same_panel = 0;
+    dropped_multiples = 0;
+    accepted_coinc = 0;
+    written_coinc = 0;
+    accepted_delayed = 0;
+    written_delayed = 0;
+    accepted_from_multiples = 0;
+    for (int ii = 0; ii < COINC_MULTIPLICITY_BINS; ii++) {
+        multiplicity[ii] = 0;
+    }
+}
+
+std::ostream& operator<<(std::ostream& os, const CoincidenceInfo& info) {
+    os << "Singles Processed: " << info.singles_processed << "\n"
+       << "Dropped (Energy)    : " << info.dropped_energy_window << "\n"
+       << "Dropped (Panel)     : " << info.dropped_invalid_panel << "\n"
+       << "Dropped (Late)      : " << info.dropped_late << "\n"
+       << "Windows (Single)    : " << info.windows_single << "\n"
+       << "Dropped (Same Panel): " << info.dropped_same_panel << "\n"
+       << "Dropped (Multiples) : " << info.dropped_multiples << "\n"
+       << "Accepted (Multiples): " << info.accepted_from_multiples << "\n"
+       << "Accepted Coincidences: " << info.accepted_coinc << "\n"
+       << "Written Coincidences : " << info.written_coinc << "\n"
+       << "Accepted Delayed     : " << info.accepted_delayed << "\n"
+       << "Written Delayed      : " << info.written_delayed << "\n"
+       << "Multiplicity:";
+    for (int ii = 1; ii < COINC_MULTIPLICITY_BINS; ii++) {
+        os << " " << info.multiplicity[ii];
+    }
+    os << "\n";
+    return(os);
+}
+
+/*!
+ * \brief Create a coincidence sorter
+ *
+ * \param config The system configuration used for the timestamp periods and
+ *        the time calibration of the coincidences
+ * \param time_window_ns The width of the coincidence window in nanoseconds
+ * \param energy_low The low edge of the energy window applied to the singles
+ * \param energy_high The high edge of the energy window applied to the singles
+ * \param coinc_storage_size The capacity of coinc_storage
+ * \param multiples_policy How windows with more than two singles are handled
+ */
+CoincidenceSorter::CoincidenceSorter(
+        SystemConfiguration const * const config,
+        float time_window_ns,
+        float energy_low,
+        float energy_high,
+        size_t coinc_storage_size,
+        MultiplesPolicy multiples_policy) :
+    coinc_storage(coinc_storage_size),
+    system_config(config),
+    time_window_ps(std::llround(time_window_ns * 1000.0)),
+    energy_low(energy_low),
+    energy_high(energy_high),
+    multiples_policy(multiples_policy),
+    output_first_key(LLONG_MIN),
+    output_last_key(LLONG_MAX),
+    lor_histogram(0),
+    lor_histogram_shard(0),
+    timing_resolution(0),
+    timing_resolution_shard(0)
+{
+}
+
+/*!
+ * \brief The implementation of insert for a multiples policy
+ */
+template <class Policy, class Iterator>
+int CoincidenceSorter::insertPolicy(Iterator begin, Iterator end) {
+    for (Iterator iter = begin; iter != end; ++iter) {
+        KeyedEventCal single;
+        single.key = EventCalTimeKey(
+                *iter,
+                system_config->uv_period_ns,
+                system_config->ct_period_ns);
+        // Only count the singles in the output range, so that the counters of
+        // sorters over adjacent ranges add up.
+        const bool in_range = (single.key >= output_first_key) &&
+                              (single.key < output_last_key);
+        info.singles_processed += in_range;
+        if (!InEnergyWindow(*iter, energy_low, energy_high)) {
+            info.dropped_energy_window += in_range;
+            continue;
+        }
+        if ((iter->panel != 0) && (iter->panel != 1)) {
+            info.dropped_invalid_panel += in_range;
+            continue;
+        }
+        single.event = *iter;
+        if (!window.empty() && (single.key < window.front().key)) {
+            info.dropped_late += in_range;
+            continue;
+        }
+        addToWindow<Policy>(window, single, -1);
+
+        if (!delayed_windows.empty()) {
+            // Bring each delayed window up to the time of this single before
+            // it can be added to them.
+            for (size_t ii = 0; ii < delayed_windows.size(); ii++) {
+                feedDelayedWindow<Policy>(
+                        delayed_windows[ii], ii, single.key, false);
+                if (single.event.panel == 0) {
+                    addToWindow<Policy>(delayed_windows[ii].window, single, ii);
+                }
+            }
+            if (single.event.panel == 1) {
+                delayed_singles.push_back(single);
+            }
+            trimDelayedSingles();
+        }
+    }
+    return(0);
+}
+
+/*!
+ * \brief Add a single to a window, closing the window first if it is too late
+ *
+ * \param window The prompt window or a delayed window
+ * \param single The single to be added
+ * \param delayed_window The index of the delayed window, or -1 for the prompt
+ */
+template <class Policy>
+void CoincidenceSorter::addToWindow(
+        std::vector<KeyedEventCal> & window,
+        const KeyedEventCal & single,
+        int delayed_window)
+{
+    if (!window.empty() &&
+        (single.key - window.front().key > time_window_ps))
+    {
+        closeWindow<Policy>(window, delayed_window);
+    }
+    window.push_back(single);
+}
+
+/*!
+ * \brief Add the delayed panel 1 singles up to a time to a delayed window
+ *
+ * \param delayed The delayed window
+ * \param delayed_window The index of the delayed window
+ * \param up_to_key Add the singles whose delayed key is at or before this key
+ * \param all Add all of the remaining singles, regardless of up_to_key
+ */
+template <class Policy>
+void CoincidenceSorter::feedDelayedWindow(
+        DelayedWindow & delayed,
+        int delayed_window,
+        int64_t up_to_key,
+        bool all)
+{
+    while (delayed.next < delayed_singles.size()) {
+        // The single waiting at the head is checked again for every later
+        // single, so its delayed key is kept until it is added.
+        KeyedEventCal & single = delayed.next_single;
+        if (!delayed.next_keyed) {
+            single = delayed_singles[delayed.next];
+            single.event.ct += delayed.delay_ticks;
+            single.key = EventCalTimeKey(
+                    single.event,
+                    system_config->uv_period_ns,
+                    system_config->ct_period_ns);
+            delayed.next_keyed = true;
+        }
+        if (!all && (single.key > up_to_key)) {
+            break;
+        }
+        addToWindow<Policy>(delayed.window, single, delayed_window);
+        delayed.next++;
+        delayed.next_keyed = false;
+    }
+}
+
+/*!
+ * \brief Remove the panel 1 singles every delayed window has already added
+ */
+void CoincidenceSorter::trimDelayedSingles() {
+    size_t no_done = delayed_singles.size();
+    for (size_t ii = 0; ii < delayed_windows.size(); ii++) {
+        no_done = std::min(no_done, delayed_windows[ii].next);
+    }
+    if (no_done == 0) {
+        return;
+    }
+    delayed_singles.erase(
+            delayed_singles.begin(), delayed_singles.begin() + no_done);
+    for (size_t ii = 0; ii < delayed_windows.size(); ii++) {
+        delayed_windows[ii].next -= no_done;
+    }
+}
+
+/*!
+ * \brief The implementation of flush for a multiples policy
+ */
+template <class Policy>
+int CoincidenceSorter::flushPolicy() {
+    if (!window.empty()) {
+        closeWindow<Policy>(window, -1);
+    }
+    for (size_t ii = 0; ii < delayed_windows.size(); ii++) {
+        DelayedWindow & delayed = delayed_windows[ii];
+        feedDelayedWindow<Policy>(delayed, ii, 0, true);
+        if (!delayed.window.empty()) {
+            closeWindow<Policy>(delayed.window, ii);
+        }
+    }
+    trimDelayedSingles();
+    updateCoincidenceInfo();
+    return(0);
+}
+
+/*!
+ * \brief Take the coincidences, if any, from a window, and then empty the window
+ *
+ * The counters for windows that do not hold a coincidence are only kept for
+ * the prompt window.
+ *
+ * \param window The prompt window or a delayed window
+ * \param delayed_window The index of the delayed window, or -1 for the prompt
+ */
+template <class Policy>
+void CoincidenceSorter::closeWindow(
+        std::vector<KeyedEventCal> & window,
+        int delayed_window)
+{
+    if ((window.front().key < output_first_key) ||
+        (window.front().key >= output_last_key))
+    {
+        window.clear();
+        return;
+    }
+    const bool prompt = (delayed_window < 0);
+    if (prompt) {
+        info.multiplicity[std::min(window.size(),
+                (size_t) (COINC_MULTIPLICITY_BINS - 1))]++;
+    }
+    if (window.size() == 1) {
+        info.windows_single += prompt;
+    } else if (window.size() == 2) {
+        if (window[0].event.panel == window[1].event.panel) {
+            info.dropped_same_panel += prompt;
+        } else {
+            addCoinc(window[0].event, window[1].event, delayed_window);
+        }
+    } else {
+        selected_pairs.clear();
+        Policy::select(window, selected_pairs);
+        if (selected_pairs.empty()) {
+            info.dropped_multiples += prompt;
+        } else if (prompt) {
+            info.accepted_from_multiples += selected_pairs.size();
+        }
+        for (size_t ii = 0; ii < selected_pairs.size(); ii++) {
+            addCoinc(window[selected_pairs[ii].first].event,
+                     window[selected_pairs[ii].second].event,
+                     delayed_window);
+        }
+    }
+    window.clear();
+}
+
+/*!
+ * \brief Build a coincidence from two singles from opposite panels
+ *
+ * \param single0 One of the singles
+ * \param single1 The other single
+ * \param delayed_window The index of the delayed window, or -1 for the prompt
+ */
+void CoincidenceSorter::addCoinc(
+        const EventCal & single0,
+        const EventCal & single1,
+        int delayed_window)
+{
+    const EventCal & left = (single0.panel == 0) ? single0 : single1;
+    const EventCal & right = (single0.panel == 0) ? single1 : single0;
+    EventCoinc coinc = MakeCoinc(
+            left,
+            right,
+            system_config->uv_period_ns,
+            system_config->ct_period_ns);
+    coinc.flags[0] = delayed_window + 1;
+    coinc.flags[1] = 0;
+    if (delayed_window < 0) {
+        coinc_data.push_back(coinc);
+        info.accepted_coinc++;
+    } else {
+        delayed_data.push_back(coinc);
+        delayed_windows[delayed_window].lor_counts.add(lorIndex(coinc));
+        info.accepted_delayed++;
+    }
+}
+
+/*!
+ * \brief Look for coincidences in the next singles of the time sorted stream
+ *
+ * The coincidences found are held until popCoinc or HandleData.  The single
+ * window left open is only closed by a later single, or by flush.
+ *
+ * \param begin The first single to be added
+ * \param end One past the last single to be added
+ *
+ * \return 0 on success
+ */
+int CoincidenceSorter::insert(
+        std::vector<EventCal>::const_iterator begin,
+        std::vector<EventCal>::const_iterator end)
+{
+    switch (multiples_policy) {
+    case TAKE_ALL_GOOD_PAIRS:
+        return(insertPolicy<TakeAllGoodPairs>(begin, end));
+    case TAKE_WINNER_OF_GOOD_PAIRS:
+        return(insertPolicy<TakeWinnerOfGoodPairs>(begin, end));
+    case KILL_ALL_MULTIPLES:
+    default:
+        return(insertPolicy<KillAllMultiples>(begin, end));
+    }
+}
+
+/*!
+ * \brief Look for coincidences in an array of time sorted singles
+ *
+ * See insert(std::vector<EventCal>::const_iterator,
+ * std::vector<EventCal>::const_iterator).  Allows singles from a file mapped
+ * into memory to be used directly.
+ */
+int CoincidenceSorter::insert(const EventCal * begin, const EventCal * end) {
+    switch (multiples_policy) {
+    case TAKE_ALL_GOOD_PAIRS:
+        return(insertPolicy<TakeAllGoodPairs>(begin, end));
+    case TAKE_WINNER_OF_GOOD_PAIRS:
+        return(insertPolicy<TakeWinnerOfGoodPairs>(begin, end));
+    case KILL_ALL_MULTIPLES:
+    default:
+        return(insertPolicy<KillAllMultiples>(begin, end));
+    }
+}
+
+/*!
+ * \brief Close the open coincidence window, as no more singles will follow
+ *
+ * Also updates the copy of the counters returned by getCoincidenceInfo.
+ *
+ * \return 0 on success
+ */
+int CoincidenceSorter::flush() {
+    switch (multiples_policy) {
+    case TAKE_ALL_GOOD_PAIRS:
+        return(flushPolicy<TakeAllGoodPairs>());
+    case TAKE_WINNER_OF_GOOD_PAIRS:
+        return(flushPolicy<TakeWinnerOfGoodPairs>());
+    case KILL_ALL_MULTIPLES:
+    default:
+        return(flushPolicy<KillAllMultiples>());
+    }
+}
+
+/*!
+ * \brief Remove the coincidences that have been found
+ *
+ * \param output Where the coincidences are appended, in time order
+ *
+ * \return 0 on success
+ */
+int CoincidenceSorter::popCoinc(std::vector<EventCoinc> & output) {
+    output.insert(output.end(), coinc_data.begin(), coinc_data.end());
+    coinc_data.clear();
+    return(0);
+}
+
+/*!
+ * \brief Find the coincidences in the next singles and write them out
+ *
+ * Called for each batch of merged singles by GlobalMergeSorter.  The
+ * coincidences are written to the coincidence file, if set, copied into
+ * coinc_storage, and added to the LOR histogram and timing resolution
+ * histograms, if set.
+ *
+ * \param begin The first single to be added
+ * \param end One past the last single to be added
+ * \param write_out_remaining Close the open window, at the end of acquisition
+ *
+ * \return 0 on success
+ */
+int CoincidenceSorter::HandleData(
+        std::vector<EventCal>::const_iterator begin,
+        std::vector<EventCal>::const_iterator end,
+        bool write_out_remaining)
+{
+    insert(begin, end);
+    if (write_out_remaining) {
+        flush();
+    }
+    coinc_storage.try_insert(coinc_data.begin(), coinc_data.end());
+    if (coinc_output_file.is_open()) {
+        coinc_output_file.write(
+                (char*) coinc_data.data(),
+                sizeof(EventCoinc) * coinc_data.size());
+        info.written_coinc += coinc_data.size();
+    }
+    if (lor_histogram) {
+        lor_histogram->add(
+                lor_histogram_shard, coinc_data.begin(), coinc_data.end());
+    }
+    if (timing_resolution) {
+        timing_resolution->add(timing_resolution_shard,
+                               coinc_data.begin(), coinc_data.end());
+    }
+    coinc_data.clear();
+    if (delayed_output_file.is_open()) {
+        delayed_output_file.write(
+                (char*) delayed_data.data(),
+                sizeof(EventCoinc) * delayed_data.size());
+        info.written_delayed += delayed_data.size();
+    }
+    delayed_data.clear();
+    updateCoincidenceInfo();
+    return(0);
+}
+
+/*!
+ * \brief Write the coincidences found by HandleData to a file
+ *
+ * Should not be called while the coincidences are being processed.
+ *
+ * \param filename The file the coincidences are written to
+ *
+ * \return 0 on success, -1 if the file could not be opened
+ */
+int CoincidenceSorter::setCoincFilename(const std::string & filename) {
+    if (coinc_output_file.is_open()) {
+        coinc_output_file.close();
+    }
+    coinc_output_file.open(filename.c_str(), std::ios::binary);
+    if (!coinc_output_file.good()) {
+        return(-1);
+    }
+    return(0);
+}
+
+/*!
+ * \brief Add a delayed window for estimating the randoms
+ *
+ * Should be called before any singles are inserted.
+ *
+ * \param delay_ticks The delay, in coarse timestamp ticks, applied to the
+ *        panel 1 singles.  Must be longer than the time window.
+ *
+ * \return The index of the delayed window, or -1 if the delay is too short
+ */
+int CoincidenceSorter::addDelayedWindow(long delay_ticks) {
+    if (delay_ticks * system_config->ct_period_ns * 1000.0 <= time_window_ps) {
+        return(-1);
+    }
+    DelayedWindow delayed;
+    delayed.delay_ticks = delay_ticks;
+    delayed.next = delayed_singles.size();
+    delayed.next_keyed = false;
+    delayed_windows.push_back(delayed);
+    return(delayed_windows.size() - 1);
+}
+
+/*!
+ * \brief Remove the delayed coincidences that have been found
+ *
+ * \param output Where the delayed coincidences are appended
+ *
+ * \return 0 on success
+ */
+int CoincidenceSorter::popDelayed(std::vector<EventCoinc> & output) {
+    output.insert(output.end(), delayed_data.begin(), delayed_data.end());
+    delayed_data.clear();
+    return(0);
+}
+
+/*!
+ * \brief Write the delayed coincidences found by HandleData to a file
+ *
+ * Should not be called while the coincidences are being processed.
+ *
+ * \param filename The file the delayed coincidences are written to
+ *
+ * \return 0 on success, -1 if the file could not be opened
+ */
+int CoincidenceSorter::setDelayedFilename(const std::string & filename) {
+    if (delayed_output_file.is_open()) {
+        delayed_output_file.close();
+    }
+    delayed_output_file.open(filename.c_str(), std::ios::binary);
+    if (!delayed_output_file.good()) {
+        return(-1);
+    }
+    return(0);
+}
+
+/*!
+ * \brief Count the prompt coincidences written out by HandleData by line of
+ *        response
+ *
+ * Should not be called while the coincidences are being processed.
+ *
+ * \param histogram The histogram, or null to stop histogramming
+ * \param shard The shard of the histogram used by the thread calling
+ *        HandleData
+ */
+void CoincidenceSorter::setLorHistogram(LorHistogram * histogram, int shard) {
+    lor_histogram = histogram;
+    lor_histogram_shard = shard;
+}
+
+/*!
+ * \brief Histogram the prompt coincidences written out by HandleData by time
+ *        difference
+ *
+ * Should not be called while the coincidences are being processed.
+ *
+ * \param resolution The histograms, or null to stop histogramming
+ * \param shard The shard of the histograms used by the thread calling
+ *        HandleData
+ */
+void CoincidenceSorter::setTimingResolution(
+        TimingResolution * resolution,
+        int shard)
+{
+    timing_resolution = resolution;
+    timing_resolution_shard = shard;
+}
+
+/*!
+ * \brief The line of response of a coincidence
+ *
+ * Numbers the crystals of each panel by (cartridge, fin, module, apd,
+ * crystal), and the line of response by the left crystal then the right.
+ *
+ * \param coinc The coincidence
+ *
+ * \return The index of the line of response
+ */
+int64_t CoincidenceSorter::lorIndex(const EventCoinc & coinc) const {
+    const SystemConfiguration & config = *system_config;
+    const int64_t crystals_per_panel = (int64_t) config.cartridges_per_panel *
+            config.fins_per_cartridge * config.modules_per_fin *
+            config.apds_per_module * config.crystals_per_apd;
+    const int64_t crystal0 = (((((int64_t) coinc.cartridge0 *
+            config.fins_per_cartridge + coinc.fin0) *
+            config.modules_per_fin + coinc.module0) *
+            config.apds_per_module + coinc.apd0) *
+            config.crystals_per_apd + coinc.crystal0);
+    const int64_t crystal1 = (((((int64_t) coinc.cartridge1 *
+            config.fins_per_cartridge + coinc.fin1) *
+            config.modules_per_fin + coinc.module1) *
+            config.apds_per_module + coinc.apd1) *
+            config.crystals_per_apd + coinc.crystal1);
+    return(crystal0 * crystals_per_panel + crystal1);
+}
+
+/*!
+ * \brief The number of delayed coincidences on each line of response
+ *
+ * Must not be called while the coincidences are being processed, as the
+ * buffered lines of response are collapsed into the counts first.
+ *
+ * \param delayed_window The index of the delayed window from addDelayedWindow
+ *
+ * \return The counts of the delayed window, sorted by lorIndex.  Lines of
+ *         response without any delayed coincidences are left out.
+ */
+const std::vector<LorCount> & CoincidenceSorter::delayedLorCounts(
+        size_t delayed_window)
+{
+    return(delayed_windows.at(delayed_window).lor_counts.sums());
+}
+
+/*!
+ * \brief Only output the windows that open within a range of time
+ *
+ * Windows, prompt or delayed, are only output and counted if the key of the
+ * single that opened them is within the range, and singles are only counted
+ * if their key is.  Sorters given adjacent ranges of the same singles, with
+ * enough singles on either side of their range for the windows to line up,
+ * produce the same coincidences and counts, between them, as one sorter over
+ * all of the singles.  Used by FindCoincidencesParallel.
+ *
+ * \param first_key The EventCalTimeKey at the start of the range
+ * \param last_key The EventCalTimeKey one past the end of the range
+ */
+void CoincidenceSorter::setOutputRange(int64_t first_key, int64_t last_key) {
+    output_first_key = first_key;
+    output_last_key = last_key;
+}
+
+void CoincidenceSorter::updateCoincidenceInfo() {
+    if (lock_locked_info.try_lock()) {
+        locked_info = info;
+        lock_locked_info.unlock();
+    }
+}
+
+CoincidenceInfo CoincidenceSorter::getCoincidenceInfo() {
+    lock_locked_info.lock();
+    CoincidenceInfo local_copy = locked_info;
+    lock_locked_info.unlock();
+    return(local_copy);
+}
+
+void CoincidenceSorter::resetCoincidenceInfo() {
+    info.reset();
+    locked_info = info;
+}
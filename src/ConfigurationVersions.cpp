@@ -0,0 +1,114 @@
+#include <miil/process/ConfigurationVersions.h>
+#include <miil/SystemConfiguration.h>
+
+using namespace std;
+
+namespace {
+/*!
+ * \brief Check that two configurations describe the same system geometry
+ *
+ * Events that are in flight are indexed according to the geometry of the
+ * configuration they were decoded with, so a new version is required to have
+ * the same geometry as the one it replaces.
+ */
+bool SameGeometry(
+        const SystemConfiguration & config1,
+        const SystemConfiguration & config2)
+{
+    return((config1.panels_per_system == config2.panels_per_system) &&
+           (config1.cartridges_per_panel == config2.cartridges_per_panel) &&
+           (config1.daqs_per_cartridge == config2.daqs_per_cartridge) &&
+           (config1.renas_per_daq == config2.renas_per_daq) &&
+           (config1.modules_per_rena == config2.modules_per_rena) &&
+           (config1.fins_per_cartridge == config2.fins_per_cartridge) &&
+           (config1.modules_per_fin == config2.modules_per_fin) &&
+           (config1.apds_per_module == config2.apds_per_module) &&
+           (config1.crystals_per_apd == config2.crystals_per_apd));
+}
+}
+
+/*!
+ * \brief Create the set of versions with the initial configuration
+ *
+ * \param config The configuration that is published as version 0
+ */
+ConfigurationVersions::ConfigurationVersions(
+        std::shared_ptr<const SystemConfiguration> config)
+{
+    std::shared_ptr<ConfigurationSnapshot> snapshot(new ConfigurationSnapshot);
+    snapshot->config = config;
+    snapshot->version = 0;
+    current = snapshot;
+}
+
+/*!
+ * \brief Get the current configuration and its version
+ *
+ * The configuration in the snapshot is kept alive as long as the snapshot is
+ * held, even if a newer version is published in the meantime.
+ */
+ConfigurationSnapshot ConfigurationVersions::acquire() const {
+    std::shared_ptr<const ConfigurationSnapshot> snapshot =
+            std::atomic_load(&current);
+    return(*snapshot);
+}
+
+/*!
+ * \brief Returns the version number of the current configuration
+ */
+int ConfigurationVersions::currentVersion() const {
+    return(std::atomic_load(&current)->version);
+}
+
+/*!
+ * \brief Make a modifiable copy of the current configuration
+ *
+ * The channel map holds pointers into the configuration it was created for,
+ * so it is recreated for the copy.
+ *
+ * \return A copy of the current configuration to be modified and published
+ */
+std::shared_ptr<SystemConfiguration> ConfigurationVersions::copyCurrent() const
+{
+    std::shared_ptr<SystemConfiguration> copy(
+            new SystemConfiguration(*acquire().config));
+    if (!copy->channel_map.empty()) {
+        copy->createChannelMap();
+    }
+    return(copy);
+}
+
+/*!
+ * \brief Replace the current configuration with a new version
+ *
+ * The new configuration is picked up by each of the processing threads at the
+ * start of its next batch.  The configuration must not be modified after it is
+ * published.
+ *
+ * \param config The new configuration
+ *
+ * \return The version number of the new configuration on success, less than
+ *         zero otherwise.
+ *         - -1 if the configuration is null
+ *         - -2 if the geometry differs from the current configuration
+ */
+int ConfigurationVersions::publish(
+        std::shared_ptr<const SystemConfiguration> config)
+{
+    if (!config) {
+        return(-1);
+    }
+    std::lock_guard<std::mutex> lck(publish_lock);
+    std::shared_ptr<const ConfigurationSnapshot> previous =
+            std::atomic_load(&current);
+    if (!SameGeometry(*previous->config, *config)) {
+        return(-2);
+    }
+    std::shared_ptr<ConfigurationSnapshot> snapshot(new ConfigurationSnapshot);
+    snapshot->config = config;
+    snapshot->version = previous->version + 1;
+    std::atomic_store(
+            &current,
+            std::shared_ptr<const ConfigurationSnapshot>(snapshot));
+    return(snapshot->version);
+}
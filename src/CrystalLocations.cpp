@@ -0,0 +1,552 @@
+#include <miil/process/CrystalLocations.h>
+#include <miil/process/FloodHistogram.h>
+#include <miil/process/ParallelFileRead.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <thread>
+
+using namespace std;
+
+namespace {
+//! The most mean shift steps taken to find the peaks of an APD
+const int MAX_ITERATIONS = 50;
+//! The largest move of a crystal, in bins, for the peaks to have settled
+const double SETTLED_SHIFT = 0.01;
+
+/*!
+ * \brief Smooth a flood with a 3x3 binomial kernel
+ *
+ * The kernel is normalized over the bins within the flood, so the edges are
+ * not pulled down.
+ */
+void SmoothFlood(
+        const double * flood,
+        int bins,
+        std::vector<double> & smoothed)
+{
+    const double kernel[3] = {1, 2, 1};
+    std::vector<double> rows(bins * bins);
+    for (int y = 0; y < bins; y++) {
+        for (int x = 0; x < bins; x++) {
+            double sum = 0;
+            double weight = 0;
+            for (int k = -1; k <= 1; k++) {
+                if ((x + k >= 0) && (x + k < bins)) {
+                    sum += kernel[k + 1] * flood[y * bins + x + k];
+                    weight += kernel[k + 1];
+                }
+            }
+            rows[y * bins + x] = sum / weight;
+        }
+    }
+    smoothed.resize(bins * bins);
+    for (int y = 0; y < bins; y++) {
+        for (int x = 0; x < bins; x++) {
+            double sum = 0;
+            double weight = 0;
+            for (int k = -1; k <= 1; k++) {
+                if ((y + k >= 0) && (y + k < bins)) {
+                    sum += kernel[k + 1] * rows[(y + k) * bins + x];
+                    weight += kernel[k + 1];
+                }
+            }
+            smoothed[y * bins + x] = sum / weight;
+        }
+    }
+}
+
+/*!
+ * \brief Find the positions that split a distribution into equal parts
+ *
+ * \param counts The counts of each bin
+ * \param no_parts The number of parts
+ * \param positions Where the middle of each part, in bins, is returned
+ */
+void Quantiles(
+        const std::vector<double> & counts,
+        int no_parts,
+        std::vector<double> & positions)
+{
+    double total = 0;
+    for (size_t ii = 0; ii < counts.size(); ii++) {
+        total += counts[ii];
+    }
+    positions.resize(no_parts);
+    double below = 0;
+    size_t bin = 0;
+    for (int part = 0; part < no_parts; part++) {
+        const double target = total * (part + 0.5) / no_parts;
+        while ((bin + 1 < counts.size()) && (below + counts[bin] < target)) {
+            below += counts[bin++];
+        }
+        double fraction = 0.5;
+        if (counts[bin] > 0) {
+            fraction = std::min(std::max(
+                    (target - below) / counts[bin], 0.0), 1.0);
+        }
+        positions[part] = bin + fraction;
+    }
+}
+
+/*!
+ * \brief The bins within a radius of a position, clipped to the flood
+ */
+struct Window {
+    int x_low;
+    int x_high;
+    int y_low;
+    int y_high;
+    double radius_sq;
+
+    Window(double x, double y, double radius, int bins) :
+        x_low(std::max((int) std::floor(x - radius), 0)),
+        x_high(std::min((int) std::ceil(x + radius), bins - 1)),
+        y_low(std::max((int) std::floor(y - radius), 0)),
+        y_high(std::min((int) std::ceil(y + radius), bins - 1)),
+        radius_sq(radius * radius)
+    {}
+
+    bool contains(int bin_x, int bin_y, double x, double y) const {
+        const double dx = bin_x + 0.5 - x;
+        const double dy = bin_y + 0.5 - y;
+        return(dx * dx + dy * dy <= radius_sq);
+    }
+};
+
+/*!
+ * \brief Move the crystals of an APD to the peaks of its flood
+ *
+ * \param flood The flood of the APD
+ * \param bins The number of bins along each axis of the flood
+ * \param peak_x The starting x of each crystal in bins, where the x of its
+ *        peak is returned
+ * \param peak_y The starting y of each crystal in bins, where the y of its
+ *        peak is returned
+ * \param peak_counts Where the events within the window of each peak are
+ *        returned
+ */
+void FindPeaks(
+        const double * flood,
+        int bins,
+        std::vector<double> & peak_x,
+        std::vector<double> & peak_y,
+        std::vector<double> & peak_counts)
+{
+    std::vector<double> smoothed;
+    SmoothFlood(flood, bins, smoothed);
+
+    const int no_peaks = peak_x.size();
+    std::vector<double> radii(no_peaks);
+    std::vector<double> next_x(no_peaks);
+    std::vector<double> next_y(no_peaks);
+    for (int iteration = 0; iteration < MAX_ITERATIONS; iteration++) {
+        for (int ii = 0; ii < no_peaks; ii++) {
+            double min_dist_sq = std::numeric_limits<double>::max();
+            for (int jj = 0; jj < no_peaks; jj++) {
+                if (ii == jj) {
+                    continue;
+                }
+                const double dx = peak_x[ii] - peak_x[jj];
+                const double dy = peak_y[ii] - peak_y[jj];
+                min_dist_sq = std::min(min_dist_sq, dx * dx + dy * dy);
+            }
+            radii[ii] = std::min(std::max(0.5 * std::sqrt(min_dist_sq), 1.0),
+                                 bins / 4.0);
+        }
+
+        double max_shift = 0;
+        for (int ii = 0; ii < no_peaks; ii++) {
+            const Window window(peak_x[ii], peak_y[ii], radii[ii], bins);
+            double background = std::numeric_limits<double>::max();
+            for (int y = window.y_low; y <= window.y_high; y++) {
+                for (int x = window.x_low; x <= window.x_high; x++) {
+                    if (window.contains(x, y, peak_x[ii], peak_y[ii])) {
+                        background = std::min(background,
+                                              smoothed[y * bins + x]);
+                    }
+                }
+            }
+            double sum = 0;
+            double sum_x = 0;
+            double sum_y = 0;
+            for (int y = window.y_low; y <= window.y_high; y++) {
+                for (int x = window.x_low; x <= window.x_high; x++) {
+                    if (!window.contains(x, y, peak_x[ii], peak_y[ii])) {
+                        continue;
+                    }
+                    const double weight = smoothed[y * bins + x] - background;
+                    sum += weight;
+                    sum_x += weight * (x + 0.5);
+                    sum_y += weight * (y + 0.5);
+                }
+            }
+            next_x[ii] = peak_x[ii];
+            next_y[ii] = peak_y[ii];
+            if (sum > 0) {
+                next_x[ii] = sum_x / sum;
+                next_y[ii] = sum_y / sum;
+            }
+            max_shift = std::max(max_shift, std::max(
+                    std::abs(next_x[ii] - peak_x[ii]),
+                    std::abs(next_y[ii] - peak_y[ii])));
+        }
+        peak_x.swap(next_x);
+        peak_y.swap(next_y);
+        if (max_shift < SETTLED_SHIFT) {
+            break;
+        }
+    }
+
+    peak_counts.assign(no_peaks, 0);
+    for (int ii = 0; ii < no_peaks; ii++) {
+        const Window window(peak_x[ii], peak_y[ii], radii[ii], bins);
+        for (int y = window.y_low; y <= window.y_high; y++) {
+            for (int x = window.x_low; x <= window.x_high; x++) {
+                if (window.contains(x, y, peak_x[ii], peak_y[ii])) {
+                    peak_counts[ii] += flood[y * bins + x];
+                }
+            }
+        }
+    }
+}
+
+/*!
+ * \brief Shift and scale the starting crystals to the spread of the flood
+ *
+ * Matches the mean and standard deviation of the crystals, along x and y, to
+ * those of the counts of the flood above its background, taken as its lower
+ * quartile, so that a change in the gain or the size of the flood since the
+ * starting locations were found does not leave the crystals between peaks.
+ */
+void AlignToFlood(
+        const double * flood,
+        int bins,
+        std::vector<double> & peak_x,
+        std::vector<double> & peak_y)
+{
+    std::vector<double> sorted(flood, flood + bins * bins);
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 4,
+                     sorted.end());
+    const double background = sorted[sorted.size() / 4];
+
+    double sum = 0;
+    double sum_x = 0;
+    double sum_y = 0;
+    double sum_xx = 0;
+    double sum_yy = 0;
+    for (int y = 0; y < bins; y++) {
+        for (int x = 0; x < bins; x++) {
+            const double weight = flood[y * bins + x] - background;
+            if (weight <= 0) {
+                continue;
+            }
+            sum += weight;
+            sum_x += weight * (x + 0.5);
+            sum_y += weight * (y + 0.5);
+            sum_xx += weight * (x + 0.5) * (x + 0.5);
+            sum_yy += weight * (y + 0.5) * (y + 0.5);
+        }
+    }
+    const int no_peaks = peak_x.size();
+    if ((sum <= 0) || (no_peaks < 2)) {
+        return;
+    }
+    const double flood_mean_x = sum_x / sum;
+    const double flood_mean_y = sum_y / sum;
+    const double flood_std_x = std::sqrt(std::max(
+            sum_xx / sum - flood_mean_x * flood_mean_x, 0.0));
+    const double flood_std_y = std::sqrt(std::max(
+            sum_yy / sum - flood_mean_y * flood_mean_y, 0.0));
+
+    double peak_mean_x = 0;
+    double peak_mean_y = 0;
+    for (int ii = 0; ii < no_peaks; ii++) {
+        peak_mean_x += peak_x[ii] / no_peaks;
+        peak_mean_y += peak_y[ii] / no_peaks;
+    }
+    double peak_var_x = 0;
+    double peak_var_y = 0;
+    for (int ii = 0; ii < no_peaks; ii++) {
+        peak_var_x += std::pow(peak_x[ii] - peak_mean_x, 2) / no_peaks;
+        peak_var_y += std::pow(peak_y[ii] - peak_mean_y, 2) / no_peaks;
+    }
+    if ((peak_var_x <= 0) || (peak_var_y <= 0)) {
+        return;
+    }
+    const double scale_x = flood_std_x / std::sqrt(peak_var_x);
+    const double scale_y = flood_std_y / std::sqrt(peak_var_y);
+    for (int ii = 0; ii < no_peaks; ii++) {
+        peak_x[ii] = flood_mean_x + (peak_x[ii] - peak_mean_x) * scale_x;
+        peak_y[ii] = flood_mean_y + (peak_y[ii] - peak_mean_y) * scale_y;
+    }
+}
+
+/*!
+ * \brief Find the crystal locations of one APD
+ *
+ * \return 0 on success, -1 if the crystals needed to start from a grid, but
+ *         there is not a square number of them
+ */
+int LocateApdCrystals(
+        const double * flood,
+        int bins,
+        float range,
+        std::vector<CrystalCalibration> & crystals,
+        double min_crystal_counts)
+{
+    const int no_crystals = crystals.size();
+    const double bins_per_unit = bins / (2.0 * range);
+
+    double flood_total = 0;
+    for (int ii = 0; ii < bins * bins; ii++) {
+        flood_total += flood[ii];
+    }
+
+    // Start from the locations in the configuration if any of the crystals
+    // are in use, such as after loadCrystalLocations.
+    std::vector<int> peak_crystals;
+    for (int ii = 0; ii < no_crystals; ii++) {
+        if (crystals[ii].use) {
+            peak_crystals.push_back(ii);
+        }
+    }
+    const bool from_config = !peak_crystals.empty();
+    std::vector<double> peak_x;
+    std::vector<double> peak_y;
+    if (from_config) {
+        for (size_t ii = 0; ii < peak_crystals.size(); ii++) {
+            const CrystalCalibration & crystal = crystals[peak_crystals[ii]];
+            peak_x.push_back((crystal.x_loc + range) * bins_per_unit);
+            peak_y.push_back((crystal.y_loc + range) * bins_per_unit);
+        }
+    } else {
+        const int side = std::lround(std::sqrt((double) no_crystals));
+        if (side * side != no_crystals) {
+            return(-1);
+        }
+        std::vector<double> x_counts(bins, 0);
+        std::vector<double> y_counts(bins, 0);
+        for (int y = 0; y < bins; y++) {
+            for (int x = 0; x < bins; x++) {
+                x_counts[x] += flood[y * bins + x];
+                y_counts[y] += flood[y * bins + x];
+            }
+        }
+        std::vector<double> grid_x;
+        std::vector<double> grid_y;
+        Quantiles(x_counts, side, grid_x);
+        Quantiles(y_counts, side, grid_y);
+        for (int ii = 0; ii < no_crystals; ii++) {
+            peak_crystals.push_back(ii);
+            peak_x.push_back(grid_x[ii % side]);
+            peak_y.push_back(grid_y[ii / side]);
+        }
+    }
+
+    if (flood_total < min_crystal_counts * peak_crystals.size()) {
+        for (size_t ii = 0; ii < peak_crystals.size(); ii++) {
+            CrystalCalibration & crystal = crystals[peak_crystals[ii]];
+            crystal.x_loc = peak_x[ii] / bins_per_unit - range;
+            crystal.y_loc = peak_y[ii] / bins_per_unit - range;
+            crystal.use = false;
+        }
+        return(0);
+    }
+
+    if (from_config) {
+        AlignToFlood(flood, bins, peak_x, peak_y);
+    }
+    std::vector<double> peak_counts;
+    FindPeaks(flood, bins, peak_x, peak_y, peak_counts);
+    for (size_t ii = 0; ii < peak_crystals.size(); ii++) {
+        CrystalCalibration & crystal = crystals[peak_crystals[ii]];
+        crystal.x_loc = peak_x[ii] / bins_per_unit - range;
+        crystal.y_loc = peak_y[ii] / bins_per_unit - range;
+        crystal.use = (peak_counts[ii] >= min_crystal_counts);
+    }
+    return(0);
+}
+}
+
+/*!
+ * \brief Find the crystal locations from a flood of each APD
+ *
+ * \param floods The floods of each APD, in the order and layout of
+ *        FloodHistogram::snapshot
+ * \param bins_per_axis The number of bins along each axis of each flood
+ * \param range The floods cover -range to range in x and y
+ * \param config The configuration giving the APDs, and any locations to start
+ *        the crystals from
+ * \param crystal_calibration Where the calibration of the configuration is
+ *        returned, with the locations, and use, of each crystal replaced
+ * \param no_threads The number of threads to process the APDs with
+ * \param min_crystal_counts The fewest events near a crystal for it to be used
+ *
+ * \return 0 on success, less than otherwise
+ *       - -1 if no_threads is less than one
+ *       - -2 if the floods are not the size expected from the configuration
+ *       - -3 if an APD without crystal locations in the configuration does
+ *         not have a square number of crystals
+ */
+int FindCrystalLocations(
+        const std::vector<double> & floods,
+        int bins_per_axis,
+        float range,
+        SystemConfiguration const * const config,
+        std::vector<std::vector<std::vector<
+                std::vector<std::vector<std::vector<
+                CrystalCalibration> > > > > > & crystal_calibration,
+        int no_threads,
+        double min_crystal_counts)
+{
+    if (no_threads < 1) {
+        return(-1);
+    }
+    const int panels = config->panels_per_system;
+    const int cartridges = config->cartridges_per_panel;
+    const int fins = config->fins_per_cartridge;
+    const int modules = config->modules_per_fin;
+    const int apds = config->apds_per_module;
+    const int no_apds = panels * cartridges * fins * modules * apds;
+    const size_t flood_bins = (size_t) bins_per_axis * bins_per_axis;
+    if ((bins_per_axis < 1) || (floods.size() != no_apds * flood_bins)) {
+        return(-2);
+    }
+
+    crystal_calibration = config->calibration;
+    config->resizeArrayPCFMAX(crystal_calibration);
+
+    std::atomic<int> next_apd(0);
+    std::atomic<int> status(0);
+    auto worker = [&]() {
+        int apd_index;
+        while ((apd_index = next_apd++) < no_apds) {
+            const int a = apd_index % apds;
+            const int m = (apd_index / apds) % modules;
+            const int f = (apd_index / (apds * modules)) % fins;
+            const int c = (apd_index / (apds * modules * fins)) % cartridges;
+            const int p = apd_index / (apds * modules * fins * cartridges);
+            if (LocateApdCrystals(
+                    &floods[apd_index * flood_bins], bins_per_axis, range,
+                    crystal_calibration[p][c][f][m][a],
+                    min_crystal_counts) < 0)
+            {
+                status = -3;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int thread = 1; thread < no_threads; thread++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t ii = 0; ii < threads.size(); ii++) {
+        threads[ii].join();
+    }
+    return(status);
+}
+
+/*!
+ * \brief Find the crystal locations from the floods of a FloodHistogram
+ *
+ * \return 0 on success, or the negative error of FindCrystalLocations
+ */
+int FindCrystalLocations(
+        FloodHistogram & floods,
+        SystemConfiguration const * const config,
+        std::vector<std::vector<std::vector<
+                std::vector<std::vector<std::vector<
+                CrystalCalibration> > > > > > & crystal_calibration,
+        int no_threads,
+        double min_crystal_counts)
+{
+    std::vector<double> flood_counts;
+    floods.snapshot(flood_counts);
+    return(FindCrystalLocations(
+            flood_counts, floods.binsPerAxis(), floods.range(), config,
+            crystal_calibration, no_threads, min_crystal_counts));
+}
+
+/*!
+ * \brief Find the crystal locations from a file of events and write them out
+ *
+ * The floods are filled from a file of decoded EventRaw, positioned with
+ * CalculateXYandEnergy, so the pedestals need to be loaded, or from a file of
+ * EventCal.  Each thread reads, and histograms, its own part of the file.
+ * The locations are written with SystemConfiguration::writeCrystalLocations,
+ * so they can be loaded with SystemConfiguration::loadCrystalLocations.
+ *
+ * \param events_filename The file of events to fill the floods from
+ * \param calibrated_events If the file holds EventCal, rather than EventRaw
+ * \param locations_filename The crystal location file to write
+ * \param config The configuration giving the APDs
+ * \param no_threads The number of threads to read the file, and process the
+ *        APDs, with
+ * \param bins_per_axis The number of bins along each axis of each flood
+ * \param range The floods cover -range to range in x and y
+ * \param min_crystal_counts The fewest events near a crystal for it to be used
+ *
+ * \return 0 on success, less than otherwise
+ *       - -1 if no_threads is less than one
+ *       - -3 if an APD without crystal locations in the configuration does
+ *         not have a square number of crystals
+ *       - -4 if the events file could not be opened or read
+ *       - -5 if the size of the events file is not a whole number of events
+ *       - -6 if the locations file could not be written
+ */
+int FindCrystalLocationsFile(
+        const std::string & events_filename,
+        bool calibrated_events,
+        const std::string & locations_filename,
+        SystemConfiguration const * const config,
+        int no_threads,
+        int bins_per_axis,
+        float range,
+        double min_crystal_counts)
+{
+    if (no_threads < 1) {
+        return(-1);
+    }
+    FloodHistogram floods(config, no_threads, bins_per_axis, range);
+    int status;
+    if (calibrated_events) {
+        status = ReadEventFileParallel<EventCal>(
+                events_filename, no_threads,
+                [&](int thread,
+                    std::vector<EventCal>::const_iterator begin,
+                    std::vector<EventCal>::const_iterator end)
+                {
+                    floods.add(thread, begin, end);
+                });
+    } else {
+        status = ReadEventFileParallel<EventRaw>(
+                events_filename, no_threads,
+                [&](int thread,
+                    std::vector<EventRaw>::const_iterator begin,
+                    std::vector<EventRaw>::const_iterator end)
+                {
+                    floods.add(thread, begin, end, config);
+                });
+    }
+    if (status < 0) {
+        return(status);
+    }
+
+    std::vector<std::vector<std::vector<
+            std::vector<std::vector<std::vector<
+            CrystalCalibration> > > > > > crystal_calibration;
+    const int find_status = FindCrystalLocations(
+            floods, config, crystal_calibration, no_threads,
+            min_crystal_counts);
+    if (find_status < 0) {
+        return(find_status);
+    }
+    if (config->writeCrystalLocations(locations_filename,
+                                      crystal_calibration) < 0)
+    {
+        return(-6);
+    }
+    return(0);
+}
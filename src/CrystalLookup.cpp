@@ -0,0 +1,142 @@
+#include <miil/CrystalLookup.h>
+#include <miil/SystemConfiguration.h>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+using namespace std;
+
+namespace {
+/*!
+ * Slack added when deciding if a crystal is a candidate for a cell.  Covers the
+ * rounding of the float distance calculation in find(), and events on the edge
+ * of a cell being placed in the neighboring cell.
+ */
+const double candidate_tolerance = 1e-5;
+
+/*!
+ * \brief The distance from a value to the closest point in [low, high]
+ */
+double MinDistance(double value, double low, double high) {
+    if (value < low) {
+        return(low - value);
+    } else if (value > high) {
+        return(value - high);
+    }
+    return(0);
+}
+
+/*!
+ * \brief The distance from a value to the furthest point in [low, high]
+ */
+double MaxDistance(double value, double low, double high) {
+    return(std::max(std::abs(value - low), std::abs(value - high)));
+}
+}
+
+CrystalLookup::CrystalLookup() :
+    cells_per_side(0)
+{
+}
+
+/*!
+ * \brief Build the grid from the crystal locations of an APD
+ *
+ * For a cell, no point in it can be further from its nearest crystal than the
+ * smallest distance from any crystal to the far corner of the cell.  Any
+ * crystal that is closer than that to the cell is a candidate.  The grid uses
+ * about four cells per crystal, so each cell typically has a handful of
+ * candidates.
+ *
+ * \param apd_cals The calibration of each crystal on the APD.  Must be rebuilt
+ *        if the crystal locations are changed.
+ *
+ * \return 0 on success
+ */
+int CrystalLookup::build(const std::vector<CrystalCalibration> & apd_cals) {
+    const int no_crystals = apd_cals.size();
+    x_locs.resize(no_crystals);
+    y_locs.resize(no_crystals);
+    for (int crystal = 0; crystal < no_crystals; crystal++) {
+        x_locs[crystal] = apd_cals[crystal].x_loc;
+        y_locs[crystal] = apd_cals[crystal].y_loc;
+    }
+
+    cells_per_side = std::max(
+            1, (int) std::ceil(2 * std::sqrt((double) no_crystals)));
+    const double cell_size = 2.0 / cells_per_side;
+
+    cell_start.clear();
+    candidates.clear();
+    cell_start.reserve(cells_per_side * cells_per_side + 1);
+    cell_start.push_back(0);
+    for (int cell_y = 0; cell_y < cells_per_side; cell_y++) {
+        const double y_low = -1.0 + cell_y * cell_size;
+        const double y_high = y_low + cell_size;
+        for (int cell_x = 0; cell_x < cells_per_side; cell_x++) {
+            const double x_low = -1.0 + cell_x * cell_size;
+            const double x_high = x_low + cell_size;
+
+            double bound = DBL_MAX;
+            for (int crystal = 0; crystal < no_crystals; crystal++) {
+                double dist = std::hypot(
+                        MaxDistance(x_locs[crystal], x_low, x_high),
+                        MaxDistance(y_locs[crystal], y_low, y_high));
+                if (dist < bound) {
+                    bound = dist;
+                }
+            }
+            for (int crystal = 0; crystal < no_crystals; crystal++) {
+                double dist = std::hypot(
+                        MinDistance(x_locs[crystal], x_low, x_high),
+                        MinDistance(y_locs[crystal], y_low, y_high));
+                if (dist <= bound + candidate_tolerance) {
+                    candidates.push_back(crystal);
+                }
+            }
+            cell_start.push_back(candidates.size());
+        }
+    }
+    return(0);
+}
+
+/*!
+ * \brief Find the closest crystal to an anger logic position
+ *
+ * Returns the same result as GetCrystalID with the crystal locations the grid
+ * was built from.
+ *
+ * \param x The x anger logic position of the event
+ * \param y The y anger logic position of the event
+ *
+ * \return The id of the closest crystal on success.
+ *         - -1 if the crystal couldn't be identified correctly
+ *         - -2 if the event is out of bounds of anger logic.
+ */
+int CrystalLookup::find(float x, float y) const {
+    if ((std::abs(x) > 1) || (std::abs(y) > 1)) {
+        return(-2);
+    }
+    if (std::isnan(x) || std::isnan(y) || (cells_per_side == 0)) {
+        return(-1);
+    }
+    // Events exactly at 1 are put in the last cell.
+    int cell_x = std::min((int) ((x + 1.0f) * 0.5f * cells_per_side),
+                          cells_per_side - 1);
+    int cell_y = std::min((int) ((y + 1.0f) * 0.5f * cells_per_side),
+                          cells_per_side - 1);
+    int cell = cell_y * cells_per_side + cell_x;
+
+    double min(__DBL_MAX__);
+    int crystal_id(-1);
+    for (int ii = cell_start[cell]; ii < cell_start[cell + 1]; ii++) {
+        int crystal = candidates[ii];
+        double dist = std::pow(x_locs[crystal] - x, 2) +
+                      std::pow(y_locs[crystal] - y, 2);
+        if (dist < min) {
+            crystal_id = crystal;
+            min = dist;
+        }
+    }
+    return(crystal_id);
+}
@@ -0,0 +1,397 @@
+#include <miil/process/EnergySpectra.h>
+#include <miil/process/processing.h>
+#include <miil/SystemConfiguration.h>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+/*!
+ * \brief Create empty spectra for every crystal of a system
+ *
+ * \param config The system configuration giving the number of crystals, and
+ *        the calibrated spatial photopeaks used as the starting estimates, if
+ *        the calibration has been loaded.  Must outlive the spectra.
+ * \param no_shards The number of threads that will add events
+ * \param spat_bins The number of bins of each spatial total spectrum
+ * \param spat_max The spatial total spectra cover 0 to spat_max
+ * \param energy_bins The number of bins of each energy spectrum
+ * \param energy_max The energy spectra cover 0 to energy_max keV
+ * \param peak_window The fraction of the peak on either side of it that the
+ *        windowed centroid is taken over
+ */
+EnergySpectra::EnergySpectra(
+        SystemConfiguration const * const config,
+        int no_shards,
+        int spat_bins,
+        float spat_max,
+        int energy_bins,
+        float energy_max,
+        float peak_window) :
+    min_peak_counts(100),
+    config(config),
+    spat_bins(spat_bins),
+    spat_bin_width(spat_max / spat_bins),
+    energy_bins(energy_bins),
+    energy_bin_width(energy_max / energy_bins),
+    peak_window(peak_window),
+    spat_histogram((size_t) noCrystals() * spat_bins, no_shards),
+    energy_histogram((size_t) noCrystals() * energy_bins, no_shards),
+    calibrated_spat_peaks(noCrystals(), 0),
+    spat_peaks(noCrystals(), -1),
+    energy_peaks(noCrystals(), -1)
+{
+    if (!config->calibrationLoaded()) {
+        return;
+    }
+    int index = 0;
+    for (int p = 0; p < config->panels_per_system; p++) {
+        for (int c = 0; c < config->cartridges_per_panel; c++) {
+            for (int f = 0; f < config->fins_per_cartridge; f++) {
+                for (int m = 0; m < config->modules_per_fin; m++) {
+                    for (int a = 0; a < config->apds_per_module; a++) {
+                        for (int x = 0; x < config->crystals_per_apd; x++) {
+                            const CrystalCalibration & crystal_cal =
+                                    config->calibration[p][c][f][m][a][x];
+                            if (crystal_cal.use) {
+                                calibrated_spat_peaks[index] =
+                                        crystal_cal.gain_spat;
+                            }
+                            index++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+int EnergySpectra::noCrystals() const {
+    return(config->panels_per_system * config->cartridges_per_panel *
+           config->fins_per_cartridge * config->modules_per_fin *
+           config->apds_per_module * config->crystals_per_apd);
+}
+
+int EnergySpectra::noShards() const {
+    return(spat_histogram.shards());
+}
+
+/*!
+ * \brief The index of a crystal within the spectra
+ *
+ * \return The index, or -1 if the crystal is outside of the system
+ */
+int EnergySpectra::crystalIndex(
+        int panel,
+        int cartridge,
+        int fin,
+        int module,
+        int apd,
+        int crystal) const
+{
+    return(config->indexPCFMAX(panel, cartridge, fin, module, apd, crystal));
+}
+
+/*!
+ * \brief Add a calibrated event to the spectra of its crystal
+ *
+ * Values outside of the range of a spectrum are not counted in it.
+ *
+ * \param shard The shard of the calling thread
+ * \param event The event
+ */
+void EnergySpectra::add(int shard, const EventCal & event) {
+    const int index = crystalIndex(event.panel, event.cartridge, event.fin,
+                                   event.module, event.apd, event.crystal);
+    if (index < 0) {
+        return;
+    }
+    const float spat_bin = std::floor(event.spat_total / spat_bin_width);
+    if ((spat_bin >= 0) && (spat_bin < spat_bins)) {
+        spat_histogram.increment(
+                shard, (size_t) index * spat_bins + (size_t) spat_bin);
+    }
+    const float energy_bin = std::floor(event.E / energy_bin_width);
+    if ((energy_bin >= 0) && (energy_bin < energy_bins)) {
+        energy_histogram.increment(
+                shard, (size_t) index * energy_bins + (size_t) energy_bin);
+    }
+}
+
+/*!
+ * \brief Add calibrated events to the spectra
+ *
+ * \param shard The shard of the calling thread
+ * \param begin The first event to be added
+ * \param end One past the last event to be added
+ */
+void EnergySpectra::add(
+        int shard,
+        std::vector<EventCal>::const_iterator begin,
+        std::vector<EventCal>::const_iterator end)
+{
+    for (std::vector<EventCal>::const_iterator iter = begin;
+         iter != end;
+         ++iter)
+    {
+        add(shard, *iter);
+    }
+}
+
+/*!
+ * \brief Add each batch of calibrated events from a ProcessParams
+ */
+void EnergySpectra::addCalibrated(
+        int shard,
+        std::vector<EventCal>::const_iterator begin,
+        std::vector<EventCal>::const_iterator end,
+        SystemConfiguration const * const)
+{
+    add(shard, begin, end);
+}
+
+/*!
+ * \brief Read the spectra of one crystal
+ *
+ * \param crystal_index The crystal, from crystalIndex
+ * \param spat_spectrum Where the spatial total spectrum is returned
+ * \param energy_spectrum Where the energy spectrum is returned
+ *
+ * \return 0 on success, -1 if the crystal does not exist
+ */
+int EnergySpectra::snapshot(
+        int crystal_index,
+        std::vector<double> & spat_spectrum,
+        std::vector<double> & energy_spectrum)
+{
+    if ((crystal_index < 0) || (crystal_index >= noCrystals())) {
+        return(-1);
+    }
+    spat_histogram.snapshot(
+            (size_t) crystal_index * spat_bins, spat_bins, spat_spectrum);
+    energy_histogram.snapshot(
+            (size_t) crystal_index * energy_bins, energy_bins,
+            energy_spectrum);
+    return(0);
+}
+
+/*!
+ * \brief The center of the largest bin of a spectrum
+ *
+ * \return The center, or -1 if the spectrum is empty
+ */
+float EnergySpectra::largestBin(
+        const double * spectrum,
+        int no_bins,
+        float bin_width) const
+{
+    int largest = -1;
+    double largest_counts = 0;
+    for (int bin = 0; bin < no_bins; bin++) {
+        if (spectrum[bin] > largest_counts) {
+            largest = bin;
+            largest_counts = spectrum[bin];
+        }
+    }
+    if (largest < 0) {
+        return(-1);
+    }
+    return((largest + 0.5f) * bin_width);
+}
+
+/*!
+ * \brief Read every spectrum and update the photopeak estimates
+ *
+ * Called periodically by a reader, such as a GUI timer.  Crystals whose
+ * window has too few counts keep their previous estimate.
+ *
+ * \return The number of crystals with a spatial peak estimate
+ */
+int EnergySpectra::updatePeaks() {
+    std::lock_guard<std::mutex> lck(lock_peaks);
+    spat_histogram.snapshot(spat_spectra);
+    energy_histogram.snapshot(energy_spectra);
+    int no_estimates = 0;
+    for (int index = 0; index < noCrystals(); index++) {
+        const double * spat_spectrum =
+                spat_spectra.data() + (size_t) index * spat_bins;
+        float spat_start = spat_peaks[index];
+        if (spat_start <= 0) {
+            spat_start = calibrated_spat_peaks[index];
+        }
+        if (spat_start <= 0) {
+            spat_start = largestBin(spat_spectrum, spat_bins, spat_bin_width);
+        }
+        if (spat_start > 0) {
+            const float peak = WindowedCentroid(
+                    spat_spectrum, spat_bins, spat_bin_width, spat_start,
+                    peak_window, min_peak_counts);
+            if (peak > 0) {
+                spat_peaks[index] = peak;
+            }
+        }
+        if (spat_peaks[index] > 0) {
+            no_estimates++;
+        }
+
+        float energy_start = energy_peaks[index];
+        if (energy_start <= 0) {
+            energy_start = 511;
+        }
+        const float peak = WindowedCentroid(
+                energy_spectra.data() + (size_t) index * energy_bins,
+                energy_bins, energy_bin_width, energy_start,
+                peak_window, min_peak_counts);
+        if (peak > 0) {
+            energy_peaks[index] = peak;
+        }
+    }
+    return(no_estimates);
+}
+
+/*!
+ * \brief The spatial total photopeak of a crystal from the last updatePeaks
+ *
+ * \return The photopeak, or -1 if there is no estimate
+ */
+float EnergySpectra::spatPeak(int crystal_index) {
+    std::lock_guard<std::mutex> lck(lock_peaks);
+    if ((crystal_index < 0) || (crystal_index >= noCrystals())) {
+        return(-1);
+    }
+    return(spat_peaks[crystal_index]);
+}
+
+/*!
+ * \brief The energy photopeak, in keV, of a crystal from the last updatePeaks
+ *
+ * \return The photopeak, or -1 if there is no estimate
+ */
+float EnergySpectra::energyPeak(int crystal_index) {
+    std::lock_guard<std::mutex> lck(lock_peaks);
+    if ((crystal_index < 0) || (crystal_index >= noCrystals())) {
+        return(-1);
+    }
+    return(energy_peaks[crystal_index]);
+}
+
+/*!
+ * \brief Estimate the spatial total photopeak of each APD
+ *
+ * Sums the spatial spectra from the last updatePeaks over the crystals of
+ * each APD, and takes the windowed centroid starting from the mean of the
+ * peaks of its crystals.
+ *
+ * \param peaks Where the peak of each APD is returned, in the order used by
+ *        writePhotopeakPositions, or -1 for an APD without an estimate
+ *
+ * \return The number of APDs with an estimate
+ */
+int EnergySpectra::apdSpatPeaks(std::vector<float> & peaks) {
+    std::lock_guard<std::mutex> lck(lock_peaks);
+    const int crystals_per_apd = config->crystals_per_apd;
+    const int no_apds = noCrystals() / crystals_per_apd;
+    peaks.assign(no_apds, -1);
+    if (spat_spectra.empty()) {
+        return(0);
+    }
+    std::vector<double> apd_spectrum(spat_bins);
+    int no_estimates = 0;
+    for (int apd = 0; apd < no_apds; apd++) {
+        std::fill(apd_spectrum.begin(), apd_spectrum.end(), 0);
+        double peak_sum = 0;
+        int no_peaks = 0;
+        for (int crystal = 0; crystal < crystals_per_apd; crystal++) {
+            const int index = apd * crystals_per_apd + crystal;
+            for (int bin = 0; bin < spat_bins; bin++) {
+                apd_spectrum[bin] +=
+                        spat_spectra[(size_t) index * spat_bins + bin];
+            }
+            if (spat_peaks[index] > 0) {
+                peak_sum += spat_peaks[index];
+                no_peaks++;
+            }
+        }
+        if (no_peaks == 0) {
+            continue;
+        }
+        peaks[apd] = WindowedCentroid(
+                apd_spectrum.data(), spat_bins, spat_bin_width,
+                peak_sum / no_peaks, peak_window, min_peak_counts);
+        if (peaks[apd] > 0) {
+            no_estimates++;
+        }
+    }
+    return(no_estimates);
+}
+
+/*!
+ * \brief Write the APD photopeaks in the photopeak position file format
+ *
+ * Writes the spatial photopeak of each APD from apdSpatPeaks with
+ * SystemConfiguration::writePhotopeakPositions, so that it can be read by
+ * loadPhotopeakPositions.  The common photopeaks are not in EventCal, so they
+ * are copied from the configuration, as are the spatial photopeaks of APDs
+ * without an estimate.
+ *
+ * \param filename The name of the file to be written
+ * \param config The configuration holding the current photopeak positions,
+ *        with the same geometry as the one the spectra were created with
+ *
+ * \return 0 on success, or the error of
+ *         SystemConfiguration::writePhotopeakPositions
+ */
+int EnergySpectra::writePhotopeakPositions(
+        const std::string & filename,
+        SystemConfiguration const * const config)
+{
+    std::vector<float> peaks;
+    apdSpatPeaks(peaks);
+    std::vector<float> gain_spat(peaks.size(), 0);
+    std::vector<float> gain_comm(peaks.size(), 0);
+    if (!config->module_configs.empty()) {
+        for (int p = 0; p < config->panels_per_system; p++) {
+            for (int c = 0; c < config->cartridges_per_panel; c++) {
+                for (int f = 0; f < config->fins_per_cartridge; f++) {
+                    for (int m = 0; m < config->modules_per_fin; m++) {
+                        for (int a = 0; a < config->apds_per_module; a++) {
+                            const ApdConfig & apd_config =
+                                    config->module_configs[p][c][f][m]
+                                            .apd_configs[a];
+                            const int apd = config->indexPCFMA(p, c, f, m, a);
+                            gain_spat[apd] = apd_config.gain_spat;
+                            gain_comm[apd] = apd_config.gain_comm;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    for (size_t apd = 0; apd < peaks.size(); apd++) {
+        if (peaks[apd] > 0) {
+            gain_spat[apd] = peaks[apd];
+        }
+    }
+    return(config->writePhotopeakPositions(filename, gain_spat, gain_comm));
+}
+
+/*!
+ * \brief Scale every spectrum, so that older events fade out
+ */
+void EnergySpectra::decay(double factor) {
+    spat_histogram.decay(factor);
+    energy_histogram.decay(factor);
+}
+
+/*!
+ * \brief Clear every spectrum and peak estimate
+ */
+void EnergySpectra::reset() {
+    spat_histogram.reset();
+    energy_histogram.reset();
+    std::lock_guard<std::mutex> lck(lock_peaks);
+    std::fill(spat_peaks.begin(), spat_peaks.end(), -1);
+    std::fill(energy_peaks.begin(), energy_peaks.end(), -1);
+    spat_spectra.clear();
+    energy_spectra.clear();
+}
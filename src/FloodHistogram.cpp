@@ -0,0 +1,195 @@
+#include <miil/process/FloodHistogram.h>
+#include <miil/process/processing.h>
+#include <miil/SystemConfiguration.h>
+#include <cmath>
+
+using namespace std;
+
+/*!
+ * \brief Create empty floods for every APD of a system
+ *
+ * \param config The system configuration giving the number of APDs.  Must
+ *        outlive the floods.
+ * \param no_shards The number of threads that will add events
+ * \param bins_per_axis The number of bins along x and along y of each flood
+ * \param range The floods cover -range to range in both x and y
+ */
+FloodHistogram::FloodHistogram(
+        SystemConfiguration const * const config,
+        int no_shards,
+        int bins_per_axis,
+        float range) :
+    config(config),
+    bins_per_axis(bins_per_axis),
+    flood_range(range),
+    bin_scale(bins_per_axis / (2 * range)),
+    histogram((size_t) noApds() * bins_per_axis * bins_per_axis, no_shards)
+{
+}
+
+/*!
+ * \brief The index of an APD within the floods
+ *
+ * \return The index, or -1 if the APD is outside of the system
+ */
+int FloodHistogram::apdIndex(
+        int panel,
+        int cartridge,
+        int fin,
+        int module,
+        int apd) const
+{
+    return(config->indexPCFMA(panel, cartridge, fin, module, apd));
+}
+
+/*!
+ * \brief Add an event, using the position and APD it already holds
+ *
+ * Events outside of the system or the range of the floods are ignored.
+ *
+ * \param shard The shard of the calling thread
+ * \param event The event
+ */
+void FloodHistogram::add(int shard, const EventCal & event) {
+    const int apd_index = apdIndex(
+            event.panel, event.cartridge, event.fin, event.module, event.apd);
+    if (apd_index < 0) {
+        return;
+    }
+    const float x_bin = std::floor((event.x + flood_range) * bin_scale);
+    const float y_bin = std::floor((event.y + flood_range) * bin_scale);
+    // Also rejects a NaN position.
+    if (!((x_bin >= 0) && (x_bin < bins_per_axis) &&
+          (y_bin >= 0) && (y_bin < bins_per_axis)))
+    {
+        return;
+    }
+    histogram.increment(shard,
+            ((size_t) apd_index * bins_per_axis + (size_t) y_bin) *
+            bins_per_axis + (size_t) x_bin);
+}
+
+/*!
+ * \brief Add calibrated events
+ *
+ * \param shard The shard of the calling thread
+ * \param begin The first event to be added
+ * \param end One past the last event to be added
+ */
+void FloodHistogram::add(
+        int shard,
+        std::vector<EventCal>::const_iterator begin,
+        std::vector<EventCal>::const_iterator end)
+{
+    for (std::vector<EventCal>::const_iterator iter = begin;
+         iter != end;
+         ++iter)
+    {
+        add(shard, *iter);
+    }
+}
+
+/*!
+ * \brief Add decoded events, positioned with CalculateXYandEnergy
+ *
+ * Events rejected by CalculateXYandEnergy, for being below the hit threshold
+ * or double triggering, are not added.
+ *
+ * \param shard The shard of the calling thread
+ * \param begin The first event to be added
+ * \param end One past the last event to be added
+ * \param config The system configuration holding the pedestals and thresholds
+ */
+void FloodHistogram::add(
+        int shard,
+        std::vector<EventRaw>::const_iterator begin,
+        std::vector<EventRaw>::const_iterator end,
+        SystemConfiguration const * const config)
+{
+    EventCal event;
+    for (std::vector<EventRaw>::const_iterator iter = begin;
+         iter != end;
+         ++iter)
+    {
+        if (CalculateXYandEnergy(event, *iter, config) < 0) {
+            continue;
+        }
+        add(shard, event);
+    }
+}
+
+/*!
+ * \brief Add each batch of decoded events from a ProcessParams
+ */
+void FloodHistogram::addDecoded(
+        int shard,
+        std::vector<EventRaw>::const_iterator begin,
+        std::vector<EventRaw>::const_iterator end,
+        SystemConfiguration const * const config)
+{
+    add(shard, begin, end, config);
+}
+
+/*!
+ * \brief Read the flood of one APD
+ *
+ * \param flood Where the bins_per_axis squared bins of the flood are returned
+ *
+ * \return 0 on success, -1 if the APD is outside of the system
+ */
+int FloodHistogram::snapshot(
+        int panel,
+        int cartridge,
+        int fin,
+        int module,
+        int apd,
+        std::vector<double> & flood)
+{
+    const int apd_index = apdIndex(panel, cartridge, fin, module, apd);
+    if (apd_index < 0) {
+        return(-1);
+    }
+    const size_t flood_bins = (size_t) bins_per_axis * bins_per_axis;
+    return(histogram.snapshot(apd_index * flood_bins, flood_bins, flood));
+}
+
+/*!
+ * \brief Read the floods of every APD, in the order of apdIndex
+ *
+ * \return 0 on success
+ */
+int FloodHistogram::snapshot(std::vector<double> & floods) {
+    return(histogram.snapshot(floods));
+}
+
+/*!
+ * \brief Scale every flood, so that older events fade out
+ */
+void FloodHistogram::decay(double factor) {
+    histogram.decay(factor);
+}
+
+/*!
+ * \brief Clear every flood
+ */
+void FloodHistogram::reset() {
+    histogram.reset();
+}
+
+int FloodHistogram::noApds() const {
+    return(config->panels_per_system * config->cartridges_per_panel *
+           config->fins_per_cartridge * config->modules_per_fin *
+           config->apds_per_module);
+}
+
+int FloodHistogram::noShards() const {
+    return(histogram.shards());
+}
+
+int FloodHistogram::binsPerAxis() const {
+    return(bins_per_axis);
+}
+
+float FloodHistogram::range() const {
+    return(flood_range);
+}
@@ -0,0 +1,479 @@
+#include <miil/process/GainDriftCorrection.h>
+#include <miil/process/ConfigurationVersions.h>
+#include <miil/process/processing.h>
+#include <miil/SystemConfiguration.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+using namespace std;
+
+/*!
+ * \brief Create an empty correction for every module of a system
+ *
+ * \param config The system configuration giving the modules, the reference
+ *        calibration, and the fins whose thermistors are excluded.  Kept for
+ *        its geometry, so it must outlive the correction.
+ * \param no_shards The number of threads that will add events
+ * \param ratio_bins The number of bins of the gain histogram of each module
+ * \param ratio_max The gain histograms cover 0 to ratio_max times the
+ *        reference gain
+ * \param peak_window The fraction of the photopeak on either side of it that
+ *        the windowed centroid is taken over
+ */
+GainDriftCorrection::GainDriftCorrection(
+        SystemConfiguration const * const config,
+        int no_shards,
+        int ratio_bins,
+        float ratio_max,
+        float peak_window) :
+    min_peak_counts(1000),
+    forgetting(0.99),
+    min_temperature_spread(0.5),
+    config(config),
+    ratio_bins(ratio_bins),
+    ratio_bin_width(ratio_max / ratio_bins),
+    peak_window(peak_window),
+    ratio_histogram((size_t) noModules() * ratio_bins, no_shards),
+    reference_spat((size_t) noModules() * config->apds_per_module *
+                   config->crystals_per_apd, 0),
+    reference_comm(reference_spat.size(), 0),
+    excluded_fins(config->panels_per_system * config->cartridges_per_panel *
+                  config->fins_per_cartridge, 0),
+    measured_gains(noModules(), -1),
+    gains(noModules(), -1),
+    coefficients(noModules(), 0)
+{
+    size_t index = 0;
+    for (int p = 0; p < config->panels_per_system; p++) {
+        for (int c = 0; c < config->cartridges_per_panel; c++) {
+            for (int f = 0; f < config->fins_per_cartridge; f++) {
+                for (int m = 0; m < config->modules_per_fin; m++) {
+                    for (int a = 0; a < config->apds_per_module; a++) {
+                        for (int x = 0; x < config->crystals_per_apd; x++) {
+                            if (config->calibrationLoaded()) {
+                                const CrystalCalibration & crystal_cal =
+                                        config->calibration[p][c][f][m][a][x];
+                                if (crystal_cal.use) {
+                                    reference_spat[index] =
+                                            crystal_cal.gain_spat;
+                                    reference_comm[index] =
+                                            crystal_cal.gain_comm;
+                                }
+                            }
+                            index++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    index = 0;
+    for (int p = 0; p < config->panels_per_system; p++) {
+        for (int c = 0; c < config->cartridges_per_panel; c++) {
+            for (int f = 0; f < config->fins_per_cartridge; f++) {
+                if ((size_t) p < config->fin_configs.size()) {
+                    excluded_fins[index] = config->fin_configs[p][c][f]
+                            .exclude_thermistor_value;
+                }
+                index++;
+            }
+        }
+    }
+    FinTemperature no_temperature;
+    no_temperature.sum = 0;
+    no_temperature.readings = 0;
+    no_temperature.latest = std::numeric_limits<float>::quiet_NaN();
+    fin_temperatures.assign(excluded_fins.size(), no_temperature);
+    GainFit no_fit = {};
+    fits.assign(noModules(), no_fit);
+}
+
+int GainDriftCorrection::noModules() const {
+    return(config->panels_per_system * config->cartridges_per_panel *
+           config->fins_per_cartridge * config->modules_per_fin);
+}
+
+int GainDriftCorrection::noShards() const {
+    return(ratio_histogram.shards());
+}
+
+/*!
+ * \brief The index of a module within the correction
+ *
+ * \return The index, or -1 if the module is out of range
+ */
+int GainDriftCorrection::moduleIndex(
+        int panel,
+        int cartridge,
+        int fin,
+        int module) const
+{
+    return(config->indexPCFM(panel, cartridge, fin, module));
+}
+
+/*!
+ * \brief Add a calibrated event to the gain histogram of its module
+ *
+ * Must only be called by the thread that owns the shard.  Events of crystals
+ * without a reference gain are ignored.
+ */
+void GainDriftCorrection::add(int shard, const EventCal & event) {
+    const int crystal = config->indexPCFMAX(
+            event.panel, event.cartridge, event.fin, event.module,
+            event.apd, event.crystal);
+    if (crystal < 0) {
+        return;
+    }
+    const float reference = reference_spat[crystal];
+    if (reference <= 0) {
+        return;
+    }
+    const int index = crystal /
+            (config->apds_per_module * config->crystals_per_apd);
+    const float ratio_bin = std::floor(
+            event.spat_total / reference / ratio_bin_width);
+    if ((ratio_bin >= 0) && (ratio_bin < ratio_bins)) {
+        ratio_histogram.increment(
+                shard, (size_t) index * ratio_bins + (size_t) ratio_bin);
+    }
+}
+
+/*!
+ * \brief Add calibrated events to the gain histograms
+ *
+ * \param shard The shard of the calling thread
+ * \param begin The first event to be added
+ * \param end One past the last event to be added
+ */
+void GainDriftCorrection::add(
+        int shard,
+        std::vector<EventCal>::const_iterator begin,
+        std::vector<EventCal>::const_iterator end)
+{
+    for (std::vector<EventCal>::const_iterator iter = begin;
+         iter != end;
+         ++iter)
+    {
+        add(shard, *iter);
+    }
+}
+
+/*!
+ * \brief Add each batch of calibrated events from a ProcessParams
+ */
+void GainDriftCorrection::addCalibrated(
+        int shard,
+        std::vector<EventCal>::const_iterator begin,
+        std::vector<EventCal>::const_iterator end,
+        SystemConfiguration const * const)
+{
+    add(shard, begin, end);
+}
+
+/*!
+ * \brief Add a temperature reading of the thermistor of a fin
+ *
+ * \param panel The panel of the fin
+ * \param cartridge The cartridge of the fin
+ * \param fin The fin
+ * \param temperature The temperature in degrees C
+ *
+ * \return 0 on success, -1 if the fin is out of range, -2 if the temperature
+ *         is not a number
+ */
+int GainDriftCorrection::addTemperature(
+        int panel,
+        int cartridge,
+        int fin,
+        float temperature)
+{
+    const int index = moduleIndex(panel, cartridge, fin, 0);
+    if (index < 0) {
+        return(-1);
+    }
+    if (std::isnan(temperature)) {
+        return(-2);
+    }
+    std::lock_guard<std::mutex> lck(lock_gains);
+    FinTemperature & fin_temperature = fin_temperatures[
+            index / config->modules_per_fin];
+    fin_temperature.sum += temperature;
+    fin_temperature.readings++;
+    return(0);
+}
+
+/*!
+ * \brief The temperature of the modules of a fin at the last update
+ *
+ * lock_gains must be held.
+ *
+ * \return The temperature, or NaN if there is no reading for the fin, or any
+ *         other fin of its cartridge
+ */
+float GainDriftCorrection::moduleTemperature(
+        int panel,
+        int cartridge,
+        int fin) const
+{
+    const int fins_per_cartridge = config->fins_per_cartridge;
+    const int first_fin = (panel * config->cartridges_per_panel + cartridge) *
+            fins_per_cartridge;
+    const FinTemperature & fin_temperature = fin_temperatures[first_fin + fin];
+    if (!excluded_fins[first_fin + fin] &&
+        !std::isnan(fin_temperature.latest))
+    {
+        return(fin_temperature.latest);
+    }
+    double sum = 0;
+    int no_fins = 0;
+    for (int other = first_fin; other < first_fin + fins_per_cartridge;
+         other++)
+    {
+        if (!excluded_fins[other] &&
+            !std::isnan(fin_temperatures[other].latest))
+        {
+            sum += fin_temperatures[other].latest;
+            no_fins++;
+        }
+    }
+    if (no_fins == 0) {
+        return(std::numeric_limits<float>::quiet_NaN());
+    }
+    return(sum / no_fins);
+}
+
+/*!
+ * \brief Measure the gains since the last update and refit them
+ *
+ * Called periodically, such as every few minutes, often enough for the
+ * temperature to change little between updates, but with enough events for
+ * the photopeak of each module to be measured.  Modules with too few events
+ * since the last update are not measured, but are still predicted from their
+ * latest temperature.
+ *
+ * \return The number of modules with a gain estimate
+ */
+int GainDriftCorrection::update() {
+    std::lock_guard<std::mutex> lck(lock_gains);
+    for (size_t ii = 0; ii < fin_temperatures.size(); ii++) {
+        FinTemperature & fin_temperature = fin_temperatures[ii];
+        if (fin_temperature.readings > 0) {
+            fin_temperature.latest = fin_temperature.sum /
+                    fin_temperature.readings;
+            fin_temperature.sum = 0;
+            fin_temperature.readings = 0;
+        }
+    }
+
+    // Only keep the counts since the last update in spectra.
+    ratio_histogram.snapshot(spectra);
+    last_spectra.resize(spectra.size(), 0);
+    for (size_t bin = 0; bin < spectra.size(); bin++) {
+        const double total = spectra[bin];
+        spectra[bin] -= last_spectra[bin];
+        last_spectra[bin] = total;
+    }
+
+    const double min_variance = min_temperature_spread *
+            min_temperature_spread;
+    int no_estimates = 0;
+    int index = 0;
+    for (int p = 0; p < config->panels_per_system; p++) {
+        for (int c = 0; c < config->cartridges_per_panel; c++) {
+            for (int f = 0; f < config->fins_per_cartridge; f++) {
+                const float temperature = moduleTemperature(p, c, f);
+                for (int m = 0; m < config->modules_per_fin; m++, index++) {
+                    const float start = (measured_gains[index] > 0) ?
+                            measured_gains[index] : 1;
+                    const float peak = WindowedCentroid(
+                            &spectra[(size_t) index * ratio_bins],
+                            ratio_bins, ratio_bin_width, start,
+                            peak_window, min_peak_counts);
+                    GainFit & fit = fits[index];
+                    if (peak > 0) {
+                        measured_gains[index] = peak;
+                        if (!std::isnan(temperature)) {
+                            fit.weight *= forgetting;
+                            fit.temperature *= forgetting;
+                            fit.temperature_sq *= forgetting;
+                            fit.gain *= forgetting;
+                            fit.temperature_gain *= forgetting;
+                            fit.weight += 1;
+                            fit.temperature += temperature;
+                            fit.temperature_sq += temperature * temperature;
+                            fit.gain += peak;
+                            fit.temperature_gain += temperature * peak;
+                        }
+                    }
+
+                    float estimate = measured_gains[index];
+                    float coefficient = 0;
+                    if ((fit.weight > 0) && !std::isnan(temperature)) {
+                        const double mean_temperature =
+                                fit.temperature / fit.weight;
+                        const double mean_gain = fit.gain / fit.weight;
+                        const double variance =
+                                fit.temperature_sq / fit.weight -
+                                mean_temperature * mean_temperature;
+                        const double covariance =
+                                fit.temperature_gain / fit.weight -
+                                mean_temperature * mean_gain;
+                        if ((variance >= min_variance) && (variance > 0)) {
+                            const double slope = covariance / variance;
+                            estimate = mean_gain + slope *
+                                    (temperature - mean_temperature);
+                            coefficient = slope / mean_gain;
+                        }
+                    }
+                    if (estimate > 0) {
+                        gains[index] = estimate;
+                        coefficients[index] = coefficient;
+                    }
+                    if (gains[index] > 0) {
+                        no_estimates++;
+                    }
+                }
+            }
+        }
+    }
+    return(no_estimates);
+}
+
+/*!
+ * \brief The gain of a module, relative to the reference, from the last
+ *        update
+ *
+ * \return The gain, or -1 if there is no estimate
+ */
+float GainDriftCorrection::gain(int module_index) {
+    std::lock_guard<std::mutex> lck(lock_gains);
+    if ((module_index < 0) || (module_index >= noModules())) {
+        return(-1);
+    }
+    return(gains[module_index]);
+}
+
+/*!
+ * \brief The fractional change in gain per degree C of a module, from the
+ *        last update
+ *
+ * \return The coefficient, or 0 if it has not been fit
+ */
+float GainDriftCorrection::coefficient(int module_index) {
+    std::lock_guard<std::mutex> lck(lock_gains);
+    if ((module_index < 0) || (module_index >= noModules())) {
+        return(0);
+    }
+    return(coefficients[module_index]);
+}
+
+/*!
+ * \brief Apply the gains from the last update to a calibration
+ *
+ * The gain_spat and gain_comm of every crystal, of each module with a gain
+ * estimate, are set to those of the reference calibration times the gain of
+ * the module.  The other crystals, and the rest of the calibration, are not
+ * changed.
+ *
+ * \param crystal_calibration The calibration to correct, with the geometry of
+ *        the configuration the correction was created with
+ *
+ * \return The number of modules corrected, or -1 if the calibration does not
+ *         have the geometry of the configuration
+ */
+int GainDriftCorrection::apply(
+        std::vector<std::vector<std::vector<
+                std::vector<std::vector<std::vector<
+                CrystalCalibration> > > > > > & crystal_calibration)
+{
+    if ((int) crystal_calibration.size() != config->panels_per_system) {
+        return(-1);
+    }
+    std::lock_guard<std::mutex> lck(lock_gains);
+    int no_corrected = 0;
+    int index = 0;
+    size_t crystal_index = 0;
+    for (int p = 0; p < config->panels_per_system; p++) {
+        for (int c = 0; c < config->cartridges_per_panel; c++) {
+            for (int f = 0; f < config->fins_per_cartridge; f++) {
+                for (int m = 0; m < config->modules_per_fin; m++, index++) {
+                    const float module_gain = gains[index];
+                    if (module_gain > 0) {
+                        no_corrected++;
+                    }
+                    for (int a = 0; a < config->apds_per_module; a++) {
+                        for (int x = 0; x < config->crystals_per_apd;
+                             x++, crystal_index++)
+                        {
+                            if ((module_gain <= 0) ||
+                                (reference_spat[crystal_index] <= 0))
+                            {
+                                continue;
+                            }
+                            CrystalCalibration & crystal_cal =
+                                    crystal_calibration[p][c][f][m][a][x];
+                            crystal_cal.gain_spat = module_gain *
+                                    reference_spat[crystal_index];
+                            crystal_cal.gain_comm = module_gain *
+                                    reference_comm[crystal_index];
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return(no_corrected);
+}
+
+/*!
+ * \brief Publish a configuration with the gains from the last update
+ *
+ * Takes a copy of the current configuration, applies the gains to its
+ * calibration, recreates its fixed point tables if it has them, so that
+ * RawEventToEventCalFixed is also corrected, and publishes it.
+ *
+ * \param versions The configurations used by the processing threads
+ *
+ * \return The version published, or less than zero
+ *       - -1 if the configuration does not have the geometry of the one the
+ *         correction was created with
+ *       - -2 if publishing the configuration failed
+ */
+int GainDriftCorrection::publish(ConfigurationVersions & versions) {
+    std::shared_ptr<SystemConfiguration> config = versions.copyCurrent();
+    if (apply(config->calibration) < 0) {
+        return(-1);
+    }
+    if (!config->energy_scale_fixed.empty()) {
+        config->createFixedPointTables();
+    }
+    const int version = versions.publish(config);
+    if (version < 0) {
+        return(-2);
+    }
+    return(version);
+}
+
+/*!
+ * \brief Clear the gain histograms, temperatures, fits, and estimates
+ */
+void GainDriftCorrection::reset() {
+    // The histograms are reset under the lock so an update can not take the
+    // difference of the cleared histograms from the old ones.
+    std::lock_guard<std::mutex> lck(lock_gains);
+    ratio_histogram.reset();
+    last_spectra.clear();
+    spectra.clear();
+    for (size_t ii = 0; ii < fin_temperatures.size(); ii++) {
+        fin_temperatures[ii].sum = 0;
+        fin_temperatures[ii].readings = 0;
+        fin_temperatures[ii].latest = std::numeric_limits<float>::quiet_NaN();
+    }
+    GainFit no_fit = {};
+    std::fill(fits.begin(), fits.end(), no_fit);
+    std::fill(measured_gains.begin(), measured_gains.end(), -1);
+    std::fill(gains.begin(), gains.end(), -1);
+    std::fill(coefficients.begin(), coefficients.end(), 0);
+}
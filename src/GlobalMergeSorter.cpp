@@ -0,0 +1,304 @@
+#include <miil/process/GlobalMergeSorter.h>
+#include <miil/process/ProcessControl.h>
+#include <miil/process/CoincidenceSorter.h>
+#include <miil/process/processing.h>
+#include <miil/SystemConfiguration.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+
+using namespace std;
+
+namespace {
+/*!
+ * Orders the input indices in the heap so that the input with the earliest
+ * first event is at the top.  Ties go to the lower input index so the output
+ * does not depend on the order the heap was built in.
+ */
+struct InputHeadLater {
+    const std::vector<std::deque<KeyedEventCal> > & queues;
+    InputHeadLater(const std::vector<std::deque<KeyedEventCal> > & queues) :
+        queues(queues)
+    {}
+    bool operator()(int input1, int input2) const {
+        int64_t key1 = queues[input1].front().key;
+        int64_t key2 = queues[input2].front().key;
+        if (key1 != key2) {
+            return(key1 > key2);
+        }
+        return(input1 > input2);
+    }
+};
+}
+
+/*!
+ * \brief Create a merge sorter with no inputs
+ *
+ * \param config The system configuration used for the timestamp periods
+ * \param control_ptr The process control shared with the ProcessParams
+ * \param max_delay The number of coarse timestamp ticks an input's watermark
+ *        can be behind the latest event before it is no longer waited on
+ * \param merged_storage_size The capacity of merged_storage
+ */
+GlobalMergeSorter::GlobalMergeSorter(
+        SystemConfiguration const * const config,
+        ProcessControl * const control_ptr,
+        long max_delay,
+        size_t merged_storage_size) :
+    merged_storage(merged_storage_size),
+    system_config(config),
+    control(control_ptr),
+    max_delay_ps(std::llround(max_delay * config->ct_period_ns * 1000.0)),
+    no_events(0),
+    max_key(LLONG_MIN),
+    last_written_key(LLONG_MIN),
+    coinc_sorter(0),
+    merged_events(0),
+    late_events(0)
+{
+}
+
+/*!
+ * \brief Add an input for the sorted events of one ProcessParams
+ *
+ * Should not be called while the merge thread is running.
+ *
+ * \return The index of the input to be given to push()
+ */
+int GlobalMergeSorter::addInput() {
+    std::lock_guard<std::mutex> lck(lock);
+    pending_events.emplace_back();
+    pending_watermarks.push_back(LLONG_MIN);
+    queues.emplace_back();
+    watermarks.push_back(LLONG_MIN);
+    return(queues.size() - 1);
+}
+
+/*!
+ * \brief Hand sorted events from an input to the merge thread
+ *
+ * Called from the processing thread of the input's ProcessParams.
+ *
+ * \param input The index of the input from addInput()
+ * \param begin The first event to be merged
+ * \param end One past the last event to be merged
+ * \param watermark The key that the input has written out every event up to,
+ *        such as RenaMergeSorter::watermark().  Use LLONG_MIN if the input is
+ *        not sorted, in which case its events are released by the delay bound.
+ *
+ * \return 0 on success, -1 if the input does not exist
+ */
+int GlobalMergeSorter::push(
+        int input,
+        std::vector<EventCal>::const_iterator begin,
+        std::vector<EventCal>::const_iterator end,
+        int64_t watermark)
+{
+    std::lock_guard<std::mutex> lck(lock);
+    if ((input < 0) || (input >= (int) pending_events.size())) {
+        return(-1);
+    }
+    pending_events[input].insert(pending_events[input].end(), begin, end);
+    pending_watermarks[input] = std::max(pending_watermarks[input], watermark);
+    cv_data_pushed.notify_all();
+    return(0);
+}
+
+/*!
+ * \brief Move the events handed over by push() into the queue of each input
+ */
+void GlobalMergeSorter::pullInputs() {
+    for (size_t input = 0; input < queues.size(); input++) {
+        {
+            std::lock_guard<std::mutex> lck(lock);
+            pulled_events.swap(pending_events[input]);
+            watermarks[input] = pending_watermarks[input];
+        }
+        std::deque<KeyedEventCal> & queue = queues[input];
+        for (size_t ii = 0; ii < pulled_events.size(); ii++) {
+            KeyedEventCal keyed_event;
+            keyed_event.key = EventCalTimeKey(
+                    pulled_events[ii],
+                    system_config->uv_period_ns,
+                    system_config->ct_period_ns);
+            keyed_event.event = pulled_events[ii];
+            if (keyed_event.key < last_written_key) {
+                late_events++;
+            }
+            // Each input is sorted, apart from late events, so search for the
+            // position from the back of the queue.
+            std::deque<KeyedEventCal>::iterator position = queue.end();
+            while ((position != queue.begin()) &&
+                   (keyed_event.key < (position - 1)->key))
+            {
+                --position;
+            }
+            queue.insert(position, keyed_event);
+            no_events++;
+            if (keyed_event.key > max_key) {
+                max_key = keyed_event.key;
+            }
+        }
+        pulled_events.clear();
+    }
+}
+
+/*!
+ * \brief The key that the merged output is complete up to
+ *
+ * The lowest watermark of the inputs, where no watermark is taken to be more
+ * than the delay bound behind the latest event.
+ */
+int64_t GlobalMergeSorter::cutoffKey() const {
+    if (max_key == LLONG_MIN) {
+        return(LLONG_MIN);
+    }
+    const int64_t floor_key = max_key - max_delay_ps;
+    int64_t cutoff = LLONG_MAX;
+    for (size_t ii = 0; ii < watermarks.size(); ii++) {
+        cutoff = std::min(cutoff, std::max(watermarks[ii], floor_key));
+    }
+    return(cutoff);
+}
+
+int GlobalMergeSorter::merge(bool all, int64_t cutoff_key) {
+    InputHeadLater later(queues);
+    heap.clear();
+    for (size_t ii = 0; ii < queues.size(); ii++) {
+        if (!queues[ii].empty()) {
+            heap.push_back(ii);
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), later);
+    while (!heap.empty()) {
+        int input = heap.front();
+        const KeyedEventCal & keyed_event = queues[input].front();
+        if (!all && (keyed_event.key > cutoff_key)) {
+            break;
+        }
+        std::pop_heap(heap.begin(), heap.end(), later);
+        merged_data.push_back(keyed_event.event);
+        if (keyed_event.key > last_written_key) {
+            last_written_key = keyed_event.key;
+        }
+        queues[input].pop_front();
+        no_events--;
+        if (queues[input].empty()) {
+            heap.pop_back();
+        } else {
+            std::push_heap(heap.begin(), heap.end(), later);
+        }
+    }
+    return(0);
+}
+
+// The functions that should be run during the loop of MergeData as well as at
+// the loop's completion.
+int GlobalMergeSorter::HandleData(bool write_out_remaining) {
+    {
+        // Wait for new data, but don't let the wait hold up the end of the
+        // loop for longer than the ProcessParams would wait.
+        std::unique_lock<std::mutex> lck(lock);
+        cv_data_pushed.wait_for(lck, std::chrono::milliseconds(500), [&] {
+            for (size_t ii = 0; ii < pending_events.size(); ii++) {
+                if (!pending_events[ii].empty()) {
+                    return(true);
+                }
+            }
+            return(write_out_remaining || !control->merge_data_flag);
+        });
+    }
+    pullInputs();
+    merge(write_out_remaining, cutoffKey());
+
+    merged_storage.try_insert(merged_data.begin(), merged_data.end());
+    if (merged_output_file.is_open()) {
+        merged_output_file.write(
+                (char*) merged_data.data(),
+                sizeof(EventCal) * merged_data.size());
+    }
+    if (coinc_sorter) {
+        coinc_sorter->HandleData(
+                merged_data.begin(),
+                merged_data.end(),
+                write_out_remaining);
+    }
+    merged_events += merged_data.size();
+    merged_data.clear();
+    return(0);
+}
+
+/*!
+ * \brief The loop run by the merge thread
+ *
+ * Runs until the merge flag of the process control is cleared by
+ * ProcessThreads, which happens after every processing thread has finished.
+ * At the end of an acquisition, every event still held is written out.
+ *
+ * \return 0 on success
+ */
+int GlobalMergeSorter::MergeData() {
+    while (control->merge_data_flag) {
+        HandleData(false);
+    }
+    if (control->end_of_acquisiton_flag) {
+        HandleData(true);
+    }
+    return(0);
+}
+
+/*!
+ * \brief Write the merged events to a file
+ *
+ * Should not be called while the merge thread is running.
+ *
+ * \param filename The file the merged events are written to
+ *
+ * \return 0 on success, -1 if the file could not be opened
+ */
+int GlobalMergeSorter::setMergedFilename(const std::string & filename) {
+    if (merged_output_file.is_open()) {
+        merged_output_file.close();
+    }
+    merged_output_file.open(filename.c_str(), std::ios::binary);
+    if (!merged_output_file.good()) {
+        return(-1);
+    }
+    return(0);
+}
+
+/*!
+ * \brief Find coincidences in the merged events as they are written out
+ *
+ * The coincidence sorter is run on the merge thread.  Should not be called
+ * while the merge thread is running.
+ *
+ * \param sorter The coincidence sorter, or null to stop finding coincidences
+ */
+void GlobalMergeSorter::setCoincidenceSorter(CoincidenceSorter * sorter) {
+    coinc_sorter = sorter;
+}
+
+/*!
+ * \brief The number of events written out by the merge
+ */
+long GlobalMergeSorter::mergedEvents() const {
+    return(merged_events);
+}
+
+/*!
+ * \brief The number of events that arrived after a later event was written out
+ */
+long GlobalMergeSorter::lateEvents() const {
+    return(late_events);
+}
+
+/*!
+ * \brief The number of events held waiting to be merged
+ *
+ * Only valid while the merge thread is not running.
+ */
+size_t GlobalMergeSorter::size() const {
+    return(no_events);
+}
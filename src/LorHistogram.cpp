@@ -0,0 +1,217 @@
+#include <miil/process/LorHistogram.h>
+#include <miil/SystemConfiguration.h>
+#include <algorithm>
+#include <fstream>
+
+using namespace std;
+
+/*!
+ * \brief Create an empty histogram for the geometry of a system
+ *
+ * Crystals are only rejected as uncalibrated if the calibration has been
+ * loaded into the configuration.
+ *
+ * \param config The system configuration the crystal table is built from.
+ *        Must outlive the histogram.
+ * \param no_shards The number of shards, typically one per thread adding
+ *        coincidences
+ * \param shard_buffer_size The smallest number of coincidences a shard holds
+ *        before collapsing them into its counts
+ */
+LorHistogram::LorHistogram(
+        SystemConfiguration const * const config,
+        int no_shards,
+        size_t shard_buffer_size) :
+    indexer(config),
+    shards(std::max(no_shards, 1)),
+    total_invalid(0)
+{
+    for (size_t ii = 0; ii < shards.size(); ii++) {
+        shards[ii].counts = LorCounter(shard_buffer_size);
+        shards[ii].invalid = 0;
+    }
+}
+
+/*!
+ * \brief The number of a crystal within its panel
+ *
+ * See LorIndexer::crystalIndex.
+ */
+int64_t LorHistogram::crystalIndex(
+        int panel,
+        int cartridge,
+        int fin,
+        int module,
+        int apd,
+        int crystal) const
+{
+    return(indexer.crystalIndex(panel, cartridge, fin, module, apd, crystal));
+}
+
+/*!
+ * \brief The line of response of a coincidence
+ *
+ * See LorIndexer::lorIndex.
+ */
+int64_t LorHistogram::lorIndex(const EventCoinc & coinc) const {
+    return(indexer.lorIndex(coinc));
+}
+
+/*!
+ * \brief The number of lines of response that lorIndex can return
+ */
+int64_t LorHistogram::noLors() const {
+    return(indexer.noLors());
+}
+
+void LorHistogram::addLocked(Shard & shard, const EventCoinc & coinc) {
+    const int64_t lor = lorIndex(coinc);
+    if (lor < 0) {
+        shard.invalid++;
+        return;
+    }
+    shard.counts.add(lor);
+}
+
+/*!
+ * \brief Add a coincidence to a shard of the histogram
+ *
+ * \param shard The shard used by the calling thread
+ * \param coinc The coincidence
+ *
+ * \return 0 on success, -1 if the shard does not exist
+ */
+int LorHistogram::add(int shard, const EventCoinc & coinc) {
+    if ((shard < 0) || (shard >= (int) shards.size())) {
+        return(-1);
+    }
+    std::lock_guard<std::mutex> lck(shards[shard].lock);
+    addLocked(shards[shard], coinc);
+    return(0);
+}
+
+/*!
+ * \brief Add coincidences to a shard of the histogram
+ *
+ * \param shard The shard used by the calling thread
+ * \param begin The first coincidence to be added
+ * \param end One past the last coincidence to be added
+ *
+ * \return 0 on success, -1 if the shard does not exist
+ */
+int LorHistogram::add(
+        int shard,
+        std::vector<EventCoinc>::const_iterator begin,
+        std::vector<EventCoinc>::const_iterator end)
+{
+    if ((shard < 0) || (shard >= (int) shards.size())) {
+        return(-1);
+    }
+    std::lock_guard<std::mutex> lck(shards[shard].lock);
+    for (std::vector<EventCoinc>::const_iterator iter = begin;
+         iter != end;
+         ++iter)
+    {
+        addLocked(shards[shard], *iter);
+    }
+    return(0);
+}
+
+/*!
+ * \brief Collect the counts of every shard into the totals
+ *
+ * Each shard is only locked long enough to take its counts, so this can be
+ * called periodically by another thread while coincidences are being added.
+ */
+void LorHistogram::merge() {
+    LorCounter counts;
+    std::vector<LorCount> merged;
+    for (size_t ii = 0; ii < shards.size(); ii++) {
+        long invalid;
+        {
+            std::lock_guard<std::mutex> lck(shards[ii].lock);
+            counts.swap(shards[ii].counts);
+            invalid = shards[ii].invalid;
+            shards[ii].invalid = 0;
+        }
+        const std::vector<LorCount> & shard_counts = counts.sums();
+        {
+            std::lock_guard<std::mutex> lck(lock_totals);
+            LorCounter::merge(total_counts, shard_counts, merged);
+            total_counts.swap(merged);
+            total_invalid += invalid;
+        }
+        counts.clear();
+    }
+}
+
+/*!
+ * \brief The counts collected by merge(), sorted by line of response
+ *
+ * Lines of response without any coincidences are left out.
+ */
+std::vector<LorCount> LorHistogram::totals() {
+    std::lock_guard<std::mutex> lck(lock_totals);
+    return(total_counts);
+}
+
+/*!
+ * \brief The number of coincidences collected by merge()
+ */
+long LorHistogram::totalCounts() {
+    std::lock_guard<std::mutex> lck(lock_totals);
+    long total = 0;
+    for (size_t ii = 0; ii < total_counts.size(); ii++) {
+        total += total_counts[ii].count;
+    }
+    return(total);
+}
+
+/*!
+ * \brief The number of coincidences collected by merge() that were rejected
+ *        by lorIndex
+ */
+long LorHistogram::invalidEvents() {
+    std::lock_guard<std::mutex> lck(lock_totals);
+    return(total_invalid);
+}
+
+/*!
+ * \brief Merge the shards and write the totals to a file
+ *
+ * The file holds a LorCount for each line of response with coincidences, in
+ * order of the line of response.
+ *
+ * \param filename The file the histogram is written to
+ *
+ * \return 0 on success, -1 if the file could not be opened, -2 if writing
+ *         the file failed
+ */
+int LorHistogram::write(const std::string & filename) {
+    merge();
+    std::ofstream output(filename.c_str(), std::ios::binary);
+    if (!output.good()) {
+        return(-1);
+    }
+    std::lock_guard<std::mutex> lck(lock_totals);
+    output.write((char*) total_counts.data(),
+                 sizeof(LorCount) * total_counts.size());
+    if (!output.good()) {
+        return(-2);
+    }
+    return(0);
+}
+
+/*!
+ * \brief Clear the counts of every shard and the totals
+ */
+void LorHistogram::reset() {
+    for (size_t ii = 0; ii < shards.size(); ii++) {
+        std::lock_guard<std::mutex> lck(shards[ii].lock);
+        shards[ii].counts.clear();
+        shards[ii].invalid = 0;
+    }
+    std::lock_guard<std::mutex> lck(lock_totals);
+    total_counts.clear();
+    total_invalid = 0;
+}
@@ -0,0 +1,99 @@
+#include <miil/process/LorIndexer.h>
+#include <miil/SystemConfiguration.h>
+
+using namespace std;
+
+/*!
+ * \brief Build the crystal table for the geometry of a system
+ *
+ * \param config The system configuration the crystal table is built from.
+ *        Must outlive the indexer.
+ */
+LorIndexer::LorIndexer(SystemConfiguration const * const config) :
+    config(config)
+{
+    crystals_per_panel = (int64_t) config->cartridges_per_panel *
+            config->fins_per_cartridge * config->modules_per_fin *
+            config->apds_per_module * config->crystals_per_apd;
+    crystal_table.resize(config->panels_per_system * crystals_per_panel);
+    size_t entry = 0;
+    for (int p = 0; p < config->panels_per_system; p++) {
+        int32_t crystal_number = 0;
+        for (int c = 0; c < config->cartridges_per_panel; c++) {
+            for (int f = 0; f < config->fins_per_cartridge; f++) {
+                for (int m = 0; m < config->modules_per_fin; m++) {
+                    for (int a = 0; a < config->apds_per_module; a++) {
+                        for (int x = 0; x < config->crystals_per_apd; x++) {
+                            bool use = true;
+                            if (config->calibrationLoaded()) {
+                                use = config->calibration[p][c][f][m][a][x].use;
+                            }
+                            crystal_table[entry++] =
+                                    use ? crystal_number : -1;
+                            crystal_number++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*!
+ * \brief The number of a crystal within its panel
+ *
+ * \return The crystal number, or -1 if the crystal is out of range or not
+ *         used by the calibration
+ */
+int64_t LorIndexer::crystalIndex(
+        int panel,
+        int cartridge,
+        int fin,
+        int module,
+        int apd,
+        int crystal) const
+{
+    const int entry = config->indexPCFMAX(
+            panel, cartridge, fin, module, apd, crystal);
+    if (entry < 0) {
+        return(-1);
+    }
+    return(crystal_table[entry]);
+}
+
+/*!
+ * \brief The line of response of a coincidence
+ *
+ * The left event of the coincidence is taken to be in panel 0, and the right
+ * event in panel 1, as they are from CoincidenceSorter.
+ *
+ * \return The crystal number of the left event times the crystals in a panel
+ *         plus the crystal number of the right event, or -1 if either crystal
+ *         is out of range or not used by the calibration
+ */
+int64_t LorIndexer::lorIndex(const EventCoinc & coinc) const {
+    const int64_t crystal0 = crystalIndex(
+            0, coinc.cartridge0, coinc.fin0,
+            coinc.module0, coinc.apd0, coinc.crystal0);
+    const int64_t crystal1 = crystalIndex(
+            1, coinc.cartridge1, coinc.fin1,
+            coinc.module1, coinc.apd1, coinc.crystal1);
+    if ((crystal0 < 0) || (crystal1 < 0)) {
+        return(-1);
+    }
+    return(crystal0 * crystals_per_panel + crystal1);
+}
+
+/*!
+ * \brief The number of crystals in each panel
+ */
+int64_t LorIndexer::noCrystals() const {
+    return(crystals_per_panel);
+}
+
+/*!
+ * \brief The number of lines of response that lorIndex can return
+ */
+int64_t LorIndexer::noLors() const {
+    return(crystals_per_panel * crystals_per_panel);
+}
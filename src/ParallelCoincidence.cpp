@@ -0,0 +1,702 @@
+#include <miil/process/ParallelCoincidence.h>
+#include <miil/process/processing.h>
+#include <miil/SystemConfiguration.h>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+/*!
+ * \brief The settings shared by the CoincidenceSorter of every slice
+ */
+struct SliceSettings {
+    const EventCal * singles;
+    size_t count;
+    SystemConfiguration const * config;
+    float time_window_ns;
+    float energy_low;
+    float energy_high;
+    MultiplesPolicy multiples_policy;
+    std::vector<long> delays;
+    //! The time window in picoseconds, the unit of the keys
+    int64_t time_window_ps;
+    int64_t uv_period_ps;
+
+    int64_t key(size_t index) const {
+        return(EventCalTimeKey(
+                singles[index],
+                config->uv_period_ns,
+                config->ct_period_ns));
+    }
+
+    bool accepted(size_t index) const {
+        const EventCal & single = singles[index];
+        return(InEnergyWindow(single, energy_low, energy_high) &&
+               ((single.panel == 0) || (single.panel == 1)));
+    }
+
+    //! The index of the first single with a key at or after key
+    size_t lowerBound(int64_t key_value) const {
+        size_t low = 0;
+        size_t high = count;
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (key(mid) < key_value) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return(low);
+    }
+
+    //! The index of the first single with a key after key
+    size_t upperBound(int64_t key_value) const {
+        if (key_value == LLONG_MAX) {
+            return(count);
+        }
+        return(lowerBound(key_value + 1));
+    }
+};
+
+/*!
+ * \brief The output of the CoincidenceSorter of one slice
+ */
+struct SliceResult {
+    SliceResult() : done(false) {}
+    std::vector<EventCoinc> coinc;
+    std::vector<EventCoinc> delayed;
+    CoincidenceInfo info;
+    bool done;
+};
+
+/*!
+ * \brief Find the keys that the slices start at
+ *
+ * Each slice starts at the first single, from about slice_size singles after
+ * the start of the previous slice, that passes the energy window and is more
+ * than the time window after the previous single that passed.  The first
+ * slice starts at LLONG_MIN and the last slice ends at LLONG_MAX.
+ */
+std::vector<int64_t> SliceBoundaries(
+        const SliceSettings & settings,
+        size_t slice_size)
+{
+    std::vector<int64_t> boundaries(1, LLONG_MIN);
+    size_t start = slice_size;
+    while (start < settings.count) {
+        size_t previous = start;
+        while ((previous > 0) && !settings.accepted(previous - 1)) {
+            previous--;
+        }
+        if (previous == 0) {
+            start += slice_size;
+            continue;
+        }
+        int64_t previous_key = settings.key(previous - 1);
+        size_t ii = start;
+        for (; ii < settings.count; ii++) {
+            if (!settings.accepted(ii)) {
+                continue;
+            }
+            const int64_t key = settings.key(ii);
+            if (key - previous_key > settings.time_window_ps) {
+                break;
+            }
+            previous_key = key;
+        }
+        if (ii == settings.count) {
+            break;
+        }
+        boundaries.push_back(settings.key(ii));
+        start = ii + slice_size;
+    }
+    boundaries.push_back(LLONG_MAX);
+    return(boundaries);
+}
+
+/*!
+ * \brief Check if the delayed stream of a CoincidenceSorter started at a
+ *        single starts a new window at or before a key
+ *
+ * Follows the order that CoincidenceSorter feeds the panel 0 singles and the
+ * delayed panel 1 singles to a delayed window in.  The stream is only
+ * complete from the delay past the first single, so only a single after that
+ * which is more than the time window after everything before it counts.
+ *
+ * \param settings The settings of the sorters
+ * \param begin The index of the first single given to the sorter
+ * \param delay_ticks The delay of the delayed window
+ * \param first_key The key that the slice starts at
+ */
+bool DelayedStreamRestarts(
+        const SliceSettings & settings,
+        size_t begin,
+        long delay_ticks,
+        int64_t first_key)
+{
+    const int64_t delay_ps = std::llround(
+            delay_ticks * settings.config->ct_period_ns * 1000.0);
+    // The delayed keys are within a uv period of the key plus the delay.
+    int64_t max_key = settings.key(begin) + delay_ps +
+                      2 * settings.uv_period_ps;
+    auto restarts = [&](int64_t key) -> bool {
+        if (key - max_key > settings.time_window_ps) {
+            return(true);
+        }
+        max_key = std::max(max_key, key);
+        return(false);
+    };
+    std::deque<int64_t> delayed_keys;
+    for (size_t ii = begin; ii < settings.count; ii++) {
+        if (!settings.accepted(ii)) {
+            continue;
+        }
+        const int64_t key = settings.key(ii);
+        if (key > first_key) {
+            break;
+        }
+        while (!delayed_keys.empty() && (delayed_keys.front() <= key)) {
+            if (restarts(delayed_keys.front())) {
+                return(true);
+            }
+            delayed_keys.pop_front();
+        }
+        if (settings.singles[ii].panel == 0) {
+            if (restarts(key)) {
+                return(true);
+            }
+        } else {
+            EventCal single = settings.singles[ii];
+            single.ct += delay_ticks;
+            delayed_keys.push_back(EventCalTimeKey(
+                    single,
+                    settings.config->uv_period_ns,
+                    settings.config->ct_period_ns));
+        }
+    }
+    while (!delayed_keys.empty() && (delayed_keys.front() <= first_key)) {
+        if (restarts(delayed_keys.front())) {
+            return(true);
+        }
+        delayed_keys.pop_front();
+    }
+    return(false);
+}
+
+/*!
+ * \brief The index of the first single the sorter of a slice needs
+ *
+ * Without delayed windows, the slice can start at its first key.  Otherwise,
+ * the start is moved back, doubling the distance each time, until the
+ * delayed stream of every delayed window starts a new window before the
+ * slice starts.
+ */
+size_t SliceBegin(const SliceSettings & settings, int64_t first_key) {
+    const size_t slice_begin = settings.lowerBound(first_key);
+    if (settings.delays.empty() || (first_key == LLONG_MIN)) {
+        return(slice_begin);
+    }
+    size_t begin = slice_begin;
+    for (size_t ii = 0; ii < settings.delays.size(); ii++) {
+        const int64_t delay_ps = std::llround(
+                settings.delays[ii] * settings.config->ct_period_ns * 1000.0);
+        int64_t margin = 4 * settings.time_window_ps;
+        while (true) {
+            size_t delay_begin = settings.lowerBound(
+                    first_key - delay_ps - 2 * settings.uv_period_ps -
+                    margin);
+            if ((delay_begin == 0) ||
+                DelayedStreamRestarts(
+                        settings, delay_begin, settings.delays[ii], first_key))
+            {
+                begin = std::min(begin, delay_begin);
+                break;
+            }
+            margin *= 2;
+        }
+    }
+    return(begin);
+}
+
+/*!
+ * \brief Find the coincidences in the windows that open within a slice
+ */
+void ProcessSlice(
+        const SliceSettings & settings,
+        int64_t first_key,
+        int64_t last_key,
+        SliceResult & result)
+{
+    // The last window of the slice can read up to the time window past the
+    // end of the slice.
+    const size_t end = (last_key == LLONG_MAX) ? settings.count :
+            settings.upperBound(last_key + settings.time_window_ps +
+                                settings.uv_period_ps);
+    const size_t begin = SliceBegin(settings, first_key);
+
+    CoincidenceSorter sorter(
+            settings.config,
+            settings.time_window_ns,
+            settings.energy_low,
+            settings.energy_high,
+            0,
+            settings.multiples_policy);
+    sorter.setOutputRange(first_key, last_key);
+    for (size_t ii = 0; ii < settings.delays.size(); ii++) {
+        sorter.addDelayedWindow(settings.delays[ii]);
+    }
+    sorter.insert(settings.singles + begin, settings.singles + end);
+    sorter.flush();
+    sorter.popCoinc(result.coinc);
+    sorter.popDelayed(result.delayed);
+    result.info = sorter.getCoincidenceInfo();
+}
+
+/*!
+ * \brief Run the slices on a pool of threads and hand each to output in order
+ *
+ * Only a couple of slices per thread are held at once, so the memory used
+ * does not grow with the number of singles.
+ *
+ * \return 0 on success, or the first error returned by output
+ */
+int RunSlices(
+        const SliceSettings & settings,
+        int no_threads,
+        size_t slice_size,
+        CoincidenceInfo & info,
+        std::function<int(const SliceResult &)> output)
+{
+    const std::vector<int64_t> boundaries = SliceBoundaries(
+            settings, slice_size);
+    const size_t no_slices = boundaries.size() - 1;
+    const size_t max_in_flight = 2 * no_threads;
+    std::vector<SliceResult> results(no_slices);
+
+    std::mutex lock;
+    std::condition_variable cv;
+    size_t next_slice = 0;
+    size_t next_output = 0;
+    auto worker = [&]() {
+        while (true) {
+            size_t slice;
+            {
+                std::unique_lock<std::mutex> lck(lock);
+                cv.wait(lck, [&] {
+                    return((next_slice >= no_slices) ||
+                           (next_slice < next_output + max_in_flight));
+                });
+                if (next_slice >= no_slices) {
+                    return;
+                }
+                slice = next_slice++;
+            }
+            ProcessSlice(
+                    settings,
+                    boundaries[slice],
+                    boundaries[slice + 1],
+                    results[slice]);
+            {
+                std::lock_guard<std::mutex> lck(lock);
+                results[slice].done = true;
+            }
+            cv.notify_all();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int thread = 0; thread < no_threads; thread++) {
+        threads.push_back(std::thread(worker));
+    }
+
+    int status = 0;
+    for (size_t slice = 0; slice < no_slices; slice++) {
+        {
+            std::unique_lock<std::mutex> lck(lock);
+            cv.wait(lck, [&] { return(results[slice].done); });
+        }
+        if (status == 0) {
+            status = output(results[slice]);
+        }
+        info.addCoincidenceInfo(results[slice].info);
+        std::vector<EventCoinc>().swap(results[slice].coinc);
+        std::vector<EventCoinc>().swap(results[slice].delayed);
+        {
+            std::lock_guard<std::mutex> lck(lock);
+            next_output = slice + 1;
+        }
+        cv.notify_all();
+    }
+    for (size_t ii = 0; ii < threads.size(); ii++) {
+        threads[ii].join();
+    }
+    return(status);
+}
+
+/*!
+ * \brief Check the arguments and fill in the settings shared by the slices
+ *
+ * \return 0 on success, -1 if no_threads or slice_size is zero, -2 if a delay
+ *         is too short for CoincidenceSorter::addDelayedWindow
+ */
+int MakeSliceSettings(
+        SliceSettings & settings,
+        const EventCal * singles,
+        size_t count,
+        SystemConfiguration const * const config,
+        float time_window_ns,
+        float energy_low,
+        float energy_high,
+        MultiplesPolicy multiples_policy,
+        const std::vector<long> & delays,
+        int no_threads,
+        size_t slice_size)
+{
+    if ((no_threads < 1) || (slice_size == 0)) {
+        return(-1);
+    }
+    settings.singles = singles;
+    settings.count = count;
+    settings.config = config;
+    settings.time_window_ns = time_window_ns;
+    settings.energy_low = energy_low;
+    settings.energy_high = energy_high;
+    settings.multiples_policy = multiples_policy;
+    settings.delays = delays;
+    settings.time_window_ps = std::llround(time_window_ns * 1000.0);
+    settings.uv_period_ps = std::llround(config->uv_period_ns * 1000.0);
+    for (size_t ii = 0; ii < delays.size(); ii++) {
+        if (delays[ii] * config->ct_period_ns * 1000.0 <=
+                settings.time_window_ps)
+        {
+            return(-2);
+        }
+    }
+    return(0);
+}
+}
+
+/*!
+ * \brief Find the coincidences in an array of sorted singles in parallel
+ *
+ * \param singles The singles, sorted by EventCalTimeKey
+ * \param count The number of singles
+ * \param config The system configuration used for the timestamps
+ * \param time_window_ns The coincidence time window in nanoseconds
+ * \param energy_low The low edge of the energy window applied to the singles
+ * \param energy_high The high edge of the energy window applied to the singles
+ * \param multiples_policy How windows with more than two singles are handled
+ * \param delays The delay, in coarse timestamp ticks, of each delayed window
+ * \param coinc Where the prompt coincidences are appended
+ * \param delayed Where the delayed coincidences are appended
+ * \param info The counters of every slice are added to this
+ * \param no_threads The number of threads that process slices
+ * \param slice_size The approximate number of singles in each slice
+ *
+ * \return 0 on success, -1 if no_threads or slice_size is zero, -2 if a delay
+ *         is not longer than the time window
+ */
+int FindCoincidencesParallel(
+        const EventCal * singles,
+        size_t count,
+        SystemConfiguration const * const config,
+        float time_window_ns,
+        float energy_low,
+        float energy_high,
+        MultiplesPolicy multiples_policy,
+        const std::vector<long> & delays,
+        std::vector<EventCoinc> & coinc,
+        std::vector<EventCoinc> & delayed,
+        CoincidenceInfo & info,
+        int no_threads,
+        size_t slice_size)
+{
+    SliceSettings settings;
+    int status = MakeSliceSettings(
+            settings, singles, count, config, time_window_ns, energy_low,
+            energy_high, multiples_policy, delays, no_threads, slice_size);
+    if (status < 0) {
+        return(status);
+    }
+    return(RunSlices(settings, no_threads, slice_size, info,
+            [&](const SliceResult & result) {
+        coinc.insert(coinc.end(), result.coinc.begin(), result.coinc.end());
+        delayed.insert(
+                delayed.end(), result.delayed.begin(), result.delayed.end());
+        return(0);
+    }));
+}
+
+/*!
+ * \brief Find the coincidences in a file of sorted singles in parallel
+ *
+ * The singles file is mapped into memory, rather than read, and the
+ * coincidences of each slice are written out as soon as the slices before it
+ * are, so files larger than memory can be processed.
+ *
+ * \param singles_filename The file of EventCal, sorted by EventCalTimeKey
+ * \param coinc_filename The file the prompt coincidences are written to
+ * \param delayed_filename The file the delayed coincidences are written to.
+ *        Can be empty if there are no delays.
+ * \param config The system configuration used for the timestamps
+ * \param time_window_ns The coincidence time window in nanoseconds
+ * \param energy_low The low edge of the energy window applied to the singles
+ * \param energy_high The high edge of the energy window applied to the singles
+ * \param multiples_policy How windows with more than two singles are handled
+ * \param delays The delay, in coarse timestamp ticks, of each delayed window
+ * \param info The counters of every slice are added to this
+ * \param no_threads The number of threads that process slices
+ * \param slice_size The approximate number of singles in each slice
+ *
+ * \return 0 on success
+ *         - -1 if no_threads or slice_size is zero
+ *         - -2 if a delay is not longer than the time window
+ *         - -3 if the singles file could not be opened or mapped
+ *         - -4 if the singles file is not a whole number of events
+ *         - -5 if an output file could not be opened
+ *         - -6 if writing an output file failed
+ */
+int FindCoincidencesParallelFile(
+        const std::string & singles_filename,
+        const std::string & coinc_filename,
+        const std::string & delayed_filename,
+        SystemConfiguration const * const config,
+        float time_window_ns,
+        float energy_low,
+        float energy_high,
+        MultiplesPolicy multiples_policy,
+        const std::vector<long> & delays,
+        CoincidenceInfo & info,
+        int no_threads,
+        size_t slice_size)
+{
+    const int fd = open(singles_filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return(-3);
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0) {
+        close(fd);
+        return(-3);
+    }
+    const size_t length_bytes = file_stat.st_size;
+    if (length_bytes % sizeof(EventCal)) {
+        close(fd);
+        return(-4);
+    }
+    const size_t count = length_bytes / sizeof(EventCal);
+    void * mapped = 0;
+    if (length_bytes) {
+        mapped = mmap(0, length_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            return(-3);
+        }
+        // The slices are read mostly in order.
+        madvise(mapped, length_bytes, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    int status = 0;
+    SliceSettings settings;
+    status = MakeSliceSettings(
+            settings, (const EventCal *) mapped, count, config,
+            time_window_ns, energy_low, energy_high, multiples_policy,
+            delays, no_threads, slice_size);
+    std::ofstream coinc_file;
+    std::ofstream delayed_file;
+    if (status == 0) {
+        coinc_file.open(coinc_filename.c_str(), std::ios::binary);
+        if (!delayed_filename.empty()) {
+            delayed_file.open(delayed_filename.c_str(), std::ios::binary);
+        }
+        if (!coinc_file.good() ||
+            (!delayed_filename.empty() && !delayed_file.good()))
+        {
+            status = -5;
+        }
+    }
+    if (status == 0) {
+        status = RunSlices(settings, no_threads, slice_size, info,
+                [&](const SliceResult & result) {
+            coinc_file.write(
+                    (char*) result.coinc.data(),
+                    sizeof(EventCoinc) * result.coinc.size());
+            info.written_coinc += result.coinc.size();
+            if (delayed_file.is_open()) {
+                delayed_file.write(
+                        (char*) result.delayed.data(),
+                        sizeof(EventCoinc) * result.delayed.size());
+                info.written_delayed += result.delayed.size();
+            }
+            if (!coinc_file.good() ||
+                (delayed_file.is_open() && !delayed_file.good()))
+            {
+                return(-6);
+            }
+            return(0);
+        });
+    }
+    if (mapped) {
+        munmap(mapped, length_bytes);
+    }
+    return(status);
+}
+
+namespace {
+/*!
+ * \brief Count the coincidences that differ between two streams, in order
+ *
+ * \return The number of positions where the coincidences are not byte for
+ *         byte the same, plus the difference in the number of coincidences
+ */
+size_t CountMismatches(
+        const std::vector<EventCoinc> & first,
+        const std::vector<EventCoinc> & second)
+{
+    const size_t common = std::min(first.size(), second.size());
+    size_t mismatches = std::max(first.size(), second.size()) - common;
+    for (size_t ii = 0; ii < common; ii++) {
+        if (std::memcmp(&first[ii], &second[ii], sizeof(EventCoinc))) {
+            mismatches++;
+        }
+    }
+    return(mismatches);
+}
+
+/*!
+ * \brief The coincidences of one delayed window, in their original order
+ */
+std::vector<EventCoinc> DelayedWindowCoinc(
+        const std::vector<EventCoinc> & delayed,
+        size_t delayed_window)
+{
+    std::vector<EventCoinc> window_coinc;
+    for (size_t ii = 0; ii < delayed.size(); ii++) {
+        if (delayed[ii].flags[0] == (int) delayed_window + 1) {
+            window_coinc.push_back(delayed[ii]);
+        }
+    }
+    return(window_coinc);
+}
+
+bool SameCoincidenceInfo(
+        const CoincidenceInfo & first,
+        const CoincidenceInfo & second)
+{
+    for (int ii = 0; ii < COINC_MULTIPLICITY_BINS; ii++) {
+        if (first.multiplicity[ii] != second.multiplicity[ii]) {
+            return(false);
+        }
+    }
+    return((first.singles_processed == second.singles_processed) &&
+           (first.dropped_energy_window == second.dropped_energy_window) &&
+           (first.dropped_invalid_panel == second.dropped_invalid_panel) &&
+           (first.dropped_late == second.dropped_late) &&
+           (first.windows_single == second.windows_single) &&
+           (first.dropped_same_panel == second.dropped_same_panel) &&
+           (first.dropped_multiples == second.dropped_multiples) &&
+           (first.accepted_from_multiples ==
+                    second.accepted_from_multiples) &&
+           (first.accepted_coinc == second.accepted_coinc) &&
+           (first.accepted_delayed == second.accepted_delayed));
+}
+}
+
+/*!
+ * \brief Check FindCoincidencesParallel against a single CoincidenceSorter
+ *
+ * Both are run over the same singles with the same settings.  The prompt
+ * coincidences are compared byte for byte in order, as are the delayed
+ * coincidences of each delayed window, since FindCoincidencesParallel groups
+ * those of different windows by slice.  Every count of comparison is zero,
+ * and info_matches is true, when the two give the same results.
+ *
+ * \param singles The singles, sorted by EventCalTimeKey
+ * \param count The number of singles
+ * \param config The system configuration used for the timestamps
+ * \param time_window_ns The coincidence time window in nanoseconds
+ * \param energy_low The low edge of the energy window applied to the singles
+ * \param energy_high The high edge of the energy window applied to the singles
+ * \param multiples_policy How windows with more than two singles are handled
+ * \param delays The delay, in coarse timestamp ticks, of each delayed window
+ * \param no_threads The number of threads that process slices
+ * \param slice_size The approximate number of singles in each slice
+ * \param comparison Where the differences are returned
+ *
+ * \return 0 on success, or the error returned by FindCoincidencesParallel or
+ *         CoincidenceSorter::addDelayedWindow
+ */
+int CompareCoincidencesParallel(
+        const EventCal * singles,
+        size_t count,
+        SystemConfiguration const * const config,
+        float time_window_ns,
+        float energy_low,
+        float energy_high,
+        MultiplesPolicy multiples_policy,
+        const std::vector<long> & delays,
+        int no_threads,
+        size_t slice_size,
+        ParallelCoincidenceComparison & comparison)
+{
+    comparison = ParallelCoincidenceComparison();
+    CoincidenceSorter sorter(
+            config,
+            time_window_ns,
+            energy_low,
+            energy_high,
+            0,
+            multiples_policy);
+    for (size_t ii = 0; ii < delays.size(); ii++) {
+        const int status = sorter.addDelayedWindow(delays[ii]);
+        if (status < 0) {
+            return(status);
+        }
+    }
+    sorter.insert(singles, singles + count);
+    sorter.flush();
+    std::vector<EventCoinc> serial_coinc;
+    std::vector<EventCoinc> serial_delayed;
+    sorter.popCoinc(serial_coinc);
+    sorter.popDelayed(serial_delayed);
+
+    std::vector<EventCoinc> parallel_coinc;
+    std::vector<EventCoinc> parallel_delayed;
+    CoincidenceInfo parallel_info;
+    const int status = FindCoincidencesParallel(
+            singles, count, config, time_window_ns, energy_low, energy_high,
+            multiples_policy, delays, parallel_coinc, parallel_delayed,
+            parallel_info, no_threads, slice_size);
+    if (status < 0) {
+        return(status);
+    }
+
+    comparison.serial_coinc = serial_coinc.size();
+    comparison.parallel_coinc = parallel_coinc.size();
+    comparison.coinc_mismatches = CountMismatches(serial_coinc,
+                                                  parallel_coinc);
+    comparison.serial_delayed = serial_delayed.size();
+    comparison.parallel_delayed = parallel_delayed.size();
+    for (size_t ii = 0; ii < delays.size(); ii++) {
+        comparison.delayed_mismatches += CountMismatches(
+                DelayedWindowCoinc(serial_delayed, ii),
+                DelayedWindowCoinc(parallel_delayed, ii));
+    }
+    comparison.info_matches = SameCoincidenceInfo(
+            sorter.getCoincidenceInfo(), parallel_info);
+    return(0);
+}
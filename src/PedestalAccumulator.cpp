@@ -0,0 +1,388 @@
+#include <miil/process/PedestalAccumulator.h>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace {
+//! a, b, c, d, com0, com0h, com1 and com1h, the order of the pedestal file
+const int NO_CHANNELS = 8;
+
+/*!
+ * \brief Copy the estimates of a channel into the fields of a ModulePedestals
+ */
+void SetChannel(
+        ModulePedestals & pedestal,
+        int channel,
+        float value,
+        float value_std)
+{
+    switch (channel) {
+    case 0:
+        pedestal.a = value;
+        pedestal.a_std = value_std;
+        break;
+    case 1:
+        pedestal.b = value;
+        pedestal.b_std = value_std;
+        break;
+    case 2:
+        pedestal.c = value;
+        pedestal.c_std = value_std;
+        break;
+    case 3:
+        pedestal.d = value;
+        pedestal.d_std = value_std;
+        break;
+    case 4:
+        pedestal.com0 = value;
+        pedestal.com0_std = value_std;
+        break;
+    case 5:
+        pedestal.com0h = value;
+        pedestal.com0h_std = value_std;
+        break;
+    case 6:
+        pedestal.com1 = value;
+        pedestal.com1_std = value_std;
+        break;
+    case 7:
+        pedestal.com1h = value;
+        pedestal.com1h_std = value_std;
+        break;
+    }
+}
+}
+
+/*!
+ * \brief Create an empty accumulator for each module of a system
+ *
+ * \param config The system configuration giving the modules.  Kept to write
+ *        the pedestal file with, so it must outlive the accumulator.  Any
+ *        pedestals it has loaded are written for modules with no events.
+ * \param no_shards The number of threads that will add events
+ */
+PedestalAccumulator::PedestalAccumulator(
+        SystemConfiguration const * const config,
+        int no_shards) :
+    no_modules(config->panels_per_system * config->cartridges_per_panel *
+               config->daqs_per_cartridge * config->renas_per_daq *
+               config->modules_per_rena),
+    shards(new Shard[std::max(no_shards, 1)]),
+    no_shards(std::max(no_shards, 1)),
+    config(config),
+    output_events(0),
+    module_events(new std::atomic<long>[no_modules]),
+    modules_complete(0),
+    output_status(1)
+{
+    for (int ii = 0; ii < this->no_shards; ii++) {
+        Shard & shard = shards[ii];
+        shard.counts.resize(no_modules, 0);
+        shard.means.resize(no_modules * NO_CHANNELS, 0);
+        shard.m2s.resize(no_modules * NO_CHANNELS, 0);
+        shard.batch_counts.resize(no_modules, 0);
+    }
+    for (int ii = 0; ii < no_modules; ii++) {
+        module_events[ii].store(0);
+    }
+
+    initial_pedestals.resize(config->panels_per_system);
+    for (int p = 0; p < config->panels_per_system; p++) {
+        initial_pedestals[p].resize(config->cartridges_per_panel);
+        for (int c = 0; c < config->cartridges_per_panel; c++) {
+            initial_pedestals[p][c].resize(config->daqs_per_cartridge);
+            for (int d = 0; d < config->daqs_per_cartridge; d++) {
+                initial_pedestals[p][c][d].resize(config->renas_per_daq);
+                for (int r = 0; r < config->renas_per_daq; r++) {
+                    initial_pedestals[p][c][d][r].resize(
+                            config->modules_per_rena, ModulePedestals());
+                    if (!config->pedestalsLoaded()) {
+                        continue;
+                    }
+                    for (int m = 0; m < config->modules_per_rena; m++) {
+                        initial_pedestals[p][c][d][r][m] =
+                                config->pedestals[p][c][d][r][m];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/*!
+ * \brief The index of a module within the accumulator
+ *
+ * \return The index, or -1 if the module is outside of the system
+ */
+int PedestalAccumulator::moduleIndex(
+        int panel,
+        int cartridge,
+        int daq,
+        int rena,
+        int module) const
+{
+    return(config->indexPCDRM(panel, cartridge, daq, rena, module));
+}
+
+/*!
+ * \brief Add the channels of a batch of decoded events to a shard
+ *
+ * The events should be straight from decoding, before any pedestal
+ * correction.  Events outside of the system are ignored.
+ *
+ * \param shard_no The shard of the calling thread
+ * \param begin The first event to add
+ * \param end One past the last event to add
+ */
+void PedestalAccumulator::add(
+        int shard_no,
+        std::vector<EventRaw>::const_iterator begin,
+        std::vector<EventRaw>::const_iterator end)
+{
+    Shard & shard = shards[shard_no];
+    {
+        std::lock_guard<std::mutex> lck(shard.lock);
+        for (std::vector<EventRaw>::const_iterator iter = begin;
+             iter != end;
+             ++iter)
+        {
+            const EventRaw & event = *iter;
+            const int index = moduleIndex(event.panel, event.cartridge,
+                                          event.daq, event.rena, event.module);
+            if (index < 0) {
+                continue;
+            }
+            if (shard.batch_counts[index]++ == 0) {
+                shard.batch_modules.push_back(index);
+            }
+            const double values[NO_CHANNELS] = {
+                    (double) event.a, (double) event.b,
+                    (double) event.c, (double) event.d,
+                    (double) event.com0, (double) event.com0h,
+                    (double) event.com1, (double) event.com1h};
+            const double inverse_count = 1.0 / (++shard.counts[index]);
+            double * means = &shard.means[index * NO_CHANNELS];
+            double * m2s = &shard.m2s[index * NO_CHANNELS];
+            for (int ch = 0; ch < NO_CHANNELS; ch++) {
+                const double delta = values[ch] - means[ch];
+                means[ch] += delta * inverse_count;
+                m2s[ch] += delta * (values[ch] - means[ch]);
+            }
+        }
+    }
+    checkOutput(shard);
+}
+
+/*!
+ * \brief Add each batch of decoded events from a ProcessParams
+ */
+void PedestalAccumulator::addDecoded(
+        int shard,
+        std::vector<EventRaw>::const_iterator begin,
+        std::vector<EventRaw>::const_iterator end,
+        SystemConfiguration const * const)
+{
+    add(shard, begin, end);
+}
+
+/*!
+ * \brief Add the batch of a shard to the totals of each module, and write
+ *        the output file if this completed the last module
+ *
+ * Only called by the thread that owns the shard, without holding its lock.
+ */
+void PedestalAccumulator::checkOutput(Shard & shard) {
+    const long target = output_events.load();
+    for (size_t ii = 0; ii < shard.batch_modules.size(); ii++) {
+        const int index = shard.batch_modules[ii];
+        const long count = shard.batch_counts[index];
+        shard.batch_counts[index] = 0;
+        const long previous = module_events[index].fetch_add(count);
+        if ((target > 0) && (previous < target) &&
+            (previous + count >= target))
+        {
+            if (modules_complete.fetch_add(1) + 1 == no_modules) {
+                std::lock_guard<std::mutex> lck(lock_output);
+                output_status.store(write(output_filename));
+            }
+        }
+    }
+    shard.batch_modules.clear();
+}
+
+/*!
+ * \brief The number of events added for a module over all of the shards
+ *
+ * \param module_index The index of the module from moduleIndex
+ *
+ * \return The number of events, or -1 if the index is out of range
+ */
+long PedestalAccumulator::events(int module_index) const {
+    if ((module_index < 0) || (module_index >= no_modules)) {
+        return(-1);
+    }
+    return(module_events[module_index].load());
+}
+
+/*!
+ * \brief Combine the shards into the pedestals of each module
+ *
+ * The estimates of the shards are combined as with Chan et al's parallel
+ * form of Welford's method.  The standard deviation of each channel is the
+ * sample standard deviation.  Modules that have had no events are given the
+ * pedestals loaded in the configuration when the accumulator was created, or
+ * zero if there were none.
+ *
+ * \param module_pedestals Where the pedestals are returned, indexed Panel,
+ *        Cartridge, DAQ_Board, Rena, Module, as SystemConfiguration::pedestals
+ *
+ * \return 0 on success
+ */
+int PedestalAccumulator::pedestals(
+        std::vector<std::vector<std::vector<std::vector<
+                std::vector<ModulePedestals> > > > > & module_pedestals) const
+{
+    std::vector<long> counts(no_modules, 0);
+    std::vector<double> means(no_modules * NO_CHANNELS, 0);
+    std::vector<double> m2s(no_modules * NO_CHANNELS, 0);
+    for (int ii = 0; ii < no_shards; ii++) {
+        Shard & shard = shards[ii];
+        std::lock_guard<std::mutex> lck(shard.lock);
+        for (int index = 0; index < no_modules; index++) {
+            const long shard_count = shard.counts[index];
+            if (shard_count == 0) {
+                continue;
+            }
+            const long count = counts[index] + shard_count;
+            for (int ch = 0; ch < NO_CHANNELS; ch++) {
+                const int jj = index * NO_CHANNELS + ch;
+                const double delta = shard.means[jj] - means[jj];
+                means[jj] += delta * shard_count / count;
+                m2s[jj] += shard.m2s[jj] + delta * delta *
+                        ((double) counts[index] * shard_count / count);
+            }
+            counts[index] = count;
+        }
+    }
+
+    module_pedestals = initial_pedestals;
+    int index = 0;
+    for (int p = 0; p < config->panels_per_system; p++) {
+        for (int c = 0; c < config->cartridges_per_panel; c++) {
+            for (int d = 0; d < config->daqs_per_cartridge; d++) {
+                for (int r = 0; r < config->renas_per_daq; r++) {
+                    for (int m = 0;
+                         m < config->modules_per_rena;
+                         m++, index++)
+                    {
+                        const long count = counts[index];
+                        if (count == 0) {
+                            continue;
+                        }
+                        ModulePedestals & pedestal =
+                                module_pedestals[p][c][d][r][m];
+                        pedestal.events = count;
+                        for (int ch = 0; ch < NO_CHANNELS; ch++) {
+                            const int jj = index * NO_CHANNELS + ch;
+                            double deviation = 0;
+                            if (count > 1) {
+                                deviation = std::sqrt(m2s[jj] / (count - 1));
+                            }
+                            SetChannel(pedestal, ch, means[jj], deviation);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return(0);
+}
+
+/*!
+ * \brief Write the current pedestals to a file
+ *
+ * The file is written by SystemConfiguration::writePedestals, so it can be
+ * loaded with SystemConfiguration::loadPedestals.
+ *
+ * \param filename The name of the file to write
+ *
+ * \return 0 on success, or the negative error of
+ *         SystemConfiguration::writePedestals
+ */
+int PedestalAccumulator::write(const std::string & filename) const {
+    std::vector<std::vector<std::vector<std::vector<
+            std::vector<ModulePedestals> > > > > module_pedestals;
+    pedestals(module_pedestals);
+    return(config->writePedestals(filename, module_pedestals));
+}
+
+/*!
+ * \brief Write the pedestals once every module has reached a number of events
+ *
+ * Should be set before events are added.  If every module already has the
+ * number of events, the file is written immediately.
+ *
+ * \param filename The name of the file to write
+ * \param events_per_module The number of events every module must have.  Zero
+ *        or less to not write the file.
+ */
+void PedestalAccumulator::setOutput(
+        const std::string & filename,
+        long events_per_module)
+{
+    std::lock_guard<std::mutex> lck(lock_output);
+    output_filename = filename;
+    output_status.store(1);
+    int complete = 0;
+    for (int ii = 0; ii < no_modules; ii++) {
+        if (module_events[ii].load() >= events_per_module) {
+            complete++;
+        }
+    }
+    modules_complete.store(complete);
+    output_events.store(events_per_module);
+    if ((events_per_module > 0) && (complete == no_modules)) {
+        output_status.store(write(output_filename));
+    }
+}
+
+/*!
+ * \brief The result of writing the file set by setOutput
+ *
+ * \return 1 if the file has not been written yet, otherwise the return value
+ *         of write
+ */
+int PedestalAccumulator::outputStatus() const {
+    return(output_status.load());
+}
+
+/*!
+ * \brief Clear the estimates of every module
+ *
+ * The file set by setOutput will be written again once every module has
+ * reached the number of events again.
+ */
+void PedestalAccumulator::reset() {
+    std::lock_guard<std::mutex> lck(lock_output);
+    for (int ii = 0; ii < no_shards; ii++) {
+        Shard & shard = shards[ii];
+        std::lock_guard<std::mutex> shard_lck(shard.lock);
+        std::fill(shard.counts.begin(), shard.counts.end(), 0);
+        std::fill(shard.means.begin(), shard.means.end(), 0);
+        std::fill(shard.m2s.begin(), shard.m2s.end(), 0);
+    }
+    for (int ii = 0; ii < no_modules; ii++) {
+        module_events[ii].store(0);
+    }
+    modules_complete.store(0);
+    output_status.store(1);
+}
+
+int PedestalAccumulator::noModules() const {
+    return(no_modules);
+}
+
+int PedestalAccumulator::noShards() const {
+    return(no_shards);
+}
@@ -0,0 +1,487 @@
+#include <miil/process/PhotopeakFit.h>
+#include <miil/process/ParallelFileRead.h>
+#include <miil/process/processing.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+using namespace std;
+
+namespace {
+//! The most times the window of a photopeak fit is moved
+const int MAX_FIT_ITERATIONS = 20;
+//! The change in the peak, in bins, for a fit to have settled
+const double SETTLED_SHIFT = 0.01;
+//! The sigma the fit starts with, as a fraction of the starting peak
+const double START_SIGMA_FRACTION = 0.06;
+//! The fit window runs from this many sigma below the peak
+const double WINDOW_LOW_SIGMA = 1.0;
+//! to this many sigma above the peak
+const double WINDOW_HIGH_SIGMA = 2.0;
+/*!
+ * The spectrum below this fraction of the bins is skipped when searching for
+ * a photopeak with no starting point
+ */
+const int SEARCH_START_DIVISOR = 16;
+
+/*!
+ * \brief Fit the photopeak of a spectrum with a gaussian
+ *
+ * Fits a parabola to the log of the counts of the bins within the window, by
+ * least squares weighted by the counts, which is the gaussian fit of
+ * Caruana's algorithm.  The window is moved to the fit peak and width, and
+ * the fit repeated, until the peak settles.  Works on the spectrum in place,
+ * with no allocation.
+ *
+ * \param counts The counts of each bin of the spectrum
+ * \param no_bins The number of bins in the spectrum
+ * \param bin_width The width of each bin
+ * \param start The position to start the fit from, or zero or less to start
+ *        from the bin with the largest product of counts and position
+ * \param min_counts The fewest counts within the final window
+ * \param peak Where the fit photopeak is returned
+ * \param fwhm_percent Where the full width at half maximum of the photopeak,
+ *        in percent of the photopeak, is returned
+ *
+ * \return 0 on success, less than otherwise
+ *       - -1 if the spectrum is empty
+ *       - -2 if the counts within the window were not peaked
+ *       - -3 if the fit peak left the spectrum
+ *       - -4 if there were fewer than min_counts in the window
+ */
+int FitPhotopeak(
+        const double * counts,
+        int no_bins,
+        double bin_width,
+        double start,
+        double min_counts,
+        float & peak,
+        float & fwhm_percent)
+{
+    double mu = start / bin_width;
+    if (start <= 0) {
+        double best = 0;
+        for (int ii = no_bins / SEARCH_START_DIVISOR; ii < no_bins; ii++) {
+            if (counts[ii] * (ii + 0.5) > best) {
+                best = counts[ii] * (ii + 0.5);
+                mu = ii + 0.5;
+            }
+        }
+        if (best <= 0) {
+            return(-1);
+        }
+    }
+    double sigma = std::max(START_SIGMA_FRACTION * mu, 1.0);
+    double window_counts = 0;
+    for (int iteration = 0; iteration < MAX_FIT_ITERATIONS; iteration++) {
+        int low = std::max((int) std::floor(mu - WINDOW_LOW_SIGMA * sigma), 0);
+        int high = std::min((int) std::ceil(mu + WINDOW_HIGH_SIGMA * sigma),
+                            no_bins - 1);
+        // Moments of the bins about the current peak, weighted by the counts.
+        double s0 = 0;
+        double s1 = 0;
+        double s2 = 0;
+        double s3 = 0;
+        double s4 = 0;
+        double l0 = 0;
+        double l1 = 0;
+        double l2 = 0;
+        window_counts = 0;
+        for (int ii = low; ii <= high; ii++) {
+            const double weight = counts[ii];
+            if (weight <= 0) {
+                continue;
+            }
+            const double t = ii + 0.5 - mu;
+            const double t2 = t * t;
+            const double log_count = std::log(weight);
+            window_counts += weight;
+            s0 += weight;
+            s1 += weight * t;
+            s2 += weight * t2;
+            s3 += weight * t2 * t;
+            s4 += weight * t2 * t2;
+            l0 += weight * log_count;
+            l1 += weight * t * log_count;
+            l2 += weight * t2 * log_count;
+        }
+        // Solve for the c of log(y) = a + b t + c t^2, and then b, by
+        // Cramer's rule.
+        const double det = s0 * (s2 * s4 - s3 * s3) -
+                s1 * (s1 * s4 - s3 * s2) +
+                s2 * (s1 * s3 - s2 * s2);
+        if (!(std::abs(det) > 0)) {
+            return(-2);
+        }
+        const double det_b = s0 * (l1 * s4 - s3 * l2) -
+                l0 * (s1 * s4 - s3 * s2) +
+                s2 * (s1 * l2 - l1 * s2);
+        const double det_c = s0 * (s2 * l2 - l1 * s3) -
+                s1 * (s1 * l2 - l1 * s2) +
+                l0 * (s1 * s3 - s2 * s2);
+        const double b = det_b / det;
+        const double c = det_c / det;
+        if (!(c < 0)) {
+            return(-2);
+        }
+        const double next_mu = mu - b / (2 * c);
+        if (!((next_mu > 0) && (next_mu < no_bins))) {
+            return(-3);
+        }
+        const bool settled = std::abs(next_mu - mu) < SETTLED_SHIFT;
+        mu = next_mu;
+        sigma = std::max(std::sqrt(-1 / (2 * c)), 0.5);
+        if (settled) {
+            break;
+        }
+    }
+    if (window_counts < min_counts) {
+        return(-4);
+    }
+    peak = mu * bin_width;
+    fwhm_percent = 2.0 * std::sqrt(2.0 * std::log(2.0)) * sigma / mu * 100;
+    return(0);
+}
+
+/*!
+ * \brief Fit a photopeak from a starting point, or search for it if that fit
+ *        fails, such as when the peak has moved far from the start
+ */
+int FitPhotopeakFrom(
+        const double * counts,
+        int no_bins,
+        double bin_width,
+        double start,
+        double min_counts,
+        float & peak,
+        float & fwhm_percent)
+{
+    if ((start > 0) && (FitPhotopeak(counts, no_bins, bin_width, start,
+                                     min_counts, peak, fwhm_percent) == 0))
+    {
+        return(0);
+    }
+    return(FitPhotopeak(counts, no_bins, bin_width, 0, min_counts,
+                        peak, fwhm_percent));
+}
+}
+
+/*!
+ * \brief Create empty spectra for every crystal of a system
+ *
+ * \param config The system configuration giving the crystals, and the
+ *        calibration the fits start from.  Kept to write the calibration
+ *        with, so it must outlive the fit.
+ * \param no_shards The number of threads that will add events
+ * \param spat_bins The number of bins of each spatial total spectrum
+ * \param spat_max The spatial total spectra cover 0 to spat_max
+ * \param comm_bins The number of bins of each common spectrum
+ * \param comm_max The common spectra cover 0 to comm_max
+ */
+PhotopeakFit::PhotopeakFit(
+        SystemConfiguration const * const config,
+        int no_shards,
+        int spat_bins,
+        float spat_max,
+        int comm_bins,
+        float comm_max) :
+    min_peak_counts(100),
+    config(config),
+    spat_bins(spat_bins),
+    spat_bin_width(spat_max / spat_bins),
+    comm_bins(comm_bins),
+    comm_bin_width(comm_max / comm_bins),
+    spat_histogram((size_t) noCrystals() * spat_bins, no_shards),
+    comm_histogram((size_t) noCrystals() * comm_bins, no_shards)
+{
+}
+
+int PhotopeakFit::noCrystals() const {
+    return(config->panels_per_system * config->cartridges_per_panel *
+           config->fins_per_cartridge * config->modules_per_fin *
+           config->apds_per_module * config->crystals_per_apd);
+}
+
+int PhotopeakFit::noShards() const {
+    return(spat_histogram.shards());
+}
+
+/*!
+ * \brief The index of a crystal within the spectra
+ *
+ * \return The index, or -1 if the crystal is outside of the system
+ */
+int PhotopeakFit::crystalIndex(
+        int panel,
+        int cartridge,
+        int fin,
+        int module,
+        int apd,
+        int crystal) const
+{
+    return(config->indexPCFMAX(
+            panel, cartridge, fin, module, apd, crystal));
+}
+
+/*!
+ * \brief Add the spatial totals of a batch of calibrated events
+ */
+void PhotopeakFit::add(
+        int shard,
+        std::vector<EventCal>::const_iterator begin,
+        std::vector<EventCal>::const_iterator end)
+{
+    for (std::vector<EventCal>::const_iterator iter = begin;
+         iter != end;
+         ++iter)
+    {
+        const EventCal & event = *iter;
+        const int index = crystalIndex(event.panel, event.cartridge,
+                                       event.fin, event.module, event.apd,
+                                       event.crystal);
+        const float spat_bin = std::floor(event.spat_total / spat_bin_width);
+        if ((index < 0) || !((spat_bin >= 0) && (spat_bin < spat_bins))) {
+            continue;
+        }
+        spat_histogram.increment(
+                shard, (size_t) index * spat_bins + (size_t) spat_bin);
+    }
+}
+
+/*!
+ * \brief Add the spatial totals and common signals of a batch of decoded
+ *        events
+ *
+ * Each event is assigned to a crystal with CalculateID, so the pedestals and
+ * crystal locations need to be loaded.
+ */
+void PhotopeakFit::add(
+        int shard,
+        std::vector<EventRaw>::const_iterator begin,
+        std::vector<EventRaw>::const_iterator end,
+        SystemConfiguration const * const config)
+{
+    EventCal event;
+    for (std::vector<EventRaw>::const_iterator iter = begin;
+         iter != end;
+         ++iter)
+    {
+        const EventRaw & rawevent = *iter;
+        if (CalculateID(event, rawevent, config) < 0) {
+            continue;
+        }
+        const int index = crystalIndex(event.panel, event.cartridge,
+                                       event.fin, event.module, event.apd,
+                                       event.crystal);
+        if (index < 0) {
+            continue;
+        }
+        const float spat_bin = std::floor(event.spat_total / spat_bin_width);
+        if ((spat_bin >= 0) && (spat_bin < spat_bins)) {
+            spat_histogram.increment(
+                    shard, (size_t) index * spat_bins + (size_t) spat_bin);
+        }
+        // CalculateID leaves the pedestal corrected common of the APD in E.
+        const float comm_bin = std::floor(event.E / comm_bin_width);
+        if ((comm_bin >= 0) && (comm_bin < comm_bins)) {
+            comm_histogram.increment(
+                    shard, (size_t) index * comm_bins + (size_t) comm_bin);
+        }
+    }
+}
+
+/*!
+ * \brief Add each batch of decoded events from a ProcessParams
+ */
+void PhotopeakFit::addDecoded(
+        int shard,
+        std::vector<EventRaw>::const_iterator begin,
+        std::vector<EventRaw>::const_iterator end,
+        SystemConfiguration const * const config)
+{
+    add(shard, begin, end, config);
+}
+
+/*!
+ * \brief Fit the photopeaks of every crystal
+ *
+ * Crystals whose spatial, or common, photopeak can not be fit keep the
+ * values of the configuration for it.  The locations and use of each crystal
+ * are not changed.
+ *
+ * \param crystal_calibration Where the calibration of the configuration is
+ *        returned, with the photopeaks and energy resolutions that were fit
+ *        replaced
+ * \param no_threads The number of threads to fit the crystals with
+ *
+ * \return The number of crystals with a spatial photopeak that was fit, or
+ *         -1 if no_threads is less than one
+ */
+int PhotopeakFit::fit(
+        std::vector<std::vector<std::vector<
+                std::vector<std::vector<std::vector<
+                CrystalCalibration> > > > > > & crystal_calibration,
+        int no_threads)
+{
+    if (no_threads < 1) {
+        return(-1);
+    }
+    crystal_calibration = config->calibration;
+    config->resizeArrayPCFMAX(crystal_calibration);
+
+    std::vector<double> spat_spectra;
+    std::vector<double> comm_spectra;
+    spat_histogram.snapshot(spat_spectra);
+    comm_histogram.snapshot(comm_spectra);
+
+    const int no_crystals = noCrystals();
+    const int cartridges_per_panel = config->cartridges_per_panel;
+    const int fins_per_cartridge = config->fins_per_cartridge;
+    const int modules_per_fin = config->modules_per_fin;
+    const int apds_per_module = config->apds_per_module;
+    const int crystals_per_apd = config->crystals_per_apd;
+    std::atomic<int> next_crystal(0);
+    std::atomic<int> no_fit(0);
+    auto worker = [&]() {
+        int index;
+        while ((index = next_crystal++) < no_crystals) {
+            const int x = index % crystals_per_apd;
+            int rest = index / crystals_per_apd;
+            const int a = rest % apds_per_module;
+            rest /= apds_per_module;
+            const int m = rest % modules_per_fin;
+            rest /= modules_per_fin;
+            const int f = rest % fins_per_cartridge;
+            rest /= fins_per_cartridge;
+            const int c = rest % cartridges_per_panel;
+            const int p = rest / cartridges_per_panel;
+            CrystalCalibration & crystal_cal =
+                    crystal_calibration[p][c][f][m][a][x];
+
+            float peak;
+            float fwhm_percent;
+            if (FitPhotopeakFrom(
+                    &spat_spectra[(size_t) index * spat_bins], spat_bins,
+                    spat_bin_width, crystal_cal.gain_spat, min_peak_counts,
+                    peak, fwhm_percent) == 0)
+            {
+                crystal_cal.gain_spat = peak;
+                crystal_cal.eres_spat = fwhm_percent;
+                no_fit++;
+            }
+            if (FitPhotopeakFrom(
+                    &comm_spectra[(size_t) index * comm_bins], comm_bins,
+                    comm_bin_width, crystal_cal.gain_comm, min_peak_counts,
+                    peak, fwhm_percent) == 0)
+            {
+                crystal_cal.gain_comm = peak;
+                crystal_cal.eres_comm = fwhm_percent;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int thread = 1; thread < no_threads; thread++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker();
+    for (size_t ii = 0; ii < threads.size(); ii++) {
+        threads[ii].join();
+    }
+    return(no_fit);
+}
+
+/*!
+ * \brief Fit the photopeaks of every crystal and write the calibration
+ *
+ * The file is written by SystemConfiguration::writeCalibration, so it can be
+ * loaded with SystemConfiguration::loadCalibration.
+ *
+ * \param filename The name of the file to write
+ * \param no_threads The number of threads to fit the crystals with
+ *
+ * \return 0 on success, -1 if no_threads is less than one, -2 if the file
+ *         could not be written
+ */
+int PhotopeakFit::write(const std::string & filename, int no_threads) {
+    std::vector<std::vector<std::vector<
+            std::vector<std::vector<std::vector<
+            CrystalCalibration> > > > > > crystal_calibration;
+    if (fit(crystal_calibration, no_threads) < 0) {
+        return(-1);
+    }
+    if (config->writeCalibration(filename, crystal_calibration) < 0) {
+        return(-2);
+    }
+    return(0);
+}
+
+/*!
+ * \brief Clear the spectra of every crystal
+ */
+void PhotopeakFit::reset() {
+    spat_histogram.reset();
+    comm_histogram.reset();
+}
+
+/*!
+ * \brief Fit the calibration of every crystal from a file of events
+ *
+ * The spectra are filled in a single pass over a file of decoded EventRaw,
+ * or of EventCal, which only give the spatial photopeaks, with each thread
+ * reading its own part of the file, and are then fit on the same number of
+ * threads.
+ *
+ * \param events_filename The file of events to fill the spectra from
+ * \param calibrated_events If the file holds EventCal, rather than EventRaw
+ * \param calibration_filename The calibration file to write
+ * \param config The configuration giving the crystals, pedestals and crystal
+ *        locations
+ * \param no_threads The number of threads to read the file, and fit the
+ *        crystals, with
+ *
+ * \return 0 on success, less than otherwise
+ *       - -1 if no_threads is less than one
+ *       - -4 if the events file could not be opened or read
+ *       - -5 if the size of the events file is not a whole number of events
+ *       - -6 if the calibration file could not be written
+ */
+int FitCalibrationFile(
+        const std::string & events_filename,
+        bool calibrated_events,
+        const std::string & calibration_filename,
+        SystemConfiguration const * const config,
+        int no_threads)
+{
+    if (no_threads < 1) {
+        return(-1);
+    }
+    PhotopeakFit spectra(config, no_threads);
+    int status;
+    if (calibrated_events) {
+        status = ReadEventFileParallel<EventCal>(
+                events_filename, no_threads,
+                [&](int thread,
+                    std::vector<EventCal>::const_iterator begin,
+                    std::vector<EventCal>::const_iterator end)
+                {
+                    spectra.add(thread, begin, end);
+                });
+    } else {
+        status = ReadEventFileParallel<EventRaw>(
+                events_filename, no_threads,
+                [&](int thread,
+                    std::vector<EventRaw>::const_iterator begin,
+                    std::vector<EventRaw>::const_iterator end)
+                {
+                    spectra.add(thread, begin, end, config);
+                });
+    }
+    if (status < 0) {
+        return(status);
+    }
+    if (spectra.write(calibration_filename, no_threads) < 0) {
+        return(-6);
+    }
+    return(0);
+}
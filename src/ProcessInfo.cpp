@@ -26,8 +26,14 @@ ProcessInfo::ProcessInfo() :
     written_calibrated_events(0),
     recv_calls_normal(0),
     recv_calls_zero(0),
-    recv_calls_error(0)
+    recv_calls_error(0),
+    calibration_version(0),
+    sort_late_events(0),
+    sort_delay_bound(0)
 {
+    for (int ii = 0; ii < SORT_DELAY_HISTOGRAM_BINS; ii++) {
+        sort_delay_histogram[ii] = 0;
+    }
 }
 
 void ProcessInfo::reset() {
@@ -56,6 +62,30 @@ void ProcessInfo::reset() {
     recv_calls_normal = 0;
     recv_calls_zero = 0;
     recv_calls_error = 0;
+    calibration_version = 0;
+    sort_late_events = 0;
+    sort_delay_bound = 0;
+    for (int ii = 0; ii < SORT_DELAY_HISTOGRAM_BINS; ii++) {
+        sort_delay_histogram[ii] = 0;
+    }
+}
+
+/*!
+ * \brief Add the calibration counters of another ProcessInfo to this one
+ *
+ * Used to fold the counts from events that were calibrated in separate
+ * batches back into a single set of counters.
+ *
+ * \param other The info whose calibration counters should be added
+ */
+void ProcessInfo::addCalibrateInfo(const ProcessInfo & other) {
+    decoded_events_processed += other.decoded_events_processed;
+    accepted_calibrate += other.accepted_calibrate;
+    dropped_threshold += other.dropped_threshold;
+    dropped_double_trigger += other.dropped_double_trigger;
+    dropped_crystal_id += other.dropped_crystal_id;
+    dropped_crystal_invalid += other.dropped_crystal_invalid;
+    dropped_energy_gate += other.dropped_energy_gate;
 }
 
 std::string ProcessInfo::getDecodeInfo()
@@ -110,6 +140,11 @@ std::ostream& operator<<(std::ostream& os, const ProcessInfo& info) {
        << "\n"
        << "Receive Calls (Data)   : " << info.recv_calls_normal << "\n"
        << "Receive Calls (Zero)   : " << info.recv_calls_zero << "\n"
-       << "Receieve Calls (Error) : " << info.recv_calls_error << "\n";
+       << "Receieve Calls (Error) : " << info.recv_calls_error << "\n"
+       << "\n"
+       << "Calibration Version    : " << info.calibration_version << "\n"
+       << "\n"
+       << "Sort (late events)     : " << info.sort_late_events << "\n"
+       << "Sort (delay bound)     : " << info.sort_delay_bound << "\n";
     return(os);
 }
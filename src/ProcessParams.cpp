@@ -2,11 +2,13 @@
 #include <algorithm>
 #include <iterator>
 #include <miil/SystemConfiguration.h>
-#include <miil/sorting.h>
 #include <miil/ethernet.h>
 #include <miil/process/processing.h>
 #include <miil/util.h>
 #include <miil/process/ProcessControl.h>
+#include <miil/process/GlobalMergeSorter.h>
+#include <miil/process/ProcessMonitor.h>
+#include <climits>
 #include <iomanip>
 #include <sstream>
 #include <cassert>
@@ -40,11 +42,13 @@ ProcessParams::ProcessParams(
         size_t max_file_size) :
     ethernet(eth_ptr),
     system_config(sysconfig_ptr),
+    config_versions(0),
     control(control_ptr),
     assumed_max_delay(sorting_max_delay),
     energy_gate_low(egate_low),
     energy_gate_high(egate_high),
     buffer_transfer(buffer_transfer_size),
+    event_sorter(sysconfig_ptr),
     split_files_flag(split_files),
     file_size_max(max_file_size),
     file_count(-1),
@@ -53,6 +57,8 @@ ProcessParams::ProcessParams(
     write_calibrated_events_flag(false),
     files_reset_flag(false),
     current_file_size(0),
+    merge_sorter(0),
+    merge_sorter_input(-1),
     raw_storage(raw_storage_size),
     decoded_storage(decoded_storage_size),
     calibrated_storage(calibrated_storage_size)
@@ -140,6 +146,70 @@ int ProcessParams::CalibrateBuffer(
     return(0);
 }
 
+/*!
+ * \brief Calibrate a range of decoded events, with an optional energy gate
+ *
+ * The calibration step of HandleData.  Events that are calibrated and pass the
+ * energy gate, if enabled, are appended to calibrated_data, and the reason for
+ * every rejected event is counted in info.
+ *
+ * \param begin The first decoded event to be calibrated
+ * \param end One past the last decoded event to be calibrated
+ * \param calibrated_data Where the calibrated events are appended
+ * \param info The process info where the calibration counters are incremented
+ * \param config The system configuration used for the calibration
+ * \param energy_gate Whether to reject events outside the energy window
+ * \param energy_gate_low The low edge of the energy window
+ * \param energy_gate_high The high edge of the energy window
+ * \param fixed_point Use RawEventToEventCalFixed instead of RawEventToEventCal
+ *
+ * \return 0 on success
+ */
+int ProcessParams::CalibrateBuffer(
+        vector<EventRaw>::const_iterator begin,
+        vector<EventRaw>::const_iterator end,
+        vector<EventCal> & calibrated_data,
+        ProcessInfo & info,
+        SystemConfiguration const * const config,
+        bool energy_gate,
+        float energy_gate_low,
+        float energy_gate_high,
+        bool fixed_point)
+{
+    for (vector<EventRaw>::const_iterator iter = begin; iter != end; ++iter) {
+        EventCal event;
+        int cal_status = 0;
+        if (fixed_point) {
+            cal_status = RawEventToEventCalFixed(*iter, event, config);
+        } else {
+            cal_status = RawEventToEventCal(*iter, event, config);
+        }
+        info.decoded_events_processed++;
+        if (cal_status == 0) {
+            if (energy_gate) {
+                if (InEnergyWindow(event, energy_gate_low, energy_gate_high)) {
+                    calibrated_data.push_back(event);
+                    info.accepted_calibrate++;
+                } else {
+                    info.dropped_energy_gate++;
+                }
+            } else {
+                calibrated_data.push_back(event);
+                info.accepted_calibrate++;
+            }
+        } else if (cal_status == -1) {
+            info.dropped_threshold++;
+        } else if (cal_status == -2) {
+            info.dropped_double_trigger++;
+        } else if (cal_status == -3) {
+            info.dropped_crystal_id++;
+        } else if (cal_status == -4) {
+            info.dropped_crystal_invalid++;
+        }
+    }
+    return(0);
+}
+
 int ProcessParams::IDBuffer(
     const vector<EventRaw> & decoded_data,
     vector<EventCal> & calibrated_data,
@@ -222,6 +292,10 @@ int ProcessParams::ClearProcessedData() {
 // The functions that should be run during the loop of ProcessData as well as at
 // the loop's completion.
 int ProcessParams::HandleData(bool write_out_remaining_cal_data) {
+    // Pick up any new calibration at the start of the batch, so that a single
+    // configuration is used for everything in it.
+    updateConfiguration();
+
     size_t size_before_pull = buffer_process_side.size();
     buffer_transfer.copy_and_clear(buffer_process_side);
     if (buffer_process_side.size() == size_before_pull) {
@@ -275,76 +349,113 @@ int ProcessParams::HandleData(bool write_out_remaining_cal_data) {
         decoded_storage.try_insert(
                 decoded_data.begin(),
                 decoded_data.end());
+        for (size_t ii = 0; ii < monitors.size(); ii++) {
+            monitors[ii].first->addDecoded(
+                    monitors[ii].second,
+                    decoded_data.begin(),
+                    decoded_data.end(),
+                    system_config);
+        }
 
         // Calibrate data
         if (control->calibrate_events_flag) {
-            for (size_t ii = 0;
-                 ii < decoded_data.size();
-                 ii++)
-            {
-                EventCal event;
-                int cal_status = RawEventToEventCal(
-                        decoded_data[ii],
-                        event,
-                        system_config);
-                info.decoded_events_processed++;
-                if (cal_status == 0) {
-                    if (control->energy_gate_calibrated_events_flag) {
-                        if (InEnergyWindow(event,
-                                           energy_gate_low,
-                                           energy_gate_high))
-                        {
-                            calibrated_data.push_back(event);
-                            info.accepted_calibrate++;
-                        } else {
-                            info.dropped_energy_gate++;
-                        }
-                    } else {
-                        calibrated_data.push_back(event);
-                        info.accepted_calibrate++;
-                    }
-                } else if (cal_status == -1) {
-                    info.dropped_threshold++;
-                } else if (cal_status == -2) {
-                    info.dropped_double_trigger++;
-                } else if (cal_status == -3) {
-                    info.dropped_crystal_id++;
-                } else if (cal_status == -4) {
-                    info.dropped_crystal_invalid++;
+            size_t first_new_event = calibrated_data.size();
+            if (calibration_pool) {
+                calibration_pool->calibrate(
+                        decoded_data,
+                        calibrated_data,
+                        info,
+                        system_config,
+                        control->energy_gate_calibrated_events_flag,
+                        energy_gate_low,
+                        energy_gate_high,
+                        control->fixed_point_calibration_flag);
+            } else {
+                CalibrateBuffer(
+                        decoded_data.begin(),
+                        decoded_data.end(),
+                        calibrated_data,
+                        info,
+                        system_config,
+                        control->energy_gate_calibrated_events_flag,
+                        energy_gate_low,
+                        energy_gate_high,
+                        control->fixed_point_calibration_flag);
+            }
+            // Record which version of the configuration was used to calibrate
+            // the events in the output stream, modulo 128 so that it fits in
+            // the int8_t flag without going negative.
+            if (config_versions) {
+                const int8_t version = config_snapshot.version % 128;
+                for (size_t ii = first_new_event;
+                     ii < calibrated_data.size();
+                     ii++)
+                {
+                    calibrated_data[ii].flags[0] = version;
                 }
             }
+            for (size_t ii = 0; ii < monitors.size(); ii++) {
+                monitors[ii].first->addCalibrated(
+                        monitors[ii].second,
+                        calibrated_data.begin() + first_new_event,
+                        calibrated_data.end(),
+                        system_config);
+            }
 
-            if (control->sort_calibrated_events_flag &&
-                !calibrated_data.empty())
-            {
-                insertion_sort(
-                        calibrated_data,
-                        EventCalLessThan,
-                        (float) system_config->uv_period_ns,
-                        (float) system_config->ct_period_ns);
-                // 2) for each event, calculate event time - last event time
-                // 3) find lower_bound of time_diff wrt (0 - assumed max delay)
-                EventCal delay_reference_event =
-                        calibrated_data.back();
-                delay_reference_event.ct -=
-                        assumed_max_delay;
-                write_out_iter = lower_bound(
+            if (control->sort_calibrated_events_flag) {
+                // Calculate the integer timestamp of each new event once, so
+                // that the sorter only has to compare integers.
+                calibrated_keys.clear();
+                for (size_t ii = 0; ii < calibrated_data.size(); ii++) {
+                    calibrated_keys.push_back(EventCalTimeKey(
+                            calibrated_data[ii],
+                            system_config->uv_period_ns,
+                            system_config->ct_period_ns));
+                }
+                // Hand the new events to the sorter, and take back the ones
+                // that are more than the assumed max delay behind the latest
+                // event, which are written out.
+                event_sorter.insert(
                         calibrated_data.begin(),
                         calibrated_data.end(),
-                        delay_reference_event,
-                        EventCalLessThanOnlyCt);
-            } else {
-                // If we are not sorting, write out until end.
-                write_out_iter = calibrated_data.end();
-            }
-            if (write_out_remaining_cal_data) {
-                write_out_iter = calibrated_data.end();
+                        calibrated_keys.begin(),
+                        info);
+                calibrated_data.clear();
+                if (write_out_remaining_cal_data) {
+                    event_sorter.popAll(calibrated_data);
+                } else {
+                    event_sorter.popSorted(calibrated_data, assumed_max_delay);
+                    info.sort_delay_bound = event_sorter.delayBound();
+                }
+            } else if (!event_sorter.empty()) {
+                // Sorting was turned off, so write out the events that were
+                // being held ahead of the new ones.
+                std::vector<EventCal> held_events;
+                event_sorter.popAll(held_events);
+                calibrated_data.insert(
+                        calibrated_data.begin(),
+                        held_events.begin(),
+                        held_events.end());
             }
-            // 4) write beginning to lower_bound
+            write_out_iter = calibrated_data.end();
 
             calibrated_storage.try_insert(
                     calibrated_data.begin(),
                     write_out_iter);
+
+            if (merge_sorter) {
+                // Without sorting, there's no guarantee on the order of the
+                // events, so leave it to the merge's delay bound.
+                int64_t watermark = LLONG_MIN;
+                if (control->sort_calibrated_events_flag) {
+                    watermark = event_sorter.watermark();
+                }
+                merge_sorter->push(
+                        merge_sorter_input,
+                        calibrated_data.begin(),
+                        write_out_iter,
+                        watermark);
+            }
         }
     }
 
@@ -416,7 +527,7 @@ int ProcessParams::HandleData(bool write_out_remaining_cal_data) {
     ClearProcessedData();
     // Clear out the other buffers
     decoded_data.clear();
-    // Leave the part of the calibrated data that we cannot assume is sorted yet
+    // Anything not yet assumed to be sorted is held in event_sorter
     calibrated_data.erase(calibrated_data.begin(), write_out_iter);
     return(0);
 }
@@ -528,6 +639,20 @@ int ProcessParams::ReadWriteSockets() {
     return(0);
 }
 
+/*!
+ * \brief Use the most recent configuration from the configuration versions
+ *
+ * Called at the start of every batch.  The previous snapshot is released here,
+ * which deletes that configuration if no other thread is still using it.
+ */
+void ProcessParams::updateConfiguration() {
+    if (config_versions) {
+        config_snapshot = config_versions->acquire();
+        system_config = config_snapshot.config.get();
+    }
+    info.calibration_version = config_snapshot.version;
+}
+
 void ProcessParams::updateProcessInfo() {
     if (lock_locked_info.try_lock()) {
         locked_info = info;
@@ -636,3 +761,102 @@ void ProcessParams::setCalibratedFilename(const std::string & filename) {
     write_calibrated_events_flag = true;
     SetupFiles();
 }
+
+/*!
+ * \brief Follow a set of configuration versions instead of a fixed config
+ *
+ * Once set, the processing thread uses the current version from versions for
+ * each batch in place of the configuration given to the constructor, so
+ * calibrations can be updated without stopping acquisition.  Each calibrated
+ * event records the version it was calibrated with, modulo 128, in flags[0].
+ * Versions only increase, so a reader of the stream can unwrap them by
+ * counting each time the flag steps back.  The flags are not touched unless
+ * versions are being followed.  This should not be called while the
+ * processing thread is running.
+ *
+ * \param versions The configuration versions to follow, or null to stop
+ *        following updates and keep the last version that was acquired.
+ */
+void ProcessParams::setConfigurationVersions(ConfigurationVersions * versions) {
+    config_versions = versions;
+    if (config_versions) {
+        updateConfiguration();
+    }
+}
+
+/*!
+ * \brief Set the number of threads used to calibrate the decoded events
+ *
+ * With zero workers, the default, the events are calibrated on the processing
+ * thread.  Otherwise the decoded events are split into batches that are
+ * calibrated by a pool of workers alongside the processing thread.  The output
+ * and the ProcessInfo counters are the same either way.  This should not be
+ * called while the processing thread is running.
+ *
+ * \param no_workers The number of additional calibration threads
+ * \param events_per_batch The number of decoded events in each batch
+ */
+void ProcessParams::setCalibrationWorkers(
+        size_t no_workers,
+        size_t events_per_batch)
+{
+    if (no_workers == 0) {
+        calibration_pool.reset();
+    } else {
+        calibration_pool.reset(
+                new CalibrationPool(no_workers, events_per_batch));
+    }
+}
+
+/*!
+ * \brief Adapt the sorting delay to the measured delays of the events
+ *
+ * By default, calibrated events are held until they are assumed_max_delay
+ * coarse timestamp ticks behind the latest event, unless every rena has
+ * already advanced past them.  When enabled, the delay is instead taken from
+ * the measured delays, and assumed_max_delay only limits it.  This should not
+ * be called while the processing thread is running.
+ *
+ * \param enable Turn the adaptive delay on or off
+ * \param quantile The fraction of events that should arrive within the delay
+ * \param min_delay The smallest delay to use in coarse timestamp ticks
+ */
+void ProcessParams::setAdaptiveSortDelay(
+        bool enable,
+        double quantile,
+        long min_delay)
+{
+    event_sorter.setAdaptiveDelay(enable, quantile, min_delay);
+}
+
+/*!
+ * \brief Hand the calibrated events to a merge across ProcessParams instances
+ *
+ * Adds an input to merger, and after each batch, pushes the calibrated events
+ * that were written out to it, along with the watermark of event_sorter.
+ * Calibrated events should be sorted for the merged output to be in order.
+ * This should not be called while the processing thread is running.
+ *
+ * \param merger The merge sorter to add an input to, or null to stop pushing
+ *        events to a merge
+ */
+void ProcessParams::setMergeSorter(GlobalMergeSorter * merger) {
+    merge_sorter = merger;
+    merge_sorter_input = -1;
+    if (merge_sorter) {
+        merge_sorter_input = merge_sorter->addInput();
+    }
+}
+
+/*!
+ * \brief Hand every batch of decoded and calibrated events to a monitor
+ *
+ * This should not be called while the processing thread is running.
+ *
+ * \param monitor The monitor, such as a FloodHistogram
+ * \param shard The shard of the monitor used by this ProcessParams, which
+ *        must not be shared with another ProcessParams
+ */
+void ProcessParams::addMonitor(ProcessMonitor * monitor, int shard) {
+    monitors.push_back(std::make_pair(monitor, shard));
+}
@@ -1,6 +1,8 @@
 #include <miil/process/ProcessThreads.h>
 #include <miil/process/ProcessParams.h>
 #include <miil/process/ProcessControl.h>
+#include <miil/process/GlobalMergeSorter.h>
+#include <miil/process/ProcessMonitor.h>
 
 using namespace std;
 
@@ -8,14 +10,80 @@ using namespace std;
 
 ProcessThreads::ProcessThreads(ProcessControl * const control_ptr) :
     control(control_ptr),
+    merge_sorter(0),
     is_running(false)
 {
 }
 
-void ProcessThreads::addParams(ProcessParams * const process_params_ptr) {
+/*!
+ * \brief Add a ProcessParams to be run on its own threads
+ *
+ * The ProcessParams is given the next shard of every monitor already added.
+ *
+ * \param process_params_ptr The ProcessParams to add
+ *
+ * \return 0 on success, -1 if a monitor does not have a shard for it, in
+ *         which case it is not added
+ */
+int ProcessThreads::addParams(ProcessParams * const process_params_ptr) {
+    for (size_t ii = 0; ii < monitors.size(); ii++) {
+        if (monitors[ii]->noShards() <= (int) process_params_vec.size()) {
+            return(-1);
+        }
+    }
     process_params_vec.push_back(process_params_ptr);
     read_sockets_threads.emplace_back();
     process_data_threads.emplace_back();
+    if (merge_sorter) {
+        process_params_ptr->setMergeSorter(merge_sorter);
+    }
+    for (size_t ii = 0; ii < monitors.size(); ii++) {
+        process_params_ptr->addMonitor(
+                monitors[ii], process_params_vec.size() - 1);
+    }
+    return(0);
+}
+
+/*!
+ * \brief Merge the sorted calibrated events of every ProcessParams in time
+ *
+ * Gives each ProcessParams, including those added later, an input to the
+ * merge sorter, and runs the merge sorter in its own thread alongside the
+ * processing threads.  Should be called before start, with a merge sorter
+ * that was not previously used by another ProcessThreads.
+ *
+ * \param merge_sorter_ptr The merge sorter to run
+ */
+void ProcessThreads::setMergeSorter(
+        GlobalMergeSorter * const merge_sorter_ptr)
+{
+    merge_sorter = merge_sorter_ptr;
+    for (size_t ii = 0; ii < process_params_vec.size(); ii++) {
+        process_params_vec[ii]->setMergeSorter(merge_sorter);
+    }
+}
+
+/*!
+ * \brief Hand the events of every ProcessParams to a monitor
+ *
+ * Each ProcessParams, including those added later, uses the shard of the
+ * monitor matching the order it was added in, so the monitor needs a shard
+ * for each ProcessParams.  Should be called before start.
+ *
+ * \param monitor The monitor, such as a FloodHistogram
+ *
+ * \return 0 on success, -1 if the monitor has fewer shards than there are
+ *         ProcessParams, in which case it is not added
+ */
+int ProcessThreads::addMonitor(ProcessMonitor * const monitor) {
+    if (monitor->noShards() < (int) process_params_vec.size()) {
+        return(-1);
+    }
+    monitors.push_back(monitor);
+    for (size_t ii = 0; ii < process_params_vec.size(); ii++) {
+        process_params_vec[ii]->addMonitor(monitor, ii);
+    }
+    return(0);
 }
 
 void ProcessThreads::stopProcessing(bool end_acquisition) {
@@ -26,6 +94,12 @@ void ProcessThreads::stopProcessing(bool end_acquisition) {
             process_data_threads[ii].join();
         }
     }
+    // Stop the merge only after every ProcessParams has pushed its last
+    // events to it.
+    control->merge_data_flag = false;
+    if (merge_data_thread.joinable()) {
+        merge_data_thread.join();
+    }
 }
 
 void ProcessThreads::startProcessing() {
@@ -47,6 +121,14 @@ void ProcessThreads::startProcessing() {
             swap_thread.join();
         }
     }
+    if (merge_sorter) {
+        control->merge_data_flag = true;
+        thread swap_thread(&GlobalMergeSorter::MergeData, merge_sorter);
+        merge_data_thread.swap(swap_thread);
+        if (swap_thread.joinable()) {
+            swap_thread.join();
+        }
+    }
 }
 
 void ProcessThreads::stopReceiving() {
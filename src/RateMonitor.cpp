@@ -0,0 +1,373 @@
+#include <miil/process/RateMonitor.h>
+#include <miil/SystemConfiguration.h>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace {
+//! The counter of each module in a bucket for all of the decoded events
+const int DECODED_COUNTER = 0;
+//! The counter of each module in a bucket for the calibrated events
+const int ACCEPTED_COUNTER = 1;
+const int NO_COUNTERS = 2;
+}
+
+/*!
+ * \brief Create an empty rate monitor for every module of a system
+ *
+ * \param config The system configuration giving the modules and the coarse
+ *        timestamp period.  Must outlive the monitor.
+ * \param no_shards The number of threads that will add events
+ * \param bucket_seconds The length of each bucket in seconds
+ * \param no_buckets The number of buckets kept in the ring of each thread
+ */
+RateMonitor::RateMonitor(
+        SystemConfiguration const * const config,
+        int no_shards,
+        double bucket_seconds,
+        int no_buckets) :
+    config(config),
+    no_modules(config->panels_per_system * config->cartridges_per_panel *
+               config->daqs_per_cartridge * config->renas_per_daq *
+               config->modules_per_rena),
+    bucket_seconds(bucket_seconds),
+    bucket_ticks(std::max((int64_t) 1, (int64_t) std::llround(
+            bucket_seconds * 1e9 / config->ct_period_ns))),
+    no_buckets(std::max(no_buckets, 2)),
+    rings(std::max(no_shards, 1))
+{
+    pcfm_table.resize(config->panels_per_system *
+                      config->cartridges_per_panel *
+                      config->fins_per_cartridge * config->modules_per_fin,
+                      -1);
+    for (int p = 0; p < config->panels_per_system; p++) {
+        for (int c = 0; c < config->cartridges_per_panel; c++) {
+            for (int f = 0; f < config->fins_per_cartridge; f++) {
+                for (int m = 0; m < config->modules_per_fin; m++) {
+                    int daq;
+                    int rena;
+                    int rena_local_module;
+                    if (config->convertPCFMtoPCDRM(
+                            p, c, f, m, daq, rena, rena_local_module) == 0)
+                    {
+                        pcfm_table[config->indexPCFM(p, c, f, m)] =
+                                moduleIndex(p, c, daq, rena,
+                                            rena_local_module);
+                    }
+                }
+            }
+        }
+    }
+
+    const size_t no_counts = (size_t) this->no_buckets * no_modules *
+            NO_COUNTERS;
+    for (size_t ii = 0; ii < rings.size(); ii++) {
+        Ring & ring = rings[ii];
+        ring.bucket_ids.reset(new std::atomic<int64_t>[this->no_buckets]);
+        for (int slot = 0; slot < this->no_buckets; slot++) {
+            ring.bucket_ids[slot].store(-1, std::memory_order_relaxed);
+        }
+        ring.counts.reset(new std::atomic<uint32_t>[no_counts]);
+        for (size_t count = 0; count < no_counts; count++) {
+            ring.counts[count].store(0, std::memory_order_relaxed);
+        }
+        ring.latest_bucket.store(-1, std::memory_order_relaxed);
+        ring.late_events.store(0, std::memory_order_relaxed);
+    }
+}
+
+/*!
+ * \brief The index of a module within the rates
+ *
+ * Modules are numbered by panel, cartridge, daq, rena, and module local to
+ * the rena, so the modules of a rena, and the renas of a daq, are adjacent.
+ *
+ * \return The index, or -1 if the module is outside of the system
+ */
+int RateMonitor::moduleIndex(
+        int panel,
+        int cartridge,
+        int daq,
+        int rena,
+        int module) const
+{
+    return(config->indexPCDRM(panel, cartridge, daq, rena, module));
+}
+
+/*!
+ * \brief Add one to a counter of a module in the bucket of a timestamp
+ *
+ * Only called by the thread that owns the ring of the shard.
+ */
+void RateMonitor::count(
+        int shard,
+        int64_t ct,
+        int module_index,
+        int counter)
+{
+    if ((module_index < 0) || (ct < 0)) {
+        return;
+    }
+    Ring & ring = rings[shard];
+    const int64_t bucket = ct / bucket_ticks;
+    const int slot = bucket % no_buckets;
+    const int64_t slot_bucket = ring.bucket_ids[slot].load(
+            std::memory_order_relaxed);
+    if (slot_bucket != bucket) {
+        if (slot_bucket > bucket) {
+            // The slot has already moved on to a later bucket.
+            ring.late_events.store(
+                    ring.late_events.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+            return;
+        }
+        // Mark the slot as being reused before clearing it, so that readers
+        // do not take the cleared counts as belonging to either bucket.
+        ring.bucket_ids[slot].store(-1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::atomic<uint32_t> * slot_counts =
+                &ring.counts[(size_t) slot * no_modules * NO_COUNTERS];
+        for (int ii = 0; ii < no_modules * NO_COUNTERS; ii++) {
+            slot_counts[ii].store(0, std::memory_order_relaxed);
+        }
+        ring.bucket_ids[slot].store(bucket, std::memory_order_release);
+        if (bucket > ring.latest_bucket.load(std::memory_order_relaxed)) {
+            ring.latest_bucket.store(bucket, std::memory_order_release);
+        }
+    }
+    std::atomic<uint32_t> & module_count = ring.counts[
+            ((size_t) slot * no_modules + module_index) * NO_COUNTERS +
+            counter];
+    module_count.store(module_count.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+}
+
+/*!
+ * \brief Count each batch of decoded events from a ProcessParams
+ */
+void RateMonitor::addDecoded(
+        int shard,
+        std::vector<EventRaw>::const_iterator begin,
+        std::vector<EventRaw>::const_iterator end,
+        SystemConfiguration const * const)
+{
+    for (std::vector<EventRaw>::const_iterator iter = begin;
+         iter != end;
+         ++iter)
+    {
+        count(shard, iter->ct,
+              moduleIndex(iter->panel, iter->cartridge, iter->daq,
+                          iter->rena, iter->module),
+              DECODED_COUNTER);
+    }
+}
+
+/*!
+ * \brief Count each batch of calibrated events from a ProcessParams
+ *
+ * The module of a calibrated event is indexed by fin, so it is converted back
+ * to the module of the rena with a table built from convertPCFMtoPCDRM.
+ */
+void RateMonitor::addCalibrated(
+        int shard,
+        std::vector<EventCal>::const_iterator begin,
+        std::vector<EventCal>::const_iterator end,
+        SystemConfiguration const * const)
+{
+    for (std::vector<EventCal>::const_iterator iter = begin;
+         iter != end;
+         ++iter)
+    {
+        const int entry = config->indexPCFM(
+                iter->panel, iter->cartridge, iter->fin, iter->module);
+        if (entry < 0) {
+            continue;
+        }
+        count(shard, iter->ct, pcfm_table[entry], ACCEPTED_COUNTER);
+    }
+}
+
+/*!
+ * \brief The average rates over the last complete buckets
+ *
+ * Each thread fills its own ring, and a thread may lag behind the others, so
+ * the window ends at the latest bucket of the thread furthest behind, among
+ * those that have added any events, as that bucket and those after it may
+ * still be filled.  A lagging thread does not then make the rates too low.
+ * The threads ahead keep their buckets in the window for as long as they are
+ * less than the length of the ring, less the window, ahead.  Past that, the
+ * buckets have been reused and are skipped, and the rates of the events of
+ * those threads are too low.
+ *
+ * \param seconds How far back to average the rates over.  Limited to the
+ *        length of the ring, less the bucket being filled.
+ * \param level Whether to give the rate of each module, each rena, or each
+ *        daq board
+ * \param decoded_rates Where the rate of decoded events, in Hz, is returned
+ * \param accepted_rates Where the rate of calibrated events, in Hz, that
+ *        were not rejected is returned
+ *
+ * \return 0 on success, -1 if no complete buckets have been filled yet
+ */
+int RateMonitor::rates(
+        double seconds,
+        RateLevel level,
+        std::vector<double> & decoded_rates,
+        std::vector<double> & accepted_rates) const
+{
+    int modules_per_entry = 1;
+    if (level == RATE_RENA) {
+        modules_per_entry = config->modules_per_rena;
+    } else if (level == RATE_DAQ) {
+        modules_per_entry = config->modules_per_rena * config->renas_per_daq;
+    }
+    decoded_rates.assign(no_modules / modules_per_entry, 0);
+    accepted_rates.assign(no_modules / modules_per_entry, 0);
+
+    int64_t latest = -1;
+    for (size_t ii = 0; ii < rings.size(); ii++) {
+        const int64_t ring_latest = rings[ii].latest_bucket.load(
+                std::memory_order_acquire);
+        if ((ring_latest >= 0) && ((latest < 0) || (ring_latest < latest))) {
+            latest = ring_latest;
+        }
+    }
+    const int64_t no_read = std::min(
+            std::max((int64_t) 1, (int64_t) std::llround(
+                    seconds / bucket_seconds)),
+            std::min((int64_t) no_buckets - 1, latest));
+    if (no_read < 1) {
+        return(-1);
+    }
+
+    std::vector<uint32_t> bucket_counts(no_modules * NO_COUNTERS);
+    for (size_t ii = 0; ii < rings.size(); ii++) {
+        const Ring & ring = rings[ii];
+        for (int64_t bucket = latest - no_read; bucket < latest; bucket++) {
+            const int slot = bucket % no_buckets;
+            if (ring.bucket_ids[slot].load(std::memory_order_acquire) !=
+                    bucket)
+            {
+                continue;
+            }
+            const std::atomic<uint32_t> * slot_counts =
+                    &ring.counts[(size_t) slot * no_modules * NO_COUNTERS];
+            for (int jj = 0; jj < no_modules * NO_COUNTERS; jj++) {
+                bucket_counts[jj] = slot_counts[jj].load(
+                        std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (ring.bucket_ids[slot].load(std::memory_order_relaxed) !=
+                    bucket)
+            {
+                // Reused while being read.
+                continue;
+            }
+            for (int module = 0; module < no_modules; module++) {
+                decoded_rates[module / modules_per_entry] +=
+                        bucket_counts[module * NO_COUNTERS + DECODED_COUNTER];
+                accepted_rates[module / modules_per_entry] +=
+                        bucket_counts[module * NO_COUNTERS + ACCEPTED_COUNTER];
+            }
+        }
+    }
+    const double read_seconds = no_read * bucket_seconds;
+    for (size_t ii = 0; ii < decoded_rates.size(); ii++) {
+        decoded_rates[ii] /= read_seconds;
+        accepted_rates[ii] /= read_seconds;
+    }
+    return(0);
+}
+
+/*!
+ * \brief Check the rate of each module against thresholds
+ *
+ * \param seconds How far back to average the rates over, as for rates
+ * \param low_rate Raise an alarm for modules with a decoded rate below this,
+ *        in Hz.  Zero for no low rate alarms.
+ * \param high_rate Raise an alarm for modules with a decoded rate above this,
+ *        in Hz.  Zero or less for no high rate alarms.
+ * \param max_rejected_fraction Raise an alarm for modules that had more than
+ *        this fraction of their decoded events rejected by calibration.  Less
+ *        than zero for no rejection alarms.  None are raised if no module had
+ *        any calibrated events in the window, as when calibration is off.
+ * \param alarms Where the alarms are returned
+ *
+ * \return The number of alarms, or -1 if no complete buckets have been filled
+ */
+int RateMonitor::checkAlarms(
+        double seconds,
+        double low_rate,
+        double high_rate,
+        double max_rejected_fraction,
+        std::vector<RateAlarm> & alarms) const
+{
+    alarms.clear();
+    std::vector<double> decoded_rates;
+    std::vector<double> accepted_rates;
+    if (rates(seconds, RATE_MODULE, decoded_rates, accepted_rates) < 0) {
+        return(-1);
+    }
+    const bool calibrated = std::find_if(
+            accepted_rates.begin(), accepted_rates.end(),
+            [](double rate) { return(rate > 0); }) != accepted_rates.end();
+    const int modules_per_rena = config->modules_per_rena;
+    const int modules_per_daq = modules_per_rena * config->renas_per_daq;
+    const int modules_per_cartridge = modules_per_daq *
+            config->daqs_per_cartridge;
+    const int modules_per_panel = modules_per_cartridge *
+            config->cartridges_per_panel;
+    for (int index = 0; index < no_modules; index++) {
+        RateAlarm alarm;
+        alarm.module = index % modules_per_rena;
+        alarm.rena = (index % modules_per_daq) / modules_per_rena;
+        alarm.daq = (index % modules_per_cartridge) / modules_per_daq;
+        alarm.cartridge = (index % modules_per_panel) / modules_per_cartridge;
+        alarm.panel = index / modules_per_panel;
+        const double decoded = decoded_rates[index];
+        if (decoded < low_rate) {
+            alarm.type = RATE_ALARM_LOW;
+            alarm.value = decoded;
+            alarms.push_back(alarm);
+        }
+        if ((high_rate > 0) && (decoded > high_rate)) {
+            alarm.type = RATE_ALARM_HIGH;
+            alarm.value = decoded;
+            alarms.push_back(alarm);
+        }
+        if (calibrated && (max_rejected_fraction >= 0) && (decoded > 0)) {
+            const double rejected_fraction =
+                    (decoded - accepted_rates[index]) / decoded;
+            if (rejected_fraction > max_rejected_fraction) {
+                alarm.type = RATE_ALARM_REJECTED;
+                alarm.value = rejected_fraction;
+                alarms.push_back(alarm);
+            }
+        }
+    }
+    return(alarms.size());
+}
+
+/*!
+ * \brief The number of events from before the oldest bucket of the ring
+ */
+long RateMonitor::lateEvents() const {
+    long late = 0;
+    for (size_t ii = 0; ii < rings.size(); ii++) {
+        late += rings[ii].late_events.load(std::memory_order_relaxed);
+    }
+    return(late);
+}
+
+double RateMonitor::bucketSeconds() const {
+    return(bucket_seconds);
+}
+
+int RateMonitor::noModules() const {
+    return(no_modules);
+}
+
+int RateMonitor::noShards() const {
+    return(rings.size());
+}
@@ -0,0 +1,326 @@
+#include <miil/process/RenaMergeSorter.h>
+#include <miil/process/ProcessInfo.h>
+#include <miil/SystemConfiguration.h>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+using namespace std;
+
+namespace {
+/*!
+ * The number of delays recorded between each halving of the histogram used for
+ * the adaptive delay.
+ */
+const long delays_per_decay = (1 << 20);
+
+/*!
+ * Orders the queue indices in the heap so that the queue with the earliest
+ * first event is at the top.  Ties go to the lower queue index so the output
+ * does not depend on the order the heap was built in.
+ */
+struct QueueHeadLater {
+    const std::vector<std::deque<KeyedEventCal> > & queues;
+    QueueHeadLater(const std::vector<std::deque<KeyedEventCal> > & queues) :
+        queues(queues)
+    {}
+    bool operator()(int queue1, int queue2) const {
+        int64_t key1 = queues[queue1].front().key;
+        int64_t key2 = queues[queue2].front().key;
+        if (key1 != key2) {
+            return(key1 > key2);
+        }
+        return(queue1 > queue2);
+    }
+};
+
+/*!
+ * \brief The bin of ProcessInfo::sort_delay_histogram a delay falls in
+ */
+int DelayBin(int64_t delay) {
+    int bin = 0;
+    while ((delay > 0) && (bin < (SORT_DELAY_HISTOGRAM_BINS - 1))) {
+        delay >>= 1;
+        bin++;
+    }
+    return(bin);
+}
+}
+
+/*!
+ * \brief Create a sorter with a queue for every rena in the system
+ *
+ * \param config The system configuration used for the size of the system and
+ *        the coarse timestamp period
+ */
+RenaMergeSorter::RenaMergeSorter(SystemConfiguration const * const config) :
+    panels_per_system(config->panels_per_system),
+    cartridges_per_panel(config->cartridges_per_panel),
+    daqs_per_cartridge(config->daqs_per_cartridge),
+    renas_per_daq(config->renas_per_daq),
+    ct_period_ps(config->ct_period_ns * 1000.0),
+    queues(config->panels_per_system * config->cartridges_per_panel *
+           config->daqs_per_cartridge * config->renas_per_daq),
+    latest_keys(queues.size(), LLONG_MIN),
+    no_events(0),
+    max_key(LLONG_MIN),
+    last_written_key(LLONG_MIN),
+    watermark_key(LLONG_MIN),
+    adaptive_delay_flag(false),
+    adaptive_delay_quantile(1.0),
+    adaptive_min_delay(0),
+    delay_bound(0),
+    delay_histogram(SORT_DELAY_HISTOGRAM_BINS, 0),
+    delays_since_decay(0)
+{
+}
+
+int RenaMergeSorter::sourceIndex(const EventCal & event) const {
+    if ((event.panel < 0) || (event.panel >= panels_per_system) ||
+        (event.cartridge < 0) || (event.cartridge >= cartridges_per_panel) ||
+        (event.daq < 0) || (event.daq >= daqs_per_cartridge) ||
+        (event.rena < 0) || (event.rena >= renas_per_daq))
+    {
+        return(-1);
+    }
+    return(((event.panel * cartridges_per_panel + event.cartridge) *
+            daqs_per_cartridge + event.daq) * renas_per_daq + event.rena);
+}
+
+/*!
+ * \brief Add calibrated events to the queues of their renas
+ *
+ * Records how far behind the latest event each event arrived in
+ * info.sort_delay_histogram, and counts the events that arrive behind an
+ * event that has already been written out in info.sort_late_events.  Late
+ * events are still written out by the next call to popSorted or popAll.
+ *
+ * \param begin The first event to be added
+ * \param end One past the last event to be added
+ * \param keys_begin The key from EventCalTimeKey for the first event, followed
+ *        by the keys for the rest of the events
+ * \param info The process info where the delays and late events are counted
+ *
+ * \return 0 on success, -1 if an event was from a rena outside of the system
+ *         configuration.  The events from valid renas are still added.
+ */
+int RenaMergeSorter::insert(
+        std::vector<EventCal>::const_iterator begin,
+        std::vector<EventCal>::const_iterator end,
+        std::vector<int64_t>::const_iterator keys_begin,
+        ProcessInfo & info)
+{
+    int status = 0;
+    std::vector<int64_t>::const_iterator key = keys_begin;
+    for (std::vector<EventCal>::const_iterator iter = begin;
+         iter != end;
+         ++iter, ++key)
+    {
+        int source = sourceIndex(*iter);
+        if (source < 0) {
+            status = -1;
+            continue;
+        }
+        KeyedEventCal keyed_event;
+        keyed_event.key = *key;
+        keyed_event.event = *iter;
+
+        int64_t delay = 0;
+        if (keyed_event.key < max_key) {
+            delay = (max_key - keyed_event.key) / ct_period_ps;
+        }
+        int bin = DelayBin(delay);
+        info.sort_delay_histogram[bin]++;
+        delay_histogram[bin]++;
+        if (++delays_since_decay >= delays_per_decay) {
+            for (size_t ii = 0; ii < delay_histogram.size(); ii++) {
+                delay_histogram[ii] /= 2;
+            }
+            delays_since_decay = 0;
+        }
+        if (keyed_event.key < last_written_key) {
+            info.sort_late_events++;
+        }
+
+        std::deque<KeyedEventCal> & queue = queues[source];
+        // Events from a rena are almost always in order, so search for the
+        // position from the back of the queue.
+        std::deque<KeyedEventCal>::iterator position = queue.end();
+        while ((position != queue.begin()) &&
+               (keyed_event.key < (position - 1)->key))
+        {
+            --position;
+        }
+        queue.insert(position, keyed_event);
+        no_events++;
+        if (keyed_event.key > latest_keys[source]) {
+            latest_keys[source] = keyed_event.key;
+        }
+        if (keyed_event.key > max_key) {
+            max_key = keyed_event.key;
+        }
+    }
+    return(status);
+}
+
+int RenaMergeSorter::merge(
+        std::vector<EventCal> & output,
+        bool all,
+        int64_t cutoff_key)
+{
+    QueueHeadLater later(queues);
+    heap.clear();
+    for (size_t ii = 0; ii < queues.size(); ii++) {
+        if (!queues[ii].empty()) {
+            heap.push_back(ii);
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), later);
+    while (!heap.empty()) {
+        int source = heap.front();
+        const KeyedEventCal & keyed_event = queues[source].front();
+        if (!all && (keyed_event.key > cutoff_key)) {
+            break;
+        }
+        std::pop_heap(heap.begin(), heap.end(), later);
+        output.push_back(keyed_event.event);
+        if (keyed_event.key > last_written_key) {
+            last_written_key = keyed_event.key;
+        }
+        queues[source].pop_front();
+        no_events--;
+        if (queues[source].empty()) {
+            heap.pop_back();
+        } else {
+            std::push_heap(heap.begin(), heap.end(), later);
+        }
+    }
+    return(0);
+}
+
+/*!
+ * \brief The delay bound from the measured delays
+ *
+ * Twice the upper edge of the histogram bin containing the configured
+ * quantile of the recent delays, limited to [adaptive_min_delay, max_delay].
+ */
+long RenaMergeSorter::adaptedDelay(long max_delay) const {
+    long total = 0;
+    for (size_t ii = 0; ii < delay_histogram.size(); ii++) {
+        total += delay_histogram[ii];
+    }
+    if (total == 0) {
+        return(max_delay);
+    }
+    const double target = adaptive_delay_quantile * total;
+    long cumulative = 0;
+    size_t bin = 0;
+    for (; bin < delay_histogram.size() - 1; bin++) {
+        cumulative += delay_histogram[bin];
+        if (cumulative >= target) {
+            break;
+        }
+    }
+    long delay = 2 * (1L << bin);
+    delay = std::max(delay, adaptive_min_delay);
+    delay = std::min(delay, max_delay);
+    return(delay);
+}
+
+/*!
+ * \brief Remove the events that can be assumed to be sorted
+ *
+ * Appends, in time order, every held event that every rena has advanced past,
+ * where no rena's watermark is taken to be more than the delay bound behind
+ * the latest event inserted.  The delay bound is max_delay, or the adapted
+ * delay if enabled by setAdaptiveDelay.
+ *
+ * \param output Where the sorted events are appended
+ * \param max_delay The number of coarse timestamp ticks an event can be
+ *        delayed behind the latest event
+ *
+ * \return 0 on success
+ */
+int RenaMergeSorter::popSorted(std::vector<EventCal> & output, long max_delay) {
+    if (adaptive_delay_flag) {
+        delay_bound = adaptedDelay(max_delay);
+    } else {
+        delay_bound = max_delay;
+    }
+    if (no_events == 0) {
+        return(0);
+    }
+    const int64_t floor_key =
+            max_key - std::llround(delay_bound * ct_period_ps);
+    int64_t watermark = LLONG_MAX;
+    for (size_t ii = 0; ii < latest_keys.size(); ii++) {
+        watermark = std::min(watermark, std::max(latest_keys[ii], floor_key));
+    }
+    watermark_key = std::max(watermark_key, watermark);
+    return(merge(output, false, watermark));
+}
+
+/*!
+ * \brief Remove all of the held events in time order
+ *
+ * \param output Where the sorted events are appended
+ *
+ * \return 0 on success
+ */
+int RenaMergeSorter::popAll(std::vector<EventCal> & output) {
+    watermark_key = std::max(watermark_key, max_key);
+    return(merge(output, true, 0));
+}
+
+/*!
+ * \brief Adapt the delay bound to the measured delays of the events
+ *
+ * When enabled, popSorted uses twice the given quantile of the recent delays,
+ * rounded up to a power of two, in place of its max_delay, while never
+ * exceeding max_delay.
+ *
+ * \param enable Turn the adaptive delay on or off
+ * \param quantile The fraction of events, e.g. 0.9999, that should arrive
+ *        within the delay bound
+ * \param min_delay The smallest delay bound to use in coarse timestamp ticks
+ */
+void RenaMergeSorter::setAdaptiveDelay(
+        bool enable,
+        double quantile,
+        long min_delay)
+{
+    adaptive_delay_flag = enable;
+    adaptive_delay_quantile = quantile;
+    adaptive_min_delay = min_delay;
+}
+
+/*!
+ * \brief The delay bound used by the last call to popSorted
+ */
+long RenaMergeSorter::delayBound() const {
+    return(delay_bound);
+}
+
+/*!
+ * \brief The key that every event written out so far is at or before
+ *
+ * Any event inserted later with a key at or before the watermark is late.
+ * Used by a downstream merge to know how far the output is complete.
+ */
+int64_t RenaMergeSorter::watermark() const {
+    return(watermark_key);
+}
+
+/*!
+ * \brief The number of events held in the sorter
+ */
+size_t RenaMergeSorter::size() const {
+    return(no_events);
+}
+
+/*!
+ * \brief Check if there are any events held in the sorter
+ */
+bool RenaMergeSorter::empty() const {
+    return(no_events == 0);
+}
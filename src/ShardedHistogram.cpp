@@ -0,0 +1,114 @@
+#include <miil/process/ShardedHistogram.h>
+#include <algorithm>
+
+using namespace std;
+
+/*!
+ * \brief Create an empty histogram
+ *
+ * \param no_bins The number of bins
+ * \param no_shards The number of shards, one for each thread filling the
+ *        histogram
+ */
+ShardedHistogram::ShardedHistogram(size_t no_bins, int no_shards) :
+    no_bins(no_bins),
+    last_counts(no_bins, 0),
+    view(no_bins, 0)
+{
+    for (int shard = 0; shard < std::max(no_shards, 1); shard++) {
+        shard_counts.emplace_back(new std::atomic<uint32_t>[no_bins]);
+        for (size_t bin = 0; bin < no_bins; bin++) {
+            shard_counts.back()[bin].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+/*!
+ * \brief Add the counts from the shards since the last read to the view
+ *
+ * lock_view must be held.
+ */
+void ShardedHistogram::fold(size_t first_bin, size_t no_bins) {
+    for (size_t bin = first_bin; bin < first_bin + no_bins; bin++) {
+        uint32_t total = 0;
+        for (size_t shard = 0; shard < shard_counts.size(); shard++) {
+            total += shard_counts[shard][bin].load(std::memory_order_relaxed);
+        }
+        // Unsigned math gives the difference correctly even if the counts
+        // have wrapped.
+        view[bin] += (uint32_t) (total - last_counts[bin]);
+        last_counts[bin] = total;
+    }
+}
+
+/*!
+ * \brief Read the whole histogram
+ *
+ * \param counts Where the counts of every bin are returned
+ *
+ * \return 0 on success
+ */
+int ShardedHistogram::snapshot(std::vector<double> & counts) {
+    return(snapshot(0, no_bins, counts));
+}
+
+/*!
+ * \brief Read a range of bins of the histogram
+ *
+ * Only the shards of the bins in the range are summed, so reading part of a
+ * large histogram is cheap.
+ *
+ * \param first_bin The first bin to read
+ * \param no_bins The number of bins to read
+ * \param counts Where the counts of the bins are returned
+ *
+ * \return 0 on success, -1 if the range is outside of the histogram
+ */
+int ShardedHistogram::snapshot(
+        size_t first_bin,
+        size_t no_bins,
+        std::vector<double> & counts)
+{
+    if ((first_bin > this->no_bins) || (no_bins > this->no_bins - first_bin)) {
+        return(-1);
+    }
+    std::lock_guard<std::mutex> lck(lock_view);
+    fold(first_bin, no_bins);
+    counts.assign(view.begin() + first_bin,
+                  view.begin() + first_bin + no_bins);
+    return(0);
+}
+
+/*!
+ * \brief Scale every bin, such as to let older counts fade out
+ *
+ * \param factor The factor each bin is multiplied by
+ */
+void ShardedHistogram::decay(double factor) {
+    std::lock_guard<std::mutex> lck(lock_view);
+    fold(0, no_bins);
+    for (size_t bin = 0; bin < no_bins; bin++) {
+        view[bin] *= factor;
+    }
+}
+
+/*!
+ * \brief Clear every bin
+ */
+void ShardedHistogram::reset() {
+    decay(0);
+}
+
+/*!
+ * \brief The number of bins in the histogram
+ */
+size_t ShardedHistogram::size() const {
+    return(no_bins);
+}
+
+/*!
+ * \brief The number of shards the histogram can be filled by
+ */
+int ShardedHistogram::shards() const {
+    return(shard_counts.size());
+}
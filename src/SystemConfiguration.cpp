@@ -1,4 +1,5 @@
 #include <miil/SystemConfiguration.h>
+#include <miil/GeometryTraits.h>
 #include <fstream>
 #include <iostream>
 #include <algorithm>
@@ -351,33 +352,37 @@ int populateADCLocationLookup(
  *
  * \return 0 if no error, less than otherwise.
  */
+template <class Geometry>
 int populatePacketSizeLookup(
     SystemConfiguration const * const config,
     std::vector<std::vector<std::vector<
             std::vector<std::vector<int> > > > > & packet_size)
 {
+    const int daqs_per_cartridge = Geometry::daqsPerCartridge(*config);
+    const int renas_per_daq = Geometry::renasPerDaq(*config);
+    const int modules_per_rena = Geometry::modulesPerRena(*config);
     packet_size.resize(config->panels_per_system);
     for (int p = 0; p < config->panels_per_system; p++) {
         packet_size[p].resize(config->cartridges_per_panel);
         for (int c = 0; c < config->cartridges_per_panel; c++) {
-            packet_size[p][c].resize(config->daqs_per_cartridge);
-            for (int d = 0; d < config->daqs_per_cartridge; d++) {
-                packet_size[p][c][d].resize(config->renas_per_daq);
-                for (int r = 0; r < config->renas_per_daq; r++) {
+            packet_size[p][c].resize(daqs_per_cartridge);
+            for (int d = 0; d < daqs_per_cartridge; d++) {
+                packet_size[p][c][d].resize(renas_per_daq);
+                for (int r = 0; r < renas_per_daq; r++) {
                     // There are four modules, so there are 2^4 = 16
                     // combinations, of which 0 shouldn't be used anyways
                     // The header for the packet is 10, so default to that
                     packet_size[p][c][d][r].resize(16, 10);
                     for (int t = 0; t < 16; t++) {
                         packet_size[p][c][d][r][t] = 10;
-                        for (int m = 0; m < config->modules_per_rena; m++) {
+                        for (int m = 0; m < modules_per_rena; m++) {
                             // If the module would have triggered, add in it's
                             // channels that would be read out.
                             if (t & (0x0001 << m)) {
                                 int fin = 0;
                                 int module = 0;
-                                config->convertPCDRMtoPCFM(p, c, d, r, m,
-                                                           fin, module);
+                                ConvertPCDRMtoPCFM<Geometry>(
+                                        *config, p, c, d, r, m, fin, module);
                                 ModuleChannelConfig module_channel_settings =
                                         config->module_configs[p][c]
                                                 [fin][module].channel_settings;
@@ -1620,7 +1625,8 @@ SystemConfiguration::SystemConfiguration(const std::string & filename) :
         pedestals_loaded_flag(false),
         calibration_loaded_flag(false),
         uv_centers_loaded_flag(false),
-        time_calibration_loaded_flag(false)
+        time_calibration_loaded_flag(false),
+        production_geometry_flag(false)
 {
     std::memset(backend_address_panel_lookup, -1,
                 sizeof(backend_address_panel_lookup));
@@ -1698,47 +1704,15 @@ int SystemConfiguration::convertPCDRMtoPCFM(
         int & fin,
         int & module) const
 {
-    // Validate input
-    if (panel < 0 || panel >= panels_per_system) {
-        return(-1);
-    }
-    if (cartridge < 0 || cartridge >= cartridges_per_panel) {
-        return(-2);
-    }
-    if (daq < 0 || daq >= daqs_per_cartridge) {
-        return(-3);
-    }
-    if (rena < 0 || rena >= renas_per_daq) {
-        return(-4);
-    }
-    if (rena_local_module < 0 || rena_local_module >= modules_per_rena) {
-        return(-5);
-    }
-    // Convert
-    fin = fins_per_cartridge - 1 - 2 * std::floor(rena / 2);
-    module = rena_local_module;
-    if (rena % 2) {
-        module += modules_per_rena;
-    }
-    if (daq % 2) {
-        module += (modules_per_fin / 2);
-    }
-
-    if (panel == 0) {
-        if (daq < 2) {
-            if (renas_per_daq > 2) {
-                fin--;
-            }
-        }
-    } else if (panel == 1) {
-        if (daq >= 2) {
-            if (renas_per_daq > 2) {
-                fin--;
-            }
-        }
-        module = modules_per_fin - 1 - module;
+    if (production_geometry_flag) {
+        return(ConvertPCDRMtoPCFM<ProductionGeometry>(
+                *this, panel, cartridge, daq, rena, rena_local_module,
+                fin, module));
+    } else {
+        return(ConvertPCDRMtoPCFM<RuntimeGeometry>(
+                *this, panel, cartridge, daq, rena, rena_local_module,
+                fin, module));
     }
-    return(0);
 }
 
 /*!
@@ -2098,7 +2072,15 @@ int loadModuleSettingsFromJson(
     if (apply_individual) {
         applyIndividualChannelSettings(config, root);
     }
-    if (populatePacketSizeLookup(config, config->packet_size) < 0) {
+    int packet_size_status = 0;
+    if (config->productionGeometry()) {
+        packet_size_status = populatePacketSizeLookup<ProductionGeometry>(
+                config, config->packet_size);
+    } else {
+        packet_size_status = populatePacketSizeLookup<RuntimeGeometry>(
+                config, config->packet_size);
+    }
+    if (packet_size_status < 0) {
         std::cerr << "populatePacketSizeLookup failed" << std::endl;
         return(-3);
     }
@@ -2157,6 +2139,7 @@ int SystemConfiguration::load(const std::string & filename) {
         return(-2);
     }
     fpgas_per_daq = renas_per_daq / renas_per_fpga;
+    selectGeometry();
     // Configure the arrays given the size
     resizePCFMArray(this, module_configs);
     resizePCArray(this, cartridge_configs);
@@ -2327,6 +2310,8 @@ int SystemConfiguration::load(const std::string & filename) {
             }
         }
     }
+    createFixedPointTables();
+    createCrystalLookup();
     return(0);
 }
 
@@ -2511,6 +2496,7 @@ int SystemConfiguration::loadPedestals(const std::string & filename) {
         return(-8);
     }
     pedestals_loaded_flag = true;
+    createFixedPointTables();
     return(0);
 }
 
@@ -2546,6 +2532,29 @@ int SystemConfiguration::loadPedestals(const std::string & filename) {
  *         -2 if there was a failure during writing
  */
 int SystemConfiguration::writePedestals(const std::string & filename) {
+    return(writePedestals(filename, pedestals));
+}
+
+/*!
+ * \brief Writes pedestal values, in the array format of pedestals, into a file
+ *
+ * Writes the file as writePedestals(filename) does, but from pedestal values
+ * held outside of the system configuration, such as ones estimated while
+ * acquiring by PedestalAccumulator, without changing the configuration.
+ *
+ * \param filename The name of the file to be written.
+ * \param module_pedestals The values for each module, indexed Panel,
+ *        Cartridge, DAQ_Board, Rena, Module, as pedestals is.
+ *
+ * \returns 0 if successful, less than otherwise
+ *         -1 if file could not be opened
+ *         -2 if there was a failure during writing
+ */
+int SystemConfiguration::writePedestals(
+        const std::string & filename,
+        const std::vector<std::vector<std::vector<std::vector<
+                std::vector<ModulePedestals> > > > > & module_pedestals) const
+{
     std::ofstream file_stream;
     file_stream.open(filename.c_str());
 
@@ -2561,7 +2570,8 @@ int SystemConfiguration::writePedestals(const std::string & filename) {
                         // Fall back to old convention listing the number of
                         // renas per cartridge
                         int rena_for_cart = r + d * renas_per_daq;
-                        ModulePedestals & pedestal = pedestals[p][c][d][r][m];
+                        const ModulePedestals & pedestal =
+                                module_pedestals[p][c][d][r][m];
                         // Write out the name of the module assuming there can
                         // never be more than 999 renas or 9 modules (hardwired
                         // for 4).
@@ -2727,6 +2737,28 @@ int SystemConfiguration::loadUVCenters(const std::string &filename) {
  *         -1 if file could not be opened
  */
 int SystemConfiguration::writeUVCenters(const std::string &filename) {
+    return(writeUVCenters(filename, pedestals));
+}
+
+/*!
+ * \brief Write uv centers, in the array format of pedestals, into a file
+ *
+ * Writes the file as writeUVCenters(filename) does, but from the u0h, v0h,
+ * u1h, and v1h of pedestal values held outside of the system configuration,
+ * such as the centers fit while acquiring by UVCircleFit.
+ *
+ * \param filename The name of the file to be written.
+ * \param module_pedestals The values for each module, indexed Panel,
+ *        Cartridge, DAQ_Board, Rena, Module, as pedestals is.
+ *
+ * \returns 0 if successful, less than otherwise
+ *         -1 if file could not be opened
+ */
+int SystemConfiguration::writeUVCenters(
+        const std::string & filename,
+        const std::vector<std::vector<std::vector<std::vector<
+                std::vector<ModulePedestals> > > > > & module_pedestals) const
+{
     std::ofstream output(filename.c_str());
     if (!output.good()) {
         return(-1);
@@ -2739,12 +2771,14 @@ int SystemConfiguration::writeUVCenters(const std::string &filename) {
                     int rena = 0;
                     int module = 0;
                     convertPCFMtoPCDRM(p, c, f, m, daq, rena, module);
+                    const ModulePedestals & pedestal =
+                            module_pedestals[p][c][daq][rena][module];
                     for (int a = 0; a < apds_per_module; a++) {
-                        float u = pedestals[p][c][daq][rena][module].u0h;
-                        float v = pedestals[p][c][daq][rena][module].v0h;
+                        float u = pedestal.u0h;
+                        float v = pedestal.v0h;
                         if (a == 1) {
-                            u = pedestals[p][c][daq][rena][module].u1h;
-                            v = pedestals[p][c][daq][rena][module].v1h;
+                            u = pedestal.u1h;
+                            v = pedestal.v1h;
                         }
                         output << std::fixed << std::setprecision(1)
                                << u << " " << v << "\n";
@@ -2855,10 +2889,8 @@ int SystemConfiguration::loadPhotopeakPositions(const std::string &filename)
  */
 int SystemConfiguration::writePhotopeakPositions(const std::string &filename)
 {
-    std::ofstream pp_output(filename.c_str());
-    if (!pp_output.good()) {
-        return(-1);
-    }
+    std::vector<float> gain_spat;
+    std::vector<float> gain_comm;
     for (int p = 0; p < panels_per_system; p++) {
         for (int c = 0; c < cartridges_per_panel; c++) {
             for (int f = 0; f < fins_per_cartridge; f++) {
@@ -2866,14 +2898,53 @@ int SystemConfiguration::writePhotopeakPositions(const std::string &filename)
                     ModuleConfig & module_config = module_configs[p][c][f][m];
                     for (int a = 0; a < apds_per_module; a++) {
                         ApdConfig apd_config = module_config.apd_configs[a];
-                        pp_output << std::fixed << std::setprecision(1)
-                                  << apd_config.gain_spat << " "
-                                  << apd_config.gain_comm << "\n";
+                        gain_spat.push_back(apd_config.gain_spat);
+                        gain_comm.push_back(apd_config.gain_comm);
                     }
                 }
             }
         }
     }
+    return(writePhotopeakPositions(filename, gain_spat, gain_comm));
+}
+
+/*!
+ * \brief Write photopeak positions for each apd into a file
+ *
+ * Writes the file as writePhotopeakPositions(filename) does, but from values
+ * held outside of the system configuration, such as the photopeaks tracked
+ * while acquiring by EnergySpectra.
+ *
+ * \param filename The name of the file to be written.
+ * \param gain_spat The spatial photopeak position of each apd, in the order
+ *        of indexPCFMA
+ * \param gain_comm The common photopeak position of each apd, in the same
+ *        order
+ *
+ * \returns
+ *      - 0 if successful
+ *      - -1 if file could not be opened
+ *      - -2 if there are fewer values than apds
+ */
+int SystemConfiguration::writePhotopeakPositions(
+        const std::string & filename,
+        const std::vector<float> & gain_spat,
+        const std::vector<float> & gain_comm) const
+{
+    const size_t no_apds = (size_t) panels_per_system * cartridges_per_panel *
+            fins_per_cartridge * modules_per_fin * apds_per_module;
+    if ((gain_spat.size() < no_apds) || (gain_comm.size() < no_apds)) {
+        return(-2);
+    }
+    std::ofstream pp_output(filename.c_str());
+    if (!pp_output.good()) {
+        return(-1);
+    }
+    for (size_t apd = 0; apd < no_apds; apd++) {
+        pp_output << std::fixed << std::setprecision(1)
+                  << gain_spat[apd] << " "
+                  << gain_comm[apd] << "\n";
+    }
     pp_output.close();
     return(0);
 }
@@ -2970,6 +3041,7 @@ int SystemConfiguration::loadCrystalLocations(const std::string &filename) {
             }
         }
     }
+    createCrystalLookup();
     return(0);
 }
 
@@ -2992,6 +3064,30 @@ int SystemConfiguration::loadCrystalLocations(const std::string &filename) {
  *       - -1 if file could not be opened
  */
 int SystemConfiguration::writeCrystalLocations(const std::string &filename) {
+    return(writeCrystalLocations(filename, calibration));
+}
+
+/*!
+ * \brief Write a crystal location file from a calibration array
+ *
+ * Writes the file as writeCrystalLocations(filename) does, but from crystal
+ * calibrations held outside of the system configuration, such as the
+ * locations found by FindCrystalLocations.
+ *
+ * \param filename The name of the file to be written.
+ * \param crystal_calibration The calibration of each crystal, indexed as
+ *        calibration is.
+ *
+ * \return
+ *       - 0 if successful
+ *       - -1 if file could not be opened
+ */
+int SystemConfiguration::writeCrystalLocations(
+        const std::string & filename,
+        const std::vector<std::vector<std::vector<
+                std::vector<std::vector<std::vector<
+                CrystalCalibration> > > > > > & crystal_calibration) const
+{
     std::ofstream output;
 
     output.open(filename.c_str());
@@ -3006,7 +3102,7 @@ int SystemConfiguration::writeCrystalLocations(const std::string &filename) {
                     for (int a = 0; a < apds_per_module; a++) {
                         for (int x = 0; x < crystals_per_apd; x++) {
                             const CrystalCalibration & cal =
-                                    calibration[p][c][f][m][a][x];
+                                    crystal_calibration[p][c][f][m][a][x];
                             int use_val = 0;
                             if (cal.use) {
                                 use_val = 1;
@@ -3199,6 +3295,8 @@ int SystemConfiguration::loadCalibration(const std::string &filename) {
         }
     }
     calibration_loaded_flag = true;
+    createFixedPointTables();
+    createCrystalLookup();
     return(0);
 }
 
@@ -3224,6 +3322,29 @@ int SystemConfiguration::loadCalibration(const std::string &filename) {
  *       - -1 if file could not be opened
  */
 int SystemConfiguration::writeCalibration(const std::string & filename) {
+    return(writeCalibration(filename, calibration));
+}
+
+/*!
+ * \brief Write out a calibration value file from a calibration array
+ *
+ * Writes the file as writeCalibration(filename) does, but from crystal
+ * calibrations held outside of the system configuration, such as the
+ * photopeaks fit by PhotopeakFit.
+ *
+ * \param filename The name of the file to be written.
+ * \param crystal_calibration The calibration of each crystal, indexed as
+ *        calibration is.
+ *
+ * \returns 0 if successful, less than otherwise
+ *       - -1 if file could not be opened
+ */
+int SystemConfiguration::writeCalibration(
+        const std::string & filename,
+        const std::vector<std::vector<std::vector<
+                std::vector<std::vector<std::vector<
+                CrystalCalibration> > > > > > & crystal_calibration) const
+{
     std::ofstream output(filename.c_str());
     if (!output.good()) {
         return(-1);
@@ -3235,8 +3356,8 @@ int SystemConfiguration::writeCalibration(const std::string & filename) {
                 for (int m = 0; m < modules_per_fin; m++) {
                     for (int a = 0; a < apds_per_module; a++) {
                         for (int x = 0; x < crystals_per_apd; x++) {
-                            CrystalCalibration & crystal_cal =
-                                    calibration[p][c][f][m][a][x];
+                            const CrystalCalibration & crystal_cal =
+                                    crystal_calibration[p][c][f][m][a][x];
                             if (crystal_cal.use) {
                                 output << "1 ";
                             } else {
@@ -3487,6 +3608,30 @@ int SystemConfiguration::loadTimeCalWithEdep(const std::string &filename) {
  *      - -1 if file could not be opened
  */
 int SystemConfiguration::writeTimeCalWithEdep(const std::string &filename) {
+    return(writeTimeCalWithEdep(filename, calibration));
+}
+
+/*!
+ * \brief Write a time offset value file from a calibration array
+ *
+ * Writes the file as writeTimeCalWithEdep(filename) does, but from crystal
+ * calibrations held outside of the system configuration, such as the offsets
+ * solved for by TimeOffsetSolver.
+ *
+ * \param filename The name of the file to be written.
+ * \param crystal_calibration The calibration of each crystal, indexed as
+ *        calibration is.
+ *
+ * \returns
+ *      - 0 if successful
+ *      - -1 if file could not be opened
+ */
+int SystemConfiguration::writeTimeCalWithEdep(
+        const std::string & filename,
+        const std::vector<std::vector<std::vector<
+                std::vector<std::vector<std::vector<
+                CrystalCalibration> > > > > > & crystal_calibration) const
+{
     std::ofstream output;
 
     output.open(filename.c_str());
@@ -3500,8 +3645,8 @@ int SystemConfiguration::writeTimeCalWithEdep(const std::string &filename) {
                 for (int m = 0; m < modules_per_fin; m++) {
                     for (int a = 0; a < apds_per_module; a++) {
                         for (int x = 0; x < crystals_per_apd; x++) {
-                            CrystalCalibration & cal =
-                                    calibration[p][c][f][m][a][x];
+                            const CrystalCalibration & cal =
+                                    crystal_calibration[p][c][f][m][a][x];
 
                             output << std::fixed << std::setprecision(1)
                                    << cal.time_offset << " "
@@ -3640,6 +3785,113 @@ int SystemConfiguration::createChannelMap() {
     return(0);
 }
 
+/*!
+ * \brief Create the lookup tables used by the fixed point calibration
+ *
+ * Converts the pedestals and the spatial photopeak positions into the integer
+ * values used by RawEventToEventCalFixed, so that no floating point math is
+ * required per event to subtract pedestals or scale the energy.  This is
+ * called whenever the pedestals or the calibration are loaded, and should be
+ * called again if either is modified directly.
+ *
+ * \return 0 on success
+ */
+int SystemConfiguration::createFixedPointTables() {
+    resizePCDRMArray(this, pedestals_fixed);
+    const double pedestal_scale = (1 << FIXED_POINT_PEDESTAL_BITS);
+    for (int p = 0; p < panels_per_system; p++) {
+        for (int c = 0; c < cartridges_per_panel; c++) {
+            for (int d = 0; d < daqs_per_cartridge; d++) {
+                for (int r = 0; r < renas_per_daq; r++) {
+                    for (int m = 0; m < modules_per_rena; m++) {
+                        const ModulePedestals & pedestal =
+                                pedestals[p][c][d][r][m];
+                        ModulePedestalsFixed & fixed =
+                                pedestals_fixed[p][c][d][r][m];
+                        fixed.a = std::lround(pedestal.a * pedestal_scale);
+                        fixed.b = std::lround(pedestal.b * pedestal_scale);
+                        fixed.c = std::lround(pedestal.c * pedestal_scale);
+                        fixed.d = std::lround(pedestal.d * pedestal_scale);
+                        fixed.com0 =
+                                std::lround(pedestal.com0 * pedestal_scale);
+                        fixed.com1 =
+                                std::lround(pedestal.com1 * pedestal_scale);
+                        fixed.com0h =
+                                std::lround(pedestal.com0h * pedestal_scale);
+                        fixed.com1h =
+                                std::lround(pedestal.com1h * pedestal_scale);
+                    }
+                }
+            }
+        }
+    }
+
+    resizePCFMAXArray(this, energy_scale_fixed);
+    const double energy_scale = (int64_t(1) << FIXED_POINT_ENERGY_SCALE_BITS);
+    for (int p = 0; p < panels_per_system; p++) {
+        for (int c = 0; c < cartridges_per_panel; c++) {
+            for (int f = 0; f < fins_per_cartridge; f++) {
+                for (int m = 0; m < modules_per_fin; m++) {
+                    for (int a = 0; a < apds_per_module; a++) {
+                        for (int x = 0; x < crystals_per_apd; x++) {
+                            const CrystalCalibration & cal =
+                                    calibration[p][c][f][m][a][x];
+                            int64_t & scale =
+                                    energy_scale_fixed[p][c][f][m][a][x];
+                            if (cal.gain_spat > 0) {
+                                scale = std::llround(
+                                        511.0 / cal.gain_spat * energy_scale);
+                            } else {
+                                scale = 0;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return(0);
+}
+
+/*!
+ * \brief Create the grids used to look up the crystal for an event
+ *
+ * Builds a CrystalLookup for each APD from the crystal locations in
+ * calibration.  This is called whenever the crystal locations are loaded, and
+ * should be called again if they are modified directly.
+ *
+ * \return 0 on success
+ */
+int SystemConfiguration::createCrystalLookup() {
+    resizeArrayPCFMA(crystal_lookup);
+    for (int p = 0; p < panels_per_system; p++) {
+        for (int c = 0; c < cartridges_per_panel; c++) {
+            for (int f = 0; f < fins_per_cartridge; f++) {
+                for (int m = 0; m < modules_per_fin; m++) {
+                    for (int a = 0; a < apds_per_module; a++) {
+                        crystal_lookup[p][c][f][m][a].build(
+                                calibration[p][c][f][m][a]);
+                    }
+                }
+            }
+        }
+    }
+    return(0);
+}
+
+/*!
+ * \brief Select the geometry used by the decoding and indexing functions
+ *
+ * Checks the size of the system against ProductionGeometry.  If it matches,
+ * the versions of the decoding and indexing functions specialized for that
+ * geometry are used, otherwise the geometry is read from the configuration at
+ * runtime.  This is called by load, and needs to be called again if the size
+ * of the system is modified directly.
+ */
+void SystemConfiguration::selectGeometry() {
+    production_geometry_flag = ProductionGeometry::matches(*this);
+}
+
 bool SystemConfiguration::inBoundsPCFMA(int p, int c, int f, int m, int a)
 {
     if (p < 0 || p >= panels_per_system ||
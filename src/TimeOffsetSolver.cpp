@@ -0,0 +1,544 @@
+#include <miil/process/TimeOffsetSolver.h>
+#include <miil/process/ParallelFileRead.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <thread>
+
+using namespace std;
+
+namespace {
+/*!
+ * The determinant of the fit of the offset and energy dependence of a crystal
+ * must be at least this fraction of the product of its diagonal terms, or the
+ * energies of the crystal are taken to be too narrow to fit the dependence.
+ */
+const double MIN_EDEP_DETERMINANT = 1e-6;
+
+/*!
+ * \brief Holds threads until all of them have reached it
+ *
+ * The last thread to arrive runs a function before the others are released,
+ * so it can prepare the next step of the work while no thread is running.
+ */
+class Barrier {
+public:
+    Barrier(int no_threads) :
+        no_threads(no_threads),
+        waiting(0),
+        generation(0)
+    {
+    }
+
+    template <class Func>
+    void wait(Func on_release) {
+        std::unique_lock<std::mutex> lck(lock);
+        const long arrived_generation = generation;
+        if (++waiting == no_threads) {
+            on_release();
+            waiting = 0;
+            generation++;
+            released.notify_all();
+            return;
+        }
+        released.wait(lck, [&]() {
+            return(generation != arrived_generation);
+        });
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable released;
+    int no_threads;
+    int waiting;
+    long generation;
+};
+}
+
+/*!
+ * \brief Create an empty solver for the geometry of a system
+ *
+ * Crystals are only rejected as unused if the calibration has been loaded
+ * into the configuration.
+ *
+ * \param config The system configuration the crystal table is built from
+ * \param no_shards The number of shards, typically one per thread adding
+ *        coincidences
+ * \param shard_buffer_size The smallest number of coincidences a shard holds
+ *        before collapsing them into its sums
+ */
+TimeOffsetSolver::TimeOffsetSolver(
+        SystemConfiguration const * const config,
+        int no_shards,
+        size_t shard_buffer_size) :
+    min_crystal_counts(100),
+    max_iterations(1000),
+    tolerance(0.01),
+    fit_edep(true),
+    indexer(config),
+    crystals_per_panel(indexer.noCrystals()),
+    fins_per_cartridge(config->fins_per_cartridge),
+    modules_per_fin(config->modules_per_fin),
+    apds_per_module(config->apds_per_module),
+    crystals_per_apd(config->crystals_per_apd),
+    shards(std::max(no_shards, 1)),
+    last_iterations(0),
+    config(config)
+{
+    for (size_t ii = 0; ii < shards.size(); ii++) {
+        shards[ii].sums = PairAccumulator(shard_buffer_size);
+    }
+}
+
+/*!
+ * \brief The number of a crystal within its panel
+ *
+ * See LorIndexer::crystalIndex.
+ */
+int64_t TimeOffsetSolver::crystalIndex(
+        int panel,
+        int cartridge,
+        int fin,
+        int module,
+        int apd,
+        int crystal) const
+{
+    return(indexer.crystalIndex(panel, cartridge, fin, module, apd, crystal));
+}
+
+/*!
+ * \brief The number of crystals in each panel
+ */
+int64_t TimeOffsetSolver::noCrystals() const {
+    return(crystals_per_panel);
+}
+
+void TimeOffsetSolver::PairTraits::start(PairSums & sums, int64_t pair) {
+    sums = PairSums();
+    sums.pair = pair;
+}
+
+void TimeOffsetSolver::PairTraits::add(
+        PairSums & sums,
+        const PairSample & sample)
+{
+    sums.counts++;
+    sums.e0 += sample.e0;
+    sums.e1 += sample.e1;
+    sums.e0e0 += (double) sample.e0 * sample.e0;
+    sums.e1e1 += (double) sample.e1 * sample.e1;
+    sums.e0e1 += (double) sample.e0 * sample.e1;
+    sums.dtf += sample.dtf;
+    sums.dtf_e0 += (double) sample.dtf * sample.e0;
+    sums.dtf_e1 += (double) sample.dtf * sample.e1;
+}
+
+void TimeOffsetSolver::PairTraits::merge(
+        PairSums & sums,
+        const PairSums & other)
+{
+    sums.counts += other.counts;
+    sums.e0 += other.e0;
+    sums.e1 += other.e1;
+    sums.e0e0 += other.e0e0;
+    sums.e1e1 += other.e1e1;
+    sums.e0e1 += other.e0e1;
+    sums.dtf += other.dtf;
+    sums.dtf_e0 += other.dtf_e0;
+    sums.dtf_e1 += other.dtf_e1;
+}
+
+void TimeOffsetSolver::addLocked(Shard & shard, const EventCoinc & coinc) {
+    if (coinc.flags[0] != 0) {
+        return;
+    }
+    const int64_t pair = indexer.lorIndex(coinc);
+    if (pair < 0) {
+        return;
+    }
+    PairSample sample;
+    sample.pair = pair;
+    sample.e0 = coinc.E0 - 511.0;
+    sample.e1 = coinc.E1 - 511.0;
+    sample.dtf = coinc.dtf;
+    shard.sums.add(sample);
+}
+
+/*!
+ * \brief Add a coincidence to a shard of the sums
+ *
+ * \param shard The shard used by the calling thread
+ * \param coinc The coincidence
+ *
+ * \return 0 on success, -1 if the shard does not exist
+ */
+int TimeOffsetSolver::add(int shard, const EventCoinc & coinc) {
+    if ((shard < 0) || (shard >= (int) shards.size())) {
+        return(-1);
+    }
+    std::lock_guard<std::mutex> lck(shards[shard].lock);
+    addLocked(shards[shard], coinc);
+    return(0);
+}
+
+/*!
+ * \brief Add coincidences to a shard of the sums
+ *
+ * \param shard The shard used by the calling thread
+ * \param begin The first coincidence to be added
+ * \param end One past the last coincidence to be added
+ *
+ * \return 0 on success, -1 if the shard does not exist
+ */
+int TimeOffsetSolver::add(
+        int shard,
+        std::vector<EventCoinc>::const_iterator begin,
+        std::vector<EventCoinc>::const_iterator end)
+{
+    if ((shard < 0) || (shard >= (int) shards.size())) {
+        return(-1);
+    }
+    std::lock_guard<std::mutex> lck(shards[shard].lock);
+    for (std::vector<EventCoinc>::const_iterator iter = begin;
+         iter != end;
+         ++iter)
+    {
+        addLocked(shards[shard], *iter);
+    }
+    return(0);
+}
+
+/*!
+ * \brief Solve for the time offset of every crystal
+ *
+ * Each shard is only locked long enough to collapse and copy its sums, so
+ * this can be called while coincidences are still being added.  Crystals that
+ * were not solved for keep the offsets of the configuration.
+ *
+ * \param crystal_calibration Where the calibration of the configuration is
+ *        returned, with the offsets that were solved for added to its
+ *        time_offset and time_offset_edep
+ * \param no_threads The number of threads to solve with
+ *
+ * \return The number of crystals solved for, or -1 if no_threads is less
+ *         than one
+ */
+int TimeOffsetSolver::solve(
+        std::vector<std::vector<std::vector<
+                std::vector<std::vector<std::vector<
+                CrystalCalibration> > > > > > & crystal_calibration,
+        int no_threads)
+{
+    if (no_threads < 1) {
+        return(-1);
+    }
+    crystal_calibration = config->calibration;
+    config->resizeArrayPCFMAX(crystal_calibration);
+
+    std::vector<PairSums> pairs;
+    std::vector<PairSums> shard_sums;
+    std::vector<PairSums> merged;
+    for (size_t ii = 0; ii < shards.size(); ii++) {
+        {
+            std::lock_guard<std::mutex> lck(shards[ii].lock);
+            shard_sums = shards[ii].sums.sums();
+        }
+        PairAccumulator::merge(pairs, shard_sums, merged);
+        pairs.swap(merged);
+    }
+    std::vector<PairSums>().swap(shard_sums);
+    std::vector<PairSums>().swap(merged);
+
+    // Drop the crystals without enough coincidences with the crystals that
+    // are kept, until none are dropped.  The left crystals are numbered
+    // first, followed by the right crystals.
+    const int64_t no_crystals = 2 * crystals_per_panel;
+    std::vector<char> active(no_crystals, 1);
+    std::vector<double> crystal_counts(no_crystals);
+    bool dropped = true;
+    while (dropped) {
+        std::fill(crystal_counts.begin(), crystal_counts.end(), 0);
+        for (size_t ii = 0; ii < pairs.size(); ii++) {
+            const int64_t left = pairs[ii].pair / crystals_per_panel;
+            const int64_t right = crystals_per_panel +
+                    pairs[ii].pair % crystals_per_panel;
+            if (active[left] && active[right]) {
+                crystal_counts[left] += pairs[ii].counts;
+                crystal_counts[right] += pairs[ii].counts;
+            }
+        }
+        dropped = false;
+        for (int64_t crystal = 0; crystal < no_crystals; crystal++) {
+            if (active[crystal] && ((crystal_counts[crystal] <= 0) ||
+                (crystal_counts[crystal] < min_crystal_counts)))
+            {
+                active[crystal] = 0;
+                dropped = true;
+            }
+        }
+    }
+
+    // Keep the pairs between active crystals, and sum each crystal over
+    // them, as the counts, energy, energy squared, time difference, and time
+    // difference times energy, with the time difference negated for the right
+    // crystal, so that its offset is solved for in the same way.
+    size_t no_pairs = 0;
+    std::vector<double> crystal_sums(5 * no_crystals, 0);
+    std::vector<int64_t> left_start(crystals_per_panel + 1, 0);
+    std::vector<int64_t> right_start(crystals_per_panel + 1, 0);
+    for (size_t ii = 0; ii < pairs.size(); ii++) {
+        const PairSums & pair_sums = pairs[ii];
+        const int64_t left = pair_sums.pair / crystals_per_panel;
+        const int64_t right = pair_sums.pair % crystals_per_panel;
+        if (!active[left] || !active[crystals_per_panel + right]) {
+            continue;
+        }
+        double * left_sums = &crystal_sums[5 * left];
+        left_sums[0] += pair_sums.counts;
+        left_sums[1] += pair_sums.e0;
+        left_sums[2] += pair_sums.e0e0;
+        left_sums[3] += pair_sums.dtf;
+        left_sums[4] += pair_sums.dtf_e0;
+        double * right_sums = &crystal_sums[5 * (crystals_per_panel + right)];
+        right_sums[0] += pair_sums.counts;
+        right_sums[1] += pair_sums.e1;
+        right_sums[2] += pair_sums.e1e1;
+        right_sums[3] -= pair_sums.dtf;
+        right_sums[4] -= pair_sums.dtf_e1;
+        left_start[left + 1]++;
+        right_start[right + 1]++;
+        pairs[no_pairs++] = pair_sums;
+    }
+    pairs.resize(no_pairs);
+    for (int64_t crystal = 0; crystal < crystals_per_panel; crystal++) {
+        left_start[crystal + 1] += left_start[crystal];
+        right_start[crystal + 1] += right_start[crystal];
+    }
+    // The pairs are sorted by left crystal, so the pairs of each right
+    // crystal are found through a list of them sorted by right crystal.
+    std::vector<int64_t> right_order(no_pairs);
+    {
+        std::vector<int64_t> next(right_start.begin(), right_start.end() - 1);
+        for (size_t ii = 0; ii < no_pairs; ii++) {
+            right_order[next[pairs[ii].pair % crystals_per_panel]++] = ii;
+        }
+    }
+
+    std::vector<double> offsets(no_crystals, 0);
+    std::vector<double> edeps(no_crystals, 0);
+
+    // Solve for the offset and energy dependence of a crystal, holding those
+    // of the crystals of the other panel fixed, and return the largest change
+    // in its time correction.
+    auto update = [&](int side, int64_t index) {
+        const int64_t crystal = side * crystals_per_panel + index;
+        if (!active[crystal]) {
+            return(0.0);
+        }
+        const double * sums = &crystal_sums[5 * crystal];
+        double rhs_offset = sums[3];
+        double rhs_edep = sums[4];
+        if (side == 0) {
+            for (int64_t ii = left_start[index];
+                 ii < left_start[index + 1]; ii++)
+            {
+                const PairSums & pair_sums = pairs[ii];
+                const int64_t other = crystals_per_panel +
+                        pair_sums.pair % crystals_per_panel;
+                rhs_offset += pair_sums.counts * offsets[other] +
+                        pair_sums.e1 * edeps[other];
+                rhs_edep += pair_sums.e0 * offsets[other] +
+                        pair_sums.e0e1 * edeps[other];
+            }
+        } else {
+            for (int64_t ii = right_start[index];
+                 ii < right_start[index + 1]; ii++)
+            {
+                const PairSums & pair_sums = pairs[right_order[ii]];
+                const int64_t other = pair_sums.pair / crystals_per_panel;
+                rhs_offset += pair_sums.counts * offsets[other] +
+                        pair_sums.e0 * edeps[other];
+                rhs_edep += pair_sums.e1 * offsets[other] +
+                        pair_sums.e0e1 * edeps[other];
+            }
+        }
+        const double counts = sums[0];
+        const double energy = sums[1];
+        const double energy_sq = sums[2];
+        const double determinant = counts * energy_sq - energy * energy;
+        double offset = rhs_offset / counts;
+        double edep = 0;
+        if (fit_edep &&
+            (determinant > MIN_EDEP_DETERMINANT * counts * energy_sq))
+        {
+            offset = (rhs_offset * energy_sq - energy * rhs_edep) /
+                    determinant;
+            edep = (counts * rhs_edep - energy * rhs_offset) / determinant;
+        }
+        const double change = std::abs(offset - offsets[crystal]) +
+                std::abs(edep - edeps[crystal]) *
+                std::sqrt(energy_sq / counts);
+        offsets[crystal] = offset;
+        edeps[crystal] = edep;
+        return(change);
+    };
+
+    // Each step solves every crystal of one panel, spread over the threads.
+    // The last thread to finish a step sets up the next one, and decides if
+    // the solution has converged after each step of the right panel.
+    Barrier barrier(no_threads);
+    std::atomic<int64_t> next_crystal(0);
+    std::vector<double> thread_changes(no_threads, 0);
+    int side = 0;
+    int iteration = 0;
+    bool done = (no_pairs == 0);
+    auto worker = [&](int thread) {
+        while (!done) {
+            int64_t index;
+            while ((index = next_crystal++) < crystals_per_panel) {
+                thread_changes[thread] = std::max(thread_changes[thread],
+                                                  update(side, index));
+            }
+            barrier.wait([&]() {
+                next_crystal = 0;
+                if (side == 1) {
+                    iteration++;
+                    const double change = *std::max_element(
+                            thread_changes.begin(), thread_changes.end());
+                    std::fill(thread_changes.begin(), thread_changes.end(), 0);
+                    done = (change < tolerance) ||
+                           (iteration >= max_iterations);
+                }
+                side = 1 - side;
+            });
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int thread = 1; thread < no_threads; thread++) {
+        threads.push_back(std::thread(worker, thread));
+    }
+    worker(0);
+    for (size_t ii = 0; ii < threads.size(); ii++) {
+        threads[ii].join();
+    }
+    last_iterations = iteration;
+
+    int no_solved = 0;
+    double offset_sum = 0;
+    for (int64_t crystal = 0; crystal < no_crystals; crystal++) {
+        if (active[crystal]) {
+            offset_sum += offsets[crystal];
+            no_solved++;
+        }
+    }
+    const double offset_mean = no_solved ? offset_sum / no_solved : 0;
+    for (int64_t crystal = 0; crystal < no_crystals; crystal++) {
+        if (!active[crystal]) {
+            continue;
+        }
+        const int p = crystal / crystals_per_panel;
+        int64_t rest = crystal % crystals_per_panel;
+        const int x = rest % crystals_per_apd;
+        rest /= crystals_per_apd;
+        const int a = rest % apds_per_module;
+        rest /= apds_per_module;
+        const int m = rest % modules_per_fin;
+        rest /= modules_per_fin;
+        const int f = rest % fins_per_cartridge;
+        const int c = rest / fins_per_cartridge;
+        CrystalCalibration & crystal_cal =
+                crystal_calibration[p][c][f][m][a][x];
+        crystal_cal.time_offset += offsets[crystal] - offset_mean;
+        crystal_cal.time_offset_edep += edeps[crystal];
+    }
+    return(no_solved);
+}
+
+/*!
+ * \brief Solve for the time offsets of every crystal and write them
+ *
+ * The file is written by SystemConfiguration::writeTimeCalWithEdep, so it can
+ * be loaded with SystemConfiguration::loadTimeCalWithEdep.
+ *
+ * \param filename The name of the file to write
+ * \param no_threads The number of threads to solve with
+ *
+ * \return 0 on success, -1 if no_threads is less than one, -2 if the file
+ *         could not be written
+ */
+int TimeOffsetSolver::write(const std::string & filename, int no_threads) {
+    std::vector<std::vector<std::vector<
+            std::vector<std::vector<std::vector<
+            CrystalCalibration> > > > > > crystal_calibration;
+    if (solve(crystal_calibration, no_threads) < 0) {
+        return(-1);
+    }
+    if (config->writeTimeCalWithEdep(filename, crystal_calibration) < 0) {
+        return(-2);
+    }
+    return(0);
+}
+
+/*!
+ * \brief The number of times each panel was solved for by the last solve
+ */
+int TimeOffsetSolver::iterations() const {
+    return(last_iterations);
+}
+
+/*!
+ * \brief Clear the sums of every shard
+ */
+void TimeOffsetSolver::reset() {
+    for (size_t ii = 0; ii < shards.size(); ii++) {
+        std::lock_guard<std::mutex> lck(shards[ii].lock);
+        shards[ii].sums.clear();
+    }
+}
+
+/*!
+ * \brief Solve for the time offsets of every crystal from a coincidence file
+ *
+ * The sums are filled in a single pass over a file of EventCoinc, with each
+ * thread reading its own part of the file, and are then solved on the same
+ * number of threads.
+ *
+ * \param coinc_filename The file of coincidences to solve from
+ * \param time_calibration_filename The time calibration file to write
+ * \param config The configuration giving the crystals, and the offsets the
+ *        singles of the coincidences were calibrated with
+ * \param no_threads The number of threads to read the file, and solve, with
+ *
+ * \return 0 on success, less than otherwise
+ *       - -1 if no_threads is less than one
+ *       - -4 if the coincidence file could not be opened or read
+ *       - -5 if the size of the file is not a whole number of coincidences
+ *       - -6 if the time calibration file could not be written
+ */
+int SolveTimeCalibrationFile(
+        const std::string & coinc_filename,
+        const std::string & time_calibration_filename,
+        SystemConfiguration const * const config,
+        int no_threads)
+{
+    if (no_threads < 1) {
+        return(-1);
+    }
+    TimeOffsetSolver solver(config, no_threads);
+    const int status = ReadEventFileParallel<EventCoinc>(
+            coinc_filename, no_threads,
+            [&](int thread,
+                std::vector<EventCoinc>::const_iterator begin,
+                std::vector<EventCoinc>::const_iterator end)
+            {
+                solver.add(thread, begin, end);
+            });
+    if (status < 0) {
+        return(status);
+    }
+    if (solver.write(time_calibration_filename, no_threads) < 0) {
+        return(-6);
+    }
+    return(0);
+}
@@ -0,0 +1,254 @@
+#include <miil/process/TimingResolution.h>
+#include <miil/SystemConfiguration.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+/*!
+ * \brief Find the full width at half maximum of the peak of a histogram
+ *
+ * The half maximum is taken from the largest bin, and the edges of the peak
+ * are interpolated between the bins where the counts cross it.
+ *
+ * \param counts The counts of each bin of the histogram
+ * \param no_bins The number of bins in the histogram
+ * \param min_counts The fewest counts in the histogram
+ * \param low_edge Where the lower edge of the peak is returned, in bins
+ * \param high_edge Where the upper edge of the peak is returned, in bins
+ *
+ * \return 0 on success, less than otherwise
+ *       - -1 if there were fewer than min_counts in the histogram
+ *       - -2 if the peak is not contained within the histogram
+ */
+int FindHalfMaximum(
+        const double * counts,
+        int no_bins,
+        double min_counts,
+        double & low_edge,
+        double & high_edge)
+{
+    double total = 0;
+    int peak_bin = 0;
+    for (int bin = 0; bin < no_bins; bin++) {
+        total += counts[bin];
+        if (counts[bin] > counts[peak_bin]) {
+            peak_bin = bin;
+        }
+    }
+    if ((total <= 0) || (total < min_counts)) {
+        return(-1);
+    }
+    const double half = counts[peak_bin] / 2;
+
+    int low = peak_bin;
+    while ((low >= 0) && (counts[low] > half)) {
+        low--;
+    }
+    int high = peak_bin;
+    while ((high < no_bins) && (counts[high] > half)) {
+        high++;
+    }
+    if ((low < 0) || (high >= no_bins)) {
+        return(-2);
+    }
+    // Bin centers are at the bin index plus one half.
+    low_edge = low + 0.5 + (half - counts[low]) /
+            (counts[low + 1] - counts[low]);
+    high_edge = high + 0.5 - (half - counts[high]) /
+            (counts[high - 1] - counts[high]);
+    return(0);
+}
+}
+
+/*!
+ * \brief Create empty histograms for the cartridges of a system
+ *
+ * \param config The system configuration giving the number of cartridges
+ * \param no_shards The number of threads that will add coincidences
+ * \param dtf_bins The number of bins of each histogram
+ * \param dtf_max The histograms cover -dtf_max to dtf_max ns
+ */
+TimingResolution::TimingResolution(
+        SystemConfiguration const * const config,
+        int no_shards,
+        int dtf_bins,
+        float dtf_max) :
+    min_counts(100),
+    cartridges_per_panel(config->cartridges_per_panel),
+    dtf_bins(dtf_bins),
+    dtf_max(dtf_max),
+    dtf_bin_width(2 * dtf_max / dtf_bins),
+    histograms((size_t) (1 + cartridges_per_panel * cartridges_per_panel) *
+               dtf_bins, no_shards),
+    fwhms(noHistograms(), -1),
+    centers(noHistograms(), 0)
+{
+}
+
+/*!
+ * \brief The number of histograms, the global one and one per cartridge pair
+ */
+int TimingResolution::noHistograms() const {
+    return(1 + cartridges_per_panel * cartridges_per_panel);
+}
+
+/*!
+ * \brief The number of bins of each histogram
+ */
+int TimingResolution::noBins() const {
+    return(dtf_bins);
+}
+
+/*!
+ * \brief The time difference, in ns, at the center of a bin
+ */
+float TimingResolution::binCenter(int bin) const {
+    return(-dtf_max + (bin + 0.5) * dtf_bin_width);
+}
+
+/*!
+ * \brief The histogram of a pair of cartridges
+ *
+ * Histogram 0 is that of every coincidence in the system.
+ *
+ * \param cartridge0 The cartridge of the left event, in panel 0
+ * \param cartridge1 The cartridge of the right event, in panel 1
+ *
+ * \return The histogram, or -1 if either cartridge is out of range
+ */
+int TimingResolution::pairHistogram(int cartridge0, int cartridge1) const {
+    if ((cartridge0 < 0) || (cartridge0 >= cartridges_per_panel) ||
+        (cartridge1 < 0) || (cartridge1 >= cartridges_per_panel))
+    {
+        return(-1);
+    }
+    return(1 + cartridge0 * cartridges_per_panel + cartridge1);
+}
+
+/*!
+ * \brief Add a coincidence to a shard of the histograms
+ *
+ * Must only be called by the thread that owns the shard.  The shard is not
+ * checked.  Delayed coincidences are rejected.
+ */
+void TimingResolution::add(int shard, const EventCoinc & coinc) {
+    if (coinc.flags[0] != 0) {
+        return;
+    }
+    const int histogram = pairHistogram(coinc.cartridge0, coinc.cartridge1);
+    const float position = (coinc.dtf + dtf_max) / dtf_bin_width;
+    // Written so that a NaN time difference is also rejected.
+    if ((histogram < 0) || !(position >= 0) || (position >= dtf_bins)) {
+        return;
+    }
+    const size_t bin = position;
+    histograms.increment(shard, bin);
+    histograms.increment(shard, (size_t) histogram * dtf_bins + bin);
+}
+
+void TimingResolution::add(
+        int shard,
+        std::vector<EventCoinc>::const_iterator begin,
+        std::vector<EventCoinc>::const_iterator end)
+{
+    for (std::vector<EventCoinc>::const_iterator iter = begin;
+         iter != end;
+         ++iter)
+    {
+        add(shard, *iter);
+    }
+}
+
+/*!
+ * \brief Read the counts of one histogram
+ *
+ * \param histogram The histogram, 0 for the whole system, or from
+ *        pairHistogram
+ * \param counts Where the counts of each bin are returned
+ *
+ * \return 0 on success, -1 if the histogram does not exist
+ */
+int TimingResolution::snapshot(int histogram, std::vector<double> & counts) {
+    if ((histogram < 0) || (histogram >= noHistograms())) {
+        return(-1);
+    }
+    return(histograms.snapshot((size_t) histogram * dtf_bins, dtf_bins,
+                               counts));
+}
+
+/*!
+ * \brief Estimate the resolution of every histogram
+ *
+ * Histograms without enough counts, or whose peak runs off of the range of
+ * the histogram, keep their previous estimate.
+ *
+ * \return The number of histograms with an estimate
+ */
+int TimingResolution::updateResolution() {
+    std::lock_guard<std::mutex> lck(lock_resolution);
+    histograms.snapshot(dtf_counts);
+    int no_estimates = 0;
+    for (int histogram = 0; histogram < noHistograms(); histogram++) {
+        double low_edge;
+        double high_edge;
+        if (FindHalfMaximum(&dtf_counts[(size_t) histogram * dtf_bins],
+                            dtf_bins, min_counts, low_edge, high_edge) == 0)
+        {
+            fwhms[histogram] = (high_edge - low_edge) * dtf_bin_width;
+            centers[histogram] = -dtf_max +
+                    (low_edge + high_edge) / 2 * dtf_bin_width;
+        }
+        if (fwhms[histogram] >= 0) {
+            no_estimates++;
+        }
+    }
+    return(no_estimates);
+}
+
+/*!
+ * \brief The full width at half maximum, in ns, from the last
+ *        updateResolution
+ *
+ * \return The width, or -1 if there is no estimate
+ */
+float TimingResolution::fwhm(int histogram) {
+    std::lock_guard<std::mutex> lck(lock_resolution);
+    if ((histogram < 0) || (histogram >= noHistograms())) {
+        return(-1);
+    }
+    return(fwhms[histogram]);
+}
+
+/*!
+ * \brief The center of the peak, in ns, from the last updateResolution
+ *
+ * Half way between the edges of the full width at half maximum.
+ *
+ * \return The center, or 0 if there is no estimate
+ */
+float TimingResolution::center(int histogram) {
+    std::lock_guard<std::mutex> lck(lock_resolution);
+    if ((histogram < 0) || (histogram >= noHistograms())) {
+        return(0);
+    }
+    return(centers[histogram]);
+}
+
+/*!
+ * \brief Scale every histogram, so that older coincidences fade out
+ */
+void TimingResolution::decay(double factor) {
+    histograms.decay(factor);
+}
+
+/*!
+ * \brief Clear every histogram and estimate
+ */
+void TimingResolution::reset() {
+    histograms.reset();
+    std::lock_guard<std::mutex> lck(lock_resolution);
+    std::fill(fwhms.begin(), fwhms.end(), -1);
+    std::fill(centers.begin(), centers.end(), 0);
+    dtf_counts.clear();
+}
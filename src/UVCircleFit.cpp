@@ -0,0 +1,403 @@
+#include <miil/process/UVCircleFit.h>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace {
+/*!
+ * The sums kept for each APD, of the samples less the offset of the APD
+ */
+enum CircleSum {
+    SUM_N,
+    SUM_U,
+    SUM_V,
+    SUM_UU,
+    SUM_VV,
+    SUM_UV,
+    SUM_UUU,
+    SUM_VVV,
+    SUM_UVV,
+    SUM_UUV,
+    NO_SUMS
+};
+}
+
+/*!
+ * \brief Create an empty fit for each APD of a system
+ *
+ * \param config The system configuration giving the modules.  Kept to write
+ *        the centers with, so it must outlive the fit.  Any uv centers it has
+ *        loaded are written for the APDs that could not be fit.
+ * \param no_shards The number of threads that will add events
+ */
+UVCircleFit::UVCircleFit(
+        SystemConfiguration const * const config,
+        int no_shards) :
+    min_samples(1000),
+    panels(config->panels_per_system),
+    cartridges_per_panel(config->cartridges_per_panel),
+    daqs_per_cartridge(config->daqs_per_cartridge),
+    renas_per_daq(config->renas_per_daq),
+    modules_per_rena(config->modules_per_rena),
+    fins_per_cartridge(config->fins_per_cartridge),
+    modules_per_fin(config->modules_per_fin),
+    apds_per_module(config->apds_per_module),
+    no_apds(panels * cartridges_per_panel * fins_per_cartridge *
+            modules_per_fin * apds_per_module),
+    pcdrm_table(panels * cartridges_per_panel * daqs_per_cartridge *
+                renas_per_daq * modules_per_rena, -1),
+    u_offsets(no_apds, 0),
+    v_offsets(no_apds, 0),
+    shards(new Shard[std::max(no_shards, 1)]),
+    no_shards(std::max(no_shards, 1)),
+    config(config)
+{
+    int entry = 0;
+    for (int p = 0; p < panels; p++) {
+        for (int c = 0; c < cartridges_per_panel; c++) {
+            for (int d = 0; d < daqs_per_cartridge; d++) {
+                for (int r = 0; r < renas_per_daq; r++) {
+                    for (int m = 0; m < modules_per_rena; m++, entry++) {
+                        int fin;
+                        int module;
+                        if (config->convertPCDRMtoPCFM(
+                                p, c, d, r, m, fin, module) < 0)
+                        {
+                            continue;
+                        }
+                        const int index = apdIndex(p, c, fin, module, 0);
+                        pcdrm_table[entry] = index;
+                        // Center the sums around the previous centers, or
+                        // otherwise the middle of the 12 bit adc range.
+                        for (int a = 0; a < apds_per_module; a++) {
+                            u_offsets[index + a] = 2048;
+                            v_offsets[index + a] = 2048;
+                        }
+                        if (config->uvCentersLoaded()) {
+                            const ModulePedestals & pedestal =
+                                    config->pedestals[p][c][d][r][m];
+                            u_offsets[index] = pedestal.u0h;
+                            v_offsets[index] = pedestal.v0h;
+                            if (apds_per_module > 1) {
+                                u_offsets[index + 1] = pedestal.u1h;
+                                v_offsets[index + 1] = pedestal.v1h;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    for (int ii = 0; ii < this->no_shards; ii++) {
+        shards[ii].sums.resize(no_apds * NO_SUMS, 0);
+    }
+}
+
+/*!
+ * \brief The index of an APD within the fit
+ *
+ * APDs are numbered in the order of the lines of a uv centers file.
+ *
+ * \return The index, or -1 if the APD is outside of the system
+ */
+int UVCircleFit::apdIndex(
+        int panel,
+        int cartridge,
+        int fin,
+        int module,
+        int apd) const
+{
+    return(config->indexPCFMA(panel, cartridge, fin, module, apd));
+}
+
+/*!
+ * \brief Add the uv samples of a batch of decoded events to a shard
+ *
+ * The high gain u and v of the APD with the larger common signal are used,
+ * as in RawEventToEventCal.  Events that are not over the hit threshold, are
+ * double triggers, or are outside of the system are ignored.
+ *
+ * \param shard_no The shard of the calling thread
+ * \param begin The first event to add
+ * \param end One past the last event to add
+ * \param config The configuration with the pedestals and thresholds to use
+ */
+void UVCircleFit::add(
+        int shard_no,
+        std::vector<EventRaw>::const_iterator begin,
+        std::vector<EventRaw>::const_iterator end,
+        SystemConfiguration const * const config)
+{
+    Shard & shard = shards[shard_no];
+    std::lock_guard<std::mutex> lck(shard.lock);
+    for (std::vector<EventRaw>::const_iterator iter = begin;
+         iter != end;
+         ++iter)
+    {
+        const EventRaw & event = *iter;
+        const int entry = config->indexPCDRM(
+                event.panel, event.cartridge, event.daq, event.rena,
+                event.module);
+        if (entry < 0) {
+            continue;
+        }
+        const int module_apd0 = pcdrm_table[entry];
+        if (module_apd0 < 0) {
+            continue;
+        }
+        const ModulePedestals & module_pedestals =
+                config->pedestals[event.panel][event.cartridge]
+                                 [event.daq][event.rena][event.module];
+        const int pcfm = module_apd0 / apds_per_module;
+        const ModuleChannelConfig & module_config =
+                config->module_configs[event.panel][event.cartridge]
+                                      [(pcfm / modules_per_fin) %
+                                       fins_per_cartridge]
+                                      [pcfm % modules_per_fin].channel_settings;
+
+        int apd = 0;
+        short primary_common = event.com0h - module_pedestals.com0h;
+        short secondary_common = event.com1h - module_pedestals.com1h;
+        if (primary_common > secondary_common) {
+            apd = 1;
+            std::swap(primary_common, secondary_common);
+        }
+        if ((primary_common > module_config.hit_threshold) ||
+            (secondary_common < module_config.double_trigger_threshold))
+        {
+            continue;
+        }
+
+        const int index = module_apd0 + apd;
+        const double u = (apd == 0 ? event.u0h : event.u1h) - u_offsets[index];
+        const double v = (apd == 0 ? event.v0h : event.v1h) - v_offsets[index];
+        const double uu = u * u;
+        const double vv = v * v;
+        double * sums = &shard.sums[index * NO_SUMS];
+        sums[SUM_N] += 1;
+        sums[SUM_U] += u;
+        sums[SUM_V] += v;
+        sums[SUM_UU] += uu;
+        sums[SUM_VV] += vv;
+        sums[SUM_UV] += u * v;
+        sums[SUM_UUU] += uu * u;
+        sums[SUM_VVV] += vv * v;
+        sums[SUM_UVV] += u * vv;
+        sums[SUM_UUV] += uu * v;
+    }
+}
+
+/*!
+ * \brief Add each batch of decoded events from a ProcessParams
+ */
+void UVCircleFit::addDecoded(
+        int shard,
+        std::vector<EventRaw>::const_iterator begin,
+        std::vector<EventRaw>::const_iterator end,
+        SystemConfiguration const * const config)
+{
+    add(shard, begin, end, config);
+}
+
+/*!
+ * \brief Add together the sums of an APD from every shard
+ */
+void UVCircleFit::sumApd(
+        int apd_index,
+        std::vector<double> & apd_sums) const
+{
+    apd_sums.assign(NO_SUMS, 0);
+    for (int ii = 0; ii < no_shards; ii++) {
+        Shard & shard = shards[ii];
+        std::lock_guard<std::mutex> lck(shard.lock);
+        for (int jj = 0; jj < NO_SUMS; jj++) {
+            apd_sums[jj] += shard.sums[apd_index * NO_SUMS + jj];
+        }
+    }
+}
+
+/*!
+ * \brief The number of samples added for an APD
+ *
+ * \return The number of samples, or -1 if the index is out of range
+ */
+long UVCircleFit::samples(int apd_index) const {
+    if ((apd_index < 0) || (apd_index >= no_apds)) {
+        return(-1);
+    }
+    std::vector<double> apd_sums;
+    sumApd(apd_index, apd_sums);
+    return(apd_sums[SUM_N]);
+}
+
+/*!
+ * \brief Fit the circle of an APD
+ *
+ * The Kasa fit minimizes the sum of (u^2 + v^2 + D u + E v + F)^2 over the
+ * samples, which, in the coordinates relative to the mean of the samples,
+ * reduces to a 2x2 linear system in the second and third moments.
+ *
+ * \param apd_index The index of the APD from apdIndex
+ * \param u Where the u of the center is returned
+ * \param v Where the v of the center is returned
+ * \param radius Where the radius of the circle is returned
+ *
+ * \return 0 on success, -1 if the index is out of range, -2 if the APD has
+ *         fewer than min_samples samples, -3 if the samples are colinear
+ */
+int UVCircleFit::fit(int apd_index, float & u, float & v, float & radius) const
+{
+    if ((apd_index < 0) || (apd_index >= no_apds)) {
+        return(-1);
+    }
+    std::vector<double> sums;
+    sumApd(apd_index, sums);
+    const double n = sums[SUM_N];
+    if ((n < min_samples) || (n < 3)) {
+        return(-2);
+    }
+    const double mean_u = sums[SUM_U] / n;
+    const double mean_v = sums[SUM_V] / n;
+    // The moments about the mean of the samples.
+    const double suu = sums[SUM_UU] - n * mean_u * mean_u;
+    const double svv = sums[SUM_VV] - n * mean_v * mean_v;
+    const double suv = sums[SUM_UV] - n * mean_u * mean_v;
+    const double suuu = sums[SUM_UUU] - 3 * mean_u * sums[SUM_UU] +
+            2 * n * mean_u * mean_u * mean_u;
+    const double svvv = sums[SUM_VVV] - 3 * mean_v * sums[SUM_VV] +
+            2 * n * mean_v * mean_v * mean_v;
+    const double suvv = sums[SUM_UVV] - 2 * mean_v * sums[SUM_UV] -
+            mean_u * sums[SUM_VV] + 2 * n * mean_u * mean_v * mean_v;
+    const double suuv = sums[SUM_UUV] - 2 * mean_u * sums[SUM_UV] -
+            mean_v * sums[SUM_UU] + 2 * n * mean_v * mean_u * mean_u;
+
+    const double det = suu * svv - suv * suv;
+    if (std::abs(det) <= 1e-12 * std::max(suu * svv, 1.0)) {
+        return(-3);
+    }
+    const double rhs_u = 0.5 * (suuu + suvv);
+    const double rhs_v = 0.5 * (svvv + suuv);
+    const double center_u = (svv * rhs_u - suv * rhs_v) / det;
+    const double center_v = (suu * rhs_v - suv * rhs_u) / det;
+    u = mean_u + center_u + u_offsets[apd_index];
+    v = mean_v + center_v + v_offsets[apd_index];
+    radius = std::sqrt(center_u * center_u + center_v * center_v +
+                       (suu + svv) / n);
+    return(0);
+}
+
+/*!
+ * \brief Fit every circle, and return the centers in the pedestal array
+ *
+ * The pedestals of the configuration are returned, with the u0h, v0h, u1h
+ * and v1h of each APD that could be fit replaced by its center.
+ *
+ * \param module_pedestals Where the values are returned, indexed Panel,
+ *        Cartridge, DAQ_Board, Rena, Module, as SystemConfiguration::pedestals
+ *
+ * \return The number of APDs that were fit
+ */
+int UVCircleFit::centers(
+        std::vector<std::vector<std::vector<std::vector<
+                std::vector<ModulePedestals> > > > > & module_pedestals) const
+{
+    module_pedestals.resize(panels);
+    for (int p = 0; p < panels; p++) {
+        module_pedestals[p].resize(cartridges_per_panel);
+        for (int c = 0; c < cartridges_per_panel; c++) {
+            module_pedestals[p][c].resize(daqs_per_cartridge);
+            for (int d = 0; d < daqs_per_cartridge; d++) {
+                module_pedestals[p][c][d].resize(renas_per_daq);
+                for (int r = 0; r < renas_per_daq; r++) {
+                    module_pedestals[p][c][d][r].assign(modules_per_rena,
+                                                        ModulePedestals());
+                    if (!config->pedestalsLoaded() &&
+                        !config->uvCentersLoaded())
+                    {
+                        continue;
+                    }
+                    for (int m = 0; m < modules_per_rena; m++) {
+                        module_pedestals[p][c][d][r][m] =
+                                config->pedestals[p][c][d][r][m];
+                    }
+                }
+            }
+        }
+    }
+
+    int no_fit = 0;
+    int entry = 0;
+    for (int p = 0; p < panels; p++) {
+        for (int c = 0; c < cartridges_per_panel; c++) {
+            for (int d = 0; d < daqs_per_cartridge; d++) {
+                for (int r = 0; r < renas_per_daq; r++) {
+                    for (int m = 0; m < modules_per_rena; m++, entry++) {
+                        const int module_apd0 = pcdrm_table[entry];
+                        if (module_apd0 < 0) {
+                            continue;
+                        }
+                        ModulePedestals & pedestal =
+                                module_pedestals[p][c][d][r][m];
+                        for (int a = 0; a < std::min(apds_per_module, 2);
+                             a++)
+                        {
+                            float u;
+                            float v;
+                            float radius;
+                            if (fit(module_apd0 + a, u, v, radius) < 0) {
+                                continue;
+                            }
+                            if (a == 0) {
+                                pedestal.u0h = u;
+                                pedestal.v0h = v;
+                            } else {
+                                pedestal.u1h = u;
+                                pedestal.v1h = v;
+                            }
+                            no_fit++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return(no_fit);
+}
+
+/*!
+ * \brief Fit every circle and write the centers to a file
+ *
+ * The file is written by SystemConfiguration::writeUVCenters, so it can be
+ * loaded with SystemConfiguration::loadUVCenters.
+ *
+ * \param filename The name of the file to write
+ *
+ * \return 0 on success, or the negative error of
+ *         SystemConfiguration::writeUVCenters
+ */
+int UVCircleFit::write(const std::string & filename) const {
+    std::vector<std::vector<std::vector<std::vector<
+            std::vector<ModulePedestals> > > > > module_pedestals;
+    centers(module_pedestals);
+    return(config->writeUVCenters(filename, module_pedestals));
+}
+
+/*!
+ * \brief Clear the sums of every APD
+ */
+void UVCircleFit::reset() {
+    for (int ii = 0; ii < no_shards; ii++) {
+        Shard & shard = shards[ii];
+        std::lock_guard<std::mutex> lck(shard.lock);
+        std::fill(shard.sums.begin(), shard.sums.end(), 0);
+    }
+}
+
+int UVCircleFit::noApds() const {
+    return(no_apds);
+}
+
+int UVCircleFit::noShards() const {
+    return(no_shards);
+}
@@ -1,6 +1,10 @@
 #include <miil/process/processing.h>
 #include <miil/SystemConfiguration.h>
+#include <miil/GeometryTraits.h>
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
+#include <fstream>
 
 using namespace std;
 
@@ -15,27 +19,12 @@ namespace {
  * implementation is thread safe.
 */
 __thread short adc_value_storage[24 * 4 + 1] = {DEFAULT_NO_READ_ADC_VALUE};
-}
 
 /*!
- * \brief Decode the raw data stream into its components
- *
- * Take a section of the raw byte stream that should start and stop with an 0x80
- * and 0x81 respectively and put it into a DaqPacket data structure to be
- * handled more easily.  Return error codes when the packet does not fit the
- * required protocol.
- *
- * \param packet_byte_stream The data stream from the ethernet port to be parsed
- * \param packet_info Where the data stream information is returned
- *
- * \return 0 if successful, less than zero otherwise
- *         -1 Empty Bytestream
- *         -2 Incorrect start byte
- *         -3 Empty trigger code (no modules triggered)
- *         -4 Incorrect packet size
- *         -5 Invalid Address Byte
+ * \brief The implementation of DecodePacketByteStream for a given geometry
  */
-int DecodePacketByteStream(
+template <class Geometry>
+int DecodePacketByteStreamGeometry(
         const deque<char>::iterator begin,
         const deque<char>::iterator end,
         SystemConfiguration const * const system_config,
@@ -101,7 +90,7 @@ int DecodePacketByteStream(
                     [daq_board]
                     [rena]
                     [trigCode].data();
-    for (int ii = 0; ii < system_config->modules_per_rena; ii++) {
+    for (int ii = 0; ii < Geometry::modulesPerRena(*system_config); ii++) {
         if (adc_locations[ii].triggered) {
             EventRaw event;
             event.ct = timestamp;
@@ -133,6 +122,64 @@ int DecodePacketByteStream(
     return(0);
 }
 
+/*!
+ * \brief The implementation of EventCalTimeKey and EventCoincTimeKey
+ */
+int64_t TimeKey(
+        int64_t ct,
+        float ft,
+        double uv_period_ns,
+        double ct_period_ns)
+{
+    const int64_t uv_period_ps = std::llround(uv_period_ns * 1000.0);
+    const int64_t uv_periods = std::llround(
+            (ct_period_ns * ct - ft) / uv_period_ns);
+    int64_t ft_ps = std::llround(ft * 1000.0);
+    // Keep the fine timestamp within the period, so that the key increases
+    // with the time regardless of rounding.
+    if (ft_ps < 0) {
+        ft_ps = 0;
+    } else if (ft_ps >= uv_period_ps) {
+        ft_ps = uv_period_ps - 1;
+    }
+    return(uv_periods * uv_period_ps + ft_ps);
+}
+}
+
+/*!
+ * \brief Decode the raw data stream into its components
+ *
+ * Take a section of the raw byte stream that should start and stop with an 0x80
+ * and 0x81 respectively and put it into a DaqPacket data structure to be
+ * handled more easily.  Return error codes when the packet does not fit the
+ * required protocol.  Uses the version specialized for ProductionGeometry if
+ * the configuration matches it.
+ *
+ * \param packet_byte_stream The data stream from the ethernet port to be parsed
+ * \param packet_info Where the data stream information is returned
+ *
+ * \return 0 if successful, less than zero otherwise
+ *         -1 Empty Bytestream
+ *         -2 Incorrect start byte
+ *         -3 Empty trigger code (no modules triggered)
+ *         -4 Incorrect packet size
+ *         -5 Invalid Address Byte
+ */
+int DecodePacketByteStream(
+        const deque<char>::iterator begin,
+        const deque<char>::iterator end,
+        SystemConfiguration const * const system_config,
+        std::vector<EventRaw> & events)
+{
+    if (system_config->productionGeometry()) {
+        return(DecodePacketByteStreamGeometry<ProductionGeometry>(
+                begin, end, system_config, events));
+    } else {
+        return(DecodePacketByteStreamGeometry<RuntimeGeometry>(
+                begin, end, system_config, events));
+    }
+}
+
 /*!
  * \brief Calculate the fine timestampe from the UV Circle
  *
@@ -164,6 +211,9 @@ float FineCalc(short u, short v, float u_cent, float v_cent, float uv_period_ns)
  *
  * Takes an event and assigns it to a crystal by finding the crystal peak that
  * is closest to the crystal.  A distance calculation is made for each crystal.
+ * The calibration functions use the CrystalLookup grids from the system
+ * configuration instead, which give the same result while only checking the
+ * crystals near the event.
  *
  * \param x The x anger logic position of the event
  * \param y The x anger logic position of the event
@@ -185,7 +235,7 @@ int GetCrystalID(
     if ((std::abs(x) > 1) || (std::abs(y) > 1)) {
         return(-2);
     }
-    for (int crystal = 0; crystal < 64; crystal++) {
+    for (int crystal = 0; crystal < (int) apd_cals.size(); crystal++) {
         double dist = std::pow(apd_cals[crystal].x_loc - x, 2) +
                       std::pow(apd_cals[crystal].y_loc - y, 2);
         if (dist < min) {
@@ -412,7 +462,9 @@ int CalculateID(
             system_config->calibration[event.panel][rawevent.cartridge]
                                       [event.fin][event.module][event.apd];
 
-    int crystal = GetCrystalID(event.x, event.y, apd_cals);
+    int crystal = system_config->crystal_lookup[event.panel]
+            [rawevent.cartridge][event.fin][event.module][event.apd].find(
+                    event.x, event.y);
 
     if (crystal < 0) {
         return(-3);
@@ -478,23 +530,182 @@ int PedestalCorrectEventRaw(
     return(0);
 }
 
+namespace {
 /*!
- * \brief Converts a Rena event into a calibrated Event using the system config
- *
+ * \brief The floating point arithmetic of RawEventToEventCal
+ */
+class FloatCalibration {
+public:
+    FloatCalibration(
+            SystemConfiguration const * const system_config,
+            const EventRaw & rawevent) :
+        module_pedestals(system_config->pedestals[rawevent.panel]
+                [rawevent.cartridge][rawevent.daq][rawevent.rena]
+                [rawevent.module])
+    {}
+
+    /*!
+     * \brief The pedestal corrected high gain commons, in whole ADC values
+     */
+    void commons(
+            const EventRaw & rawevent,
+            short & common0,
+            short & common1) const
+    {
+        common0 = rawevent.com0h - module_pedestals.com0h;
+        common1 = rawevent.com1h - module_pedestals.com1h;
+    }
+
+    /*!
+     * \brief Fill in the spatial total and anger logic position of the event
+     *
+     * \return 0 on success, -3 if the spatial total is not positive
+     */
+    int position(const EventRaw & rawevent, EventCal & event) const {
+        float a = (float) rawevent.a - module_pedestals.a;
+        float b = (float) rawevent.b - module_pedestals.b;
+        float c = (float) rawevent.c - module_pedestals.c;
+        float d = (float) rawevent.d - module_pedestals.d;
+
+        event.spat_total = a + b + c + d;
+        if (event.spat_total <= 0) {
+            return(-3);
+        }
+        event.x = (c + d - (b + a)) / (event.spat_total);
+        event.y = (a + d - (b + c)) / (event.spat_total);
+        return(0);
+    }
+
+    /*!
+     * \brief Fill in the energy of an event that has been identified
+     *
+     * \return 0 on success, -4 if the crystal has no spatial gain
+     */
+    int energy(
+            SystemConfiguration const * const,
+            const CrystalCalibration & crystal_cal,
+            EventCal & event) const
+    {
+        if (crystal_cal.gain_spat <= 0) {
+            return(-4);
+        }
+        event.E = event.spat_total / crystal_cal.gain_spat * 511;
+        return(0);
+    }
+
+private:
+    const ModulePedestals & module_pedestals;
+};
+
+/*!
+ * \brief The fixed point arithmetic of RawEventToEventCalFixed
  *
- * \param rawevent The non-pedestal corrected event decoded from the bitstream
- * \param event Where the calibrated event is returned
- * \param system_config Pointer to the system configuration to be used
+ * Uses the tables created by SystemConfiguration::createFixedPointTables.
+ */
+class FixedPointCalibration {
+public:
+    FixedPointCalibration(
+            SystemConfiguration const * const system_config,
+            const EventRaw & rawevent) :
+        module_pedestals(system_config->pedestals_fixed[rawevent.panel]
+                [rawevent.cartridge][rawevent.daq][rawevent.rena]
+                [rawevent.module]),
+        spat_total(0)
+    {}
+
+    /*!
+     * \brief The pedestal corrected high gain commons, truncated to whole ADC
+     *        values, as by FloatCalibration
+     */
+    void commons(
+            const EventRaw & rawevent,
+            short & common0,
+            short & common1) const
+    {
+        common0 = (rawevent.com0h * one - module_pedestals.com0h) / one;
+        common1 = (rawevent.com1h * one - module_pedestals.com1h) / one;
+    }
+
+    /*!
+     * \brief Fill in the spatial total and anger logic position of the event
+     *
+     * The anger logic ratios are calculated with a single reciprocal of the
+     * spatial total and carry 30 fractional bits.
+     *
+     * \return 0 on success, -3 if the spatial total is not positive or the
+     *         position is outside of [-1, 1]
+     */
+    int position(const EventRaw & rawevent, EventCal & event) {
+        int32_t a = rawevent.a * one - module_pedestals.a;
+        int32_t b = rawevent.b * one - module_pedestals.b;
+        int32_t c = rawevent.c * one - module_pedestals.c;
+        int32_t d = rawevent.d * one - module_pedestals.d;
+
+        spat_total = a + b + c + d;
+        if (spat_total <= 0) {
+            return(-3);
+        }
+        int32_t x_numerator = c + d - (b + a);
+        int32_t y_numerator = a + d - (b + c);
+        // The crystal lookup rejects anything outside of [-1, 1], and doing it
+        // here keeps the products with the reciprocal below from overflowing.
+        if ((std::abs(x_numerator) > spat_total) ||
+            (std::abs(y_numerator) > spat_total))
+        {
+            return(-3);
+        }
+        // Use integer division rather than shifts, as it rounds towards zero
+        // regardless of the sign.
+        const int64_t reciprocal = (int64_t(1) << 62) / spat_total;
+        const int64_t x_fixed = (x_numerator * reciprocal) / (int64_t(1) << 32);
+        const int64_t y_fixed = (y_numerator * reciprocal) / (int64_t(1) << 32);
+
+        event.spat_total = (float) spat_total / one;
+        event.x = (float) x_fixed / (1 << 30);
+        event.y = (float) y_fixed / (1 << 30);
+        return(0);
+    }
+
+    /*!
+     * \brief Fill in the energy of an event that has been identified
+     *
+     * \return 0 on success, -4 if the crystal has no energy scale
+     */
+    int energy(
+            SystemConfiguration const * const system_config,
+            const CrystalCalibration &,
+            EventCal & event) const
+    {
+        const int64_t energy_scale =
+                system_config->energy_scale_fixed[event.panel]
+                        [event.cartridge][event.fin][event.module][event.apd]
+                        [event.crystal];
+        if (energy_scale <= 0) {
+            return(-4);
+        }
+        // The product carries the fractional bits of both of the terms.
+        event.E = (float) (spat_total * energy_scale) /
+                  (int64_t(1) << (FIXED_POINT_PEDESTAL_BITS +
+                                  FIXED_POINT_ENERGY_SCALE_BITS));
+        return(0);
+    }
+
+private:
+    //! 1.0 in the fixed point format of the pedestal corrected channels
+    static const int32_t one = (1 << FIXED_POINT_PEDESTAL_BITS);
+    const ModulePedestalsFixed & module_pedestals;
+    int32_t spat_total;
+};
+
+/*!
+ * \brief The implementation of RawEventToEventCal, and its fixed point
+ *        version, for the arithmetic of Calibration
  *
- * \return
- *     -  0 on success
- *     - -1 if the event is below the hit threshold for the module
- *     - -2 if the other apd is above the double trigger threshold
- *     - -3 if the crystal could not be correctly identified
- *     - -4 if the identified crystal has been marked as invalid
- *     - -5 If the conversion from PCDRM to PCFM indexing fails
+ * The lookups, the gating, and the time calibration are shared, so only the
+ * arithmetic of the position and energy differ between the two.
  */
-int RawEventToEventCal(
+template <class Calibration>
+int RawEventToEventCalArithmetic(
         const EventRaw & rawevent,
         EventCal & event,
         SystemConfiguration const * const system_config)
@@ -508,6 +719,10 @@ int RawEventToEventCal(
       return(-5);
     }
 
+    Calibration calibration(system_config, rawevent);
+
+    // The uv circle centers are only used for the fine timestamp, which is
+    // calculated in floating point for both.
     const ModulePedestals & module_pedestals =
             system_config->pedestals[rawevent.panel][rawevent.cartridge]
                      [rawevent.daq][rawevent.rena][rawevent.module];
@@ -521,8 +736,9 @@ int RawEventToEventCal(
     // Greater in this case is less than, because the common signals go negative
     // i.e. start (zero) at roughly 3000 and max out at roughly 1000 or so.
     int apd = 0;
-    short primary_common = rawevent.com0h - module_pedestals.com0h;
-    short secondary_common = rawevent.com1h - module_pedestals.com1h;
+    short primary_common;
+    short secondary_common;
+    calibration.commons(rawevent, primary_common, secondary_common);
     if (primary_common > secondary_common) {
         apd = 1;
         swap(primary_common, secondary_common);
@@ -536,18 +752,10 @@ int RawEventToEventCal(
 
     event.ct = rawevent.ct;
 
-    float a = (float) rawevent.a - module_pedestals.a;
-    float b = (float) rawevent.b - module_pedestals.b;
-    float c = (float) rawevent.c - module_pedestals.c;
-    float d = (float) rawevent.d - module_pedestals.d;
-
-
-    event.spat_total = a + b + c + d;
-    if (event.spat_total <= 0) {
-        return(-3);
+    const int position_status = calibration.position(rawevent, event);
+    if (position_status < 0) {
+        return(position_status);
     }
-    event.x = (c + d - (b + a)) / (event.spat_total);
-    event.y = (a + d - (b + c)) / (event.spat_total);
     if (apd == 1) {
         event.y *= -1;
         event.ft = FineCalc(rawevent.u1h,
@@ -567,7 +775,8 @@ int RawEventToEventCal(
             system_config->calibration[rawevent.panel][rawevent.cartridge]
                                       [fin][module][apd];
 
-    int crystal = GetCrystalID(event.x, event.y, apd_cals);
+    int crystal = system_config->crystal_lookup[rawevent.panel]
+            [rawevent.cartridge][fin][module][apd].find(event.x, event.y);
 
     if (crystal < 0) {
         return(-3);
@@ -588,10 +797,11 @@ int RawEventToEventCal(
     event.daq = rawevent.daq;
     event.rena = rawevent.rena;
 
-    if (crystal_cal.gain_spat <= 0) {
-        return(-4);
+    const int energy_status =
+            calibration.energy(system_config, crystal_cal, event);
+    if (energy_status < 0) {
+        return(energy_status);
     }
-    event.E = event.spat_total / crystal_cal.gain_spat * 511;
 
     // Changed the convention from the cal_offset programs, so that we subtract
     // from both panels, rather than adding to the right hand side.
@@ -611,6 +821,178 @@ int RawEventToEventCal(
 
     return(0);
 }
+}
+
+/*!
+ * \brief Converts a Rena event into a calibrated Event using the system config
+ *
+ *
+ * \param rawevent The non-pedestal corrected event decoded from the bitstream
+ * \param event Where the calibrated event is returned
+ * \param system_config Pointer to the system configuration to be used
+ *
+ * \return
+ *     -  0 on success
+ *     - -1 if the event is below the hit threshold for the module
+ *     - -2 if the other apd is above the double trigger threshold
+ *     - -3 if the crystal could not be correctly identified
+ *     - -4 if the identified crystal has been marked as invalid
+ *     - -5 If the conversion from PCDRM to PCFM indexing fails
+ */
+int RawEventToEventCal(
+        const EventRaw & rawevent,
+        EventCal & event,
+        SystemConfiguration const * const system_config)
+{
+    return(RawEventToEventCalArithmetic<FloatCalibration>(
+            rawevent, event, system_config));
+}
+
+/*!
+ * \brief Converts a Rena event into a calibrated Event using integer math
+ *
+ * A fixed point version of RawEventToEventCal, sharing everything but the
+ * arithmetic with it.  The pedestal subtraction, the anger logic, and the
+ * energy scaling are done with integers using the tables created by
+ * SystemConfiguration::createFixedPointTables, so the position and energy of
+ * an event do not depend on the floating point behavior of the compiler or
+ * machine.  The channels are pedestal corrected with FIXED_POINT_PEDESTAL_BITS
+ * fractional bits, the anger logic ratios are calculated with a single
+ * reciprocal of the spatial total and carry 30 fractional bits, and the energy
+ * is scaled with the per crystal factor from energy_scale_fixed.  The results
+ * are converted to float once to fill in the same EventCal as
+ * RawEventToEventCal.
+ *
+ * The results differ from RawEventToEventCal by the rounding of the pedestals
+ * to FIXED_POINT_PEDESTAL_BITS, and of the ratios and energy scales, which can
+ * be measured over a decoded file with CompareFixedPointCalibrationFile.  The
+ * fine timestamp is still calculated in floating point.
+ *
+ * \param rawevent The non-pedestal corrected event decoded from the bitstream
+ * \param event Where the calibrated event is returned
+ * \param system_config Pointer to the system configuration to be used
+ *
+ * \return
+ *     -  0 on success
+ *     - -1 if the event is below the hit threshold for the module
+ *     - -2 if the other apd is above the double trigger threshold
+ *     - -3 if the crystal could not be correctly identified
+ *     - -4 if the identified crystal has been marked as invalid
+ *     - -5 If the conversion from PCDRM to PCFM indexing fails
+ */
+int RawEventToEventCalFixed(
+        const EventRaw & rawevent,
+        EventCal & event,
+        SystemConfiguration const * const system_config)
+{
+    return(RawEventToEventCalArithmetic<FixedPointCalibration>(
+            rawevent, event, system_config));
+}
+
+/*!
+ * \brief Calibrate events with both RawEventToEventCal and
+ *        RawEventToEventCalFixed and record how they differ
+ *
+ * The differences are added to those already in comparison, so it can be
+ * called on successive blocks of events.
+ *
+ * \param begin The first event to be compared
+ * \param end One past the last event to be compared
+ * \param system_config The configuration, with the fixed point tables created
+ * \param comparison Where the differences are accumulated
+ */
+void CompareFixedPointCalibration(
+        std::vector<EventRaw>::const_iterator begin,
+        std::vector<EventRaw>::const_iterator end,
+        SystemConfiguration const * const system_config,
+        FixedPointComparison & comparison)
+{
+    for (std::vector<EventRaw>::const_iterator iter = begin;
+         iter != end;
+         ++iter)
+    {
+        EventCal float_event;
+        EventCal fixed_event;
+        const int float_status =
+                RawEventToEventCal(*iter, float_event, system_config);
+        const int fixed_status =
+                RawEventToEventCalFixed(*iter, fixed_event, system_config);
+        comparison.events++;
+        if ((float_status == 0) != (fixed_status == 0)) {
+            comparison.status_mismatches++;
+            continue;
+        }
+        if (float_status != 0) {
+            continue;
+        }
+        comparison.calibrated++;
+        if ((float_event.fin != fixed_event.fin) ||
+            (float_event.module != fixed_event.module) ||
+            (float_event.apd != fixed_event.apd) ||
+            (float_event.crystal != fixed_event.crystal))
+        {
+            comparison.crystal_mismatches++;
+            continue;
+        }
+        comparison.max_x_difference = std::max(
+                comparison.max_x_difference,
+                std::abs(float_event.x - fixed_event.x));
+        comparison.max_y_difference = std::max(
+                comparison.max_y_difference,
+                std::abs(float_event.y - fixed_event.y));
+        comparison.max_energy_difference = std::max(
+                comparison.max_energy_difference,
+                std::abs(float_event.E - fixed_event.E));
+    }
+}
+
+/*!
+ * \brief Compare the fixed and floating point calibrations over a file of
+ *        decoded EventRaw
+ *
+ * The crystal mismatch rate is comparison.crystal_mismatches over
+ * comparison.calibrated.
+ *
+ * \param filename The file of decoded EventRaw
+ * \param system_config The configuration, with the pedestals and calibration
+ *        loaded, and the fixed point tables created
+ * \param comparison Where the differences are returned
+ *
+ * \return 0 on success, less than otherwise
+ *       - -1 if the file could not be opened or read
+ *       - -2 if the size of the file is not a whole number of events
+ */
+int CompareFixedPointCalibrationFile(
+        const std::string & filename,
+        SystemConfiguration const * const system_config,
+        FixedPointComparison & comparison)
+{
+    comparison = FixedPointComparison();
+    std::ifstream input(filename.c_str(), std::ios::binary);
+    if (!input.good()) {
+        return(-1);
+    }
+    input.seekg(0, std::ios::end);
+    const size_t length_bytes = input.tellg();
+    input.seekg(0, std::ios::beg);
+    if (length_bytes % sizeof(EventRaw)) {
+        return(-2);
+    }
+    const size_t events_per_read = 100000;
+    std::vector<EventRaw> events;
+    for (size_t remaining = length_bytes / sizeof(EventRaw); remaining > 0;) {
+        const size_t count = std::min(events_per_read, remaining);
+        events.resize(count);
+        input.read((char*) events.data(), count * sizeof(EventRaw));
+        if (!input.good()) {
+            return(-1);
+        }
+        CompareFixedPointCalibration(events.begin(), events.end(),
+                                     system_config, comparison);
+        remaining -= count;
+    }
+    return(0);
+}
 
 /*!
  * \brief Checks if an event is in a given energy window
@@ -672,6 +1054,55 @@ float EventCalTimeDiff(
     return(difference);
 }
 
+/*!
+ * \brief Calculate an integer timestamp for an event in picoseconds
+ *
+ * Combines the coarse and fine timestamps into a single absolute time, so that
+ * events can be ordered and compared with integer math.  The coarse timestamp
+ * only picks which uv period the event is in, which is the period whose start
+ * plus the fine timestamp is closest to the time of the coarse timestamp.  The
+ * time is then the start of that period plus the fine timestamp.
+ *
+ * The uv period is rounded to a whole number of picoseconds, so the key drifts
+ * from the true time by less than a picosecond per uv period.  It is only
+ * meant for ordering events and for differences over short spans of time.
+ * Unlike EventCalLessThan, comparing keys is consistent for events less than a
+ * uv period apart where the fine timestamp has wrapped.
+ *
+ * \param event The calibrated event
+ * \param uv_period_ns The period of the uv circle in nanoseconds
+ * \param ct_period_ns The period in nanoseconds of each coarse timestamp tick
+ *
+ * \return The time of the event in picoseconds
+ */
+int64_t EventCalTimeKey(
+        const EventCal & event,
+        double uv_period_ns,
+        double ct_period_ns)
+{
+    return(TimeKey(event.ct, event.ft, uv_period_ns, ct_period_ns));
+}
+
+/*!
+ * \brief Calculate an integer timestamp for a coincidence in picoseconds
+ *
+ * The key from EventCalTimeKey of the left event of the coincidence, from ct0
+ * and ft0, so that coincidences can be ordered by time with integer math.
+ *
+ * \param event The coincidence event
+ * \param uv_period_ns The period of the uv circle in nanoseconds
+ * \param ct_period_ns The period in nanoseconds of each coarse timestamp tick
+ *
+ * \return The time of the left event in picoseconds
+ */
+int64_t EventCoincTimeKey(
+        const EventCoinc & event,
+        double uv_period_ns,
+        double ct_period_ns)
+{
+    return(TimeKey(event.ct0, event.ft0, uv_period_ns, ct_period_ns));
+}
+
 /*!
  * \brief Calculate if time(event 1) < time(event 2)
  *
@@ -792,3 +1223,56 @@ int TimeCalCoincEvent(
     }
     return(0);
 }
+
+/*!
+ * \brief Estimate the photopeak of a spectrum with a windowed centroid
+ *
+ * Takes the mean of the bins whose center is within a fraction, window, of
+ * the estimate on either side, and repeats with the mean as the new estimate
+ * until it moves by less than a hundredth of a bin, or for at most 20 passes.
+ * Used to track photopeaks while acquiring, by EnergySpectra and
+ * GainDriftCorrection, where starting from the last estimate usually settles
+ * in a single pass.
+ *
+ * \param spectrum The counts of each bin, with bin 0 starting at zero
+ * \param no_bins The number of bins in the spectrum
+ * \param bin_width The width of each bin
+ * \param start The first estimate of the photopeak
+ * \param window The fraction of the estimate on either side of it that the
+ *        mean is taken over
+ * \param min_counts The fewest counts within the window for an estimate
+ *
+ * \return The estimate, or -1 if the window has too few counts
+ */
+float WindowedCentroid(
+        const double * spectrum,
+        int no_bins,
+        float bin_width,
+        float start,
+        float window,
+        double min_counts)
+{
+    float estimate = start;
+    for (int pass = 0; pass < 20; pass++) {
+        const int first_bin = std::max(0, (int) std::ceil(
+                estimate * (1 - window) / bin_width - 0.5f));
+        const int last_bin = std::min(no_bins - 1, (int) std::floor(
+                estimate * (1 + window) / bin_width - 0.5f));
+        double counts = 0;
+        double weighted_sum = 0;
+        for (int bin = first_bin; bin <= last_bin; bin++) {
+            counts += spectrum[bin];
+            weighted_sum += spectrum[bin] * (bin + 0.5) * bin_width;
+        }
+        if ((counts < min_counts) || (counts <= 0)) {
+            return(-1);
+        }
+        const float centroid = weighted_sum / counts;
+        const bool settled = std::abs(centroid - estimate) < 0.01 * bin_width;
+        estimate = centroid;
+        if (settled) {
+            break;
+        }
+    }
+    return(estimate);
+}